@@ -5,13 +5,22 @@
 #include <string.h>
 #include <stdio.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <time.h>
 #include <unistd.h>
 #include <arpa/inet.h>
+#include <sys/epoll.h>
 #include <sys/socket.h>
 #include <netinet/ip.h>
+#include <netinet/tcp.h>
 
-// constant definition used to limit the size of data sent and received
-#define MAX_MSG_SIZE 4096
+// largest message sent or accepted, matching the server's default --max-msg-size
+#define MAX_MSG_SIZE (512u << 20)
 
 // response type tags, must match server.c's protocol
 enum {
@@ -19,6 +28,7 @@ enum {
     RES_ERR = 1,
     RES_STR = 2,
     RES_INT = 3,
+    RES_ARR = 4,
 };
 
 // function to handle errors
@@ -59,19 +69,21 @@ static int32_t write_all(int fd, const char *buf, size_t n) {   // writes n byte
     return 0;
 }
 
-// query function: sends a command as a list of strings, e.g. {"set", "key1", "hello"}
 // wire format (after the outer 4-byte total length): [nstr][len1][str1][len2][str2]...
-static int32_t send_req(int fd, const char **cmd, size_t n) {
-    uint32_t len = 4;   // 4 bytes to hold nstr itself
+// bytes a command takes on the wire, outer length included, or 0 if its body
+// exceeds the allowed size
+static size_t req_size(const char **cmd, size_t n) {
+    size_t len = 4;     // 4 bytes to hold nstr itself
     for (size_t i = 0; i < n; i++) {
-        len += 4 + (uint32_t)strlen(cmd[i]);   // 4-byte length prefix + the string bytes
-    }
-    if (len > MAX_MSG_SIZE) {   // returns -1 if the whole body exceeds allowed size
-        return -1;
+        len += 4 + strlen(cmd[i]);  // 4-byte length prefix + the string bytes
     }
+    return len > MAX_MSG_SIZE ? 0 : 4 + len;
+}
 
-    char wbuf[4 + MAX_MSG_SIZE];    // 4 bytes for outer length + the body
-    memcpy(wbuf, &len, 4);          // outer length header
+// write a command of req_size() bytes into wbuf
+static void encode_req(char *wbuf, const char **cmd, size_t n, size_t size) {
+    uint32_t hdr = (uint32_t)(size - 4);
+    memcpy(wbuf, &hdr, 4);          // outer length header
 
     uint32_t nstr = (uint32_t)n;
     memcpy(&wbuf[4], &nstr, 4);     // number of strings in this request
@@ -84,50 +96,39 @@ static int32_t send_req(int fd, const char **cmd, size_t n) {
         memcpy(&wbuf[pos], cmd[i], slen);
         pos += slen;
     }
-    return write_all(fd, wbuf, 4 + len);
 }
 
- static int32_t read_res(int fd) {
-    // reading server response header
-    char rbuf[4 + MAX_MSG_SIZE + 1];           // buffer for server's response
-    errno = 0;                              // resets errno to catch new errors
-
-    int32_t err = read_full(fd, rbuf, 4);   // reads 4 byte-length header from server
-    if (err) {                              // if reading fails, prints EOF if errno = 0 or message if it's non-zero
-        if (errno == 0) {                           
-            msg("EOF");
-        } else {
-            msg("read() error");
-        }
-        return err;
-    }
-    
-    uint32_t len = 0;
-    memcpy(&len, rbuf, 4);  // reads message length from response header
-    if (len > MAX_MSG_SIZE) {  // returns error if message exceedds allowed length
-        msg("too long");
+// query function: sends a command as a list of strings, e.g. {"set", "key1", "hello"}
+static int32_t send_req(int fd, const char **cmd, size_t n) {
+    size_t size = req_size(cmd, n);
+    if (size == 0) {    // returns -1 if the whole body exceeds allowed size
         return -1;
     }
 
-    // reading the response body
-    err = read_full(fd, &rbuf[4], len);     // reads message into rbuf after header
-    if (err) {                              // error
-        msg("read() error");
-        return err;
+    char *wbuf = malloc(size);      // 4 bytes for outer length + the body
+    if (!wbuf) {
+        return -1;
     }
+    encode_req(wbuf, cmd, n, size);
+    int32_t err = write_all(fd, wbuf, size);
+    free(wbuf);
+    return err;
+}
 
+// print one typed response body: [type][payload]. An array prints its
+// elements one per line below it, indented one step per level of nesting.
+static int32_t print_value(const char *rbuf, uint32_t len, int depth) {
     if (len < 1) {
         msg("empty response");
         return -1;
     }
-
-    uint8_t type = (uint8_t)rbuf[4];        // first byte of the body is the type tag
-    const char *payload = &rbuf[5];         // everything after the type tag
+    uint8_t type = (uint8_t)rbuf[0];        // first byte of the body is the type tag
+    const char *payload = &rbuf[1];         // everything after the type tag
     size_t plen = len - 1;
 
     switch (type) {
     case RES_NIL:
-        printf("server says: (nil)\n");
+        printf("(nil)\n");
         break;
     case RES_ERR: {
         if (plen < 4) {
@@ -136,11 +137,11 @@ static int32_t send_req(int fd, const char **cmd, size_t n) {
         }
         uint32_t code = 0;
         memcpy(&code, payload, 4);
-        printf("server says: (error %u) %.*s\n", code, (int)(plen - 4), payload + 4);
+        printf("(error %u) %.*s\n", code, (int)(plen - 4), payload + 4);
         break;
     }
     case RES_STR:
-        printf("server says: %.*s\n", (int)plen, payload);
+        printf("%.*s\n", (int)plen, payload);
         break;
     case RES_INT: {
         if (plen < 8) {
@@ -149,7 +150,37 @@ static int32_t send_req(int fd, const char **cmd, size_t n) {
         }
         int64_t val = 0;
         memcpy(&val, payload, 8);
-        printf("server says: (integer) %lld\n", (long long)val);
+        printf("(integer) %lld\n", (long long)val);
+        break;
+    }
+    case RES_ARR: {
+        // [count] then count elements, each [4-byte length][typed body]
+        if (plen < 4) {
+            msg("malformed array response");
+            return -1;
+        }
+        uint32_t n = 0;
+        memcpy(&n, payload, 4);
+        printf("(array) %u\n", n);
+        size_t pos = 4;
+        for (uint32_t i = 0; i < n; i++) {
+            uint32_t elen = 0;
+            if (plen - pos < 4) {
+                msg("malformed array response");
+                return -1;
+            }
+            memcpy(&elen, &payload[pos], 4);
+            pos += 4;
+            if (plen - pos < elen) {    // element would run past the end of the array
+                msg("malformed array response");
+                return -1;
+            }
+            printf("%*s%u) ", 2 * (depth + 1), "", i + 1);
+            if (print_value(&payload[pos], elen, depth + 1) < 0) {
+                return -1;
+            }
+            pos += elen;
+        }
         break;
     }
     default:
@@ -159,9 +190,86 @@ static int32_t send_req(int fd, const char **cmd, size_t n) {
     return 0;
 }
 
-// client program
-int main() {
-    // create a TCP socket
+static int32_t print_res(const char *rbuf, uint32_t len) {
+    printf("server says: ");
+    return print_value(rbuf, len, 0);
+}
+
+// a response header's length must leave room for the type tag and stay
+// within the allowed size (value + framing)
+static int32_t check_res_len(uint32_t len) {
+    if (len > MAX_MSG_SIZE + 16) {
+        msg("too long");
+        return -1;
+    }
+    if (len < 1) {
+        msg("empty response");
+        return -1;
+    }
+    return 0;
+}
+
+ static int32_t read_res(int fd) {
+    // reading server response header
+    char hdr[4];
+    errno = 0;                              // resets errno to catch new errors
+
+    int32_t err = read_full(fd, hdr, 4);    // reads 4 byte-length header from server
+    if (err) {                              // if reading fails, prints EOF if errno = 0 or message if it's non-zero
+        if (errno == 0) {                           
+            msg("EOF");
+        } else {
+            msg("read() error");
+        }
+        return err;
+    }
+    
+    uint32_t len = 0;
+    memcpy(&len, hdr, 4);   // reads message length from response header
+    if (check_res_len(len) < 0) {
+        return -1;
+    }
+
+    // reading the response body into a buffer sized for it
+    char *rbuf = malloc(len);
+    if (!rbuf) {
+        msg("out of memory");
+        return -1;
+    }
+    err = read_full(fd, rbuf, len);
+    if (err) {                              // error
+        msg("read() error");
+        free(rbuf);
+        return err;
+    }
+    err = print_res(rbuf, len);
+    free(rbuf);
+    return err;
+}
+
+// settings from the command line
+static struct {
+    struct in_addr host;    // server address, IPv4
+    int port;
+    bool bench;             // run the load generator instead of the demo
+    uint32_t threads;       // load generator threads, each with its own epoll set
+    uint32_t connections;   // spread across the threads
+    uint32_t pipeline;      // requests kept in flight on each connection
+    uint64_t requests;      // stop after this many, unless seconds is set
+    uint32_t seconds;       // run for this long instead
+    uint32_t keyspace;      // keys are key:0 .. key:<keyspace - 1>, picked uniformly
+    uint32_t value_size;    // bytes per SET value
+    uint32_t get_ratio;     // percentage of operations that are GETs, the rest SETs
+    uint32_t ttl_ratio;     // percentage of SETs followed by an EXPIRE
+    uint32_t ttl;           // the seconds that EXPIRE gives
+    uint32_t seed;
+    bool json;              // print the report as one JSON object
+    const char **cmd;       // a command to send instead of the demo, from the arguments after the flags
+    size_t ncmd;
+} config = {{0}, 1234, false, 2, 50, 1, 100000, 0, 100000, 100, 50, 0, 60, 1, false, NULL, 0};
+
+// create a TCP socket connected to the server
+static int connect_server(void) {
     int fd = socket(AF_INET, SOCK_STREAM, 0);
         // AF_INET selects IP level protocol (IPv4)
         // SOCK_STREAM specifies TCP protocol
@@ -173,14 +281,22 @@ int main() {
     // define server address
     struct sockaddr_in addr = {};   // initalises address structure for server
     addr.sin_family = AF_INET;      // IPv4 for address family
-    addr.sin_port = htons(1234);    // sets port to 1234 after using htons
-    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);  // sets IP address to 127.0.0.1 (loopback address) using htonl
+    addr.sin_port = htons(config.port);     // sets port (1234 by default) after using htons
+    addr.sin_addr = config.host;    // 127.0.0.1 (loopback address) by default
 
     // connect to the server
     int rv = connect(fd, (const struct sockaddr *)&addr, sizeof(addr)); // connect to the server using specified address and socket fd
     if (rv) {
         die("connect"); // if connects return non-zero value (rv), prints out error and exit
     }
+    return fd;
+}
+
+// ---- demo ----
+// Sends a fixed list of commands, one at a time, and prints each reply.
+
+static void run_demo(void) {
+    int fd = connect_server();
 
     // multiple pipelined requests, each now a list of strings (command + args)
     const char *cmd1[] = {"set", "key1", "hello"};
@@ -191,11 +307,21 @@ int main() {
     const char *cmd6[] = {"set", "key2", "world"};
     const char *cmd7[] = {"expire", "key2", "1"};  // key2 expires in 1 second
     const char *cmd8[] = {"ttl", "key2"};          // should report ~1 second remaining
+    const char *cmd9[] = {"mset", "key3", "a", "key4", "b"};
+    const char *cmd10[] = {"mget", "key3", "key4", "key1"};    // an array, with nil for the deleted key1
+    const char *cmd11[] = {"zadd", "board", "30", "carol", "10", "alice", "20", "bob"};
+    const char *cmd12[] = {"zrange", "board", "0", "-1", "withscores"};  // members by score, each with its score
+    const char *cmd13[] = {"get", "board"};     // WRONGTYPE: board holds a sorted set
+    const char *cmd14[] = {"hset", "user:1", "name", "ada", "lang", "c"};
+    const char *cmd15[] = {"hgetall", "user:1"};    // each field followed by its value
+    const char *cmd16[] = {"rpush", "queue", "a", "b", "c"};
+    const char *cmd17[] = {"lpop", "queue"};        // a, from the front
+    const char *cmd18[] = {"blpop", "queue", "1"};  // queue and b, at once: it only waits on an empty list
 
     struct {
         const char **cmd;
         size_t n;
-    } requests[8] = {
+    } requests[] = {
         {cmd1, sizeof(cmd1) / sizeof(cmd1[0])},
         {cmd2, sizeof(cmd2) / sizeof(cmd2[0])},
         {cmd3, sizeof(cmd3) / sizeof(cmd3[0])},
@@ -204,9 +330,19 @@ int main() {
         {cmd6, sizeof(cmd6) / sizeof(cmd6[0])},
         {cmd7, sizeof(cmd7) / sizeof(cmd7[0])},
         {cmd8, sizeof(cmd8) / sizeof(cmd8[0])},
+        {cmd9, sizeof(cmd9) / sizeof(cmd9[0])},
+        {cmd10, sizeof(cmd10) / sizeof(cmd10[0])},
+        {cmd11, sizeof(cmd11) / sizeof(cmd11[0])},
+        {cmd12, sizeof(cmd12) / sizeof(cmd12[0])},
+        {cmd13, sizeof(cmd13) / sizeof(cmd13[0])},
+        {cmd14, sizeof(cmd14) / sizeof(cmd14[0])},
+        {cmd15, sizeof(cmd15) / sizeof(cmd15[0])},
+        {cmd16, sizeof(cmd16) / sizeof(cmd16[0])},
+        {cmd17, sizeof(cmd17) / sizeof(cmd17[0])},
+        {cmd18, sizeof(cmd18) / sizeof(cmd18[0])},
     };
 
-    for (size_t i = 0; i < 8; i++) {                          // loop through requests and send each one
+    for (size_t i = 0; i < sizeof(requests) / sizeof(requests[0]); i++) {                          // loop through requests and send each one
         if (send_req(fd, requests[i].cmd, requests[i].n) < 0) { // if error occurs, program exit
             goto L_DONE;
         }
@@ -219,8 +355,8 @@ int main() {
     // wait for key2's TTL to pass, then confirm it's gone (lazy expiration on access)
     printf("(sleeping 2s to let key2 expire...)\n");
     sleep(2);
-    const char *cmd9[] = {"get", "key2"};   // should now be (nil)
-    if (send_req(fd, cmd9, sizeof(cmd9) / sizeof(cmd9[0])) < 0) {
+    const char *cmd19[] = {"get", "key2"};  // should now be (nil)
+    if (send_req(fd, cmd19, sizeof(cmd19) / sizeof(cmd19[0])) < 0) {
         goto L_DONE;
     }
     if (read_res(fd) < 0) {
@@ -229,5 +365,513 @@ int main() {
 
 L_DONE:         // uses goto L_DONE if error occurs, skipping further requests
     close(fd);  // closes connection to server before exiting
-    return 0;   
-}
\ No newline at end of file
+}
+
+// send the command given on the command line and print its reply
+static int run_command(void) {
+    int fd = connect_server();
+    int32_t err = send_req(fd, config.cmd, config.ncmd);
+    if (err == 0) {
+        err = read_res(fd);
+    }
+    close(fd);
+    return err < 0 ? EXIT_FAILURE : 0;
+}
+
+// ---- load generator ----
+// Like redis-benchmark: config.threads threads each drive their share of the
+// connections from their own epoll set, keeping config.pipeline requests in
+// flight on every one. A request is timed from when it is queued for writing
+// to when its reply has been read, into a per-thread histogram; the
+// histograms are merged once every thread is done.
+
+#define BENCH_MAX_EVENTS 256
+#define BENCH_READ_CHUNK 65536
+
+// log-linear, like the server's: 8 sub-buckets per power of two, so any
+// latency is known to within 12.5%. Values are in nanoseconds.
+#define HIST_SUB_BITS 3
+#define HIST_SUB (1u << HIST_SUB_BITS)
+#define HIST_MAX_BITS 40        // values of 2^40 ns (18 minutes) and over share the top bucket
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 1) * HIST_SUB)
+
+typedef struct {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total;
+    uint64_t sum;
+    uint64_t max;
+} Hist;
+
+static uint32_t hist_bucket(uint64_t v) {
+    if (v < HIST_SUB) {
+        return (uint32_t)v;
+    }
+    uint32_t e = 63 - (uint32_t)__builtin_clzll(v);    // v is in [2^e, 2^(e+1))
+    if (e >= HIST_MAX_BITS) {
+        return HIST_BUCKETS - 1;
+    }
+    return (e - HIST_SUB_BITS + 1) * HIST_SUB + (uint32_t)((v >> (e - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+static void hist_add(Hist *h, uint64_t v) {
+    h->counts[hist_bucket(v)]++;
+    h->total++;
+    h->sum += v;
+    if (v > h->max) {
+        h->max = v;
+    }
+}
+
+// the value p percent of those recorded are at or below, rounded up to its
+// bucket's upper bound
+static uint64_t hist_percentile(const Hist *h, double p) {
+    double want = p / 100 * (double)h->total;
+    uint64_t rank = (uint64_t)want, seen = 0;
+    rank += (double)rank < want || rank == 0;
+    for (uint32_t b = 0; b + 1 < HIST_BUCKETS; b++) {
+        seen += h->counts[b];
+        if (seen >= rank) {
+            uint32_t shift = b < HIST_SUB ? 0 : b / HIST_SUB - 1;
+            uint64_t hi = b < HIST_SUB ? b : ((uint64_t)(HIST_SUB + b % HIST_SUB) << shift) + ((uint64_t)1 << shift) - 1;
+            return hi < h->max ? hi : h->max;
+        }
+    }
+    return h->max;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+// one connection: requests queued in wbuf, replies read into rbuf, and the
+// time each in-flight request was queued, oldest first, as replies come back
+// in order
+typedef struct {
+    int fd;
+    char *wbuf;
+    size_t wstart, wend, wcap;
+    char *rbuf;
+    size_t rstart, rend, rcap;
+    uint64_t *sent_ns;      // ring of config.pipeline + 1: a SET may bring an EXPIRE along
+    uint32_t head, inflight;
+    bool want_write;        // EPOLLOUT is registered
+} BenchConn;
+
+typedef struct {
+    pthread_t tid;
+    BenchConn *conns;
+    uint32_t nconns;
+    uint64_t rng;
+    uint64_t done, errors, get_misses;
+    uint64_t sets, gets, expires;
+    Hist hist;
+    bool failed;
+} BenchWorker;
+
+static _Atomic uint64_t bench_issued;   // requests handed out so far, against config.requests
+static uint64_t bench_deadline_ns;      // with --seconds, when to stop starting operations
+static char *bench_value;               // config.value_size bytes of 'x'
+
+static uint64_t bench_rand(BenchWorker *w) {
+    // xorshift64*
+    w->rng ^= w->rng >> 12;
+    w->rng ^= w->rng << 25;
+    w->rng ^= w->rng >> 27;
+    return w->rng * 2685821657736338717ULL;
+}
+
+// whether another operation may start, claiming it from the budget
+static bool bench_claim(uint64_t now) {
+    if (config.seconds) {
+        return now < bench_deadline_ns;
+    }
+    return atomic_fetch_add(&bench_issued, 1) < config.requests;
+}
+
+// queue one command on c, noting when
+static void bench_queue(BenchConn *c, const char **cmd, size_t n, uint64_t now) {
+    size_t size = req_size(cmd, n);
+    if (c->wcap - c->wend < size) {
+        size_t len = c->wend - c->wstart;
+        memmove(c->wbuf, c->wbuf + c->wstart, len);
+        c->wstart = 0;
+        c->wend = len;
+        while (c->wcap - c->wend < size) {
+            c->wcap = c->wcap ? c->wcap * 2 : 4096;
+        }
+        c->wbuf = realloc(c->wbuf, c->wcap);
+        if (!c->wbuf) {
+            die("realloc()");
+        }
+    }
+    encode_req(c->wbuf + c->wend, cmd, n, size);
+    c->wend += size;
+    c->sent_ns[(c->head + c->inflight) % (config.pipeline + 1)] = now;
+    c->inflight++;
+}
+
+// start operations until the pipeline is full or the budget runs out
+static void bench_refill(BenchWorker *w, BenchConn *c, uint64_t now) {
+    char key[24];
+    char ttl[16];
+    snprintf(ttl, sizeof(ttl), "%u", config.ttl);
+    while (c->inflight < config.pipeline && bench_claim(now)) {
+        uint64_t r = bench_rand(w);
+        snprintf(key, sizeof(key), "key:%u", (uint32_t)(r % config.keyspace));
+        r /= config.keyspace;
+        if (r % 100 < config.get_ratio) {
+            const char *get[] = {"get", key};
+            bench_queue(c, get, 2, now);
+            w->gets++;
+            continue;
+        }
+        const char *set[] = {"set", key, bench_value};
+        bench_queue(c, set, 3, now);
+        w->sets++;
+        if ((r / 100) % 100 < config.ttl_ratio) {
+            const char *expire[] = {"expire", key, ttl};
+            bench_queue(c, expire, 3, now);
+            w->expires++;
+        }
+    }
+}
+
+// write what is queued until the socket would block
+static int32_t bench_flush(int epfd, BenchConn *c) {
+    while (c->wstart < c->wend) {
+        ssize_t rv = write(c->fd, c->wbuf + c->wstart, c->wend - c->wstart);
+        if (rv < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }
+        if (rv <= 0) {
+            msg("write() error");
+            return -1;
+        }
+        c->wstart += (size_t)rv;
+    }
+    if (c->wstart == c->wend) {
+        c->wstart = c->wend = 0;
+    }
+    bool want_write = c->wstart < c->wend;
+    if (want_write != c->want_write) {
+        struct epoll_event ev = {.events = EPOLLIN | (want_write ? EPOLLOUT : 0), .data.ptr = c};
+        epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev);
+        c->want_write = want_write;
+    }
+    return 0;
+}
+
+// read what has arrived and account for every complete reply in it
+static int32_t bench_read(BenchWorker *w, BenchConn *c) {
+    while (1) {
+        if (c->rcap - c->rend < BENCH_READ_CHUNK) {
+            size_t len = c->rend - c->rstart;
+            memmove(c->rbuf, c->rbuf + c->rstart, len);
+            c->rstart = 0;
+            c->rend = len;
+            while (c->rcap - c->rend < BENCH_READ_CHUNK) {
+                c->rcap = c->rcap ? c->rcap * 2 : BENCH_READ_CHUNK * 2;
+            }
+            c->rbuf = realloc(c->rbuf, c->rcap);
+            if (!c->rbuf) {
+                die("realloc()");
+            }
+        }
+        ssize_t rv = read(c->fd, c->rbuf + c->rend, c->rcap - c->rend);
+        if (rv < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }
+        if (rv <= 0) {
+            msg(rv == 0 ? "EOF" : "read() error");
+            return -1;
+        }
+        c->rend += (size_t)rv;
+    }
+    uint64_t now = now_ns();
+    while (c->rend - c->rstart >= 4) {
+        uint32_t len = 0;
+        memcpy(&len, c->rbuf + c->rstart, 4);
+        if (check_res_len(len) < 0 || c->inflight == 0) {
+            return -1;
+        }
+        if (c->rend - c->rstart < 4 + (size_t)len) {
+            break;
+        }
+        uint8_t type = (uint8_t)c->rbuf[c->rstart + 4];
+        w->errors += type == RES_ERR;
+        w->get_misses += type == RES_NIL;
+        hist_add(&w->hist, now - c->sent_ns[c->head]);
+        c->head = (c->head + 1) % (config.pipeline + 1);
+        c->inflight--;
+        w->done++;
+        c->rstart += 4 + (size_t)len;
+    }
+    if (c->rstart == c->rend) {
+        c->rstart = c->rend = 0;
+    }
+    return 0;
+}
+
+static void *bench_worker_run(void *arg) {
+    BenchWorker *w = arg;
+    int epfd = epoll_create1(0);
+    if (epfd < 0) {
+        die("epoll_create1()");
+    }
+    uint32_t busy = 0;  // connections with requests in flight
+    uint64_t now = now_ns();
+    for (uint32_t i = 0; i < w->nconns; i++) {
+        BenchConn *c = &w->conns[i];
+        struct epoll_event ev = {.events = EPOLLIN, .data.ptr = c};
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &ev) < 0) {
+            die("epoll_ctl()");
+        }
+        bench_refill(w, c, now);
+        if (bench_flush(epfd, c) < 0) {
+            w->failed = true;
+            break;
+        }
+        busy += c->inflight > 0;
+    }
+    struct epoll_event events[BENCH_MAX_EVENTS];
+    while (busy > 0 && !w->failed) {
+        int nready = epoll_wait(epfd, events, BENCH_MAX_EVENTS, 1000);
+        if (nready < 0 && errno != EINTR) {
+            die("epoll_wait()");
+        }
+        for (int i = 0; i < nready; i++) {
+            BenchConn *c = events[i].data.ptr;
+            bool was_busy = c->inflight > 0;
+            if ((events[i].events & EPOLLIN) && bench_read(w, c) < 0) {
+                w->failed = true;
+                break;
+            }
+            bench_refill(w, c, now_ns());
+            if (bench_flush(epfd, c) < 0) {
+                w->failed = true;
+                break;
+            }
+            busy -= was_busy && c->inflight == 0;
+        }
+    }
+    close(epfd);
+    return NULL;
+}
+
+static void bench_print(const BenchWorker *sum, double secs) {
+    double ops = (double)sum->done / secs;
+    double avg_us = sum->hist.total ? (double)sum->hist.sum / (double)sum->hist.total / 1000 : 0;
+    double p50 = (double)hist_percentile(&sum->hist, 50) / 1000, p99 = (double)hist_percentile(&sum->hist, 99) / 1000;
+    double p999 = (double)hist_percentile(&sum->hist, 99.9) / 1000, max = (double)sum->hist.max / 1000;
+    char host[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &config.host, host, sizeof(host));
+    if (config.json) {
+        printf("{\"host\":\"%s\",\"port\":%d,\"threads\":%u,\"connections\":%u,\"pipeline\":%u,"
+            "\"keyspace\":%u,\"value_size\":%u,\"get_ratio\":%u,\"ttl_ratio\":%u,\"ttl\":%u,"
+            "\"requests\":%llu,\"gets\":%llu,\"sets\":%llu,\"expires\":%llu,\"errors\":%llu,\"get_misses\":%llu,"
+            "\"seconds\":%.3f,\"ops_per_sec\":%.0f,"
+            "\"latency_usec\":{\"avg\":%.3f,\"p50\":%.3f,\"p99\":%.3f,\"p999\":%.3f,\"max\":%.3f}}\n",
+            host, config.port, config.threads, config.connections, config.pipeline,
+            config.keyspace, config.value_size, config.get_ratio, config.ttl_ratio, config.ttl,
+            (unsigned long long)sum->done, (unsigned long long)sum->gets, (unsigned long long)sum->sets,
+            (unsigned long long)sum->expires, (unsigned long long)sum->errors, (unsigned long long)sum->get_misses,
+            secs, ops, avg_us, p50, p99, p999, max);
+        return;
+    }
+    printf("%s:%d, %u threads, %u connections, pipeline %u\n", host, config.port, config.threads,
+        config.connections, config.pipeline);
+    printf("%u keys, %u-byte values, %u%% GET, %u%% of SETs with a %us TTL\n",
+        config.keyspace, config.value_size, config.get_ratio, config.ttl_ratio, config.ttl);
+    printf("%-16s %llu (%llu GET, %llu SET, %llu EXPIRE)\n", "requests", (unsigned long long)sum->done,
+        (unsigned long long)sum->gets, (unsigned long long)sum->sets, (unsigned long long)sum->expires);
+    printf("%-16s %llu errors, %llu GET misses\n", "replies", (unsigned long long)sum->errors,
+        (unsigned long long)sum->get_misses);
+    printf("%-16s %.2f\n", "seconds", secs);
+    printf("%-16s %.0f\n", "ops/sec", ops);
+    printf("%-16s avg %.1f  p50 %.1f  p99 %.1f  p99.9 %.1f  max %.1f\n", "latency (usec)", avg_us, p50, p99, p999, max);
+}
+
+static int run_bench(void) {
+    bench_value = malloc(config.value_size + 1);
+    if (!bench_value) {
+        die("malloc()");
+    }
+    memset(bench_value, 'x', config.value_size);
+    bench_value[config.value_size] = '\0';
+
+    BenchConn *conns = calloc(config.connections, sizeof(BenchConn));
+    BenchWorker *ws = calloc(config.threads, sizeof(BenchWorker));
+    if (!conns || !ws) {
+        die("calloc()");
+    }
+    for (uint32_t i = 0; i < config.connections; i++) {
+        conns[i].fd = connect_server();
+        int one = 1;
+        setsockopt(conns[i].fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        fcntl(conns[i].fd, F_SETFL, fcntl(conns[i].fd, F_GETFL, 0) | O_NONBLOCK);
+        conns[i].sent_ns = calloc(config.pipeline + 1, sizeof(uint64_t));
+        if (!conns[i].sent_ns) {
+            die("calloc()");
+        }
+    }
+
+    uint64_t start = now_ns();
+    bench_deadline_ns = start + (uint64_t)config.seconds * 1000000000;
+    uint32_t per = config.connections / config.threads, extra = config.connections % config.threads, first = 0;
+    for (uint32_t i = 0; i < config.threads; i++) {
+        ws[i].conns = &conns[first];
+        ws[i].nconns = per + (i < extra);
+        ws[i].rng = ((uint64_t)config.seed << 32) + i * 0x9E3779B97F4A7C15ULL + 1;
+        first += ws[i].nconns;
+        if (pthread_create(&ws[i].tid, NULL, bench_worker_run, &ws[i]) != 0) {
+            die("pthread_create()");
+        }
+    }
+    BenchWorker *sum = calloc(1, sizeof(BenchWorker));
+    if (!sum) {
+        die("calloc()");
+    }
+    for (uint32_t i = 0; i < config.threads; i++) {
+        pthread_join(ws[i].tid, NULL);
+        sum->failed |= ws[i].failed;
+        sum->done += ws[i].done;
+        sum->errors += ws[i].errors;
+        sum->get_misses += ws[i].get_misses;
+        sum->gets += ws[i].gets;
+        sum->sets += ws[i].sets;
+        sum->expires += ws[i].expires;
+        for (uint32_t b = 0; b < HIST_BUCKETS; b++) {
+            sum->hist.counts[b] += ws[i].hist.counts[b];
+        }
+        sum->hist.total += ws[i].hist.total;
+        sum->hist.sum += ws[i].hist.sum;
+        sum->hist.max = ws[i].hist.max > sum->hist.max ? ws[i].hist.max : sum->hist.max;
+    }
+    double secs = (double)(now_ns() - start) / 1e9;
+    bool failed = sum->failed;
+    if (!failed) {
+        bench_print(sum, secs);
+    }
+
+    for (uint32_t i = 0; i < config.connections; i++) {
+        close(conns[i].fd);
+        free(conns[i].wbuf);
+        free(conns[i].rbuf);
+        free(conns[i].sent_ns);
+    }
+    free(conns);
+    free(ws);
+    free(sum);
+    free(bench_value);
+    return failed ? EXIT_FAILURE : 0;
+}
+
+// ---- command line ----
+
+static void usage(const char *prog) {
+    fprintf(stderr, "usage: %s [--host ADDR] [--port N] [COMMAND [ARG ...]]\n"
+        "       %s --bench [--threads N] [--connections N] [--pipeline N] [--requests N | --seconds N]\n"
+        "       [--keyspace N] [--value-size BYTES] [--get-ratio PCT] [--ttl-ratio PCT] [--ttl SECONDS]\n"
+        "       [--seed N] [--json]\n", prog, prog);
+    fprintf(stderr, "Without --bench, sends COMMAND, or a fixed list of demo commands, and prints each reply.\n");
+    fprintf(stderr, "  --host ADDR           server IPv4 address (default 127.0.0.1)\n");
+    fprintf(stderr, "  --port N              server port (default 1234)\n");
+    fprintf(stderr, "  --bench               generate load and report throughput and latency; implied by the flags below\n");
+    fprintf(stderr, "  --threads N           load generator threads (default %u)\n", config.threads);
+    fprintf(stderr, "  --connections N       connections, spread across the threads (default %u)\n", config.connections);
+    fprintf(stderr, "  --pipeline N          requests in flight per connection (default %u)\n", config.pipeline);
+    fprintf(stderr, "  --requests N          operations to run in total (default %llu)\n", (unsigned long long)config.requests);
+    fprintf(stderr, "  --seconds N           run for N seconds instead\n");
+    fprintf(stderr, "  --keyspace N          keys are key:0 .. key:N-1, picked at random (default %u)\n", config.keyspace);
+    fprintf(stderr, "  --value-size BYTES    SET value size (default %u)\n", config.value_size);
+    fprintf(stderr, "  --get-ratio PCT       percentage of operations that are GETs, the rest SETs (default %u)\n", config.get_ratio);
+    fprintf(stderr, "  --ttl-ratio PCT       percentage of SETs followed by an EXPIRE (default %u)\n", config.ttl_ratio);
+    fprintf(stderr, "  --ttl SECONDS         the TTL those EXPIREs set (default %u)\n", config.ttl);
+    fprintf(stderr, "  --seed N              seed for the key and operation choices (default %u)\n", config.seed);
+    fprintf(stderr, "  --json                print the report as one JSON object\n");
+    exit(EXIT_FAILURE);
+}
+
+// parse a decimal command line value in [min, max], or print usage and exit
+static long parse_flag_value(const char *prog, const char *s, long min, long max) {
+    char *end = NULL;
+    errno = 0;
+    long v = strtol(s, &end, 10);
+    if (errno != 0 || end == s || *end != '\0' || v < min || v > max) {
+        usage(prog);
+    }
+    return v;
+}
+
+static void parse_args(int argc, char **argv) {
+    config.host.s_addr = htonl(INADDR_LOOPBACK);
+    for (int i = 1; i < argc; i++) {
+        const char *flag = argv[i];
+        bool has_value = i + 1 < argc;
+        if (strncmp(flag, "--", 2) != 0) {     // the first non-flag starts a command to send
+            config.cmd = (const char **)&argv[i];
+            config.ncmd = (size_t)(argc - i);
+            break;
+        }
+        if (strcmp(flag, "--bench") == 0) {
+            config.bench = true;
+        } else if (strcmp(flag, "--json") == 0) {
+            config.bench = config.json = true;
+        } else if (has_value && strcmp(flag, "--host") == 0) {
+            if (inet_pton(AF_INET, argv[++i], &config.host) != 1) {
+                usage(argv[0]);
+            }
+        } else if (has_value && strcmp(flag, "--port") == 0) {
+            config.port = (int)parse_flag_value(argv[0], argv[++i], 1, 65535);
+        } else if (has_value && strcmp(flag, "--threads") == 0) {
+            config.threads = (uint32_t)parse_flag_value(argv[0], argv[++i], 1, 1024);
+        } else if (has_value && strcmp(flag, "--connections") == 0) {
+            config.connections = (uint32_t)parse_flag_value(argv[0], argv[++i], 1, 1000000);
+        } else if (has_value && strcmp(flag, "--pipeline") == 0) {
+            config.pipeline = (uint32_t)parse_flag_value(argv[0], argv[++i], 1, 100000);
+        } else if (has_value && strcmp(flag, "--requests") == 0) {
+            config.requests = (uint64_t)parse_flag_value(argv[0], argv[++i], 1, LONG_MAX);
+        } else if (has_value && strcmp(flag, "--seconds") == 0) {
+            config.seconds = (uint32_t)parse_flag_value(argv[0], argv[++i], 1, 86400);
+        } else if (has_value && strcmp(flag, "--keyspace") == 0) {
+            config.keyspace = (uint32_t)parse_flag_value(argv[0], argv[++i], 1, UINT32_MAX);
+        } else if (has_value && strcmp(flag, "--value-size") == 0) {
+            config.value_size = (uint32_t)parse_flag_value(argv[0], argv[++i], 0, MAX_MSG_SIZE - 64);
+        } else if (has_value && strcmp(flag, "--get-ratio") == 0) {
+            config.get_ratio = (uint32_t)parse_flag_value(argv[0], argv[++i], 0, 100);
+        } else if (has_value && strcmp(flag, "--ttl-ratio") == 0) {
+            config.ttl_ratio = (uint32_t)parse_flag_value(argv[0], argv[++i], 0, 100);
+        } else if (has_value && strcmp(flag, "--ttl") == 0) {
+            config.ttl = (uint32_t)parse_flag_value(argv[0], argv[++i], 1, INT32_MAX);
+        } else if (has_value && strcmp(flag, "--seed") == 0) {
+            config.seed = (uint32_t)parse_flag_value(argv[0], argv[++i], 0, UINT32_MAX);
+        } else {
+            usage(argv[0]);
+        }
+        if (strcmp(flag, "--host") != 0 && strcmp(flag, "--port") != 0) {
+            config.bench = true;    // every other flag is a load generator option
+        }
+    }
+    if (config.threads > config.connections) {
+        config.threads = config.connections;
+    }
+    if (config.bench && config.cmd) {
+        usage(argv[0]);
+    }
+}
+
+// client program
+int main(int argc, char **argv) {
+    parse_args(argc, argv);
+    if (config.bench) {
+        signal(SIGPIPE, SIG_IGN);   // a server going away is a write() error, reported as such
+        return run_bench();
+    }
+    if (config.cmd) {
+        return run_command();
+    }
+    run_demo();
+    return 0;
+}
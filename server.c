@@ -1,27 +1,218 @@
 // libraries
 #include <assert.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include <errno.h>
+#include <limits.h>
 #include <fcntl.h>
-#include <poll.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <strings.h>
 #include <time.h>
 #include <unistd.h>
+#include <netdb.h>
 #include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
 #include <netinet/ip.h>
+#include <netinet/tcp.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
-#define MAX_MSG_SIZE 4096
-#define MAX_FD 1024  // Maximum file descriptors for simplicity
-#define MAX_ARGS 200 // Maximum number of strings allowed in one request
+#define MSG_SIZE_LIMIT (512u << 20) // Default cap on one request, like Redis's proto-max-bulk-len
+#define MAX_ARGS 1024 // Maximum number of strings allowed in one request, enough for MSET of 500 pairs
+#define MAX_EVENTS 1024 // Maximum readiness events taken from one epoll_wait()
+#define MAX_THREADS 64  // Maximum I/O threads, and so keyspace shards
+#define REPL_BACKLOG_SIZE (1u << 20) // Default replication backlog, like Redis's repl-backlog-size
+#define REPL_BUFFER_LIMIT (256u << 20) // Default cap on a replica's unsent stream, like Redis's replica output limit
+
+// settings from the command line, fixed once the server is running
+static struct {
+    int port;
+    uint32_t threads;       // I/O threads, and so keyspace shards
+    uint32_t max_msg_size;  // largest request body accepted, in bytes
+    const char *log_level;  // initial log level name, changeable later with LOGLEVEL
+    const char *snapshot;   // file SAVE/BGSAVE write and startup loads
+    const char *aof;        // append-only file, or NULL to run without one
+    uint32_t hash_pack_entries; // a hash stays packed up to this many fields
+    uint32_t hash_pack_value;   // and while no field or value is longer than this
+    uint32_t list_pack_entries; // likewise for a list's elements
+    uint32_t list_pack_value;
+    size_t maxmemory;       // bytes the keys may take before writes evict, 0 for no limit
+    int maxmemory_policy;   // EVICT_*
+    size_t repl_backlog_size;   // bytes of the write stream kept for replicas that reconnect
+    size_t repl_buffer_limit;   // bytes of the stream a replica may have unsent before it is dropped
+} config = {1234, 1, MSG_SIZE_LIMIT, "warn", "dump.rdb", NULL, 128, 64, 128, 64, 0, 0, REPL_BACKLOG_SIZE, REPL_BUFFER_LIMIT};
+
+// ---- logging ----
+// Log lines are formatted by the thread that produces them into a fixed-size
+// slot of a lock-free ring (Vyukov's bounded queue: each slot carries a
+// sequence number saying whose turn it is), and a background thread drains
+// the ring to stderr in batches. An I/O thread never blocks on the terminal
+// or on a lock; if the ring is full the line is dropped and counted. A level
+// check happens before any formatting, so a disabled level costs one relaxed
+// atomic load.
+
+enum {
+    LOG_OFF = 0,
+    LOG_WARN = 1,
+    LOG_INFO = 2,
+    LOG_DEBUG = 3,  // includes a trace line for every request
+};
+
+#define LOG_RING_SIZE 4096  // slots, a power of two
+#define LOG_LINE_MAX 240    // longer lines are truncated
+#define LOG_IDLE_SLEEP_MS 10
+#define LOG_DROPPED_NOTICE_MAX 80  // room the "log lines dropped" line needs, count included
+
+static const char *const log_level_names[] = {"off", "warn", "info", "debug"};
+
+typedef struct {
+    atomic_size_t seq;  // == position: free for a producer; == position + 1: holds a line
+    uint8_t level;
+    uint16_t len;
+    uint64_t ts_ms;
+    char text[LOG_LINE_MAX];
+} LogSlot;
+
+static struct {
+    LogSlot slots[LOG_RING_SIZE];
+    atomic_size_t head;         // next position a producer claims
+    size_t tail;                // next position the drainer reads; only it touches this
+    atomic_ullong dropped;      // lines lost to a full ring
+} log_ring;
+
+static atomic_int log_level = LOG_WARN;
+
+#define log_enabled(level) ((level) <= atomic_load_explicit(&log_level, memory_order_relaxed))
+#define log_at(level, ...) \
+    do { \
+        if (log_enabled(level)) { \
+            log_write(level, __VA_ARGS__); \
+        } \
+    } while (0)
+
+static void log_init(void) {
+    for (size_t i = 0; i < LOG_RING_SIZE; i++) {
+        atomic_init(&log_ring.slots[i].seq, i);
+    }
+    atomic_init(&log_ring.head, 0);
+    log_ring.tail = 0;
+}
+
+// claim a slot and format into it; callers normally go through log_at()
+__attribute__((format(printf, 2, 3)))
+static void log_write(int level, const char *fmt, ...) {
+    size_t pos = atomic_load_explicit(&log_ring.head, memory_order_relaxed);
+    LogSlot *slot;
+    while (1) {
+        slot = &log_ring.slots[pos & (LOG_RING_SIZE - 1)];
+        size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&log_ring.head, &pos, pos + 1,
+                    memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {  // the drainer is a full lap behind
+            atomic_fetch_add_explicit(&log_ring.dropped, 1, memory_order_relaxed);
+            return;
+        } else {
+            pos = atomic_load_explicit(&log_ring.head, memory_order_relaxed);
+        }
+    }
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    slot->ts_ms = (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+    slot->level = (uint8_t)level;
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(slot->text, sizeof(slot->text), fmt, ap);
+    va_end(ap);
+    slot->len = (uint16_t)(n < 0 ? 0 : n >= LOG_LINE_MAX ? LOG_LINE_MAX - 1 : n);
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+}
+
+// write every finished line to out in one go; returns how many there were.
+// Only one thread may drain.
+static size_t log_drain(FILE *out) {
+    char batch[64 * 1024];
+    size_t used = 0, lines = 0;
+    while (1) {
+        LogSlot *slot = &log_ring.slots[log_ring.tail & (LOG_RING_SIZE - 1)];
+        if (atomic_load_explicit(&slot->seq, memory_order_acquire) != log_ring.tail + 1) {
+            break;  // empty, or the producer of the next line hasn't finished it
+        }
+        if (sizeof(batch) - used < LOG_LINE_MAX + 64) {
+            fwrite(batch, 1, used, out);
+            used = 0;
+        }
+        time_t secs = (time_t)(slot->ts_ms / 1000);
+        struct tm tm;
+        localtime_r(&secs, &tm);
+        used += strftime(&batch[used], sizeof(batch) - used, "%Y-%m-%d %H:%M:%S", &tm);
+        used += (size_t)snprintf(&batch[used], sizeof(batch) - used, ".%03u [%s] %.*s\n",
+            (unsigned)(slot->ts_ms % 1000), log_level_names[slot->level], (int)slot->len, slot->text);
+        atomic_store_explicit(&slot->seq, log_ring.tail + LOG_RING_SIZE, memory_order_release);
+        log_ring.tail++;
+        lines++;
+    }
+    static unsigned long long reported_dropped = 0;
+    unsigned long long dropped = atomic_load_explicit(&log_ring.dropped, memory_order_relaxed);
+    if (dropped != reported_dropped) {
+        if (sizeof(batch) - used < LOG_DROPPED_NOTICE_MAX) {
+            fwrite(batch, 1, used, out);
+            used = 0;
+        }
+        used += (size_t)snprintf(&batch[used], sizeof(batch) - used,
+            "(%llu log lines dropped, the ring was full)\n", dropped - reported_dropped);
+        reported_dropped = dropped;
+    }
+    if (used) {
+        fwrite(batch, 1, used, out);
+        fflush(out);
+    }
+    return lines;
+}
+
+static void *log_thread_run(void *arg) {
+    (void)arg;
+    while (1) {
+        if (log_drain(stderr) == 0) {
+            struct timespec ts = {0, LOG_IDLE_SLEEP_MS * 1000000L};
+            nanosleep(&ts, NULL);
+        }
+    }
+    return NULL;
+}
+
+// parse "off"/"warn"/"info"/"debug"; -1 if it's none of them
+static int log_level_parse(const char *name, size_t len) {
+    for (int i = LOG_OFF; i <= LOG_DEBUG; i++) {
+        if (strlen(log_level_names[i]) == len && strncasecmp(log_level_names[i], name, len) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
 
 // helper function to write simple error message
 static void msg(const char *msg) {
-    fprintf(stderr, "%s\n", msg);
+    log_at(LOG_WARN, "%s", msg);
 }
 
 // error handling
@@ -41,443 +232,7385 @@ static void fd_set_nb(int fd) {
     }
 }
 
+// ---- growable byte buffers ----
+// Connection buffers start empty and grow on demand, so an idle connection
+// costs a few dozen bytes rather than a pair of worst-case arrays. Data is
+// consumed from the front by advancing `start`; the live bytes are slid back
+// to the front only when that makes room, so each byte moves at most once.
+// Parsing reads requests in place, which is why this is one contiguous block
+// rather than a ring.
+
+#define BUF_INIT_SIZE 1024          // first allocation for a buffer
+#define BUF_READ_CHUNK 4096         // minimum free space offered to each read()
+#define BUF_KEEP_SIZE (16 * 1024)   // buffers above this are freed as soon as they drain
+
+typedef struct {
+    uint8_t *data;
+    size_t start;   // offset of the first unconsumed byte
+    size_t end;     // offset just past the last byte
+    size_t cap;
+} Buf;
+
+static size_t buf_len(const Buf *b) {
+    return b->end - b->start;
+}
+
+// make room for at least n more bytes after end
+static void buf_reserve(Buf *b, size_t n) {
+    if (b->cap - b->end >= n) {
+        return;
+    }
+    size_t len = buf_len(b);
+    if (b->start > 0 && b->cap - len >= n && b->start >= len) {
+        // enough room once the consumed prefix is reclaimed, and it is at
+        // least as big as what has to move, so the copy pays for itself
+        memmove(b->data, b->data + b->start, len);
+        b->start = 0;
+        b->end = len;
+        return;
+    }
+    size_t cap = b->cap ? b->cap : BUF_INIT_SIZE;
+    while (cap - len < n) {
+        cap *= 2;
+    }
+    uint8_t *data = malloc(cap);
+    if (!data) {
+        die("malloc()");
+    }
+    if (len) {
+        memcpy(data, b->data + b->start, len);
+    }
+    free(b->data);
+    b->data = data;
+    b->start = 0;
+    b->end = len;
+    b->cap = cap;
+}
+
+static void buf_append(Buf *b, const void *data, size_t n) {
+    buf_reserve(b, n);
+    memcpy(b->data + b->end, data, n);
+    b->end += n;
+}
+
+// append printf-style text
+__attribute__((format(printf, 2, 3)))
+static void buf_printf(Buf *b, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+    if (n <= 0) {
+        return;
+    }
+    buf_reserve(b, (size_t)n + 1);  // vsnprintf writes a terminating NUL
+    va_start(ap, fmt);
+    vsnprintf((char *)b->data + b->end, (size_t)n + 1, fmt, ap);
+    va_end(ap);
+    b->end += (size_t)n;
+}
+
+static void buf_consume(Buf *b, size_t n) {
+    b->start += n;
+    if (b->start == b->end) {
+        b->start = b->end = 0;
+    }
+}
+
+static void buf_free(Buf *b) {
+    free(b->data);
+    memset(b, 0, sizeof(*b));
+}
+
+// give memory back once a buffer has drained: anything above BUF_KEEP_SIZE
+// right away, and everything when the connection has gone idle
+static void buf_shrink(Buf *b, bool idle) {
+    if (buf_len(b) == 0 && (idle || b->cap > BUF_KEEP_SIZE)) {
+        buf_free(b);
+    }
+}
+
+// ---- chained reply buffers ----
+// Replies are built into an Out: a chain of segments that goes to the socket
+// with writev(). Type tags, lengths and most strings are copied into inline
+// segments, and a new segment is started when the last one is full, so the
+// bytes already written never move and a long pipelined batch is never copied
+// to make room. A segment can also reference bytes that live elsewhere, such
+// as a reply built on another thread, which is spliced in without a copy. A
+// reference carries a release function that is called once its bytes have
+// been sent or the connection is gone.
+
+#define OUT_SEG_MIN 1024            // first inline segment of a chain
+#define OUT_SEG_MAX (64 * 1024)     // inline segments double up to this size
+#define OUT_IOV_MAX 64              // segments handed to one writev()
+
+typedef struct OutSeg {
+    struct OutSeg *next;
+    const uint8_t *data;        // inline bytes just after this header, or referenced ones
+    size_t len;
+    size_t cap;                 // room for inline bytes; 0 for a reference
+    void (*release)(void *);    // for a reference: called with owner once it is done with
+    void *owner;
+} OutSeg;
+
+// An all-zero Out is a valid empty chain.
+typedef struct {
+    OutSeg *head, *tail;
+    size_t sent;        // bytes of head already written
+    size_t len;         // bytes not yet written, across every segment
+    uint32_t total;     // bytes ever appended, mod 2^32, for out_len_end
+} Out;
+
+static size_t out_len(const Out *out) {
+    return out->len;
+}
+
+static void out_link(Out *out, OutSeg *seg) {
+    if (out->tail) {
+        out->tail->next = seg;
+    } else {
+        out->head = seg;
+    }
+    out->tail = seg;
+}
+
+// room for n contiguous inline bytes at the end of the chain; the caller fills them
+static uint8_t *out_reserve(Out *out, size_t n) {
+    OutSeg *t = out->tail;
+    if (!t || t->cap == 0 || t->cap - t->len < n) {
+        size_t cap = t && t->cap ? t->cap * 2 : OUT_SEG_MIN;
+        cap = cap > OUT_SEG_MAX ? OUT_SEG_MAX : cap;
+        cap = cap < n ? n : cap;
+        t = malloc(sizeof(OutSeg) + cap);
+        if (!t) {
+            die("malloc()");
+        }
+        *t = (OutSeg){.data = (const uint8_t *)(t + 1), .cap = cap};
+        out_link(out, t);
+    }
+    uint8_t *p = (uint8_t *)(t + 1) + t->len;
+    t->len += n;
+    out->len += n;
+    out->total += (uint32_t)n;
+    return p;
+}
+
+static void out_append(Out *out, const void *data, size_t n) {
+    if (n) {
+        memcpy(out_reserve(out, n), data, n);
+    }
+}
+
+// append len bytes at data without copying them; release(owner) is called
+// once they have been sent, or dropped along with the chain
+static void out_ref(Out *out, const uint8_t *data, size_t len, void (*release)(void *), void *owner) {
+    OutSeg *seg = malloc(sizeof(OutSeg));
+    if (!seg) {
+        die("malloc()");
+    }
+    *seg = (OutSeg){.data = data, .len = len, .release = release, .owner = owner};
+    out_link(out, seg);
+    out->len += len;
+    out->total += (uint32_t)len;
+}
+
+// A 4-byte length of whatever is appended between out_len_begin() and
+// out_len_end(), references included. The placeholder notes where the count
+// stood, which works because inline bytes never move.
+static uint8_t *out_len_begin(Out *out) {
+    uint8_t *at = out_reserve(out, 4);
+    memcpy(at, &out->total, 4);
+    return at;
+}
+
+static void out_len_end(Out *out, uint8_t *at) {
+    uint32_t begin = 0;
+    memcpy(&begin, at, 4);
+    uint32_t len = out->total - begin;
+    memcpy(at, &len, 4);
+}
+
+// move every segment of src onto the end of dst, leaving src empty
+static void out_splice(Out *dst, Out *src) {
+    if (!src->head) {
+        return;
+    }
+    assert(src->sent == 0);
+    out_link(dst, src->head);
+    dst->tail = src->tail;
+    dst->len += src->len;
+    dst->total += (uint32_t)src->len;
+    memset(src, 0, sizeof(*src));
+}
+
+static void out_seg_free(OutSeg *seg) {
+    if (seg->release) {
+        seg->release(seg->owner);
+    }
+    free(seg);
+}
+
+// fill iov with up to max unsent pieces of the chain; returns how many
+static int out_iov(const Out *out, struct iovec *iov, int max) {
+    int n = 0;
+    size_t skip = out->sent;
+    for (const OutSeg *seg = out->head; seg && n < max; seg = seg->next) {
+        if (seg->len > skip) {
+            iov[n].iov_base = (void *)(seg->data + skip);
+            iov[n].iov_len = seg->len - skip;
+            n++;
+        }
+        skip = 0;
+    }
+    return n;
+}
+
+// drop n sent bytes from the front. A chain that drains keeps its last inline
+// segment for the next replies if it is no bigger than BUF_KEEP_SIZE.
+static void out_consume(Out *out, size_t n) {
+    out->len -= n;
+    n += out->sent;
+    while (out->head && n >= out->head->len) {
+        OutSeg *seg = out->head;
+        n -= seg->len;
+        out->head = seg->next;
+        if (!out->head && seg->cap && seg->cap <= BUF_KEEP_SIZE) {
+            seg->len = 0;
+            out->head = seg;
+            break;
+        }
+        out_seg_free(seg);
+    }
+    if (!out->head) {
+        out->tail = NULL;
+    }
+    out->sent = n;
+}
+
+static void out_free(Out *out) {
+    while (out->head) {
+        OutSeg *seg = out->head;
+        out->head = seg->next;
+        out_seg_free(seg);
+    }
+    memset(out, 0, sizeof(*out));
+}
+
+// once a chain has drained and its connection has gone idle, free the
+// segment out_consume kept
+static void out_shrink(Out *out, bool idle) {
+    if (out->len == 0 && idle) {
+        out_free(out);
+    }
+}
+
+// ---- connections ----
+
 // define connection states
 enum {
     STATE_REQ = 0,  // waiting for client request (read)
     STATE_RES = 1,  // ready to send response to client (write)
     STATE_END = 2,  // mark connection for closure (client disconnected or error)
+    STATE_BLOCKED = 3,  // parked in BLPOP/BRPOP: reads nothing until answered, but notices a hangup
+    STATE_SYNC = 4,     // sent PSYNC: about to be handed to thread 0, which serves replicas
+    STATE_REPLICA = 5,  // a replica's connection, carrying the write stream (see replication)
+    STATE_COUNT,
 };
 
+struct Loop;
+
 // store connection data
 struct Conn {
     int fd;                         // file descriptor
     uint32_t state;                 // current state (REQ, RES, END)
-    size_t rbuf_size;               // size of current data in read buffer
-    uint8_t rbuf[4 + MAX_MSG_SIZE]; // read buffer (header + msg)
-    size_t wbuf_size;               // size of data in write buffer
-    size_t wbuf_sent;               // number of bytes already sent from write buffer
-    uint8_t wbuf[4 + MAX_MSG_SIZE]; // write buffer (header + message)
+    uint32_t events;                // interest currently registered with epoll
+    struct Loop *loop;              // the I/O thread that owns this connection
+    bool waiting;                   // a request was forwarded to another shard and its reply is pending
+    bool held;                      // its replies wait for an AOF fsync (--aof-fsync always)
+    bool blocked;                   // the pending reply is a BLPOP/BRPOP's, which may wait on its shard
+    uint64_t block_hcode;           // hash of that request's first key, to find and cancel its waiter
+    uint64_t last_active_ms;        // when the client last sent anything, for idle buffer shrinking
+    uint64_t read_ticks;            // ticks_now() when the requests now being answered were read, or 0
+    uint32_t replies_due;           // replies to them added to wbuf, timed once it has all been written
+    bool primary;                   // the link to our primary: its stream is applied and never answered
+    pid_t sync_child;               // a replica's: the child still writing it a full sync, or 0
+    Buf repl_pending;               // a replica's: stream not yet queued on wbuf, appended by every loop under repl.mu
+    bool repl_overflow;             // a replica's: repl_pending would have passed --repl-buffer-limit
+    uint64_t repl_ack;              // a replica's: how much of the stream it last said it had applied
+    uint64_t repl_ack_ms;           // and when
+    Buf rbuf;                       // read buffer (header + msg), bytes not yet parsed
+    Out wbuf;                       // replies (header + message) not yet sent
+};
+
+// ---- inter-thread messages ----
+// Each I/O thread has an inbox: an intrusive multi-producer single-consumer
+// queue (Dmitry Vyukov's design). Pushing is a single atomic exchange, so a
+// sender never waits on the receiver or on other senders.
+
+enum {
+    MSG_REQ = 0,        // run a request against the receiver's shard and send back a MSG_RES
+    MSG_REQ_ALL = 1,    // run a request that reads every shard (only ever sent to thread 0)
+    MSG_RES = 2,        // the reply to a forwarded request
+    MSG_PAUSE = 3,      // park until thread 0 has finished a stop_world() section
+    MSG_UNBLOCK = 4,    // the client of a parked BLPOP/BRPOP went away; data is its block_hcode
+    MSG_PSYNC = 5,      // a connection that sent PSYNC, handed over to thread 0 with the request in its rbuf
+    MSG_SYNCED = 6,     // the replication thread is done; data is its ReplSync pointer
+    MSG_APPLY = 7,      // a write from our primary's stream: run it and send nothing back
 };
 
-// store and retrieve connection data by file descriptor
-struct Conn *fd2conn[MAX_FD] = {NULL};
+typedef struct Msg {
+    _Atomic(struct Msg *) next;
+    uint32_t type;
+    struct Loop *from;  // the thread to send the reply back to
+    struct Conn *conn;  // the connection the reply is for; only ever touched by `from` (MSG_PSYNC passes it on)
+    Out res;            // the reply, for MSG_RES; spliced onto the connection's own chain
+    uint32_t len;
+    uint8_t data[];     // request body for MSG_REQ*
+} Msg;
+
+typedef struct {
+    _Atomic(Msg *) head;    // most recently pushed message, producers swap themselves in here
+    Msg *tail;              // oldest message, only touched by the consumer
+    Msg stub;               // placeholder that keeps the list non-empty
+} MsgQueue;
+
+static void mq_init(MsgQueue *q) {
+    atomic_store(&q->stub.next, NULL);
+    atomic_store(&q->head, &q->stub);
+    q->tail = &q->stub;
+}
+
+static void mq_push(MsgQueue *q, Msg *m) {
+    atomic_store_explicit(&m->next, NULL, memory_order_relaxed);
+    Msg *prev = atomic_exchange_explicit(&q->head, m, memory_order_acq_rel);
+    atomic_store_explicit(&prev->next, m, memory_order_release);
+}
+
+// pop the oldest message, or NULL if the queue is empty (or a push is only
+// half done; the pusher wakes the consumer again once it has finished)
+static Msg *mq_pop(MsgQueue *q) {
+    Msg *tail = q->tail;
+    Msg *next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    if (tail == &q->stub) {
+        if (!next) {
+            return NULL;
+        }
+        q->tail = next;
+        tail = next;
+        next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    }
+    if (next) {
+        q->tail = next;
+        return tail;
+    }
+    if (tail != atomic_load_explicit(&q->head, memory_order_acquire)) {
+        return NULL;
+    }
+    mq_push(q, &q->stub);
+    next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    if (next) {
+        q->tail = next;
+        return tail;
+    }
+    return NULL;
+}
+
+// ---- event loops ----
+// One per I/O thread. Each loop has its own listening socket (SO_REUSEPORT
+// lets the kernel spread new connections across them), its own epoll set and
+// connection table, and owns the keyspace shard with the same index.
+
+typedef struct Loop {
+    uint32_t id;                // also the index of the shard this thread owns
+    pthread_t thread;
+    int epfd;                   // the epoll instance every socket is registered with exactly once
+    int listen_fd;
+    int wake_fd;                // eventfd other threads poke after pushing to inbox
+    atomic_bool wake_pending;   // set while a poke is outstanding, so bursts cost one write()
+    MsgQueue inbox;
+    struct Conn **fd2conn;      // connections by fd; grows with the highest fd seen, so the
+    size_t fd2conn_cap;         // only limit on connections is RLIMIT_NOFILE
+    size_t cron_cursor;         // next fd2conn slot conn_cron() looks at
+    uint64_t cron_last_ms;      // when conn_cron() last ran
+    uint64_t aof_wait_seq;      // the last AOF batch this loop appended
+    struct Held *held;          // replies waiting for that batch to be synced
+    size_t nheld, held_cap;
+} Loop;
 
-// store a connection object in the global array
-static void conn_put(struct Conn *conn) {
-    if (conn->fd >= 0 && conn->fd < MAX_FD) {
-        fd2conn[conn->fd] = conn;   // add connection to the global array
+static Loop loops[MAX_THREADS];
+static uint32_t nloops = 1;
+
+// store a connection object in its loop's connection table
+static void conn_put(Loop *loop, struct Conn *conn) {
+    if ((size_t)conn->fd >= loop->fd2conn_cap) {
+        size_t cap = loop->fd2conn_cap ? loop->fd2conn_cap : 1024;
+        while (cap <= (size_t)conn->fd) {
+            cap *= 2;
+        }
+        struct Conn **grown = realloc(loop->fd2conn, cap * sizeof(struct Conn *));
+        if (!grown) {
+            die("realloc()");
+        }
+        memset(&grown[loop->fd2conn_cap], 0, (cap - loop->fd2conn_cap) * sizeof(struct Conn *));
+        loop->fd2conn = grown;
+        loop->fd2conn_cap = cap;
     }
+    loop->fd2conn[conn->fd] = conn;   // add connection to the table
 }
 
-// accept new client connection
-static int32_t accept_new_conn(int fd) {
-    struct sockaddr_in client_addr = {};
-    socklen_t socklen = sizeof(client_addr);
-    int connfd = accept(fd, (struct sockaddr *)&client_addr, &socklen); // accept a new connection
-    if(connfd < 0) {
-        msg("accept() error");
-        return -1;
+// epoll interest for a connection state: read while waiting for requests,
+// write while a response is pending. Edge-triggered, so each wakeup must
+// drain the socket until it would block.
+static uint32_t state_events(uint32_t state) {
+    if (state == STATE_BLOCKED) {   // replies from before it may still be going out
+        return EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
     }
-    if (connfd >= MAX_FD) {   // reject if fd is beyond what fd2conn[] can hold
-        msg("too many connections, rejecting");
-        close(connfd);
-        return -1;
+    if (state == STATE_REPLICA) {   // streams out, and reads its acknowledgements
+        return EPOLLIN | EPOLLOUT | EPOLLET;
     }
-    fd_set_nb(connfd);  // set new connection to nonblocking mode
+    return (state == STATE_REQ ? EPOLLIN : EPOLLOUT) | EPOLLET;
+}
 
+// set up a connection for a connected nonblocking socket, registered with
+// loop's epoll set; NULL (with fd closed) on failure
+static struct Conn *conn_new(Loop *loop, int fd) {
     struct Conn *conn = (struct Conn *)malloc(sizeof(struct Conn)); // allocate memory for connection
     if(!conn) {
-        close(connfd);
-        return -1;
+        close(fd);
+        return NULL;
     }
 
-    conn->fd = connfd;
+    conn->fd = fd;
     conn->state = STATE_REQ;    // initialise connection in the read state
-    conn->rbuf_size = 0;
-    conn->wbuf_size = 0;
-    conn->wbuf_sent = 0;
-    conn_put(conn); // store connection in the global array
-    return 0;
+    conn->events = state_events(STATE_REQ);
+    conn->loop = loop;
+    conn->waiting = false;
+    conn->held = false;
+    conn->blocked = false;
+    conn->block_hcode = 0;
+    conn->last_active_ms = 0;
+    conn->read_ticks = 0;
+    conn->replies_due = 0;
+    conn->primary = false;
+    conn->sync_child = 0;
+    conn->repl_ack = conn->repl_ack_ms = 0;
+    conn->repl_overflow = false;
+    memset(&conn->repl_pending, 0, sizeof(conn->repl_pending));
+    memset(&conn->rbuf, 0, sizeof(conn->rbuf));
+    memset(&conn->wbuf, 0, sizeof(conn->wbuf));
+
+    struct epoll_event ev = {.events = conn->events, .data.fd = fd};
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        msg("epoll_ctl() error");
+        close(fd);
+        free(conn);
+        return NULL;
+    }
+    conn_put(loop, conn); // store connection in the loop's table
+    return conn;
+}
+
+// accept new client connection; returns -1 once there is nothing left to accept
+static int32_t accept_new_conn(Loop *loop) {
+    struct sockaddr_in client_addr = {};
+    socklen_t socklen = sizeof(client_addr);
+    int connfd = accept(loop->listen_fd, (struct sockaddr *)&client_addr, &socklen); // accept a new connection
+    if(connfd < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            msg("accept() error");
+        }
+        return -1;
+    }
+    fd_set_nb(connfd);  // set new connection to nonblocking mode
+    // replies go out as soon as they are ready: with Nagle's algorithm a reply
+    // that completes a pipelined batch would wait for the client's delayed ACK
+    int one = 1;
+    setsockopt(connfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return conn_new(loop, connfd) ? 0 : -1;
 }
 
-// ---- simple chained hash table for the key-value store ----
+// ---- clocks ----
 
-#define HTABLE_SIZE 4096
+// wall-clock time in milliseconds, the same clock TTLs are measured against
+static uint64_t get_wall_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
 
-typedef struct Entry {
-    char *key;
-    size_t klen;
-    char *val;
-    size_t vlen;
-    time_t expire_at;   // absolute unix time this key expires at; 0 = no expiry
-    struct Entry *next;
-} Entry;
+// monotonic time in microseconds, for measuring how long work takes
+static uint64_t get_monotonic_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
 
-static Entry *htable[HTABLE_SIZE] = {NULL};
+// a cycle counter for timing single requests, far cheaper to read than
+// clock_gettime(): the CPU's timestamp counter on x86-64, which ticks at a
+// constant rate, and monotonic nanoseconds elsewhere. Ticks only become
+// time when something is reported, see ticks_per_ns().
+static uint64_t ticks_now(void) {
+#ifdef __x86_64__
+    return __builtin_ia32_rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+#endif
+}
 
-// FNV-1a hash over arbitrary bytes
-static uint64_t hash_bytes(const uint8_t *data, size_t len) {
-    uint64_t h = 14695981039346656037UL;
-    for (size_t i = 0; i < len; i++) {
-        h ^= data[i];
-        h *= 1099511628211UL;
+static double ticks_ratio = 1;
+static pthread_once_t ticks_once = PTHREAD_ONCE_INIT;
+
+static void ticks_calibrate(void) {
+#ifdef __x86_64__
+    uint64_t us = get_monotonic_us(), t = ticks_now();
+    struct timespec pause = {0, 20 * 1000000};
+    nanosleep(&pause, NULL);
+    uint64_t took_us = get_monotonic_us() - us;
+    ticks_ratio = (double)(ticks_now() - t) / ((double)took_us * 1000);
+#endif
+}
+
+// ticks per nanosecond, measured against the monotonic clock the first time
+// it is asked for (main() does so before anything is timed)
+static double ticks_per_ns(void) {
+    pthread_once(&ticks_once, ticks_calibrate);
+    return ticks_ratio;
+}
+
+// ---- latency histograms ----
+// HDR-style: every power of two is split into HIST_SUB equal sub-buckets, so
+// any value is known to within 1/HIST_SUB of itself from a few hundred
+// counters, whether it is 50ns or 5s. Adding a value is a count-leading-
+// zeros and an increment. Values are in ticks.
+
+#define HIST_SUB_BITS 3         // 8 sub-buckets per power of two: within 12.5%
+#define HIST_SUB (1u << HIST_SUB_BITS)
+#define HIST_MAX_BITS 40        // values of 2^40 ticks (minutes) and over share the top bucket
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 1) * HIST_SUB)
+
+typedef struct {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total;     // values recorded
+    uint64_t max;       // the largest, exactly
+} Hist;
+
+static uint32_t hist_bucket(uint64_t v) {
+    if (v < HIST_SUB) {
+        return (uint32_t)v;
     }
-    return h;
+    uint32_t e = 63 - (uint32_t)__builtin_clzll(v);    // v is in [2^e, 2^(e+1))
+    if (e >= HIST_MAX_BITS) {
+        return HIST_BUCKETS - 1;
+    }
+    return (e - HIST_SUB_BITS + 1) * HIST_SUB + (uint32_t)((v >> (e - HIST_SUB_BITS)) & (HIST_SUB - 1));
 }
 
-static Entry *h_lookup(const uint8_t *key, size_t klen) {
-    uint64_t slot = hash_bytes(key, klen) % HTABLE_SIZE;
-    Entry **pp = &htable[slot];
-    while (*pp) {
-        Entry *e = *pp;
-        if (e->klen == klen && memcmp(e->key, key, klen) == 0) {
-            if (e->expire_at != 0 && e->expire_at <= time(NULL)) {
-                // key has expired: remove it lazily and report as missing
-                *pp = e->next;
-                free(e->key);
-                free(e->val);
-                free(e);
-                return NULL;
-            }
-            return e;
-        }
-        pp = &e->next;
+// the largest value bucket b holds (below the top bucket)
+static uint64_t hist_bucket_max(uint32_t b) {
+    if (b < HIST_SUB) {
+        return b;
     }
-    return NULL;
+    uint32_t shift = b / HIST_SUB - 1;
+    return ((uint64_t)(HIST_SUB + b % HIST_SUB) << shift) + ((uint64_t)1 << shift) - 1;
 }
 
-static void h_set(const uint8_t *key, size_t klen, const uint8_t *val, size_t vlen) {
-    Entry *e = h_lookup(key, klen);
-    if (e) {   // key exists, just replace the value and clear any TTL
-        free(e->val);
-        e->val = malloc(vlen);
-        memcpy(e->val, val, vlen);
-        e->vlen = vlen;
-        e->expire_at = 0;
-        return;
+// record n occurrences of v
+static void hist_add(Hist *h, uint64_t v, uint64_t n) {
+    h->counts[hist_bucket(v)] += n;
+    h->total += n;
+    if (v > h->max) {
+        h->max = v;
     }
-    e = malloc(sizeof(Entry));   // new key, insert at the head of its bucket
-    e->key = malloc(klen);
-    memcpy(e->key, key, klen);
-    e->klen = klen;
-    e->val = malloc(vlen);
-    memcpy(e->val, val, vlen);
-    e->vlen = vlen;
-    e->expire_at = 0;
+}
 
-    uint64_t slot = hash_bytes(key, klen) % HTABLE_SIZE;
-    e->next = htable[slot];
-    htable[slot] = e;
+static void hist_merge(Hist *into, const Hist *h) {
+    for (uint32_t b = 0; b < HIST_BUCKETS; b++) {
+        into->counts[b] += h->counts[b];
+    }
+    into->total += h->total;
+    if (h->max > into->max) {
+        into->max = h->max;
+    }
 }
 
-static bool h_del(const uint8_t *key, size_t klen) {
-    uint64_t slot = hash_bytes(key, klen) % HTABLE_SIZE;
-    Entry **pp = &htable[slot];
-    while (*pp) {
-        Entry *e = *pp;
-        if (e->klen == klen && memcmp(e->key, key, klen) == 0) {
-            *pp = e->next;
-            free(e->key);
-            free(e->val);
-            free(e);
-            return true;
+// the value p percent of those recorded are at or below, rounded up to its
+// bucket's upper bound; 0 if nothing was recorded
+static uint64_t hist_percentile(const Hist *h, double p) {
+    if (h->total == 0) {
+        return 0;
+    }
+    double want = p / 100 * (double)h->total;
+    uint64_t rank = (uint64_t)want;
+    rank += (double)rank < want || rank == 0;
+    uint64_t seen = 0;
+    for (uint32_t b = 0; b < HIST_BUCKETS; b++) {
+        seen += h->counts[b];
+        if (seen >= rank && b < HIST_BUCKETS - 1) {
+            uint64_t v = hist_bucket_max(b);
+            return v < h->max ? v : h->max;
         }
-        pp = &e->next;
     }
-    return false;
+    return h->max;
 }
 
-// ---- request parsing and command dispatch ----
+// ---- deadline min-heap ----
+// An intrusive binary min-heap ordered by deadline. Anything with a deadline
+// embeds a HeapNode; the node remembers its own position so it can be
+// removed or rescheduled in O(log n) without searching.
+
+#define HEAP_NONE ((size_t)-1)  // idx of a node that is not in any heap
 
-// a single parsed argument: a pointer into the request buffer + its length
 typedef struct {
-    uint32_t len;
-    const uint8_t *data;
-} Arg;
+    uint64_t at_ms;     // absolute wall-clock deadline in milliseconds
+    size_t idx;         // position in the heap array, HEAP_NONE when not queued
+} HeapNode;
 
+typedef struct {
+    HeapNode **items;
+    size_t size;
+    size_t cap;
+} Heap;
 
+#define container_of(ptr, type, member) ((type *)((char *)(ptr) - offsetof(type, member)))
 
-// parse a request body of the form [nstr][len1][str1][len2][str2]...
-// returns 0 on success, -1 if the body is malformed
-static int32_t parse_req(const uint8_t *data, size_t len, uint32_t *out_nstr, Arg *out_args, uint32_t max_args) {
-    if (len < 4) {
-        return -1;
-    }
-    uint32_t nstr = 0;
-    memcpy(&nstr, data, 4);
-    if (nstr > max_args) {
-        return -1;
+static void heap_place(Heap *h, size_t i, HeapNode *n) {
+    h->items[i] = n;
+    n->idx = i;
+}
+
+static void heap_sift_up(Heap *h, size_t i) {
+    HeapNode *n = h->items[i];
+    while (i > 0) {
+        size_t parent = (i - 1) / 2;
+        if (h->items[parent]->at_ms <= n->at_ms) {
+            break;
+        }
+        heap_place(h, i, h->items[parent]);
+        i = parent;
     }
+    heap_place(h, i, n);
+}
 
-    size_t pos = 4;
-    for (uint32_t i = 0; i < nstr; i++) {
-        if (pos + 4 > len) {
-            return -1;
+static void heap_sift_down(Heap *h, size_t i) {
+    HeapNode *n = h->items[i];
+    while (1) {
+        size_t child = 2 * i + 1;
+        if (child >= h->size) {
+            break;
         }
-        uint32_t slen = 0;
-        memcpy(&slen, &data[pos], 4);
-        pos += 4;
-        if (pos + slen > len) {   // string would run past the end of the body
-            return -1;
+        if (child + 1 < h->size && h->items[child + 1]->at_ms < h->items[child]->at_ms) {
+            child++;
         }
-        out_args[i].len = slen;
-        out_args[i].data = &data[pos];
-        pos += slen;
-    }
-    if (pos != len) {   // trailing bytes that don't belong to any string
-        return -1;
+        if (h->items[child]->at_ms >= n->at_ms) {
+            break;
+        }
+        heap_place(h, i, h->items[child]);
+        i = child;
     }
-    *out_nstr = nstr;
-    return 0;
+    heap_place(h, i, n);
 }
 
-// ---- typed response protocol ----
-// every response body now starts with a 1-byte type tag:
-//   NIL -> no payload
-//   ERR -> [4-byte error code][message bytes]
-//   STR -> raw string bytes
-//   INT -> [8-byte int64]
-enum {
-    RES_NIL = 0,
-    RES_ERR = 1,
-    RES_STR = 2,
-    RES_INT = 3,
-};
+static void heap_remove(Heap *h, HeapNode *n) {
+    if (n->idx == HEAP_NONE) {
+        return;
+    }
+    size_t i = n->idx;
+    n->idx = HEAP_NONE;
+    h->size--;
+    if (i == h->size) {
+        return;     // it was the last item, nothing to fill the hole with
+    }
+    heap_place(h, i, h->items[h->size]);
+    heap_sift_up(h, i);
+    heap_sift_down(h, h->items[i]->idx);
+}
 
-enum {
-    ERR_UNKNOWN_CMD = 1,
+// insert n, or move it if it is already queued
+static void heap_upsert(Heap *h, HeapNode *n, uint64_t at_ms) {
+    if (n->idx != HEAP_NONE) {
+        n->at_ms = at_ms;
+        heap_sift_up(h, n->idx);
+        heap_sift_down(h, n->idx);
+        return;
+    }
+    if (h->size == h->cap) {
+        size_t cap = h->cap ? h->cap * 2 : 64;
+        HeapNode **items = realloc(h->items, cap * sizeof(HeapNode *));
+        if (!items) {
+            die("realloc()");
+        }
+        h->items = items;
+        h->cap = cap;
+    }
+    n->at_ms = at_ms;
+    heap_place(h, h->size, n);
+    h->size++;
+    heap_sift_up(h, n->idx);
+}
+
+static HeapNode *heap_top(const Heap *h) {
+    return h->size ? h->items[0] : NULL;
+}
+
+// ---- resizable hash table for the key-value store ----
+// Works like Redis's dict: the table grows once it is full enough and shrinks
+// once it falls below 10% full. A resize never moves every key at once;
+// instead a second table is allocated and buckets are migrated into it a few
+// at a time, on every lookup/insert/delete and on idle event loop ticks, so
+// no single request ever pays for the whole move.
+//
+// There are two engines behind the same hm_* functions, picked at compile
+// time. The default is a chained table. Building with -DHT_SWISS selects a
+// Swiss-table-style open-addressing table instead: a byte of 7-bit hash tags
+// per slot, scanned 16 at a time (with SSE2 where available), and each slot
+// keeps the key length and a 32-bit hash fingerprint beside the entry
+// pointer, so a lookup rarely dereferences an entry that isn't the one it
+// wants. tests/bench_hashtable.c compares the two.
+
+#define HT_MIN_FILL 10          // shrink once fewer than 10% of slots are used
+#define HT_REHASH_STEP 1        // buckets (or groups of 16 slots) migrated per lookup/insert/delete
+#define HT_REHASH_IDLE_MS 1     // time budget for migrating buckets on an idle tick
+#define HT_DIST_MAX 8           // INFO's chain (or probe) length distribution stops at 8+
+
+#ifdef HT_SWISS
+#define HT_ENGINE "swiss"
+#define HT_GROUP 16             // slots whose tags are compared in one go
+#define HT_INIT_SIZE HT_GROUP   // smallest slot count, always a power of two
+#define HT_MAX_FILL 7           // grow once used + deleted slots pass 7/8
+#else
+#define HT_ENGINE "chained"
+#define HT_INIT_SIZE 4          // smallest bucket count, always a power of two
+#endif
+
+// Keys are hashed with wyhash (final version 4, public domain): up to 16
+// bytes take two overlapping reads and one 64x64->128 bit multiply, and
+// longer keys are consumed 16 bytes, or 48 bytes in three independent lanes,
+// per step. The seed is random per process (hash_seed_init), so which keys
+// collide can't be worked out in advance and sent to flood one bucket or
+// shard. Hashes are never written to disk or sent to another process, so
+// the seed needn't survive a restart.
+#define HASH_SECRET0 0x2d358dccaa6c78a5ULL
+#define HASH_SECRET1 0x8bb84b93962eacc9ULL
+#define HASH_SECRET2 0x4b33a62ed433d4a3ULL
+#define HASH_SECRET3 0x4d5a2da51de1aa47ULL
+
+// the seed as hash_bytes uses it, premixed by hash_seed_init; until main()
+// calls that it is seed 0 premixed, so the tests hash the same on every run
+static uint64_t hash_seed = 0xca813bf4c7abf0a9ULL;
+
+// the 128-bit product of a and b: the low half in a, the high half in b
+static void hash_mul(uint64_t *a, uint64_t *b) {
+#ifdef __SIZEOF_INT128__
+    __uint128_t r = (__uint128_t)*a * *b;
+    *a = (uint64_t)r;
+    *b = (uint64_t)(r >> 64);
+#else
+    uint64_t ha = *a >> 32, hb = *b >> 32, la = (uint32_t)*a, lb = (uint32_t)*b;
+    uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+    uint64_t t = rl + (rm0 << 32), lo = t + (rm1 << 32);
+    *a = lo;
+    *b = rh + (rm0 >> 32) + (rm1 >> 32) + (t < rl) + (lo < t);
+#endif
+}
+
+// both halves of a * b folded together
+static uint64_t hash_mix(uint64_t a, uint64_t b) {
+    hash_mul(&a, &b);
+    return a ^ b;
+}
+
+static uint64_t hash_read8(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return v;
+}
+
+static uint64_t hash_read4(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static uint64_t hash_bytes(const uint8_t *data, size_t len) {
+    uint64_t seed = hash_seed;
+    uint64_t a = 0, b = 0;
+    if (len <= 16) {
+        if (len >= 4) {
+            size_t mid = (len >> 3) << 2;   // 0 below 8 bytes, else 4: the two reads overlap to cover it all
+            a = hash_read4(data) << 32 | hash_read4(data + mid);
+            b = hash_read4(data + len - 4) << 32 | hash_read4(data + len - 4 - mid);
+        } else if (len > 0) {
+            a = (uint64_t)data[0] << 16 | (uint64_t)data[len >> 1] << 8 | data[len - 1];
+        }
+    } else {
+        const uint8_t *p = data;
+        size_t left = len;
+        if (left > 48) {
+            uint64_t see1 = seed, see2 = seed;
+            do {
+                seed = hash_mix(hash_read8(p) ^ HASH_SECRET1, hash_read8(p + 8) ^ seed);
+                see1 = hash_mix(hash_read8(p + 16) ^ HASH_SECRET2, hash_read8(p + 24) ^ see1);
+                see2 = hash_mix(hash_read8(p + 32) ^ HASH_SECRET3, hash_read8(p + 40) ^ see2);
+                p += 48;
+                left -= 48;
+            } while (left > 48);
+            seed ^= see1 ^ see2;
+        }
+        while (left > 16) {
+            seed = hash_mix(hash_read8(p) ^ HASH_SECRET1, hash_read8(p + 8) ^ seed);
+            p += 16;
+            left -= 16;
+        }
+        a = hash_read8(p + left - 16);  // the last 16 bytes, overlapping the ones before if need be
+        b = hash_read8(p + left - 8);
+    }
+    a ^= HASH_SECRET1;
+    b ^= seed;
+    hash_mul(&a, &b);
+    return hash_mix(a ^ HASH_SECRET0 ^ len, b ^ HASH_SECRET1);
+}
+
+// pick this process's hash seed; must run before the first key is hashed
+static void hash_seed_init(void) {
+    uint64_t seed = 0;
+    int fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || read(fd, &seed, sizeof(seed)) != (ssize_t)sizeof(seed)) {
+        // no urandom (chroot?): the clock and pid still differ between runs
+        seed = get_wall_ms() ^ ((uint64_t)getpid() << 32) ^ (uint64_t)(uintptr_t)&seed;
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    hash_seed = seed ^ hash_mix(seed ^ HASH_SECRET0, HASH_SECRET1);
+}
+
+// what a key holds, in Entry.type
+enum {
+    TYPE_STRING = 0,
+    TYPE_ZSET = 1,
+    TYPE_HASH = 2,
+    TYPE_LIST = 3,
+};
+
+// how a hash or list is held, in Entry.enc
+enum {
+    ENC_PACK = 0,       // packed into the value bytes, see hashes and lists
+    ENC_TABLE = 1,      // a hash in a HashObj
+    ENC_QUICKLIST = 2,  // a list in a QList
+};
+
+// An entry is one block from its shard's slab allocator: this header, then
+// the key bytes, then the value bytes. key and val point into the block,
+// except that a value of VAL_SHARED_MIN bytes or more lives in a refcounted
+// SharedVal of its own (see keyspace shards). A small hash or list keeps its
+// elements packed into the value bytes too; a sorted set, or a hash or list
+// too big to pack, has no value bytes and the union points at its container.
+typedef struct Entry {
+    char *key;
+    union {
+        char *val;              // TYPE_STRING
+        struct ZSet *zset;      // TYPE_ZSET
+        struct HashObj *hash;   // TYPE_HASH in ENC_TABLE
+        struct QList *list;     // TYPE_LIST in ENC_QUICKLIST
+    };
+    uint32_t vlen;          // 0 when the union holds a container
+    uint32_t klen;          // keys and values are bounded by --max-msg-size, well under 4 GiB
+    uint16_t slab_class;    // size class the block came from, or SLAB_LARGE
+    uint8_t type;           // TYPE_*
+    uint8_t enc;            // ENC_*, for a hash or list
+    uint32_t lru : 24;      // last access on the LRU clock, or LFU time and counter; see entry_touch
+    time_t expire_at;   // absolute unix time this key expires at; 0 = no expiry
+    HeapNode ttl_node;  // position in ttl_heap while expire_at is set
+    uint64_t hcode;     // cached hash_bytes(key), so migrating a bucket never rehashes key bytes
+#ifndef HT_SWISS
+    struct Entry *next;
+#endif
+} Entry;
+
+#ifdef HT_SWISS
+// a slot holds enough to reject most mismatches without touching the entry
+typedef struct {
+    Entry *e;
+    uint32_t klen;
+    uint32_t fp;    // low 32 bits of the entry's hcode
+} HSlot;
+
+// ctrl[i] is HT_EMPTY, HT_DELETED, or the 7-bit tag of the entry in tab[i]. Slots are probed a group of HT_GROUP at a time.
+typedef struct {
+    uint8_t *ctrl;
+    HSlot *tab;
+    size_t mask;        // slot count - 1; the slot count is a power of two
+    size_t size;        // number of entries stored in this array
+    size_t deleted;     // HT_DELETED slots, which still lengthen probes
+} HTab;
+#else
+// one bucket array; the bucket count is a power of two so a slot is hcode & mask
+typedef struct {
+    Entry **tab;
+    size_t mask;
+    size_t size;    // number of entries stored in this array
+} HTab;
+#endif
+
+// ht[0] is the live table. While a resize is in progress ht[1] is the new
+// table, and every bucket (or group) of ht[0] below rehash_idx has already
+// been moved. An all-zero HMap is a valid empty map.
+typedef struct {
+    HTab ht[2];
+    size_t rehash_idx;      // next ht[0] bucket to migrate, while ht[1] exists
+} HMap;
+
+// expiry counters, reported by INFO
+typedef struct {
+    uint64_t expired_keys;      // keys removed because their TTL passed, lazily or actively
+    uint64_t sweeps;            // active sweeps that found at least one expired key
+    uint64_t last_sweep_us;     // duration of the most recent such sweep
+    uint64_t max_sweep_us;      // longest sweep so far
+    uint64_t total_sweep_us;    // time spent in all sweeps
+} ExpireStats;
+
+// ---- slab allocator ----
+// Every entry lives in a single block holding the Entry header, the key and
+// the value, instead of three malloc()s. Blocks come from size classes
+// spaced SLAB_GROWTH apart, like memcached's, each carved out of
+// SLAB_PAGE_SIZE pages, so there is no per-allocation malloc header and
+// same-sized keys sit next to each other. A freed block goes on its class's
+// free list for the next entry of that size; pages themselves are never
+// handed back. Blocks too big for the largest class are malloc()ed whole.
+// Each shard has its own allocator, so, like the rest of the shard, it is
+// only touched by one thread and needs no locking.
+
+#define SLAB_PAGE_SIZE (256 * 1024)
+#define SLAB_MIN_CHUNK 96           // smallest class: an Entry plus a short key and value
+#define SLAB_MAX_CHUNK (SLAB_PAGE_SIZE / 4)
+#define SLAB_GROWTH 1.25            // each class is this much bigger than the last
+#define SLAB_MAX_CLASSES 48
+#define SLAB_LARGE UINT16_MAX       // slab_class of a block that was malloc()ed directly
+
+static size_t slab_chunk_size[SLAB_MAX_CLASSES];
+static uint32_t slab_nclasses = 0;
+
+// fill in the class sizes; called by main before any thread starts
+static void slab_classes_init(void) {
+    size_t size = SLAB_MIN_CHUNK;
+    slab_nclasses = 0;
+    while (slab_nclasses < SLAB_MAX_CLASSES && size < SLAB_MAX_CHUNK) {
+        slab_chunk_size[slab_nclasses++] = size;
+        size = ((size_t)(size * SLAB_GROWTH) + 7) & ~(size_t)7;     // keep blocks 8-byte aligned
+    }
+    slab_chunk_size[slab_nclasses++] = SLAB_MAX_CHUNK;
+}
+
+typedef struct {
+    void *free_list;    // freed chunks, linked through their first word
+    uint8_t *page;      // page chunks are currently being carved from
+    size_t page_left;   // bytes of page not yet handed out
+    size_t pages;
+    size_t used;        // chunks holding an entry
+    size_t free;        // chunks on free_list
+    size_t requested;   // bytes actually asked for by the entries in use
+} SlabClass;
+
+typedef struct {
+    SlabClass classes[SLAB_MAX_CLASSES];
+    size_t large_used;          // malloc()ed blocks in use
+    size_t large_bytes;
+    uint64_t allocs;
+    uint64_t frees;
+    uint64_t inplace_overwrites;    // SETs that reused the entry's own block
+    size_t shared_values;       // values big enough to live outside their entry's block
+    size_t shared_bytes;
+} Slab;
+
+// the smallest class that fits size bytes, or SLAB_LARGE
+static uint32_t slab_class_for(size_t size) {
+    if (slab_nclasses == 0) {
+        slab_classes_init();
+    }
+    if (size > slab_chunk_size[slab_nclasses - 1]) {
+        return SLAB_LARGE;
+    }
+    uint32_t lo = 0, hi = slab_nclasses - 1;
+    while (lo < hi) {
+        uint32_t mid = (lo + hi) / 2;
+        if (slab_chunk_size[mid] < size) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// a block of at least size bytes; *cls is set to the class it came from
+static void *slab_alloc(Slab *sl, size_t size, uint32_t *cls) {
+    sl->allocs++;
+    *cls = slab_class_for(size);
+    if (*cls == SLAB_LARGE) {
+        void *p = malloc(size);
+        if (!p) {
+            die("malloc()");
+        }
+        sl->large_used++;
+        sl->large_bytes += size;
+        return p;
+    }
+    SlabClass *c = &sl->classes[*cls];
+    size_t chunk = slab_chunk_size[*cls];
+    void *p = c->free_list;
+    if (p) {
+        memcpy(&c->free_list, p, sizeof(void *));
+        c->free--;
+    } else {
+        if (c->page_left < chunk) {     // the tail of the old page too small for a chunk is wasted
+            c->page = malloc(SLAB_PAGE_SIZE);
+            if (!c->page) {
+                die("malloc()");
+            }
+            c->page_left = SLAB_PAGE_SIZE;
+            c->pages++;
+        }
+        p = c->page + (SLAB_PAGE_SIZE - c->page_left);
+        c->page_left -= chunk;
+    }
+    c->used++;
+    c->requested += size;
+    return p;
+}
+
+// give back a block from slab_alloc(size) of class cls
+static void slab_free(Slab *sl, void *p, uint32_t cls, size_t size) {
+    sl->frees++;
+    if (cls == SLAB_LARGE) {
+        sl->large_used--;
+        sl->large_bytes -= size;
+        free(p);
+        return;
+    }
+    SlabClass *c = &sl->classes[cls];
+    memcpy(p, &c->free_list, sizeof(void *));
+    c->free_list = p;
+    c->free++;
+    c->used--;
+    c->requested -= size;
+}
+
+// a chunk of class cls now holds new_size bytes' worth of entry instead of old_size
+static void slab_resize_in_place(Slab *sl, uint32_t cls, size_t old_size, size_t new_size) {
+    sl->inplace_overwrites++;
+    sl->classes[cls].requested = sl->classes[cls].requested - old_size + new_size;
+}
+
+// ---- sorted sets ----
+// A sorted set is a skiplist ordered by (score, member) plus an index from
+// member to node, like Redis's zset. Every level of a node's tower records
+// its span, the number of level-0 steps its forward link covers, so a
+// node's rank is the sum of the spans walked to reach it, and ZRANK and
+// ZRANGE by index cost O(log n) like a lookup by score does. A node is one
+// malloc()ed block: the node, its tower, then the member bytes. The index is
+// a chained table threaded through the nodes themselves. Unlike the
+// keyspace it is resized all at once, since one set is far smaller than the
+// whole keyspace. A set belongs to its key's shard, so it needs no locking.
+// Every byte it allocates is charged to that shard's mem_used through
+// zs->mem, which is how --maxmemory sees it.
+
+#define ZSET_MAX_LEVEL 32
+#define ZSET_BRANCH 4           // a tower grows another level with probability 1/4
+#define ZSET_INDEX_MIN 4        // smallest bucket count of the member index
+
+typedef struct ZNode {
+    double score;
+    struct ZNode *backward;     // previous node on level 0, NULL for the first
+    struct ZNode *hnext;        // next node in the same index bucket
+    uint64_t hcode;             // hash_bytes(member)
+    uint32_t mlen;
+    uint32_t height;
+    struct {
+        struct ZNode *forward;
+        size_t span;
+    } lvl[];                    // height levels, then the member bytes
+} ZNode;
+
+typedef struct ZSet {
+    ZNode *header;      // a full-height tower with no member, before the first node
+    ZNode *tail;
+    uint32_t height;    // tallest tower in use
+    size_t len;
+    ZNode **index;
+    size_t mask;        // bucket count - 1
+    uint64_t rng;       // xorshift state for tower heights
+    size_t *mem;        // the owning shard's mem_used
+} ZSet;
+
+// a score interval; an excluded end is written "(score" by clients
+typedef struct {
+    double min, max;
+    bool minex, maxex;
+} ZRange;
+
+static const uint8_t *znode_member(const ZNode *n) {
+    return (const uint8_t *)&n->lvl[n->height];
+}
+
+static size_t znode_size(uint32_t height, size_t mlen) {
+    return sizeof(ZNode) + height * sizeof(((ZNode *)0)->lvl[0]) + mlen;
+}
+
+static ZNode *znode_new(uint32_t height, double score, const uint8_t *member, size_t mlen, uint64_t hcode) {
+    ZNode *n = malloc(znode_size(height, mlen));
+    if (!n) {
+        die("malloc()");
+    }
+    n->score = score;
+    n->backward = NULL;
+    n->hnext = NULL;
+    n->hcode = hcode;
+    n->mlen = (uint32_t)mlen;
+    n->height = height;
+    for (uint32_t i = 0; i < height; i++) {
+        n->lvl[i].forward = NULL;
+        n->lvl[i].span = 0;
+    }
+    memcpy((uint8_t *)&n->lvl[height], member, mlen);
+    return n;
+}
+
+static ZSet *zset_new(size_t *mem) {
+    ZSet *zs = calloc(1, sizeof(ZSet));
+    if (!zs) {
+        die("calloc()");
+    }
+    zs->header = znode_new(ZSET_MAX_LEVEL, 0, (const uint8_t *)"", 0, 0);
+    zs->height = 1;
+    zs->rng = (uint64_t)(uintptr_t)zs | 1;
+    zs->mem = mem;
+    *mem += sizeof(ZSet) + znode_size(ZSET_MAX_LEVEL, 0);
+    return zs;
+}
+
+static void zset_free(ZSet *zs) {
+    ZNode *n = zs->header;
+    while (n) {
+        ZNode *next = n->lvl[0].forward;
+        *zs->mem -= znode_size(n->height, n->mlen);
+        free(n);
+        n = next;
+    }
+    *zs->mem -= sizeof(ZSet) + (zs->index ? (zs->mask + 1) * sizeof(ZNode *) : 0);
+    free(zs->index);
+    free(zs);
+}
+
+static uint32_t zset_random_height(ZSet *zs) {
+    uint32_t h = 1;
+    while (h < ZSET_MAX_LEVEL) {
+        zs->rng ^= zs->rng << 13;
+        zs->rng ^= zs->rng >> 7;
+        zs->rng ^= zs->rng << 17;
+        if (zs->rng % ZSET_BRANCH != 0) {
+            break;
+        }
+        h++;
+    }
+    return h;
+}
+
+// move every node into a bucket array of the given size
+static void zset_index_resize(ZSet *zs, size_t buckets) {
+    ZNode **index = calloc(buckets, sizeof(ZNode *));
+    if (!index) {
+        die("calloc()");
+    }
+    for (ZNode *n = zs->header->lvl[0].forward; n; n = n->lvl[0].forward) {
+        ZNode **slot = &index[n->hcode & (buckets - 1)];
+        n->hnext = *slot;
+        *slot = n;
+    }
+    *zs->mem += buckets * sizeof(ZNode *) - (zs->index ? (zs->mask + 1) * sizeof(ZNode *) : 0);
+    free(zs->index);
+    zs->index = index;
+    zs->mask = buckets - 1;
+}
+
+static ZNode *zset_find(const ZSet *zs, const uint8_t *member, size_t mlen) {
+    if (!zs->index) {
+        return NULL;
+    }
+    uint64_t hcode = hash_bytes(member, mlen);
+    for (ZNode *n = zs->index[hcode & zs->mask]; n; n = n->hnext) {
+        if (n->hcode == hcode && n->mlen == mlen && memcmp(znode_member(n), member, mlen) == 0) {
+            return n;
+        }
+    }
+    return NULL;
+}
+
+// whether n sorts before (score, member)
+static bool znode_before(const ZNode *n, double score, const uint8_t *member, size_t mlen) {
+    if (n->score != score) {
+        return n->score < score;
+    }
+    size_t common = n->mlen < mlen ? n->mlen : mlen;
+    int c = memcmp(znode_member(n), member, common);
+    return c < 0 || (c == 0 && n->mlen < mlen);
+}
+
+// link a member that is not in the set yet into the skiplist and the index
+static void zset_insert(ZSet *zs, double score, const uint8_t *member, size_t mlen) {
+    ZNode *update[ZSET_MAX_LEVEL];
+    size_t rank[ZSET_MAX_LEVEL];
+    ZNode *x = zs->header;
+    for (int i = (int)zs->height - 1; i >= 0; i--) {
+        rank[i] = i == (int)zs->height - 1 ? 0 : rank[i + 1];
+        while (x->lvl[i].forward && znode_before(x->lvl[i].forward, score, member, mlen)) {
+            rank[i] += x->lvl[i].span;
+            x = x->lvl[i].forward;
+        }
+        update[i] = x;
+    }
+    uint32_t height = zset_random_height(zs);
+    if (height > zs->height) {
+        for (uint32_t i = zs->height; i < height; i++) {
+            rank[i] = 0;
+            update[i] = zs->header;
+            update[i]->lvl[i].span = zs->len;
+        }
+        zs->height = height;
+    }
+    x = znode_new(height, score, member, mlen, hash_bytes(member, mlen));
+    *zs->mem += znode_size(height, mlen);
+    for (uint32_t i = 0; i < height; i++) {
+        x->lvl[i].forward = update[i]->lvl[i].forward;
+        update[i]->lvl[i].forward = x;
+        x->lvl[i].span = update[i]->lvl[i].span - (rank[0] - rank[i]);
+        update[i]->lvl[i].span = rank[0] - rank[i] + 1;
+    }
+    for (uint32_t i = height; i < zs->height; i++) {
+        update[i]->lvl[i].span++;   // the new node sits under these links
+    }
+    x->backward = update[0] == zs->header ? NULL : update[0];
+    if (x->lvl[0].forward) {
+        x->lvl[0].forward->backward = x;
+    } else {
+        zs->tail = x;
+    }
+    zs->len++;
+    if (zs->len > zs->mask + 1 || !zs->index) {
+        zset_index_resize(zs, zs->index ? (zs->mask + 1) * 2 : ZSET_INDEX_MIN);
+    } else {
+        ZNode **slot = &zs->index[x->hcode & zs->mask];
+        x->hnext = *slot;
+        *slot = x;
+    }
+}
+
+// unlink x, whose predecessor on each level is in update[], and free it
+static void zset_unlink(ZSet *zs, ZNode *x, ZNode **update) {
+    for (uint32_t i = 0; i < zs->height; i++) {
+        if (update[i]->lvl[i].forward == x) {
+            update[i]->lvl[i].span += x->lvl[i].span - 1;
+            update[i]->lvl[i].forward = x->lvl[i].forward;
+        } else {
+            update[i]->lvl[i].span--;
+        }
+    }
+    if (x->lvl[0].forward) {
+        x->lvl[0].forward->backward = x->backward;
+    } else {
+        zs->tail = x->backward;
+    }
+    while (zs->height > 1 && !zs->header->lvl[zs->height - 1].forward) {
+        zs->height--;
+    }
+    ZNode **slot = &zs->index[x->hcode & zs->mask];
+    while (*slot != x) {
+        slot = &(*slot)->hnext;
+    }
+    *slot = x->hnext;
+    zs->len--;
+    *zs->mem -= znode_size(x->height, x->mlen);
+    free(x);
+    if (zs->mask + 1 > ZSET_INDEX_MIN && zs->len * 10 < zs->mask + 1) {
+        zset_index_resize(zs, (zs->mask + 1) / 2);
+    }
+}
+
+// fill update[] with the last node on each level that sorts before x
+static void zset_path_to(const ZSet *zs, const ZNode *x, ZNode **update) {
+    ZNode *p = zs->header;
+    for (int i = (int)zs->height - 1; i >= 0; i--) {
+        while (p->lvl[i].forward && znode_before(p->lvl[i].forward, x->score, znode_member(x), x->mlen)) {
+            p = p->lvl[i].forward;
+        }
+        update[i] = p;
+    }
+}
+
+static void zset_remove(ZSet *zs, ZNode *x) {
+    ZNode *update[ZSET_MAX_LEVEL];
+    zset_path_to(zs, x, update);
+    zset_unlink(zs, x, update);
+}
+
+// add member or change its score; whether it is new
+static bool zset_add(ZSet *zs, double score, const uint8_t *member, size_t mlen) {
+    ZNode *x = zset_find(zs, member, mlen);
+    if (x) {
+        if (x->score != score) {
+            zset_remove(zs, x);
+            zset_insert(zs, score, member, mlen);
+        }
+        return false;
+    }
+    zset_insert(zs, score, member, mlen);
+    return true;
+}
+
+// 0-based rank of a node in the set
+static size_t zset_rank(const ZSet *zs, const ZNode *x) {
+    size_t rank = 0;
+    const ZNode *p = zs->header;
+    for (int i = (int)zs->height - 1; i >= 0; i--) {
+        while (p->lvl[i].forward && (p->lvl[i].forward == x
+                || znode_before(p->lvl[i].forward, x->score, znode_member(x), x->mlen))) {
+            rank += p->lvl[i].span;
+            p = p->lvl[i].forward;
+        }
+        if (p == x) {
+            break;
+        }
+    }
+    return rank - 1;
+}
+
+// the node at a 0-based rank below len
+static ZNode *zset_at_rank(const ZSet *zs, size_t rank) {
+    size_t walked = 0;
+    ZNode *p = zs->header;
+    rank++;     // spans count from the header
+    for (int i = (int)zs->height - 1; i >= 0; i--) {
+        while (p->lvl[i].forward && walked + p->lvl[i].span <= rank) {
+            walked += p->lvl[i].span;
+            p = p->lvl[i].forward;
+        }
+        if (walked == rank) {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+static bool zrange_above_min(const ZRange *r, double score) {
+    return r->minex ? score > r->min : score >= r->min;
+}
+
+static bool zrange_below_max(const ZRange *r, double score) {
+    return r->maxex ? score < r->max : score <= r->max;
+}
+
+// the first node whose score is in r, or NULL; update, if given, gets the
+// path to it for zset_unlink
+static ZNode *zset_first_in_range(const ZSet *zs, const ZRange *r, ZNode **update) {
+    ZNode *p = zs->header;
+    for (int i = (int)zs->height - 1; i >= 0; i--) {
+        while (p->lvl[i].forward && !zrange_above_min(r, p->lvl[i].forward->score)) {
+            p = p->lvl[i].forward;
+        }
+        if (update) {
+            update[i] = p;
+        }
+    }
+    p = p->lvl[0].forward;
+    return p && zrange_below_max(r, p->score) ? p : NULL;
+}
+
+// remove every member whose score is in r; how many there were
+static size_t zset_remove_range(ZSet *zs, const ZRange *r) {
+    ZNode *update[ZSET_MAX_LEVEL];
+    ZNode *x = zset_first_in_range(zs, r, update);
+    size_t removed = 0;
+    while (x && zrange_below_max(r, x->score)) {
+        ZNode *next = x->lvl[0].forward;
+        zset_unlink(zs, x, update);     // every level's predecessor stays the same
+        removed++;
+        x = next;
+    }
+    return removed;
+}
+
+// ---- hashes and lists ----
+// A small hash or list is packed: its elements sit end to end in the
+// entry's own slab block, where a string keeps its value, each one a varint
+// length and then the bytes. A hash alternates fields and values. A field
+// of a small hash then costs its bytes plus a length byte each for it and
+// its value, instead of a node with pointers and a malloc header of its own.
+// Finding a field scans the pack, and a change rebuilds it, like Redis's
+// listpack; with as few elements as the limits allow that is cheap.
+//
+// A hash that grows past --hash-max-pack-entries fields, or gets a field or
+// value longer than --hash-max-pack-value bytes, is converted to a chained
+// hash table of HFields. A list past the --list-max-pack-* limits becomes a
+// quicklist: a doubly linked list of packs of up to --list-max-pack-entries
+// elements and QLIST_NODE_BYTES bytes each, so pushes and pops at either end
+// only touch one small pack. Neither converts back. Like a sorted set, each
+// container charges what it allocates to its shard's mem_used.
+
+#define QLIST_NODE_BYTES 8192   // a quicklist pack stops growing here, unless one element is bigger
+#define HASH_TABLE_MIN 4        // smallest bucket count of a hash table
+
+// bytes a pack element of len bytes takes
+static size_t pack_elem_size(uint32_t len) {
+    size_t n = 1;
+    for (uint32_t v = len; v >= 0x80; v >>= 7) {
+        n++;
+    }
+    return n + len;
+}
+
+// write an element at p; returns where the next one goes
+static uint8_t *pack_put(uint8_t *p, const uint8_t *data, uint32_t len) {
+    uint32_t v = len;
+    while (v >= 0x80) {
+        *p++ = (uint8_t)(v | 0x80);
+        v >>= 7;
+    }
+    *p++ = (uint8_t)v;
+    memcpy(p, data, len);
+    return p + len;
+}
+
+static void pack_append(Buf *b, const uint8_t *data, uint32_t len) {
+    buf_reserve(b, pack_elem_size(len));
+    b->end = (size_t)(pack_put(b->data + b->end, data, len) - b->data);
+}
+
+// read the element at p; returns the one after it
+static const uint8_t *pack_next(const uint8_t *p, const uint8_t **data, uint32_t *len) {
+    uint32_t v = 0;
+    for (int shift = 0; ; shift += 7) {
+        uint8_t c = *p++;
+        v |= (uint32_t)(c & 0x7F) << shift;
+        if (!(c & 0x80)) {
+            break;
+        }
+    }
+    *data = p;
+    *len = v;
+    return p + v;
+}
+
+static size_t pack_count(const uint8_t *p, size_t len) {
+    const uint8_t *end = p + len, *data = NULL;
+    uint32_t n = 0;
+    size_t count = 0;
+    while (p < end) {
+        p = pack_next(p, &data, &n);
+        count++;
+    }
+    return count;
+}
+
+// where the last of count elements starts
+static const uint8_t *pack_last(const uint8_t *p, size_t count) {
+    const uint8_t *data = NULL;
+    uint32_t n = 0;
+    for (size_t i = 1; i < count; i++) {
+        p = pack_next(p, &data, &n);
+    }
+    return p;
+}
+
+// check a pack read from outside, counting its elements and finding the
+// longest; false if an element runs past the end
+static bool pack_check(const uint8_t *p, size_t len, size_t *count, uint32_t *longest) {
+    const uint8_t *end = p + len;
+    *count = 0;
+    *longest = 0;
+    while (p < end) {
+        uint32_t v = 0;
+        int shift = 0;
+        while (p < end && (*p & 0x80) && shift < 28) {
+            v |= (uint32_t)(*p++ & 0x7F) << shift;
+            shift += 7;
+        }
+        if (p == end || (*p & 0x80) || (shift == 28 && *p > 0x0F)) {
+            return false;
+        }
+        v |= (uint32_t)*p++ << shift;
+        if ((size_t)(end - p) < v) {
+            return false;
+        }
+        p += v;
+        (*count)++;
+        *longest = v > *longest ? v : *longest;
+    }
+    return true;
+}
+
+typedef struct HField {
+    struct HField *next;
+    uint64_t hcode;         // hash_bytes(field)
+    uint32_t flen, vlen;
+    uint8_t data[];         // the field, then the value
+} HField;
+
+typedef struct HashObj {
+    HField **tab;
+    size_t mask;    // bucket count - 1
+    size_t len;
+    size_t *mem;    // the owning shard's mem_used
+} HashObj;
+
+static size_t hfield_size(uint32_t flen, uint32_t vlen) {
+    return sizeof(HField) + flen + vlen;
+}
+
+static void hashobj_resize(HashObj *h, size_t buckets) {
+    HField **tab = calloc(buckets, sizeof(HField *));
+    if (!tab) {
+        die("calloc()");
+    }
+    for (size_t i = 0; h->tab && i <= h->mask; i++) {
+        HField *f = h->tab[i];
+        while (f) {
+            HField *next = f->next;
+            f->next = tab[f->hcode & (buckets - 1)];
+            tab[f->hcode & (buckets - 1)] = f;
+            f = next;
+        }
+    }
+    *h->mem += buckets * sizeof(HField *) - (h->tab ? (h->mask + 1) * sizeof(HField *) : 0);
+    free(h->tab);
+    h->tab = tab;
+    h->mask = buckets - 1;
+}
+
+static HashObj *hashobj_new(size_t *mem) {
+    HashObj *h = calloc(1, sizeof(HashObj));
+    if (!h) {
+        die("calloc()");
+    }
+    h->mem = mem;
+    *mem += sizeof(HashObj);
+    hashobj_resize(h, HASH_TABLE_MIN);
+    return h;
+}
+
+static void hashobj_free(HashObj *h) {
+    for (size_t i = 0; i <= h->mask; i++) {
+        HField *f = h->tab[i];
+        while (f) {
+            HField *next = f->next;
+            *h->mem -= hfield_size(f->flen, f->vlen);
+            free(f);
+            f = next;
+        }
+    }
+    *h->mem -= sizeof(HashObj) + (h->mask + 1) * sizeof(HField *);
+    free(h->tab);
+    free(h);
+}
+
+// the link that points at field, or at the NULL ending its bucket
+static HField **hashobj_link(const HashObj *h, const uint8_t *field, uint32_t flen, uint64_t hcode) {
+    HField **link = &h->tab[hcode & h->mask];
+    while (*link && !((*link)->hcode == hcode && (*link)->flen == flen && memcmp((*link)->data, field, flen) == 0)) {
+        link = &(*link)->next;
+    }
+    return link;
+}
+
+static HField *hashobj_get(const HashObj *h, const uint8_t *field, uint32_t flen) {
+    return *hashobj_link(h, field, flen, hash_bytes(field, flen));
+}
+
+// set field to val; whether the field is new
+static bool hashobj_set(HashObj *h, const uint8_t *field, uint32_t flen, const uint8_t *val, uint32_t vlen) {
+    uint64_t hcode = hash_bytes(field, flen);
+    HField **link = hashobj_link(h, field, flen, hcode);
+    HField *old = *link;
+    HField *f = malloc(hfield_size(flen, vlen));
+    if (!f) {
+        die("malloc()");
+    }
+    *h->mem += hfield_size(flen, vlen) - (old ? hfield_size(old->flen, old->vlen) : 0);
+    f->next = old ? old->next : NULL;
+    f->hcode = hcode;
+    f->flen = flen;
+    f->vlen = vlen;
+    memcpy(f->data, field, flen);
+    memcpy(f->data + flen, val, vlen);
+    *link = f;
+    free(old);
+    if (old) {
+        return false;
+    }
+    if (++h->len > h->mask + 1) {
+        hashobj_resize(h, (h->mask + 1) * 2);
+    }
+    return true;
+}
+
+static bool hashobj_del(HashObj *h, const uint8_t *field, uint32_t flen) {
+    HField **link = hashobj_link(h, field, flen, hash_bytes(field, flen));
+    HField *f = *link;
+    if (!f) {
+        return false;
+    }
+    *link = f->next;
+    *h->mem -= hfield_size(f->flen, f->vlen);
+    free(f);
+    h->len--;
+    if (h->mask + 1 > HASH_TABLE_MIN && h->len * 10 < h->mask + 1) {
+        hashobj_resize(h, (h->mask + 1) / 2);
+    }
+    return true;
+}
+
+typedef struct QNode {
+    struct QNode *prev, *next;
+    uint32_t count;     // elements in the pack
+    uint32_t len, cap;  // bytes of data used and allocated
+    uint8_t data[];
+} QNode;
+
+typedef struct QList {
+    QNode *head, *tail;
+    size_t len;
+    size_t *mem;    // the owning shard's mem_used
+} QList;
+
+static QList *qlist_new(size_t *mem) {
+    QList *l = calloc(1, sizeof(QList));
+    if (!l) {
+        die("calloc()");
+    }
+    l->mem = mem;
+    *mem += sizeof(QList);
+    return l;
+}
+
+static void qlist_free(QList *l) {
+    QNode *n = l->head;
+    while (n) {
+        QNode *next = n->next;
+        *l->mem -= sizeof(QNode) + n->cap;
+        free(n);
+        n = next;
+    }
+    *l->mem -= sizeof(QList);
+    free(l);
+}
+
+// give n room for need more bytes; returns n, which may have moved
+static QNode *qnode_reserve(QList *l, QNode *n, size_t need) {
+    if (n->cap - n->len >= need) {
+        return n;
+    }
+    size_t cap = n->cap ? n->cap : 64;
+    while (cap - n->len < need) {
+        cap *= 2;
+    }
+    QNode *moved = realloc(n, sizeof(QNode) + cap);
+    if (!moved) {
+        die("realloc()");
+    }
+    *l->mem += cap - moved->cap;
+    moved->cap = (uint32_t)cap;
+    *(moved->prev ? &moved->prev->next : &l->head) = moved;
+    *(moved->next ? &moved->next->prev : &l->tail) = moved;
+    return moved;
+}
+
+static void qlist_push(QList *l, bool front, const uint8_t *data, uint32_t len) {
+    size_t need = pack_elem_size(len);
+    QNode *n = front ? l->head : l->tail;
+    if (!n || n->count >= config.list_pack_entries || n->len + need > QLIST_NODE_BYTES) {
+        n = calloc(1, sizeof(QNode));
+        if (!n) {
+            die("calloc()");
+        }
+        *l->mem += sizeof(QNode);
+        if (front) {
+            n->next = l->head;
+            *(l->head ? &l->head->prev : &l->tail) = n;
+            l->head = n;
+        } else {
+            n->prev = l->tail;
+            *(l->tail ? &l->tail->next : &l->head) = n;
+            l->tail = n;
+        }
+    }
+    n = qnode_reserve(l, n, need);
+    if (front) {
+        memmove(n->data + need, n->data, n->len);
+        pack_put(n->data, data, len);
+    } else {
+        pack_put(n->data + n->len, data, len);
+    }
+    n->len += (uint32_t)need;
+    n->count++;
+    l->len++;
+}
+
+// the element at one end of a non-empty quicklist
+static void qlist_peek(const QList *l, bool front, const uint8_t **data, uint32_t *len) {
+    const QNode *n = front ? l->head : l->tail;
+    pack_next(front ? n->data : pack_last(n->data, n->count), data, len);
+}
+
+// remove the element at one end of a non-empty quicklist
+static void qlist_drop(QList *l, bool front) {
+    QNode *n = front ? l->head : l->tail;
+    const uint8_t *data = NULL;
+    uint32_t len = 0;
+    if (front) {
+        size_t size = (size_t)(pack_next(n->data, &data, &len) - n->data);
+        memmove(n->data, n->data + size, n->len - size);
+        n->len -= (uint32_t)size;
+    } else {
+        n->len = (uint32_t)(pack_last(n->data, n->count) - n->data);
+    }
+    n->count--;
+    l->len--;
+    if (n->count == 0) {
+        *(n->prev ? &n->prev->next : &l->head) = n->next;
+        *(n->next ? &n->next->prev : &l->tail) = n->prev;
+        *l->mem -= sizeof(QNode) + n->cap;
+        free(n);
+    }
+}
+
+// ---- keyspace shards ----
+// The keyspace is partitioned by hash_bytes(key) into one shard per I/O
+// thread. Shard i is only ever touched by thread i (or by thread 0 while every
+// other thread is parked, see stop_world), so none of this needs locking.
+// With a single thread there is one shard and routing is a no-op.
+
+#define EVICT_POOL_SIZE 16
+
+// a key eviction may pick later, held by name: by then it may be gone
+typedef struct {
+    uint64_t score;     // how good a pick it is: idle time, or how seldom it is used
+    uint64_t hcode;
+    uint32_t klen;
+    uint8_t *key;       // a malloc()ed copy
+} EvictCand;
+
+typedef struct {
+    HMap db;
+    Heap ttl_heap;      // every key with a TTL, soonest expiry first, so the active sweeper never scans
+    ExpireStats expire_stats;
+    Slab slab;          // memory for this shard's entries
+    size_t mem_used;    // bytes held for its keys: their blocks, large values and containers
+    uint64_t clock_ms;  // wall clock read once per event loop iteration, for access times
+    uint64_t rng;       // xorshift state for LFU counters and eviction samples
+    EvictCand evict_pool[EVICT_POOL_SIZE];  // the best eviction candidates sampled so far, best last
+    uint32_t evict_pool_len;
+    uint64_t evicted_keys;
+    Buf aof_buf;        // writes not yet appended to the AOF
+    size_t aof_rewrite_skip;    // leading bytes of aof_buf a rewrite child already has
+} Shard;
+
+static Shard shards[MAX_THREADS];
+static uint32_t nshards = 1;
+
+// the shard a key hash belongs to. The high bits pick the shard because the
+// low bits pick the bucket, and reusing them would leave most buckets empty.
+static uint32_t shard_idx(uint64_t hcode) {
+    return nshards == 1 ? 0 : (uint32_t)((hcode >> 32) % nshards);
+}
+
+static Shard *shard_of(uint64_t hcode) {
+    return &shards[shard_idx(hcode)];
+}
+
+// Each entry keeps 24 bits of access history for --maxmemory-policy, packed
+// beside its type, so a GET only stores into the entry it has just read and
+// links no list. Under allkeys-lfu they are Redis's LFU pair: the minute of
+// the last access in the top 16 bits and a logarithmic access counter in the
+// low 8, which loses one for every minute the key goes unused. Under every
+// other policy they are the time of the last access on a clock of
+// LRU_CLOCK_MS ticks, which wraps after about 19 days.
+#define LRU_CLOCK_MS 100
+#define LRU_CLOCK_MAX ((1u << 24) - 1)
+#define LFU_INIT_VAL 5          // a new key's counter, so it isn't the first to go
+#define LFU_LOG_FACTOR 10       // a counter at c grows with probability 1 / ((c - LFU_INIT_VAL) * 10 + 1)
+
+enum {
+    EVICT_NOEVICTION = 0,
+    EVICT_ALLKEYS_LRU = 1,
+    EVICT_ALLKEYS_LFU = 2,
+    EVICT_VOLATILE_TTL = 3,
+    EVICT_ALLKEYS_RANDOM = 4,
+};
+
+static const char *const evict_policy_names[] = {"noeviction", "allkeys-lru", "allkeys-lfu", "volatile-ttl", "allkeys-random"};
+
+static uint32_t lru_clock(const Shard *sh) {
+    return (uint32_t)(sh->clock_ms / LRU_CLOCK_MS) & LRU_CLOCK_MAX;
+}
+
+static uint32_t lfu_minutes(const Shard *sh) {
+    return (uint32_t)(sh->clock_ms / 60000) & 0xFFFF;
+}
+
+static uint64_t shard_rand(Shard *sh) {
+    if (sh->rng == 0) {
+        sh->rng = (uint64_t)(uintptr_t)sh | 1;
+    }
+    sh->rng ^= sh->rng << 13;
+    sh->rng ^= sh->rng >> 7;
+    sh->rng ^= sh->rng << 17;
+    return sh->rng;
+}
+
+// e's LFU counter less the minutes it has gone unused
+static uint32_t lfu_decayed(const Shard *sh, const Entry *e) {
+    uint32_t idle = (lfu_minutes(sh) - (e->lru >> 8)) & 0xFFFF;
+    uint32_t counter = e->lru & 0xFF;
+    return idle < counter ? counter - idle : 0;
+}
+
+// the access history a new entry starts with
+static uint32_t entry_first_access(const Shard *sh) {
+    return config.maxmemory_policy == EVICT_ALLKEYS_LFU ? lfu_minutes(sh) << 8 | LFU_INIT_VAL : lru_clock(sh);
+}
+
+// note an access to e
+static void entry_touch(Shard *sh, Entry *e) {
+    if (config.maxmemory_policy != EVICT_ALLKEYS_LFU) {
+        e->lru = lru_clock(sh);
+        return;
+    }
+    uint32_t counter = lfu_decayed(sh, e);
+    uint32_t base = counter > LFU_INIT_VAL ? counter - LFU_INIT_VAL : 0;
+    if (counter < 255 && shard_rand(sh) % (base * LFU_LOG_FACTOR + 1) == 0) {
+        counter++;
+    }
+    e->lru = lfu_minutes(sh) << 8 | counter;
+}
+
+// Values of VAL_SHARED_MIN bytes or more are not copied into the entry's
+// block but into a SharedVal of their own. It is refcounted and never changes
+// once written; a SET makes a new one. A GET reply references the value
+// instead of copying it (see out_value) and holds a reference until the
+// bytes have been sent, so a SET or DEL of the key meanwhile only drops the
+// entry's reference. The last reference may be dropped by whichever thread
+// sent the reply, hence the atomic count.
+#define VAL_SHARED_MIN (16 * 1024)
+
+typedef struct {
+    atomic_uint refs;
+    uint8_t data[];
+} SharedVal;
+
+static bool val_is_shared(size_t vlen) {
+    return vlen >= VAL_SHARED_MIN;
+}
+
+// the SharedVal holding e's value, which must be one
+static SharedVal *entry_shared_val(const Entry *e) {
+    return (SharedVal *)(e->val - offsetof(SharedVal, data));
+}
+
+static void shared_val_retain(SharedVal *sv) {
+    atomic_fetch_add_explicit(&sv->refs, 1, memory_order_relaxed);
+}
+
+// drop a reference; shaped to be an out_ref() release function
+static void shared_val_release(void *p) {
+    SharedVal *sv = p;
+    if (atomic_fetch_sub_explicit(&sv->refs, 1, memory_order_acq_rel) == 1) {
+        free(sv);
+    }
+}
+
+// bytes an entry's block must hold
+static size_t entry_size(size_t klen, size_t vlen) {
+    return sizeof(Entry) + klen + (val_is_shared(vlen) ? 0 : vlen);
+}
+
+// what an entry costs its shard's mem_used: the whole chunk its block takes
+// up, plus a large value's own block
+static size_t entry_mem(uint32_t cls, size_t klen, size_t vlen) {
+    size_t size = entry_size(klen, vlen);
+    return (cls == SLAB_LARGE ? size : slab_chunk_size[cls]) + (val_is_shared(vlen) ? sizeof(SharedVal) + vlen : 0);
+}
+
+// a new, unlinked entry with no TTL, in one block from sh's slab
+static Entry *entry_new(Shard *sh, const uint8_t *key, size_t klen, const uint8_t *val, size_t vlen, uint64_t hcode) {
+    uint32_t cls = 0;
+    Entry *e = slab_alloc(&sh->slab, entry_size(klen, vlen), &cls);
+    e->key = (char *)(e + 1);
+    memcpy(e->key, key, klen);
+    e->klen = (uint32_t)klen;
+    e->val = e->key + klen;
+    if (val_is_shared(vlen)) {
+        SharedVal *sv = malloc(sizeof(SharedVal) + vlen);
+        if (!sv) {
+            die("malloc()");
+        }
+        atomic_init(&sv->refs, 1);
+        e->val = (char *)sv->data;
+        sh->slab.shared_values++;
+        sh->slab.shared_bytes += vlen;
+    }
+    memcpy(e->val, val, vlen);
+    e->vlen = (uint32_t)vlen;
+    e->expire_at = 0;
+    e->ttl_node.idx = HEAP_NONE;
+    e->hcode = hcode;
+#ifndef HT_SWISS
+    e->next = NULL;
+#endif
+    e->slab_class = (uint16_t)cls;
+    e->type = TYPE_STRING;
+    e->enc = ENC_PACK;
+    e->lru = entry_first_access(sh);
+    sh->mem_used += entry_mem(cls, klen, vlen);
+    return e;
+}
+
+static void entry_free(Entry *e) {
+    Shard *sh = shard_of(e->hcode);
+    heap_remove(&sh->ttl_heap, &e->ttl_node);
+    if (e->type == TYPE_ZSET) {
+        zset_free(e->zset);
+    } else if (e->enc == ENC_TABLE) {
+        hashobj_free(e->hash);
+    } else if (e->enc == ENC_QUICKLIST) {
+        qlist_free(e->list);
+    } else if (val_is_shared(e->vlen)) {
+        sh->slab.shared_values--;
+        sh->slab.shared_bytes -= e->vlen;
+        shared_val_release(entry_shared_val(e));
+    }
+    sh->mem_used -= entry_mem(e->slab_class, e->klen, e->vlen);
+    slab_free(&sh->slab, e, e->slab_class, entry_size(e->klen, e->vlen));
+}
+
+static bool hm_is_rehashing(const HMap *m) {
+    return m->ht[1].tab != NULL;
+}
+
+static size_t hm_size(const HMap *m) {
+    return m->ht[0].size + m->ht[1].size;
+}
+
+#ifdef HT_SWISS
+
+#define HT_EMPTY 0x80
+#define HT_DELETED 0xFE
+
+// A slot's fingerprint (the low 32 bits of hcode) also gives its tag and its
+// first probe group, so a resize moves slots without touching the entries.
+// The tag uses the fingerprint's top bits, which only start picking groups
+// as well in tables of over 500 million slots.
+static uint8_t ht_tag(uint32_t fp) {
+    return (uint8_t)(fp >> 25);
+}
+
+// bit i set for each slot of the group at ctrl whose byte equals b
+static uint32_t ht_group_match(const uint8_t *ctrl, uint8_t b) {
+#ifdef __SSE2__
+    __m128i group = _mm_load_si128((const __m128i *)ctrl);
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8((char)b)));
+#else
+    uint32_t bits = 0;
+    for (uint32_t i = 0; i < HT_GROUP; i++) {
+        bits |= (uint32_t)(ctrl[i] == b) << i;
+    }
+    return bits;
+#endif
+}
+
+// bit i set for each free slot (empty or deleted: the only bytes with the top bit set)
+static uint32_t ht_group_free(const uint8_t *ctrl) {
+#ifdef __SSE2__
+    return (uint32_t)_mm_movemask_epi8(_mm_load_si128((const __m128i *)ctrl));
+#else
+    uint32_t bits = 0;
+    for (uint32_t i = 0; i < HT_GROUP; i++) {
+        bits |= (uint32_t)(ctrl[i] >> 7) << i;
+    }
+    return bits;
+#endif
+}
+
+static void ht_init(HTab *t, size_t n) {
+    t->ctrl = aligned_alloc(HT_GROUP, n);
+    t->tab = malloc(n * sizeof(HSlot));
+    if (!t->ctrl || !t->tab) {
+        die("malloc()");
+    }
+    memset(t->ctrl, HT_EMPTY, n);
+    t->mask = n - 1;
+    t->size = 0;
+    t->deleted = 0;
+}
+
+static void ht_free(HTab *t) {
+    free(t->ctrl);
+    free(t->tab);
+    memset(t, 0, sizeof(*t));
+}
+
+// the group a probe visits at step i: triangular steps cover every group
+static size_t ht_probe_group(const HTab *t, uint32_t fp, size_t i) {
+    size_t ngroups = (t->mask + 1) / HT_GROUP;
+    return ((size_t)fp + i * (i + 1) / 2) & (ngroups - 1);
+}
+
+// slot holding key in t, or SIZE_MAX
+static size_t ht_find(const HTab *t, const uint8_t *key, size_t klen, uint64_t hcode) {
+    uint32_t fp = (uint32_t)hcode;
+    uint8_t tag = ht_tag(fp);
+    size_t ngroups = (t->mask + 1) / HT_GROUP;
+    for (size_t i = 0; i < ngroups; i++) {
+        size_t base = ht_probe_group(t, fp, i) * HT_GROUP;
+        const uint8_t *ctrl = &t->ctrl[base];
+        for (uint32_t bits = ht_group_match(ctrl, tag); bits; bits &= bits - 1) {
+            const HSlot *sl = &t->tab[base + (size_t)__builtin_ctz(bits)];
+            if (sl->fp == fp && sl->klen == klen && memcmp(sl->e->key, key, klen) == 0) {
+                return base + (size_t)__builtin_ctz(bits);
+            }
+        }
+        if (ht_group_match(ctrl, HT_EMPTY)) {  // an empty slot ends every probe that reached it
+            break;
+        }
+    }
+    return SIZE_MAX;
+}
+
+// place sl, whose key is not in t, in the first free slot of its probe sequence
+static void ht_insert(HTab *t, HSlot sl) {
+    size_t ngroups = (t->mask + 1) / HT_GROUP;
+    for (size_t i = 0; i < ngroups; i++) {
+        size_t base = ht_probe_group(t, sl.fp, i) * HT_GROUP;
+        uint32_t bits = ht_group_free(&t->ctrl[base]);
+        if (bits) {
+            size_t slot = base + (size_t)__builtin_ctz(bits);
+            if (t->ctrl[slot] == HT_DELETED) {
+                t->deleted--;
+            }
+            t->ctrl[slot] = ht_tag(sl.fp);
+            t->tab[slot] = sl;
+            t->size++;
+            return;
+        }
+    }
+    assert(!"hash table full");     // hm_check_resize keeps a free slot in every table
+}
+
+// free a slot. It can go straight back to empty if its group still has an
+// empty slot, since then no probe ever went past this group; otherwise it
+// must become a tombstone so later probes keep going.
+static void ht_erase(HTab *t, size_t slot) {
+    const uint8_t *ctrl = &t->ctrl[slot & ~(size_t)(HT_GROUP - 1)];
+    if (ht_group_match(ctrl, HT_EMPTY)) {
+        t->ctrl[slot] = HT_EMPTY;
+    } else {
+        t->ctrl[slot] = HT_DELETED;
+        t->deleted++;
+    }
+    t->size--;
+}
+
+// whether t is past its maximum fill; inserting must then wait for a resize
+static bool ht_is_full(const HTab *t) {
+    return (t->size + t->deleted + 1) * 8 > (t->mask + 1) * HT_MAX_FILL;
+}
+
+// migrate up to n groups from ht[0] into ht[1]; returns true if work remains
+static bool hm_rehash(HMap *m, size_t n) {
+    if (!hm_is_rehashing(m)) {
+        return false;
+    }
+    HTab *from = &m->ht[0], *to = &m->ht[1];
+    size_t ngroups = (from->mask + 1) / HT_GROUP;
+    while (n-- > 0 && from->size != 0 && m->rehash_idx < ngroups) {
+        size_t base = m->rehash_idx * HT_GROUP;
+        for (uint32_t i = 0; i < HT_GROUP; i++) {
+            if (!(from->ctrl[base + i] & 0x80)) {
+                ht_insert(to, from->tab[base + i]);
+                // a tombstone, not an empty slot, so keys further along
+                // this slot's probe sequences are still found
+                from->ctrl[base + i] = HT_DELETED;
+                from->size--;
+            }
+        }
+        m->rehash_idx++;
+    }
+    if (from->size == 0) {  // every group moved: the new table becomes the live one
+        ht_free(from);
+        *from = *to;
+        memset(to, 0, sizeof(*to));
+        m->rehash_idx = 0;
+        return false;
+    }
+    return true;
+}
+
+// start moving towards a table of n slots (n is a power of two)
+static void hm_resize(HMap *m, size_t n) {
+    if (hm_is_rehashing(m)) {
+        return;
+    }
+    ht_init(&m->ht[1], n);
+    m->rehash_idx = 0;
+}
+
+// Grow (or just clear out tombstones) once used plus deleted slots pass 7/8,
+// and, if may_shrink, shrink below HT_MIN_FILL percent. Either way the new
+// table starts at most 7/16 full, so it has room for the keys inserted while
+// ht[0] drains into it. Inserts never shrink, so a table pre-sized by
+// hm_reserve keeps its size while it fills.
+static void hm_check_resize(HMap *m, bool may_shrink) {
+    if (hm_is_rehashing(m)) {
+        return;
+    }
+    size_t slots = m->ht[0].mask + 1;
+    size_t used = m->ht[0].size;
+    bool full = ht_is_full(&m->ht[0]);
+    if (full || (may_shrink && slots > HT_INIT_SIZE && used * 100 / slots < HT_MIN_FILL)) {
+        size_t n = HT_INIT_SIZE;
+        while (n * HT_MAX_FILL < used * 16) {
+            n *= 2;
+        }
+        if (n != slots || full) {
+            hm_resize(m, n);
+        }
+    }
+}
+
+static Entry *hm_lookup(HMap *m, const uint8_t *key, size_t klen, uint64_t hcode) {
+    for (int i = 0; i < 2; i++) {
+        HTab *t = &m->ht[i];
+        if (!t->tab) {
+            continue;
+        }
+        size_t slot = ht_find(t, key, klen, hcode);
+        if (slot != SIZE_MAX) {
+            return t->tab[slot].e;
+        }
+    }
+    return NULL;
+}
+
+// add e, whose key is not in the map yet
+static void hm_insert(HMap *m, Entry *e) {
+    if (!m->ht[0].tab) {
+        ht_init(&m->ht[0], HT_INIT_SIZE);
+    }
+    // new keys go into the new table during a resize; if even that is full
+    // (many inserts during a long shrink), finish the move first
+    while (hm_is_rehashing(m) && ht_is_full(&m->ht[1])) {
+        hm_rehash(m, SIZE_MAX);
+        hm_check_resize(m, false);
+    }
+    HSlot sl = {e, e->klen, (uint32_t)e->hcode};
+    ht_insert(hm_is_rehashing(m) ? &m->ht[1] : &m->ht[0], sl);
+    hm_check_resize(m, false);
+}
+
+// unlink and return key's entry, or NULL
+static Entry *hm_remove(HMap *m, const uint8_t *key, size_t klen, uint64_t hcode) {
+    for (int i = 0; i < 2; i++) {
+        HTab *t = &m->ht[i];
+        if (!t->tab) {
+            continue;
+        }
+        size_t slot = ht_find(t, key, klen, hcode);
+        if (slot != SIZE_MAX) {
+            Entry *e = t->tab[slot].e;
+            ht_erase(t, slot);
+            // only a shrink is worth it here: deleted slots left behind only
+            // matter once inserts need the room, and hm_insert sees to that
+            if (t->size * 100 / (t->mask + 1) < HT_MIN_FILL) {
+                hm_check_resize(m, true);
+            }
+            return e;
+        }
+    }
+    return NULL;
+}
+
+// put ne, which has the same key, where old is
+static void hm_replace(HMap *m, Entry *old, Entry *ne) {
+    for (int i = 0; i < 2; i++) {
+        HTab *t = &m->ht[i];
+        if (!t->tab) {
+            continue;
+        }
+        size_t slot = ht_find(t, (const uint8_t *)old->key, old->klen, old->hcode);
+        if (slot != SIZE_MAX) {
+            t->tab[slot].e = ne;
+            return;
+        }
+    }
+}
+
+// call fn on every entry; fn must not change the map
+static void hm_foreach(HMap *m, void (*fn)(Entry *, void *), void *arg) {
+    for (int i = 0; i < 2; i++) {
+        HTab *t = &m->ht[i];
+        for (size_t j = 0; t->tab && j <= t->mask; j++) {
+            if (!(t->ctrl[j] & 0x80)) {
+                fn(t->tab[j].e, arg);
+            }
+        }
+    }
+}
+
+// up to n entries from the slots after a random one, for eviction to choose
+// among; it gives up after 10 slots per entry wanted, so a sparse table may
+// yield fewer
+static size_t hm_sample(const HMap *m, uint64_t rnd, Entry **out, size_t n) {
+    size_t got = 0;
+    for (int i = 0; i < 2; i++) {
+        const HTab *t = &m->ht[i];
+        for (size_t j = 0; t->tab && got < n && j <= t->mask && j < n * 10; j++) {
+            size_t slot = (rnd + j) & t->mask;
+            if (!(t->ctrl[slot] & 0x80)) {
+                out[got++] = t->tab[slot].e;
+            }
+        }
+    }
+    return got;
+}
+
+// for INFO: entries by how many groups past the first one of their probe
+// sequence they sit, the last counter taking HT_DIST_MAX and up
+static void hm_probe_lengths(const HMap *m, uint64_t *dist) {
+    for (int i = 0; i < 2; i++) {
+        const HTab *t = &m->ht[i];
+        size_t ngroups = (t->mask + 1) / HT_GROUP;
+        for (size_t j = 0; t->tab && j <= t->mask; j++) {
+            if (t->ctrl[j] & 0x80) {
+                continue;
+            }
+            size_t steps = 0;
+            while (steps < HT_DIST_MAX && steps < ngroups && ht_probe_group(t, t->tab[j].fp, steps) != j / HT_GROUP) {
+                steps++;
+            }
+            dist[steps]++;
+        }
+    }
+}
+
+// start loading the first probe group a key's hash maps to, in each table
+static void hm_prefetch(const HMap *m, uint64_t hcode) {
+    for (int i = 0; i < 2; i++) {
+        const HTab *t = &m->ht[i];
+        if (t->tab) {
+            size_t base = ht_probe_group(t, (uint32_t)hcode, 0) * HT_GROUP;
+            __builtin_prefetch(&t->ctrl[base]);
+            __builtin_prefetch(&t->tab[base]);
+        }
+    }
+}
+
+// start loading the entry of the first slot in that group whose fingerprint
+// matches; meant to run once hm_prefetch's loads have had time to land
+static void hm_prefetch_entry(const HMap *m, uint64_t hcode) {
+    uint32_t fp = (uint32_t)hcode;
+    for (int i = 0; i < 2; i++) {
+        const HTab *t = &m->ht[i];
+        if (!t->tab) {
+            continue;
+        }
+        size_t base = ht_probe_group(t, fp, 0) * HT_GROUP;
+        for (uint32_t bits = ht_group_match(&t->ctrl[base], ht_tag(fp)); bits; bits &= bits - 1) {
+            const HSlot *sl = &t->tab[base + (size_t)__builtin_ctz(bits)];
+            if (sl->fp == fp) {
+                __builtin_prefetch(sl->e);
+                __builtin_prefetch(sl->e + 1);  // the key, which starts on the next cache line or two
+                break;
+            }
+        }
+    }
+}
+
+// size an empty map for n keys, so filling it doesn't resize along the way
+static void hm_reserve(HMap *m, size_t n) {
+    if (m->ht[0].tab || n == 0) {
+        return;
+    }
+    size_t slots = HT_INIT_SIZE;
+    while (slots * HT_MAX_FILL < n * 8) {
+        slots *= 2;
+    }
+    ht_init(&m->ht[0], slots);
+}
+
+#else   // chained engine
+
+static void ht_init(HTab *t, size_t n) {
+    t->tab = calloc(n, sizeof(Entry *));
+    if (!t->tab) {
+        die("calloc()");
+    }
+    t->mask = n - 1;
+    t->size = 0;
+}
+
+// migrate up to n buckets from ht[0] into ht[1]; returns true if work remains.
+// Long runs of empty buckets are capped at n*10 visits so one call stays cheap.
+static bool hm_rehash(HMap *m, size_t n) {
+    if (!hm_is_rehashing(m)) {
+        return false;
+    }
+    size_t empty_visits = n * 10;
+    HTab *from = &m->ht[0], *to = &m->ht[1];
+    while (n-- > 0 && from->size != 0) {
+        while (from->tab[m->rehash_idx] == NULL) {
+            m->rehash_idx++;
+            if (--empty_visits == 0) {
+                return true;
+            }
+        }
+        Entry *e = from->tab[m->rehash_idx];
+        while (e) {
+            Entry *next = e->next;
+            size_t slot = e->hcode & to->mask;
+            e->next = to->tab[slot];
+            to->tab[slot] = e;
+            from->size--;
+            to->size++;
+            e = next;
+        }
+        from->tab[m->rehash_idx] = NULL;
+        m->rehash_idx++;
+    }
+    if (from->size == 0) {  // every bucket moved: the new table becomes the live one
+        free(from->tab);
+        *from = *to;
+        memset(to, 0, sizeof(*to));
+        m->rehash_idx = 0;
+        return false;
+    }
+    return true;
+}
+
+// start moving towards a table of n buckets (n is a power of two)
+static void hm_resize(HMap *m, size_t n) {
+    if (hm_is_rehashing(m) || n == m->ht[0].mask + 1) {
+        return;
+    }
+    ht_init(&m->ht[1], n);
+    m->rehash_idx = 0;
+}
+
+// grow at a load factor of 1 and, if may_shrink, shrink below HT_MIN_FILL
+// percent; inserts never shrink, so a table pre-sized by hm_reserve keeps
+// its size while it fills
+static void hm_check_resize(HMap *m, bool may_shrink) {
+    if (hm_is_rehashing(m)) {
+        return;
+    }
+    size_t buckets = m->ht[0].mask + 1;
+    size_t used = m->ht[0].size;
+    if (used >= buckets) {
+        hm_resize(m, buckets * 2);
+    } else if (may_shrink && buckets > HT_INIT_SIZE && used * 100 / buckets < HT_MIN_FILL) {
+        size_t n = HT_INIT_SIZE;
+        while (n < used) {
+            n *= 2;
+        }
+        hm_resize(m, n);
+    }
+}
+
+// find the link pointing at key's entry in either table, or NULL. *out_t is
+// set to the table holding it so the caller can keep that table's size right.
+static Entry **hm_find(HMap *m, const uint8_t *key, size_t klen, uint64_t hcode, HTab **out_t) {
+    for (int i = 0; i < 2; i++) {
+        HTab *t = &m->ht[i];
+        if (!t->tab) {
+            continue;
+        }
+        Entry **pp = &t->tab[hcode & t->mask];
+        while (*pp) {
+            Entry *e = *pp;
+            if (e->hcode == hcode && e->klen == klen && memcmp(e->key, key, klen) == 0) {
+                *out_t = t;
+                return pp;
+            }
+            pp = &e->next;
+        }
+        if (!hm_is_rehashing(m)) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+static Entry *hm_lookup(HMap *m, const uint8_t *key, size_t klen, uint64_t hcode) {
+    HTab *t = NULL;
+    Entry **pp = hm_find(m, key, klen, hcode, &t);
+    return pp ? *pp : NULL;
+}
+
+// add e, whose key is not in the map yet
+static void hm_insert(HMap *m, Entry *e) {
+    if (!m->ht[0].tab) {
+        ht_init(&m->ht[0], HT_INIT_SIZE);
+    }
+    // new keys go into the new table during a resize, at the head of their bucket
+    HTab *t = hm_is_rehashing(m) ? &m->ht[1] : &m->ht[0];
+    size_t slot = e->hcode & t->mask;
+    e->next = t->tab[slot];
+    t->tab[slot] = e;
+    t->size++;
+    hm_check_resize(m, false);
+}
+
+// unlink and return key's entry, or NULL
+static Entry *hm_remove(HMap *m, const uint8_t *key, size_t klen, uint64_t hcode) {
+    HTab *t = NULL;
+    Entry **pp = hm_find(m, key, klen, hcode, &t);
+    if (!pp) {
+        return NULL;
+    }
+    Entry *e = *pp;
+    *pp = e->next;
+    t->size--;
+    hm_check_resize(m, true);
+    return e;
+}
+
+// put ne, which has the same key, where old is
+static void hm_replace(HMap *m, Entry *old, Entry *ne) {
+    HTab *t = NULL;
+    Entry **pp = hm_find(m, (const uint8_t *)old->key, old->klen, old->hcode, &t);
+    if (pp) {
+        ne->next = old->next;
+        *pp = ne;
+    }
+}
+
+// call fn on every entry; fn must not change the map
+static void hm_foreach(HMap *m, void (*fn)(Entry *, void *), void *arg) {
+    for (int i = 0; i < 2; i++) {
+        HTab *t = &m->ht[i];
+        for (size_t j = 0; t->tab && j <= t->mask; j++) {
+            for (Entry *e = t->tab[j]; e; e = e->next) {
+                fn(e, arg);
+            }
+        }
+    }
+}
+
+// up to n entries from the buckets after a random one, for eviction to
+// choose among; it gives up after 10 buckets per entry wanted, so a sparse
+// table may yield fewer
+static size_t hm_sample(const HMap *m, uint64_t rnd, Entry **out, size_t n) {
+    size_t got = 0;
+    for (int i = 0; i < 2; i++) {
+        const HTab *t = &m->ht[i];
+        for (size_t j = 0; t->tab && got < n && j <= t->mask && j < n * 10; j++) {
+            for (Entry *e = t->tab[(rnd + j) & t->mask]; e && got < n; e = e->next) {
+                out[got++] = e;
+            }
+        }
+    }
+    return got;
+}
+
+// for INFO: buckets by how many entries are chained in them, the last
+// counter taking HT_DIST_MAX and up
+static void hm_chain_lengths(const HMap *m, uint64_t *dist) {
+    for (int i = 0; i < 2; i++) {
+        const HTab *t = &m->ht[i];
+        for (size_t j = 0; t->tab && j <= t->mask; j++) {
+            size_t len = 0;
+            for (const Entry *e = t->tab[j]; e && len < HT_DIST_MAX; e = e->next) {
+                len++;
+            }
+            dist[len]++;
+        }
+    }
+}
+
+// start loading the bucket heads a key's hash maps to, in each table
+static void hm_prefetch(const HMap *m, uint64_t hcode) {
+    for (int i = 0; i < 2; i++) {
+        const HTab *t = &m->ht[i];
+        if (t->tab) {
+            __builtin_prefetch(&t->tab[hcode & t->mask]);
+        }
+    }
+}
+
+// start loading the first entry of each of those buckets; meant to run once
+// hm_prefetch's loads have had time to land
+static void hm_prefetch_entry(const HMap *m, uint64_t hcode) {
+    for (int i = 0; i < 2; i++) {
+        const HTab *t = &m->ht[i];
+        const Entry *e = t->tab ? t->tab[hcode & t->mask] : NULL;
+        if (e) {
+            __builtin_prefetch(e);
+            __builtin_prefetch(e + 1);  // the key, which starts on the next cache line or two
+        }
+    }
+}
+
+// size an empty map for n keys, so filling it doesn't resize along the way
+static void hm_reserve(HMap *m, size_t n) {
+    if (m->ht[0].tab || n == 0) {
+        return;
+    }
+    size_t buckets = HT_INIT_SIZE;
+    while (buckets < n) {
+        buckets *= 2;
+    }
+    ht_init(&m->ht[0], buckets);
+}
+
+#endif  // HT_SWISS
+
+// migrate buckets in batches of 100 until the resize finishes or ms runs out
+static void hm_rehash_ms(HMap *m, int ms) {
+    uint64_t start = get_monotonic_us();
+    while (hm_rehash(m, 100)) {
+        if (get_monotonic_us() - start >= (uint64_t)ms * 1000) {
+            break;
+        }
+    }
+}
+
+// set or clear (at == 0) a key's expiry, keeping its shard's ttl_heap in step
+static void entry_set_expire(Entry *e, time_t at) {
+    Heap *ttl_heap = &shard_of(e->hcode)->ttl_heap;
+    e->expire_at = at;
+    if (at == 0) {
+        heap_remove(ttl_heap, &e->ttl_node);
+    } else {
+        heap_upsert(ttl_heap, &e->ttl_node, (uint64_t)at * 1000);
+    }
+}
+
+// the h_*_hashed functions take a key whose hash_bytes() is already known
+static Entry *h_lookup_hashed(const uint8_t *key, size_t klen, uint64_t hcode) {
+    Shard *sh = shard_of(hcode);
+    hm_rehash(&sh->db, HT_REHASH_STEP);
+    Entry *e = hm_lookup(&sh->db, key, klen, hcode);
+    if (e && e->expire_at != 0 && e->expire_at <= time(NULL)) {
+        // key has expired: remove it lazily and report as missing
+        entry_free(hm_remove(&sh->db, key, klen, hcode));
+        sh->expire_stats.expired_keys++;
+        return NULL;
+    }
+    if (e) {
+        entry_touch(sh, e);
+    }
+    return e;
+}
+
+static Entry *h_lookup(const uint8_t *key, size_t klen) {
+    return h_lookup_hashed(key, klen, hash_bytes(key, klen));
+}
+
+// replace the value bytes of a string or a packed hash or list, keeping its
+// type, encoding and TTL; returns the entry, which may have moved. val may
+// point into the old value.
+static Entry *entry_set_value(Entry *e, const uint8_t *val, size_t vlen) {
+    assert(e->type == TYPE_STRING || e->enc == ENC_PACK);
+    Shard *sh = shard_of(e->hcode);
+    size_t old_size = entry_size(e->klen, e->vlen), new_size = entry_size(e->klen, vlen);
+    if (e->slab_class != SLAB_LARGE && !val_is_shared(e->vlen) && !val_is_shared(vlen)
+            && slab_class_for(new_size) == e->slab_class) {
+        // the new value fits the block the entry already has, and isn't
+        // so much smaller that a smaller class would be worth the move.
+        // A shared value is never written in place: a reply may still be
+        // sending it.
+        slab_resize_in_place(&sh->slab, e->slab_class, old_size, new_size);
+        memmove(e->val, val, vlen);
+        e->vlen = (uint32_t)vlen;
+        return e;
+    }
+    // move to a block of the right size, in the same spot in the table
+    Entry *ne = entry_new(sh, (const uint8_t *)e->key, e->klen, val, vlen, e->hcode);
+    ne->type = e->type;
+    ne->enc = e->enc;
+    ne->lru = e->lru;
+    hm_replace(&sh->db, e, ne);
+    if (e->expire_at != 0) {
+        entry_set_expire(ne, e->expire_at);
+    }
+    entry_free(e);
+    return ne;
+}
+
+// store a string value at key; false, changing nothing, if the key holds
+// another type
+static bool h_set_hashed(const uint8_t *key, size_t klen, const uint8_t *val, size_t vlen, uint64_t hcode) {
+    Entry *e = h_lookup_hashed(key, klen, hcode);
+    if (e && e->type != TYPE_STRING) {
+        return false;
+    }
+    if (e) {    // key exists: replace the value and clear any TTL
+        entry_set_expire(e, 0);
+        entry_set_value(e, val, vlen);
+        return true;
+    }
+    Shard *sh = shard_of(hcode);
+    hm_insert(&sh->db, entry_new(sh, key, klen, val, vlen, hcode));
+    return true;
+}
+
+static bool h_set(const uint8_t *key, size_t klen, const uint8_t *val, size_t vlen) {
+    return h_set_hashed(key, klen, val, vlen, hash_bytes(key, klen));
+}
+
+// a new, empty key of the given type, which must not exist yet. A sorted
+// set gets its container; a hash or list starts out as an empty pack.
+static Entry *h_new_typed(const uint8_t *key, size_t klen, uint8_t type) {
+    uint64_t hcode = hash_bytes(key, klen);
+    Shard *sh = shard_of(hcode);
+    Entry *e = entry_new(sh, key, klen, (const uint8_t *)"", 0, hcode);
+    e->type = type;
+    if (type == TYPE_ZSET) {
+        e->zset = zset_new(&sh->mem_used);
+    }
+    hm_insert(&sh->db, e);
+    return e;
+}
+
+// Hashes and lists go through these whatever their encoding. Any change may
+// move the entry to another block, so the functions that make one return
+// the entry as it now is.
+
+static size_t hash_len(const Entry *e) {
+    return e->enc == ENC_TABLE ? e->hash->len : pack_count((const uint8_t *)e->val, e->vlen) / 2;
+}
+
+static bool hash_get(const Entry *e, const uint8_t *field, uint32_t flen, const uint8_t **val, uint32_t *vlen) {
+    if (e->enc == ENC_TABLE) {
+        const HField *f = hashobj_get(e->hash, field, flen);
+        if (f) {
+            *val = f->data + f->flen;
+            *vlen = f->vlen;
+        }
+        return f != NULL;
+    }
+    const uint8_t *p = (const uint8_t *)e->val, *end = p + e->vlen, *f = NULL;
+    uint32_t n = 0;
+    while (p < end) {
+        p = pack_next(p, &f, &n);
+        p = pack_next(p, val, vlen);
+        if (n == flen && memcmp(f, field, flen) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// call fn on every field and its value
+static void hash_foreach(const Entry *e, void (*fn)(const uint8_t *, uint32_t, const uint8_t *, uint32_t, void *), void *arg) {
+    if (e->enc == ENC_TABLE) {
+        for (size_t i = 0; i <= e->hash->mask; i++) {
+            for (const HField *f = e->hash->tab[i]; f; f = f->next) {
+                fn(f->data, f->flen, f->data + f->flen, f->vlen, arg);
+            }
+        }
+        return;
+    }
+    const uint8_t *p = (const uint8_t *)e->val, *end = p + e->vlen, *f = NULL, *v = NULL;
+    uint32_t flen = 0, vlen = 0;
+    while (p < end) {
+        p = pack_next(p, &f, &flen);
+        p = pack_next(p, &v, &vlen);
+        fn(f, flen, v, vlen, arg);
+    }
+}
+
+static void hash_copy_field(const uint8_t *f, uint32_t flen, const uint8_t *v, uint32_t vlen, void *arg) {
+    hashobj_set((HashObj *)arg, f, flen, v, vlen);
+}
+
+// set a field; *added says whether it is new
+static Entry *hash_set(Entry *e, const uint8_t *field, uint32_t flen, const uint8_t *val, uint32_t vlen, bool *added) {
+    const uint8_t *old = NULL;
+    uint32_t oldlen = 0;
+    if (e->enc == ENC_PACK && !(flen <= config.hash_pack_value && vlen <= config.hash_pack_value
+            && (hash_len(e) < config.hash_pack_entries || hash_get(e, field, flen, &old, &oldlen)))) {
+        HashObj *h = hashobj_new(&shard_of(e->hcode)->mem_used);
+        hash_foreach(e, hash_copy_field, h);
+        e = entry_set_value(e, (const uint8_t *)"", 0);
+        e->enc = ENC_TABLE;
+        e->hash = h;
+    }
+    if (e->enc == ENC_TABLE) {
+        *added = hashobj_set(e->hash, field, flen, val, vlen);
+        return e;
+    }
+    // rebuild the pack with the field replaced, or added at the end
+    Buf pack = {0};
+    const uint8_t *p = (const uint8_t *)e->val, *end = p + e->vlen, *f = NULL, *v = NULL;
+    uint32_t n = 0, m = 0;
+    *added = true;
+    while (p < end) {
+        p = pack_next(p, &f, &n);
+        p = pack_next(p, &v, &m);
+        pack_append(&pack, f, n);
+        if (n == flen && memcmp(f, field, flen) == 0) {
+            pack_append(&pack, val, vlen);
+            *added = false;
+        } else {
+            pack_append(&pack, v, m);
+        }
+    }
+    if (*added) {
+        pack_append(&pack, field, flen);
+        pack_append(&pack, val, vlen);
+    }
+    e = entry_set_value(e, pack.data, buf_len(&pack));
+    buf_free(&pack);
+    return e;
+}
+
+// delete a field if it is there; *removed says whether it was
+static Entry *hash_del(Entry *e, const uint8_t *field, uint32_t flen, bool *removed) {
+    if (e->enc == ENC_TABLE) {
+        *removed = hashobj_del(e->hash, field, flen);
+        return e;
+    }
+    const uint8_t *start = (const uint8_t *)e->val, *p = start, *end = p + e->vlen, *f = NULL, *v = NULL;
+    uint32_t n = 0, m = 0;
+    while (p < end) {
+        const uint8_t *at = p;
+        p = pack_next(p, &f, &n);
+        p = pack_next(p, &v, &m);
+        if (n == flen && memcmp(f, field, flen) == 0) {
+            Buf pack = {0};
+            buf_reserve(&pack, e->vlen);
+            buf_append(&pack, start, (size_t)(at - start));
+            buf_append(&pack, p, (size_t)(end - p));
+            e = entry_set_value(e, pack.data, buf_len(&pack));
+            buf_free(&pack);
+            *removed = true;
+            return e;
+        }
+    }
+    *removed = false;
+    return e;
+}
+
+static size_t list_len(const Entry *e) {
+    return e->enc == ENC_QUICKLIST ? e->list->len : pack_count((const uint8_t *)e->val, e->vlen);
+}
+
+// push an element onto the front or the back
+static Entry *list_push(Entry *e, bool front, const uint8_t *data, uint32_t len) {
+    if (e->enc == ENC_PACK && (len > config.list_pack_value || list_len(e) + 1 > config.list_pack_entries)) {
+        QList *l = qlist_new(&shard_of(e->hcode)->mem_used);
+        const uint8_t *p = (const uint8_t *)e->val, *end = p + e->vlen, *el = NULL;
+        uint32_t n = 0;
+        while (p < end) {
+            p = pack_next(p, &el, &n);
+            qlist_push(l, false, el, n);
+        }
+        e = entry_set_value(e, (const uint8_t *)"", 0);
+        e->enc = ENC_QUICKLIST;
+        e->list = l;
+    }
+    if (e->enc == ENC_QUICKLIST) {
+        qlist_push(e->list, front, data, len);
+        return e;
+    }
+    Buf pack = {0};
+    buf_reserve(&pack, e->vlen + pack_elem_size(len));
+    if (!front) {
+        buf_append(&pack, e->val, e->vlen);
+    }
+    pack_append(&pack, data, len);
+    if (front) {
+        buf_append(&pack, e->val, e->vlen);
+    }
+    e = entry_set_value(e, pack.data, buf_len(&pack));
+    buf_free(&pack);
+    return e;
+}
+
+// the element at the front or the back of a non-empty list
+static void list_peek(const Entry *e, bool front, const uint8_t **data, uint32_t *len) {
+    if (e->enc == ENC_QUICKLIST) {
+        qlist_peek(e->list, front, data, len);
+        return;
+    }
+    const uint8_t *p = (const uint8_t *)e->val;
+    pack_next(front ? p : pack_last(p, pack_count(p, e->vlen)), data, len);
+}
+
+// remove the element at the front or the back of a non-empty list
+static Entry *list_drop(Entry *e, bool front) {
+    if (e->enc == ENC_QUICKLIST) {
+        qlist_drop(e->list, front);
+        return e;
+    }
+    const uint8_t *p = (const uint8_t *)e->val, *data = NULL;
+    uint32_t len = 0;
+    if (front) {
+        const uint8_t *rest = pack_next(p, &data, &len);
+        Buf pack = {0};
+        buf_reserve(&pack, e->vlen);
+        buf_append(&pack, rest, e->vlen - (size_t)(rest - p));
+        e = entry_set_value(e, pack.data, buf_len(&pack));
+        buf_free(&pack);
+        return e;
+    }
+    // dropping the tail only shortens the pack, which entry_set_value can
+    // do in place when the block's class doesn't change
+    return entry_set_value(e, p, (size_t)(pack_last(p, pack_count(p, e->vlen)) - p));
+}
+
+// call fn on count elements starting at index start, which must be in range
+static void list_foreach(const Entry *e, size_t start, size_t count, void (*fn)(const uint8_t *, uint32_t, void *), void *arg) {
+    const uint8_t *data = NULL;
+    uint32_t len = 0;
+    if (e->enc == ENC_PACK) {
+        const uint8_t *p = (const uint8_t *)e->val;
+        for (size_t i = 0; i < start + count; i++) {
+            p = pack_next(p, &data, &len);
+            if (i >= start) {
+                fn(data, len, arg);
+            }
+        }
+        return;
+    }
+    const QNode *n = e->list->head;
+    while (start >= n->count) {     // whole nodes before the range are skipped by their counts
+        start -= n->count;
+        n = n->next;
+    }
+    for (; n && count > 0; n = n->next, start = 0) {
+        const uint8_t *p = n->data;
+        for (uint32_t i = 0; i < n->count && count > 0; i++) {
+            p = pack_next(p, &data, &len);
+            if (i >= start) {
+                fn(data, len, arg);
+                count--;
+            }
+        }
+    }
+}
+
+static bool h_del_hashed(const uint8_t *key, size_t klen, uint64_t hcode) {
+    HMap *db = &shard_of(hcode)->db;
+    hm_rehash(db, HT_REHASH_STEP);
+    Entry *e = hm_remove(db, key, klen, hcode);
+    if (!e) {
+        return false;
+    }
+    entry_free(e);
+    return true;
+}
+
+static bool h_del(const uint8_t *key, size_t klen) {
+    return h_del_hashed(key, klen, hash_bytes(key, klen));
+}
+
+static void collect_entry(Entry *e, void *arg) {
+    Entry ***next = (Entry ***)arg;
+    *(*next)++ = e;
+}
+
+// drop every key in a shard and free its tables, as a replica does before
+// loading its primary's snapshot
+static void shard_flush(Shard *sh) {
+    HMap *m = &sh->db;
+    size_t n = hm_size(m);
+    Entry **all = malloc((n ? n : 1) * sizeof(Entry *)), **next = all;
+    if (!all) {
+        die("malloc()");
+    }
+    hm_foreach(m, collect_entry, &next);    // freed afterwards: a chain walk reads each entry's next
+    for (size_t i = 0; i < n; i++) {
+        entry_free(all[i]);
+    }
+    free(all);
+    for (int i = 0; i < 2; i++) {
+#ifdef HT_SWISS
+        free(m->ht[i].ctrl);
+#endif
+        free(m->ht[i].tab);
+        memset(&m->ht[i], 0, sizeof(m->ht[i]));
+    }
+    m->rehash_idx = 0;
+}
+
+// ---- active expiration ----
+// Lazy expiry alone leaks every key that is never read again, so each event
+// loop iteration also pops keys off its shard's ttl_heap whose deadline has
+// passed. The work is capped by a time budget so a burst of expiries can't
+// stall the loop; whatever is left over is picked up on the next iteration.
+
+#define EXPIRE_SWEEP_BUDGET_US 1000     // time budget for one sweep
+#define EXPIRE_SWEEP_CHECK_EVERY 16     // keys removed between clock checks
+
+// remove expired keys until none are left or the budget runs out;
+// returns true if expired keys are still waiting
+static bool expire_sweep(Shard *sh, uint64_t budget_us) {
+    HeapNode *top = heap_top(&sh->ttl_heap);
+    uint64_t now_ms = get_wall_ms();
+    if (!top || top->at_ms > now_ms) {
+        return false;
+    }
+    uint64_t start = get_monotonic_us();
+    uint64_t removed = 0;
+    bool more = false;
+    while ((top = heap_top(&sh->ttl_heap)) && top->at_ms <= now_ms) {
+        Entry *e = container_of(top, Entry, ttl_node);
+        Entry *gone = hm_remove(&sh->db, (const uint8_t *)e->key, e->klen, e->hcode);
+        assert(gone == e);
+        entry_free(gone);
+        removed++;
+        if (removed % EXPIRE_SWEEP_CHECK_EVERY == 0 && get_monotonic_us() - start >= budget_us) {
+            more = heap_top(&sh->ttl_heap) && heap_top(&sh->ttl_heap)->at_ms <= now_ms;
+            break;
+        }
+    }
+    uint64_t took = get_monotonic_us() - start;
+    ExpireStats *st = &sh->expire_stats;
+    st->expired_keys += removed;
+    st->sweeps++;
+    st->last_sweep_us = took;
+    st->total_sweep_us += took;
+    if (took > st->max_sweep_us) {
+        st->max_sweep_us = took;
+    }
+    return more;
+}
+
+// fold one shard's expiry counters into a running total; durations take the max
+static void expire_stats_add(ExpireStats *sum, const ExpireStats *st) {
+    sum->expired_keys += st->expired_keys;
+    sum->sweeps += st->sweeps;
+    sum->total_sweep_us += st->total_sweep_us;
+    if (st->last_sweep_us > sum->last_sweep_us) {
+        sum->last_sweep_us = st->last_sweep_us;
+    }
+    if (st->max_sweep_us > sum->max_sweep_us) {
+        sum->max_sweep_us = st->max_sweep_us;
+    }
+}
+
+// how long epoll_wait() may sleep before the soonest key in sh expires, capped at max_ms
+static int next_expiry_timeout_ms(Shard *sh, int max_ms) {
+    HeapNode *top = heap_top(&sh->ttl_heap);
+    if (!top) {
+        return max_ms;
+    }
+    uint64_t now_ms = get_wall_ms();
+    if (top->at_ms <= now_ms) {
+        return 0;
+    }
+    uint64_t wait = top->at_ms - now_ms;
+    return wait < (uint64_t)max_ms ? (int)wait : max_ms;
+}
+
+// ---- snapshots ----
+// SAVE and BGSAVE write every live key to a compact binary file, which is
+// loaded back at startup. The file is a header followed by blocks of up to
+// SNAP_BLOCK_SIZE bytes of records, each block carrying its own CRC-32C, and
+// an empty block at the end holding the record count, so a torn or corrupted
+// file is refused rather than half-loaded. A record is
+//
+//   [type:1][expire_at:8][klen:4][vlen:4][key][val]
+//
+// with expire_at an absolute unix time (0 for none), so a TTL keeps counting
+// down while the server is stopped. A sorted set's val is its members in
+// score order, each [score:8][mlen:4][member]. A hash's or list's val is a
+// pack of its elements (see "hashes and lists"), fields and values
+// alternating for a hash, whatever encoding it has in memory; loading packs
+// it again if it is within the limits. BGSAVE forks: the child writes a
+// copy-on-write view of the keyspace while the parent keeps serving.
+//
+// Every block can be checked and decoded on its own, so loading maps the
+// file and decodes blocks on all cores, then fills each shard's table, sized
+// up front for exactly its keys, from a thread of its own (see
+// snapshot_load). A key costs one insert, with no lookups and no resizing.
+
+#define SNAP_MAGIC "MYRDB"
+#define SNAP_VERSION 2                  // 1 used CRC-32 rather than CRC-32C
+#define SNAP_BLOCK_SIZE (64 * 1024)     // records are flushed once a block reaches this
+#define SNAP_HEADER_SIZE 16             // magic (5) + version (3) + key count (8)
+#define SNAP_BLOCK_HEADER_SIZE 12       // payload length, record count, crc32c
+
+enum {
+    SNAP_REC_STRING = 0,
+    SNAP_REC_ZSET = 1,
+    SNAP_REC_HASH = 2,
+    SNAP_REC_LIST = 3,
+};
+
+// CRC-32C (Castagnoli). x86-64 CPUs with SSE4.2 compute it 8 bytes per
+// instruction, more than ten times faster than a byte-at-a-time table, which
+// otherwise bounds how fast a snapshot loads; other CPUs use the table.
+static uint32_t crc32c_table[256];
+
+#ifdef __x86_64__
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const uint8_t *data, size_t len) {
+    uint64_t c = crc;
+    for (; len >= 8; data += 8, len -= 8) {
+        uint64_t word;
+        memcpy(&word, data, 8);
+        c = __builtin_ia32_crc32di(c, word);
+    }
+    crc = (uint32_t)c;
+    for (; len > 0; data++, len--) {
+        crc = __builtin_ia32_crc32qi(crc, *data);
+    }
+    return crc;
+}
+#endif
+
+static uint32_t crc32c_update(uint32_t crc, const uint8_t *data, size_t len) {
+    crc = ~crc;
+#ifdef __x86_64__
+    if (__builtin_cpu_supports("sse4.2")) {
+        return ~crc32c_sse42(crc, data, len);
+    }
+#endif
+    // filled on first use; the loader checks the end marker on its own
+    // thread before any decoder starts, so this never races
+    if (crc32c_table[1] == 0) {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++) {
+                c = c & 1 ? 0x82F63B78u ^ (c >> 1) : c >> 1;
+            }
+            crc32c_table[i] = c;
+        }
+    }
+    for (size_t i = 0; i < len; i++) {
+        crc = crc32c_table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+// persistence state, only touched by thread 0 (SAVE/BGSAVE/INFO run there)
+static struct {
+    pid_t child;                // running BGSAVE or BGREWRITEAOF child, or 0
+    bool child_is_rewrite;
+    uint64_t child_start_ms;
+    time_t last_save;           // when the last successful save finished
+    bool last_save_ok;
+    uint64_t last_save_bytes;
+    uint64_t last_save_ms;      // how long it took
+    uint64_t loaded_keys;       // from the snapshot or AOF at startup
+    uint64_t load_bytes;        // size of the file they came from
+    uint64_t load_ms;
+    bool last_rewrite_ok;       // how the last BGREWRITEAOF went
+    uint64_t aof_loaded_commands;
+} persist = {.last_save_ok = true, .last_rewrite_ok = true};
+
+static int write_full(int fd, const uint8_t *data, size_t len) {
+    while (len > 0) {
+        ssize_t rv = write(fd, data, len);
+        if (rv < 0 && errno == EINTR) {
+            continue;
+        }
+        if (rv <= 0) {
+            return -1;
+        }
+        data += rv;
+        len -= (size_t)rv;
+    }
+    return 0;
+}
+
+typedef struct {
+    int fd;
+    Buf block;          // records of the block being built
+    uint32_t count;     // records in block
+    uint64_t total;     // records written so far
+    uint64_t bytes;
+    time_t now;
+    bool failed;
+} SnapWriter;
+
+static void snap_flush_block(SnapWriter *w) {
+    uint32_t hdr[3] = {(uint32_t)buf_len(&w->block), w->count, crc32c_update(0, w->block.data, buf_len(&w->block))};
+    if (write_full(w->fd, (const uint8_t *)hdr, sizeof(hdr)) < 0
+            || write_full(w->fd, w->block.data, buf_len(&w->block)) < 0) {
+        w->failed = true;
+    }
+    w->bytes += sizeof(hdr) + buf_len(&w->block);
+    w->total += w->count;
+    w->count = 0;
+    buf_consume(&w->block, buf_len(&w->block));
+}
+
+static void snap_pack_field(const uint8_t *f, uint32_t flen, const uint8_t *v, uint32_t vlen, void *arg) {
+    pack_append((Buf *)arg, f, flen);
+    pack_append((Buf *)arg, v, vlen);
+}
+
+// a hash or list that isn't packed in memory, packed onto the end of b
+static void snap_pack_container(const Entry *e, Buf *b) {
+    if (e->type == TYPE_HASH) {
+        hash_foreach(e, snap_pack_field, b);
+        return;
+    }
+    for (const QNode *n = e->list->head; n; n = n->next) {
+        buf_append(b, n->data, n->len);     // packs placed end to end are one pack
+    }
+}
+
+static void snap_put_entry(Entry *e, void *arg) {
+    SnapWriter *w = (SnapWriter *)arg;
+    if (w->failed || (e->expire_at != 0 && e->expire_at <= w->now)) {
+        return;     // an expired key that nobody has removed yet isn't worth saving
+    }
+    static const uint8_t rec_types[] = {
+        [TYPE_STRING] = SNAP_REC_STRING, [TYPE_ZSET] = SNAP_REC_ZSET,
+        [TYPE_HASH] = SNAP_REC_HASH, [TYPE_LIST] = SNAP_REC_LIST,
+    };
+    uint8_t type = rec_types[e->type];
+    int64_t expire_at = (int64_t)e->expire_at;
+    uint32_t klen = e->klen, vlen = (uint32_t)e->vlen;
+    if (e->type == TYPE_ZSET) {
+        vlen = 0;
+        for (const ZNode *x = e->zset->header->lvl[0].forward; x; x = x->lvl[0].forward) {
+            vlen += 12 + x->mlen;
+        }
+    }
+    buf_append(&w->block, &type, 1);
+    buf_append(&w->block, &expire_at, 8);
+    buf_append(&w->block, &klen, 4);
+    size_t vlen_at = w->block.end;
+    buf_append(&w->block, &vlen, 4);
+    buf_append(&w->block, e->key, klen);
+    if (e->type != TYPE_STRING && e->type != TYPE_ZSET && e->enc != ENC_PACK) {
+        // the length is only known once the pack is written
+        size_t start = w->block.end;
+        snap_pack_container(e, &w->block);
+        vlen = (uint32_t)(w->block.end - start);
+        memcpy(w->block.data + vlen_at, &vlen, 4);
+    } else if (e->type == TYPE_ZSET) {
+        for (const ZNode *x = e->zset->header->lvl[0].forward; x; x = x->lvl[0].forward) {
+            buf_append(&w->block, &x->score, 8);
+            buf_append(&w->block, &x->mlen, 4);
+            buf_append(&w->block, znode_member(x), x->mlen);
+        }
+    } else {
+        buf_append(&w->block, e->val, vlen);
+    }
+    w->count++;
+    if (buf_len(&w->block) >= SNAP_BLOCK_SIZE) {
+        snap_flush_block(w);
+    }
+}
+
+// write every shard to fd in the snapshot format; returns the bytes
+// written, or -1. The end marker makes it self-delimiting, so a full sync
+// sends it down a replica's socket as it is.
+static int64_t snapshot_write(int fd) {
+    SnapWriter w = {.fd = fd, .now = time(NULL)};
+    uint8_t header[SNAP_HEADER_SIZE] = SNAP_MAGIC;
+    uint32_t version = SNAP_VERSION;
+    uint64_t hint = 0;
+    for (uint32_t i = 0; i < nshards; i++) {
+        hint += hm_size(&shards[i].db);
+    }
+    memcpy(&header[5], &version, 3);
+    memcpy(&header[8], &hint, 8);
+    w.failed = write_full(w.fd, header, sizeof(header)) < 0;
+    w.bytes = sizeof(header);
+    for (uint32_t i = 0; i < nshards && !w.failed; i++) {
+        hm_foreach(&shards[i].db, snap_put_entry, &w);
+    }
+    if (w.count > 0) {
+        snap_flush_block(&w);
+    }
+    // the end marker: an empty block whose count is the total, checksummed itself
+    uint32_t end[3] = {0, (uint32_t)w.total, 0};
+    end[2] = crc32c_update(0, (const uint8_t *)end, 8);
+    w.failed = w.failed || write_full(w.fd, (const uint8_t *)end, sizeof(end)) < 0;
+    w.bytes += sizeof(end);
+    buf_free(&w.block);
+    return w.failed ? -1 : (int64_t)w.bytes;
+}
+
+// write every shard to path, via a temporary file renamed into place once it
+// is complete and synced; returns the file size, or -1
+static int64_t snapshot_save(const char *path) {
+    char tmp[4096];
+    snprintf(tmp, sizeof(tmp), "%s.tmp-%d", path, (int)getpid());
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return -1;
+    }
+    int64_t bytes = snapshot_write(fd);
+    bool failed = bytes < 0 || fsync(fd) < 0;
+    failed = close(fd) < 0 || failed;
+    if (failed || rename(tmp, path) < 0) {
+        unlink(tmp);
+        return -1;
+    }
+    return bytes;
+}
+
+// A loaded snapshot is decoded in two parallel passes over the mapped file.
+// First, decoders on every core claim blocks, check each block's CRC, and
+// hash its keys into hcodes[], counting keys per shard. Then one inserter per
+// shard sizes its table for exactly its count and walks the blocks again,
+// copying in its own records with entry_new + hm_insert. Every shard has
+// exactly one writer, so neither pass takes a lock.
+
+typedef struct {
+    const uint8_t *payload;
+    uint32_t len;
+    uint32_t count;
+    uint64_t first;     // number of records in the blocks before this one
+} SnapBlock;
+
+typedef struct {
+    SnapBlock *blocks;
+    size_t nblocks;
+    uint64_t *hcodes;               // per record, in file order
+    atomic_size_t next_block;       // next block a decoder claims
+    _Atomic(const char *) err;      // the first problem found
+    uint64_t shard_keys[MAX_THREADS];
+    time_t now;
+} SnapLoad;
+
+typedef struct {
+    SnapLoad *load;
+    uint32_t shard;                 // for an inserter
+    uint64_t shard_keys[MAX_THREADS];   // for a decoder: keys it saw per shard
+    uint64_t loaded;                // for an inserter: keys it inserted
+} SnapWorker;
+
+// whether a sorted set record's val is a whole number of members
+static bool snap_zset_ok(const uint8_t *p, size_t len) {
+    while (len >= 12) {
+        uint32_t mlen = 0;
+        memcpy(&mlen, p + 8, 4);
+        if (len - 12 < mlen) {
+            return false;
+        }
+        p += 12 + (size_t)mlen;
+        len -= 12 + (size_t)mlen;
+    }
+    return len == 0;
+}
+
+static void snap_load_fail(SnapLoad *l, const char *err) {
+    const char *none = NULL;
+    atomic_compare_exchange_strong(&l->err, &none, err);
+}
+
+static void *snap_decode_run(void *arg) {
+    SnapWorker *w = (SnapWorker *)arg;
+    SnapLoad *l = w->load;
+    size_t i;
+    while ((i = atomic_fetch_add(&l->next_block, 1)) < l->nblocks && !atomic_load(&l->err)) {
+        const SnapBlock *b = &l->blocks[i];
+        uint32_t crc = 0;
+        memcpy(&crc, b->payload - 4, 4);
+        if (crc32c_update(0, b->payload, b->len) != crc) {
+            snap_load_fail(l, "snapshot checksum mismatch");
+            break;
+        }
+        const uint8_t *p = b->payload, *end = b->payload + b->len;
+        for (uint32_t j = 0; j < b->count; j++) {
+            uint32_t klen = 0, vlen = 0;
+            if (end - p < 17 || p[0] > SNAP_REC_LIST) {
+                break;
+            }
+            memcpy(&klen, p + 9, 4);
+            memcpy(&vlen, p + 13, 4);
+            size_t count = 0;
+            uint32_t longest = 0;
+            if ((size_t)(end - p - 17) < (size_t)klen + vlen
+                    || (p[0] == SNAP_REC_ZSET && !snap_zset_ok(p + 17 + klen, vlen))
+                    || (p[0] >= SNAP_REC_HASH && !pack_check(p + 17 + klen, vlen, &count, &longest))
+                    || (p[0] == SNAP_REC_HASH && count % 2 != 0)) {
+                break;
+            }
+            uint64_t hcode = hash_bytes(p + 17, klen);
+            l->hcodes[b->first + j] = hcode;
+            w->shard_keys[shard_idx(hcode)]++;
+            p += 17 + (size_t)klen + vlen;
+        }
+        if (p != end) {
+            snap_load_fail(l, "malformed snapshot record");
+            break;
+        }
+    }
+    return NULL;
+}
+
+// the entry for a hash or list record, packed as it is in the file if that
+// is within the limits, else in its container
+static Entry *snap_new_collection(Shard *sh, uint8_t type, const uint8_t *key, uint32_t klen, uint32_t vlen, uint64_t hcode) {
+    const uint8_t *pack = key + klen, *end = pack + vlen, *data = NULL, *val = NULL;
+    size_t count = 0;
+    uint32_t longest = 0, len = 0, n = 0;
+    pack_check(pack, vlen, &count, &longest);
+    bool packed = type == SNAP_REC_HASH
+        ? count / 2 <= config.hash_pack_entries && longest <= config.hash_pack_value
+        : count <= config.list_pack_entries && longest <= config.list_pack_value;
+    Entry *e = entry_new(sh, key, klen, pack, packed ? vlen : 0, hcode);
+    e->type = type == SNAP_REC_HASH ? TYPE_HASH : TYPE_LIST;
+    if (packed) {
+        return e;
+    }
+    if (type == SNAP_REC_HASH) {
+        e->enc = ENC_TABLE;
+        e->hash = hashobj_new(&sh->mem_used);
+        while (pack < end) {
+            pack = pack_next(pack, &data, &len);
+            pack = pack_next(pack, &val, &n);
+            hashobj_set(e->hash, data, len, val, n);
+        }
+    } else {
+        e->enc = ENC_QUICKLIST;
+        e->list = qlist_new(&sh->mem_used);
+        while (pack < end) {
+            pack = pack_next(pack, &data, &len);
+            qlist_push(e->list, false, data, len);
+        }
+    }
+    return e;
+}
+
+static void *snap_insert_run(void *arg) {
+    SnapWorker *w = (SnapWorker *)arg;
+    SnapLoad *l = w->load;
+    Shard *sh = &shards[w->shard];
+    hm_reserve(&sh->db, l->shard_keys[w->shard]);
+    for (size_t i = 0; i < l->nblocks; i++) {
+        const SnapBlock *b = &l->blocks[i];
+        const uint8_t *p = b->payload;
+        for (uint32_t j = 0; j < b->count; j++) {
+            int64_t expire_at = 0;
+            uint32_t klen = 0, vlen = 0;
+            uint8_t type = p[0];
+            memcpy(&expire_at, p + 1, 8);
+            memcpy(&klen, p + 9, 4);
+            memcpy(&vlen, p + 13, 4);
+            const uint8_t *key = p + 17;
+            p += 17 + (size_t)klen + vlen;
+            uint64_t hcode = l->hcodes[b->first + j];
+            if (shard_idx(hcode) != w->shard || (expire_at != 0 && expire_at <= l->now)) {
+                continue;   // another inserter's, or expired while the server was down
+            }
+            // keys in a snapshot are unique, so there's no need to look them up first
+            Entry *e = NULL;
+            if (type == SNAP_REC_ZSET) {
+                e = entry_new(sh, key, klen, key + klen, 0, hcode);
+                e->type = TYPE_ZSET;
+                e->zset = zset_new(&sh->mem_used);
+                for (const uint8_t *m = key + klen; m < key + klen + vlen; ) {
+                    double score = 0;
+                    uint32_t mlen = 0;
+                    memcpy(&score, m, 8);
+                    memcpy(&mlen, m + 8, 4);
+                    zset_add(e->zset, score, m + 12, mlen);
+                    m += 12 + (size_t)mlen;
+                }
+            } else if (type == SNAP_REC_HASH || type == SNAP_REC_LIST) {
+                e = snap_new_collection(sh, type, key, klen, vlen, hcode);
+            } else {
+                e = entry_new(sh, key, klen, key + klen, vlen, hcode);
+            }
+            hm_insert(&sh->db, e);
+            if (expire_at != 0) {
+                entry_set_expire(e, (time_t)expire_at);
+            }
+            w->loaded++;
+        }
+    }
+    return NULL;
+}
+
+// run fn on n threads, one per worker, and wait for them all
+static void snap_run_workers(void *(*fn)(void *), SnapWorker *ws, uint32_t n) {
+    pthread_t tids[MAX_THREADS];
+    for (uint32_t i = 1; i < n; i++) {
+        if (pthread_create(&tids[i], NULL, fn, &ws[i]) != 0) {
+            die("pthread_create()");
+        }
+    }
+    fn(&ws[0]);
+    for (uint32_t i = 1; i < n; i++) {
+        pthread_join(tids[i], NULL);
+    }
+}
+
+// index the blocks of the mapped file; NULL if they don't add up
+static const char *snap_index_blocks(const uint8_t *data, size_t size, SnapLoad *l) {
+    size_t pos = SNAP_HEADER_SIZE, cap = 0;
+    uint64_t records = 0;
+    while (1) {
+        uint32_t hdr[3];
+        if (size - pos < SNAP_BLOCK_HEADER_SIZE) {
+            return "snapshot is truncated";
+        }
+        memcpy(hdr, data + pos, sizeof(hdr));
+        pos += SNAP_BLOCK_HEADER_SIZE;
+        if (hdr[0] == 0) {  // the end marker
+            if (hdr[2] != crc32c_update(0, (const uint8_t *)hdr, 8) || hdr[1] != (uint32_t)records) {
+                return "snapshot end marker does not match its contents";
+            }
+            return NULL;
+        }
+        if (size - pos < hdr[0]) {
+            return "snapshot is truncated";
+        }
+        if (l->nblocks == cap) {
+            cap = cap ? cap * 2 : 1024;
+            l->blocks = realloc(l->blocks, cap * sizeof(SnapBlock));
+            if (!l->blocks) {
+                die("realloc()");
+            }
+        }
+        l->blocks[l->nblocks++] = (SnapBlock){data + pos, hdr[0], hdr[1], records};
+        records += hdr[1];
+        pos += hdr[0];
+    }
+}
+
+// load path into the (empty) keyspace, using up to nworkers threads to
+// decode. Returns the number of keys loaded, 0 if there is no file, or -1
+// with *err set if the file is unusable.
+static int64_t snapshot_load(const char *path, uint32_t nworkers, const char **err) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        if (errno == ENOENT) {
+            return 0;
+        }
+        *err = strerror(errno);
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size < SNAP_HEADER_SIZE) {
+        close(fd);
+        *err = "not a snapshot file";
+        return -1;
+    }
+    size_t size = (size_t)st.st_size;
+    const uint8_t *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        *err = strerror(errno);
+        return -1;
+    }
+    madvise((void *)data, size, MADV_WILLNEED);     // start reading ahead on every block at once
+
+    uint32_t version = 0;
+    memcpy(&version, data + 5, 3);
+    SnapLoad l = {.now = time(NULL)};
+    *err = NULL;
+    if (memcmp(data, SNAP_MAGIC, 5) != 0) {
+        *err = "not a snapshot file";
+    } else if (version != SNAP_VERSION) {
+        *err = "unsupported snapshot version";
+    } else {
+        *err = snap_index_blocks(data, size, &l);
+    }
+    uint64_t records = l.nblocks ? l.blocks[l.nblocks - 1].first + l.blocks[l.nblocks - 1].count : 0;
+    int64_t loaded = 0;
+    if (!*err && records > 0) {
+        l.hcodes = malloc(records * sizeof(uint64_t));
+        if (!l.hcodes) {
+            die("malloc()");
+        }
+        SnapWorker ws[MAX_THREADS] = {0};
+        uint32_t n = nworkers < 1 ? 1 : nworkers > MAX_THREADS ? MAX_THREADS : nworkers;
+        for (uint32_t i = 0; i < n; i++) {
+            ws[i].load = &l;
+        }
+        snap_run_workers(snap_decode_run, ws, n);
+        *err = atomic_load(&l.err);
+        for (uint32_t i = 0; i < n; i++) {
+            for (uint32_t s = 0; s < nshards; s++) {
+                l.shard_keys[s] += ws[i].shard_keys[s];
+            }
+        }
+        if (!*err) {
+            memset(ws, 0, sizeof(ws));
+            for (uint32_t s = 0; s < nshards; s++) {
+                ws[s].load = &l;
+                ws[s].shard = s;
+            }
+            snap_run_workers(snap_insert_run, ws, nshards);
+            for (uint32_t s = 0; s < nshards; s++) {
+                loaded += (int64_t)ws[s].loaded;
+            }
+        }
+        free(l.hcodes);
+    }
+    free(l.blocks);
+    munmap((void *)data, size);
+    return *err ? -1 : loaded;
+}
+
+// BGSAVE: fork, and let the child write the snapshot from its copy-on-write
+// view of memory. The caller has every other thread parked, so the child
+// sees a consistent keyspace and no thread is mid-malloc when it forks.
+static int snapshot_bgsave(const char *path) {
+    pid_t pid = fork();
+    if (pid < 0) {
+        return -1;
+    }
+    if (pid == 0) {
+        _exit(snapshot_save(path) < 0 ? 1 : 0);
+    }
+    persist.child = pid;
+    persist.child_start_ms = get_wall_ms();
+    return 0;
+}
+
+// ---- request parsing and command dispatch ----
+
+// a single parsed argument: a pointer into the request buffer + its length
+typedef struct {
+    uint32_t len;
+    const uint8_t *data;
+} Arg;
+
+
+
+// parse a request body of the form [nstr][len1][str1][len2][str2]...
+// returns 0 on success, -1 if the body is malformed
+static int32_t parse_req(const uint8_t *data, size_t len, uint32_t *out_nstr, Arg *out_args, uint32_t max_args) {
+    if (len < 4) {
+        return -1;
+    }
+    uint32_t nstr = 0;
+    memcpy(&nstr, data, 4);
+    if (nstr > max_args) {
+        return -1;
+    }
+
+    size_t pos = 4;
+    for (uint32_t i = 0; i < nstr; i++) {
+        if (pos + 4 > len) {
+            return -1;
+        }
+        uint32_t slen = 0;
+        memcpy(&slen, &data[pos], 4);
+        pos += 4;
+        if (pos + slen > len) {   // string would run past the end of the body
+            return -1;
+        }
+        out_args[i].len = slen;
+        out_args[i].data = &data[pos];
+        pos += slen;
+    }
+    if (pos != len) {   // trailing bytes that don't belong to any string
+        return -1;
+    }
+    *out_nstr = nstr;
+    return 0;
+}
+
+// ---- command table ----
+// Every command is described once in commands[], indexed by its CMD_* id:
+// its arity, flags and which arguments are keys. Dispatch (cmd_call), request
+// routing, --maxmemory, the per-command statistics and COMMAND INFO all work
+// from this table, so a name is resolved to an id once per request, through
+// cmd_lookup(), and never compared against the other names.
+
+enum {
+    CMD_GET, CMD_MGET, CMD_SET, CMD_MSET, CMD_DEL, CMD_EXPIRE, CMD_EXPIREAT, CMD_TTL,
+    CMD_ZADD, CMD_ZREM, CMD_ZREMRANGEBYSCORE, CMD_ZSCORE, CMD_ZRANK, CMD_ZCARD, CMD_ZRANGE, CMD_ZRANGEBYSCORE,
+    CMD_HSET, CMD_HGET, CMD_HDEL, CMD_HGETALL, CMD_HLEN,
+    CMD_LPUSH, CMD_RPUSH, CMD_LPOP, CMD_RPOP, CMD_BLPOP, CMD_BRPOP, CMD_LRANGE, CMD_LLEN,
+    CMD_INFO, CMD_LATENCY, CMD_SLABSTATS, CMD_SAVE, CMD_BGSAVE, CMD_BGREWRITEAOF, CMD_LOGLEVEL,
+    CMD_REPLICAOF, CMD_PSYNC, CMD_COMMAND,
+    CMD_COUNT,
+};
+
+#define CMD_NONE UINT32_MAX     // cmd_lookup() of a name that is no command
+
+// Command.flags; cmd_flag_names gives them in bit order for COMMAND INFO
+#define CMD_WRITE (1u << 0)     // may change the keyspace, and is logged to the AOF if it does; refused by a replica
+#define CMD_READONLY (1u << 1)
+#define CMD_DENYOOM (1u << 2)   // may need more memory: refused when over --maxmemory with nothing left to evict
+#define CMD_FAST (1u << 3)      // O(1) or O(log n) in the size of the value it touches
+#define CMD_BLOCKING (1u << 4)  // may park the client
+#define CMD_ADMIN (1u << 5)     // changes or persists server state rather than data
+#define CMD_GLOBAL (1u << 6)    // reads every shard: runs on thread 0 with the others parked
+
+static const char *const cmd_flag_names[] = {"write", "readonly", "denyoom", "fast", "blocking", "admin", "global"};
+
+typedef struct {
+    const char *name;
+    int32_t arity;      // argument count, name included; -n for at least n
+    uint32_t flags;     // CMD_*
+    // the arguments that are keys: first_key, every key_step-th one after
+    // it, up to last_key, which counts back from the end when negative
+    // (-1 is the last argument); first_key is 0 for a command with no keys
+    uint32_t first_key;
+    int32_t last_key;
+    uint32_t key_step;
+} Command;
+
+static const Command commands[CMD_COUNT] = {
+    [CMD_GET] = {"get", 2, CMD_READONLY | CMD_FAST, 1, 1, 1},
+    [CMD_MGET] = {"mget", -2, CMD_READONLY | CMD_FAST, 1, -1, 1},
+    [CMD_SET] = {"set", 3, CMD_WRITE | CMD_DENYOOM, 1, 1, 1},
+    [CMD_MSET] = {"mset", -3, CMD_WRITE | CMD_DENYOOM, 1, -1, 2},
+    [CMD_DEL] = {"del", -2, CMD_WRITE, 1, -1, 1},
+    [CMD_EXPIRE] = {"expire", 3, CMD_WRITE | CMD_FAST, 1, 1, 1},
+    [CMD_EXPIREAT] = {"expireat", 3, CMD_WRITE | CMD_FAST, 1, 1, 1},
+    [CMD_TTL] = {"ttl", 2, CMD_READONLY | CMD_FAST, 1, 1, 1},
+    [CMD_ZADD] = {"zadd", -4, CMD_WRITE | CMD_DENYOOM | CMD_FAST, 1, 1, 1},
+    [CMD_ZREM] = {"zrem", -3, CMD_WRITE | CMD_FAST, 1, 1, 1},
+    [CMD_ZREMRANGEBYSCORE] = {"zremrangebyscore", 4, CMD_WRITE, 1, 1, 1},
+    [CMD_ZSCORE] = {"zscore", 3, CMD_READONLY | CMD_FAST, 1, 1, 1},
+    [CMD_ZRANK] = {"zrank", 3, CMD_READONLY | CMD_FAST, 1, 1, 1},
+    [CMD_ZCARD] = {"zcard", 2, CMD_READONLY | CMD_FAST, 1, 1, 1},
+    [CMD_ZRANGE] = {"zrange", -4, CMD_READONLY, 1, 1, 1},
+    [CMD_ZRANGEBYSCORE] = {"zrangebyscore", -4, CMD_READONLY, 1, 1, 1},
+    [CMD_HSET] = {"hset", -4, CMD_WRITE | CMD_DENYOOM | CMD_FAST, 1, 1, 1},
+    [CMD_HGET] = {"hget", 3, CMD_READONLY | CMD_FAST, 1, 1, 1},
+    [CMD_HDEL] = {"hdel", -3, CMD_WRITE | CMD_FAST, 1, 1, 1},
+    [CMD_HGETALL] = {"hgetall", 2, CMD_READONLY, 1, 1, 1},
+    [CMD_HLEN] = {"hlen", 2, CMD_READONLY | CMD_FAST, 1, 1, 1},
+    [CMD_LPUSH] = {"lpush", -3, CMD_WRITE | CMD_DENYOOM | CMD_FAST, 1, 1, 1},
+    [CMD_RPUSH] = {"rpush", -3, CMD_WRITE | CMD_DENYOOM | CMD_FAST, 1, 1, 1},
+    [CMD_LPOP] = {"lpop", 2, CMD_WRITE | CMD_FAST, 1, 1, 1},
+    [CMD_RPOP] = {"rpop", 2, CMD_WRITE | CMD_FAST, 1, 1, 1},
+    [CMD_BLPOP] = {"blpop", -3, CMD_WRITE | CMD_BLOCKING, 1, -2, 1},
+    [CMD_BRPOP] = {"brpop", -3, CMD_WRITE | CMD_BLOCKING, 1, -2, 1},
+    [CMD_LRANGE] = {"lrange", 4, CMD_READONLY, 1, 1, 1},
+    [CMD_LLEN] = {"llen", 2, CMD_READONLY | CMD_FAST, 1, 1, 1},
+    [CMD_INFO] = {"info", -1, CMD_GLOBAL, 0, 0, 0},
+    [CMD_LATENCY] = {"latency", -2, CMD_ADMIN | CMD_GLOBAL, 0, 0, 0},
+    [CMD_SLABSTATS] = {"slabstats", 1, CMD_GLOBAL, 0, 0, 0},
+    [CMD_SAVE] = {"save", 1, CMD_ADMIN | CMD_GLOBAL, 0, 0, 0},
+    [CMD_BGSAVE] = {"bgsave", 1, CMD_ADMIN | CMD_GLOBAL, 0, 0, 0},
+    [CMD_BGREWRITEAOF] = {"bgrewriteaof", 1, CMD_ADMIN | CMD_GLOBAL, 0, 0, 0},
+    [CMD_LOGLEVEL] = {"loglevel", -1, CMD_ADMIN, 0, 0, 0},
+    [CMD_REPLICAOF] = {"replicaof", 3, CMD_ADMIN | CMD_GLOBAL, 0, 0, 0},
+    [CMD_PSYNC] = {"psync", 3, CMD_ADMIN, 0, 0, 0},
+    [CMD_COMMAND] = {"command", -1, 0, 0, 0, 0},
+};
+
+#define CMD_INDEX_SIZE 256      // slots in the name index, a power of two well above CMD_COUNT
+
+// A perfect hash of the names: cmd_index_build() tries seeds until every
+// name has a slot of its own, so a lookup hashes the name, reads one slot
+// and compares one name. Slots hold a command id + 1, 0 for no command.
+static uint8_t cmd_index[CMD_INDEX_SIZE];
+static uint32_t cmd_index_seed;
+static pthread_once_t cmd_index_once = PTHREAD_ONCE_INIT;
+
+// case-insensitive FNV-1a of a name, finished so the seed reaches every bit
+static uint32_t cmd_name_hash(const uint8_t *name, size_t len, uint32_t seed) {
+    uint32_t h = 2166136261u ^ seed;
+    for (size_t i = 0; i < len; i++) {
+        h ^= name[i] | 0x20;    // folds case for letters; a mix-up elsewhere only costs a compare
+        h *= 16777619u;
+    }
+    h ^= h >> 15;
+    h *= 0x2c1b3c6du;
+    return h ^ h >> 12;
+}
+
+static void cmd_index_build(void) {
+    for (uint32_t seed = 0; seed < 1000000; seed++) {
+        memset(cmd_index, 0, sizeof(cmd_index));
+        uint32_t id = 0;
+        for (; id < CMD_COUNT; id++) {
+            const char *name = commands[id].name;
+            uint32_t i = cmd_name_hash((const uint8_t *)name, strlen(name), seed) & (CMD_INDEX_SIZE - 1);
+            if (cmd_index[i]) {
+                break;
+            }
+            cmd_index[i] = (uint8_t)(id + 1);
+        }
+        if (id == CMD_COUNT) {
+            cmd_index_seed = seed;
+            return;
+        }
+    }
+    fprintf(stderr, "no perfect hash for the command names; raise CMD_INDEX_SIZE\n");
+    exit(EXIT_FAILURE);
+}
+
+// the command a request's first argument names, or CMD_NONE
+static uint32_t cmd_lookup(const Arg *a) {
+    pthread_once(&cmd_index_once, cmd_index_build);
+    uint8_t slot = cmd_index[cmd_name_hash(a->data, a->len, cmd_index_seed) & (CMD_INDEX_SIZE - 1)];
+    if (slot == 0) {
+        return CMD_NONE;
+    }
+    const char *name = commands[slot - 1].name;
+    if (strlen(name) != a->len || strncasecmp((const char *)a->data, name, a->len) != 0) {
+        return CMD_NONE;
+    }
+    return slot - 1u;
+}
+
+// the range of arguments a request for c has keys in: false if it has none
+// (or is too short to), else [*first, *last], every key_step-th one
+static bool cmd_key_range(const Command *c, uint32_t nstr, uint32_t *first, uint32_t *last) {
+    if (c->first_key == 0 || c->first_key >= nstr) {
+        return false;
+    }
+    int64_t end = c->last_key < 0 ? (int64_t)nstr + c->last_key : c->last_key;
+    if (end < c->first_key || end >= nstr) {
+        return false;
+    }
+    *first = c->first_key;
+    *last = (uint32_t)end;
+    return true;
+}
+
+// ---- command statistics ----
+// Each thread counts the commands it runs, and how long they took, in its
+// own ThreadStats: recording one is a few plain increments, with no locks or
+// atomics. INFO and LATENCY read (and LATENCY RESET clears) every thread's
+// while the others are parked, since they run across all shards.
+
+#define STATS_TICK_MS 1000      // how often each thread works out its ops/sec
+
+typedef struct {
+    uint64_t calls;
+    uint64_t ticks;     // spent running them
+    Hist hist;          // of single calls
+} CmdStats;
+
+typedef struct {
+    _Alignas(64) CmdStats cmds[CMD_COUNT];  // aligned so threads never share a cache line
+    Hist read_reply;    // from reading a request to writing its reply, for this thread's connections
+    uint64_t tick_ms;   // when ops_per_sec was last worked out
+    uint64_t calls_then[CMD_COUNT];     // each command's calls at that point
+    uint32_t ops_per_sec[CMD_COUNT];    // over the second before it
+} ThreadStats;
+
+static ThreadStats thread_stats[MAX_THREADS];
+static _Thread_local uint32_t stats_slot;   // the running thread's, set by loop_run(); 0 for main()
+
+// note one run of cmd that took the given ticks, on the running thread
+static void stats_record(uint32_t cmd, uint64_t ticks) {
+    CmdStats *cs = &thread_stats[stats_slot].cmds[cmd];
+    cs->calls++;
+    cs->ticks += ticks;
+    hist_add(&cs->hist, ticks, 1);
+}
+
+// called by every loop iteration: once a second, the calls each command got
+// since the last time become its ops/sec
+static void stats_tick(ThreadStats *ts, uint64_t now_ms) {
+    uint64_t elapsed = now_ms - ts->tick_ms;
+    if (elapsed < STATS_TICK_MS) {
+        return;
+    }
+    for (uint32_t c = 0; c < CMD_COUNT; c++) {
+        ts->ops_per_sec[c] = (uint32_t)((ts->cmds[c].calls - ts->calls_then[c]) * 1000 / elapsed);
+        ts->calls_then[c] = ts->cmds[c].calls;
+    }
+    ts->tick_ms = now_ms;
+}
+
+// cmd's counters summed over every thread, ops/sec included
+static void stats_sum(uint32_t cmd, CmdStats *sum, uint64_t *ops_per_sec) {
+    memset(sum, 0, sizeof(*sum));
+    *ops_per_sec = 0;
+    for (uint32_t i = 0; i < nloops; i++) {
+        const CmdStats *cs = &thread_stats[i].cmds[cmd];
+        sum->calls += cs->calls;
+        sum->ticks += cs->ticks;
+        hist_merge(&sum->hist, &cs->hist);
+        *ops_per_sec += thread_stats[i].ops_per_sec[cmd];
+    }
+}
+
+static void stats_read_reply_sum(Hist *sum) {
+    memset(sum, 0, sizeof(*sum));
+    for (uint32_t i = 0; i < nloops; i++) {
+        hist_merge(sum, &thread_stats[i].read_reply);
+    }
+}
+
+static double ticks_to_us(uint64_t ticks) {
+    return (double)ticks / ticks_per_ns() / 1000;
+}
+
+// ---- replication backlog ----
+// A primary sends its replicas the stream of writes the AOF gets, in the
+// same framing. Once the first replica connects, every loop's batch is also
+// copied into a circular backlog of --repl-backlog-size bytes, and into each
+// replica's own pending buffer, which thread 0 drains into its socket. Each
+// byte of the stream has an offset within this server's history, which is
+// named by a random 40-digit replication id. A replica that reconnects asks
+// to carry on from the history and offset it had reached; if those bytes are
+// still in the backlog it gets only them (a partial resync), otherwise a
+// snapshot of the whole keyspace first (a full resync). So the backlog is
+// only the window for reconnecting: a connected replica that is slow to read
+// is limited by --repl-buffer-limit instead. See the replication section for
+// the connections at either end.
+
+#define REPL_BACKLOG_MIN (16 * 1024)
+#define REPL_ID_LEN 40
+#define REPL_SEND_CHUNK (256 * 1024)    // stream bytes queued for a replica at a time
+#define REPL_ACK_MAX 64                 // longest request a replica sends, a REPLCONF ACK
+#define REPL_ACK_INTERVAL_MS 1000
+#define REPL_RETRY_MS 1000              // wait between attempts to reach the primary
+#define REPL_SYNC_TIMEOUT_S 60          // socket timeout while a full sync is sent or received
+
+// a replica's link to its primary
+enum {
+    REPL_LINK_NONE = 0,     // not a replica
+    REPL_LINK_CONNECT = 1,  // waiting to connect, at retry_ms
+    REPL_LINK_SYNCING = 2,  // the replication thread is connecting and syncing
+    REPL_LINK_UP = 3,       // link is applying the stream
+};
+
+static struct {
+    // as a primary. The backlog pointer is only set with every other thread
+    // parked, so loops test it without mu; mu guards its bytes and offsets,
+    // and the replicas list, which only thread 0 changes.
+    char replid[REPL_ID_LEN + 1];
+    pthread_mutex_t mu;
+    uint8_t *backlog;           // NULL until the first replica connects
+    uint64_t offset;            // stream bytes so far; byte o is at backlog[o % size]
+    uint64_t backlog_off;       // the oldest byte still in the backlog
+    struct Conn **replicas;     // connections in STATE_REPLICA, fed with every append
+    size_t nreplicas, replicas_cap;
+    // the rest is thread 0's
+    uint64_t sync_full, sync_partial_ok, sync_partial_err;
+    // as a replica
+    char primary_host[256];
+    int primary_port;           // 0 when not a replica
+    int link_state;             // REPL_LINK_*
+    uint64_t link_gen;          // bumped by REPLICAOF, so a sync with the old primary is thrown away
+    bool relink;                // REPLICAOF changed the primary: drop the current link
+    struct Conn *link;          // the connection to the primary, while REPL_LINK_UP
+    char link_replid[REPL_ID_LEN + 1];  // the primary's history we hold a copy of, "?" for none
+    uint64_t link_offset;       // how much of it has been applied
+    uint64_t retry_ms;          // when to try connecting again
+    uint64_t ack_ms;            // when the last REPLCONF ACK was queued
+    Buf ack_buf;                // the part of it not sent yet
+} repl = {.mu = PTHREAD_MUTEX_INITIALIZER, .link_replid = "?"};
+
+// a fresh replication id: 40 hex digits
+static void repl_new_id(char *id) {
+    uint8_t raw[REPL_ID_LEN / 2];
+    int fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || read(fd, raw, sizeof(raw)) != (ssize_t)sizeof(raw)) {
+        uint64_t x = get_wall_ms() ^ ((uint64_t)getpid() << 32) ^ ticks_now();
+        for (size_t i = 0; i < sizeof(raw); i++) {
+            x = hash_mix(x ^ HASH_SECRET0, HASH_SECRET1);
+            raw[i] = (uint8_t)x;
+        }
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    for (size_t i = 0; i < sizeof(raw); i++) {
+        snprintf(&id[2 * i], 3, "%02x", raw[i]);
+    }
+}
+
+// start keeping the stream; called with every other thread parked
+static void repl_backlog_create(void) {
+    repl.backlog = malloc(config.repl_backlog_size);
+    if (!repl.backlog) {
+        die("malloc()");
+    }
+    repl.backlog_off = repl.offset;
+}
+
+// append a loop's batch to the stream: to the backlog, and to every
+// replica's pending buffer unless that would pass the limit
+static void repl_backlog_append(const uint8_t *data, size_t len) {
+    size_t size = config.repl_backlog_size;
+    pthread_mutex_lock(&repl.mu);
+    for (size_t i = 0; i < repl.nreplicas; i++) {
+        struct Conn *conn = repl.replicas[i];
+        if (conn->repl_overflow || buf_len(&conn->repl_pending) + len > config.repl_buffer_limit) {
+            conn->repl_overflow = true;     // thread 0 drops it
+            continue;
+        }
+        buf_append(&conn->repl_pending, data, len);
+    }
+    repl.offset += len;
+    if (len > size) {   // only its tail fits
+        data += len - size;
+        len = size;
+    }
+    size_t at = (size_t)((repl.offset - len) % size);
+    size_t first = len < size - at ? len : size - at;
+    memcpy(repl.backlog + at, data, first);
+    memcpy(repl.backlog, data + first, len - first);
+    if (repl.offset - repl.backlog_off > size) {
+        repl.backlog_off = repl.offset - size;
+    }
+    pthread_mutex_unlock(&repl.mu);
+}
+
+// queue up to max bytes of the stream from offset from onto out: the number
+// queued, 0 when there is nothing new, or -1 when from is not in the
+// backlog. Called with repl.mu held.
+static int64_t repl_backlog_copy(uint64_t from, Out *out, size_t max) {
+    int64_t n = -1;
+    if (repl.backlog && from >= repl.backlog_off && from <= repl.offset) {
+        size_t size = config.repl_backlog_size;
+        size_t len = repl.offset - from < max ? (size_t)(repl.offset - from) : max;
+        size_t at = (size_t)(from % size);
+        size_t first = len < size - at ? len : size - at;
+        out_append(out, repl.backlog + at, first);
+        out_append(out, repl.backlog, len - first);
+        n = (int64_t)len;
+    }
+    return n;
+}
+
+// start feeding conn the stream; called with repl.mu held
+static void repl_add_replica(struct Conn *conn) {
+    if (repl.nreplicas == repl.replicas_cap) {
+        repl.replicas_cap = repl.replicas_cap ? repl.replicas_cap * 2 : 4;
+        repl.replicas = realloc(repl.replicas, repl.replicas_cap * sizeof(struct Conn *));
+        if (!repl.replicas) {
+            die("realloc()");
+        }
+    }
+    repl.replicas[repl.nreplicas++] = conn;
+}
+
+// ---- append-only file ----
+// With --aof FILE every write is also appended to FILE, in the same
+// [len][nstr][len1][str1]... framing clients send, so replaying it at startup
+// is just running the requests again. EXPIRE is logged as EXPIREAT with an
+// absolute deadline, which makes every logged command idempotent and keeps a
+// replayed TTL counting from when it was set, not from the restart.
+//
+// A write is first appended to its shard's aof_buf. At the end of each event
+// loop iteration the owning thread appends the whole buffer with one write(),
+// so a burst of writes costs one system call. fsync is up to --aof-fsync:
+//   always   replies wait until their batch is on disk. A background thread
+//            runs fdatasync for everything written so far and then releases
+//            the held replies, so one fsync covers every loop's batch.
+//   everysec the background thread syncs once a second; a crash can lose
+//            about the last second of writes
+//   no       the kernel flushes whenever it likes
+//
+// BGREWRITEAOF forks a child that writes a compact log (one SET, plus an
+// EXPIREAT, per live key) to FILE.rewrite, while the parent keeps appending
+// to the old log and copies every batch written since the fork into
+// rewrite_buf. When the child is done the parent appends rewrite_buf to the
+// new file and dup2()s it over the old one, so the fd everyone uses never
+// changes.
+
+enum {
+    AOF_FSYNC_NO = 0,
+    AOF_FSYNC_EVERYSEC = 1,
+    AOF_FSYNC_ALWAYS = 2,
+};
+
+static const char *aof_fsync_names[] = {"no", "everysec", "always"};
+
+static struct {
+    int fd;                         // open with O_APPEND, or -1 when the AOF is off
+    int fsync;                      // AOF_FSYNC_*
+    pthread_mutex_t mu;             // serialises appends with each other and with a rewrite swap
+    pthread_cond_t cv;              // wakes the fsync thread when a batch needs syncing
+    uint64_t written;               // batches appended so far, guarded by mu
+    atomic_uint_fast64_t synced;    // batches known to be on disk
+    atomic_uint_fast64_t fsyncs;    // fdatasync calls made
+    bool rewriting;                 // a rewrite child runs; guarded by mu
+    Buf rewrite_buf;                // batches appended since it forked; guarded by mu
+} aof = {.fd = -1, .fsync = AOF_FSYNC_EVERYSEC, .mu = PTHREAD_MUTEX_INITIALIZER, .cv = PTHREAD_COND_INITIALIZER};
+
+static int aof_fsync_parse(const char *s) {
+    for (int i = 0; i < 3; i++) {
+        if (strcmp(s, aof_fsync_names[i]) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// append one command to b as a request message
+static void aof_append_cmd(Buf *b, const Arg *args, uint32_t nstr) {
+    uint32_t len = 4;
+    for (uint32_t i = 0; i < nstr; i++) {
+        len += 4 + args[i].len;
+    }
+    buf_append(b, &len, 4);
+    buf_append(b, &nstr, 4);
+    for (uint32_t i = 0; i < nstr; i++) {
+        buf_append(b, &args[i].len, 4);
+        buf_append(b, args[i].data, args[i].len);
+    }
+}
+
+// log a write that has just been applied, for the AOF and any replicas;
+// args[1] is its key
+static void aof_feed(const Arg *args, uint32_t nstr) {
+    if (aof.fd < 0 && !repl.backlog) {
+        return;
+    }
+    aof_append_cmd(&shard_of(hash_bytes(args[1].data, args[1].len))->aof_buf, args, nstr);
+}
+
+// log EXPIREAT key at, whatever form the command that set the TTL took
+static void aof_feed_expireat(const Arg *key, time_t at) {
+    char text[24];
+    int n = snprintf(text, sizeof(text), "%lld", (long long)at);
+    Arg args[3] = {{8, (const uint8_t *)"expireat"}, *key, {(uint32_t)n, (const uint8_t *)text}};
+    aof_feed(args, 3);
+}
+
+// append this loop's shard's batch to the replication backlog and to the
+// file. Under always, the loop's replies are held until aof.synced reaches
+// the returned batch number.
+static void aof_write_batch(Loop *loop) {
+    Shard *sh = &shards[loop->id];
+    if (buf_len(&sh->aof_buf) == 0) {
+        return;
+    }
+    if (repl.backlog) {
+        repl_backlog_append(sh->aof_buf.data + sh->aof_buf.start, buf_len(&sh->aof_buf));
+    }
+    if (aof.fd < 0) {
+        buf_consume(&sh->aof_buf, buf_len(&sh->aof_buf));
+        buf_shrink(&sh->aof_buf, false);
+        return;
+    }
+    pthread_mutex_lock(&aof.mu);
+    if (write_full(aof.fd, sh->aof_buf.data + sh->aof_buf.start, buf_len(&sh->aof_buf)) < 0) {
+        die("write() to the AOF");  // carrying on would acknowledge writes that aren't logged
+    }
+    if (aof.rewriting) {
+        // the child already has whatever was buffered when it forked
+        buf_append(&aof.rewrite_buf, sh->aof_buf.data + sh->aof_buf.start + sh->aof_rewrite_skip,
+            buf_len(&sh->aof_buf) - sh->aof_rewrite_skip);
+    }
+    sh->aof_rewrite_skip = 0;
+    loop->aof_wait_seq = ++aof.written;
+    if (aof.fsync == AOF_FSYNC_ALWAYS) {
+        pthread_cond_signal(&aof.cv);
+    }
+    pthread_mutex_unlock(&aof.mu);
+    buf_consume(&sh->aof_buf, buf_len(&sh->aof_buf));
+    buf_shrink(&sh->aof_buf, false);
+}
+
+// whether replies leaving this loop must wait for an fsync: under always,
+// while its shard has writes that are not on disk yet
+static bool aof_must_hold(const Loop *loop) {
+    return aof.fsync == AOF_FSYNC_ALWAYS && aof.fd >= 0
+        && (buf_len(&shards[loop->id].aof_buf) > 0 || atomic_load(&aof.synced) < loop->aof_wait_seq);
+}
+
+typedef struct {
+    int fd;
+    Buf out;
+    time_t now;
+    bool failed;
+} AofWriter;
+
+#define AOF_BATCH 64   // members, fields or elements per command when a rewrite writes out a collection
+
+// a sorted set as ZADDs of up to AOF_BATCH members each
+static void aof_put_zset(AofWriter *w, const Arg *key, const ZSet *zs) {
+    Arg zadd[2 + 2 * AOF_BATCH] = {{4, (const uint8_t *)"zadd"}, *key};
+    char scores[AOF_BATCH][32];
+    uint32_t n = 0;
+    for (const ZNode *x = zs->header->lvl[0].forward; x; x = x->lvl[0].forward) {
+        int len = snprintf(scores[n], sizeof(scores[n]), "%.17g", x->score);
+        zadd[2 + 2 * n] = (Arg){(uint32_t)len, (const uint8_t *)scores[n]};
+        zadd[3 + 2 * n] = (Arg){x->mlen, znode_member(x)};
+        if (++n == AOF_BATCH || !x->lvl[0].forward) {
+            aof_append_cmd(&w->out, zadd, 2 + 2 * n);
+            n = 0;
+        }
+    }
+}
+
+// a hash or list as HSETs or RPUSHes, filled in by the foreach callbacks
+typedef struct {
+    Buf *out;
+    Arg cmd[2 + 2 * AOF_BATCH];
+    uint32_t n;     // arguments after the key
+} AofBatch;
+
+static void aof_batch_flush(AofBatch *b) {
+    if (b->n > 0) {
+        aof_append_cmd(b->out, b->cmd, 2 + b->n);
+        b->n = 0;
+    }
+}
+
+static void aof_batch_field(const uint8_t *f, uint32_t flen, const uint8_t *v, uint32_t vlen, void *arg) {
+    AofBatch *b = (AofBatch *)arg;
+    b->cmd[2 + b->n++] = (Arg){flen, f};
+    b->cmd[2 + b->n++] = (Arg){vlen, v};
+    if (b->n == 2 * AOF_BATCH) {
+        aof_batch_flush(b);
+    }
+}
+
+static void aof_batch_element(const uint8_t *data, uint32_t len, void *arg) {
+    AofBatch *b = (AofBatch *)arg;
+    b->cmd[2 + b->n++] = (Arg){len, data};
+    if (b->n == AOF_BATCH) {
+        aof_batch_flush(b);
+    }
+}
+
+static void aof_put_entry(Entry *e, void *arg) {
+    AofWriter *w = (AofWriter *)arg;
+    if (w->failed || (e->expire_at != 0 && e->expire_at <= w->now)) {
+        return;
+    }
+    Arg key = {e->klen, (const uint8_t *)e->key};
+    if (e->type == TYPE_ZSET) {
+        aof_put_zset(w, &key, e->zset);
+    } else if (e->type == TYPE_HASH) {
+        AofBatch b = {.out = &w->out, .cmd = {{4, (const uint8_t *)"hset"}, key}};
+        hash_foreach(e, aof_batch_field, &b);
+        aof_batch_flush(&b);
+    } else if (e->type == TYPE_LIST) {
+        AofBatch b = {.out = &w->out, .cmd = {{5, (const uint8_t *)"rpush"}, key}};
+        list_foreach(e, 0, list_len(e), aof_batch_element, &b);
+        aof_batch_flush(&b);
+    } else {
+        Arg set[3] = {{3, (const uint8_t *)"set"}, key, {(uint32_t)e->vlen, (const uint8_t *)e->val}};
+        aof_append_cmd(&w->out, set, 3);
+    }
+    if (e->expire_at != 0) {
+        char text[24];
+        int n = snprintf(text, sizeof(text), "%lld", (long long)e->expire_at);
+        Arg expireat[3] = {{8, (const uint8_t *)"expireat"}, key, {(uint32_t)n, (const uint8_t *)text}};
+        aof_append_cmd(&w->out, expireat, 3);
+    }
+    if (buf_len(&w->out) >= SNAP_BLOCK_SIZE) {
+        w->failed = write_full(w->fd, w->out.data + w->out.start, buf_len(&w->out)) < 0;
+        buf_consume(&w->out, buf_len(&w->out));
+    }
+}
+
+// write a log that recreates the current keyspace to path, synced; 0 or -1
+static int aof_write_keyspace(const char *path) {
+    AofWriter w = {.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644), .now = time(NULL)};
+    if (w.fd < 0) {
+        return -1;
+    }
+    for (uint32_t i = 0; i < nshards && !w.failed; i++) {
+        hm_foreach(&shards[i].db, aof_put_entry, &w);
+    }
+    w.failed = w.failed || write_full(w.fd, w.out.data + w.out.start, buf_len(&w.out)) < 0;
+    w.failed = w.failed || fsync(w.fd) < 0;
+    w.failed = close(w.fd) < 0 || w.failed;
+    buf_free(&w.out);
+    return w.failed ? -1 : 0;
+}
+
+// open path for appending, first writing the current keyspace to it if it
+// doesn't exist yet, so a log started next to a snapshot is complete
+static int aof_open(const char *path) {
+    if (access(path, F_OK) < 0 && aof_write_keyspace(path) < 0) {
+        return -1;
+    }
+    aof.fd = open(path, O_WRONLY | O_APPEND);
+    return aof.fd < 0 ? -1 : 0;
+}
+
+static void aof_rewrite_path(char *out, size_t cap, const char *path) {
+    snprintf(out, cap, "%s.rewrite", path);
+}
+
+// BGREWRITEAOF: like BGSAVE, called with the other threads parked
+static int aof_bgrewrite(const char *path) {
+    char tmp[4096];
+    aof_rewrite_path(tmp, sizeof(tmp), path);
+    pthread_mutex_lock(&aof.mu);
+    for (uint32_t i = 0; i < nshards; i++) {
+        shards[i].aof_rewrite_skip = buf_len(&shards[i].aof_buf);
+    }
+    aof.rewriting = true;
+    pthread_mutex_unlock(&aof.mu);
+    pid_t pid = fork();
+    if (pid < 0) {
+        pthread_mutex_lock(&aof.mu);
+        for (uint32_t i = 0; i < nshards; i++) {
+            shards[i].aof_rewrite_skip = 0;
+        }
+        aof.rewriting = false;
+        pthread_mutex_unlock(&aof.mu);
+        return -1;
+    }
+    if (pid == 0) {
+        _exit(aof_write_keyspace(tmp) < 0 ? 1 : 0);
+    }
+    persist.child = pid;
+    persist.child_is_rewrite = true;
+    persist.child_start_ms = get_wall_ms();
+    return 0;
+}
+
+// finish a rewrite whose child succeeded (ok) or failed: append what was
+// written meanwhile and swap the new log in, or throw it away
+static bool aof_rewrite_done(const char *path, bool ok) {
+    char tmp[4096];
+    aof_rewrite_path(tmp, sizeof(tmp), path);
+    pthread_mutex_lock(&aof.mu);
+    int fd = ok ? open(tmp, O_WRONLY | O_APPEND) : -1;
+    ok = fd >= 0
+        && write_full(fd, aof.rewrite_buf.data + aof.rewrite_buf.start, buf_len(&aof.rewrite_buf)) == 0
+        && fsync(fd) == 0
+        && rename(tmp, path) == 0
+        && dup2(fd, aof.fd) >= 0;
+    if (fd >= 0) {
+        close(fd);
+    }
+    if (!ok) {
+        unlink(tmp);
+    }
+    aof.rewriting = false;
+    buf_free(&aof.rewrite_buf);
+    pthread_mutex_unlock(&aof.mu);
+    return ok;
+}
+
+// record the outcome of a finished BGSAVE or BGREWRITEAOF child; called from
+// thread 0's loop
+static void persist_reap_child(void) {
+    int status = 0;
+    if (persist.child == 0 || waitpid(persist.child, &status, WNOHANG) != persist.child) {
+        return;
+    }
+    bool ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    uint64_t took_ms = get_wall_ms() - persist.child_start_ms;
+    persist.child = 0;
+    if (persist.child_is_rewrite) {
+        persist.child_is_rewrite = false;
+        persist.last_rewrite_ok = aof_rewrite_done(config.aof, ok);
+        log_at(persist.last_rewrite_ok ? LOG_INFO : LOG_WARN, "AOF rewrite %s after %llu ms",
+            persist.last_rewrite_ok ? "finished" : "failed", (unsigned long long)took_ms);
+        return;
+    }
+    persist.last_save_ok = ok;
+    persist.last_save_ms = took_ms;
+    if (ok) {
+        struct stat st;
+        persist.last_save = time(NULL);
+        persist.last_save_bytes = stat(config.snapshot, &st) == 0 ? (uint64_t)st.st_size : 0;
+        log_at(LOG_INFO, "background save finished: %llu bytes in %llu ms",
+            (unsigned long long)persist.last_save_bytes, (unsigned long long)took_ms);
+    } else {
+        log_at(LOG_WARN, "background save failed");
+    }
+}
+
+// ---- eviction ----
+// With --maxmemory, a write that may grow the keyspace first checks the
+// shards it writes to against their share of the limit, maxmemory / nshards:
+// a shard is only ever touched by its own thread, so it can't spend another
+// shard's memory or take it back. A shard over its share evicts keys by
+// --maxmemory-policy until it is under again, and if it can't, the write
+// fails with ERR_OOM and changes nothing. Like Redis, it approximates LRU and
+// LFU rather than keeping keys on a list in access order, which would cost
+// every GET two pointer writes: each round samples EVICT_SAMPLES keys from
+// random spots in the table into a small pool of the best candidates seen so
+// far, then evicts the best one still there. volatile-ttl needs no sampling,
+// since the ttl_heap already knows the key that expires soonest. An evicted
+// key is logged to the AOF as a DEL, so a replay ends up with what was kept.
+
+#define EVICT_SAMPLES 5
+
+// -1 if s is not a policy name
+static int evict_policy_parse(const char *s) {
+    for (int i = 0; i < (int)(sizeof(evict_policy_names) / sizeof(evict_policy_names[0])); i++) {
+        if (strcmp(s, evict_policy_names[i]) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// how good an eviction pick e is: how long since it was used, or how seldom
+static uint64_t evict_score(const Shard *sh, const Entry *e) {
+    if (config.maxmemory_policy == EVICT_ALLKEYS_LFU) {
+        return 255 - lfu_decayed(sh, e);
+    }
+    return (lru_clock(sh) - e->lru) & LRU_CLOCK_MAX;
+}
+
+// add a sampled entry to sh's pool, which keeps the EVICT_POOL_SIZE best
+// candidates in ascending order, unless it is no better than all of them
+static void evict_pool_offer(Shard *sh, const Entry *e) {
+    EvictCand *pool = sh->evict_pool;
+    uint32_t n = sh->evict_pool_len, at = 0;
+    uint64_t score = evict_score(sh, e);
+    for (uint32_t i = 0; i < n; i++) {
+        if (pool[i].hcode == e->hcode && pool[i].klen == e->klen && memcmp(pool[i].key, e->key, e->klen) == 0) {
+            return;     // sampled again before it was picked
+        }
+    }
+    while (at < n && pool[at].score < score) {
+        at++;
+    }
+    if (n == EVICT_POOL_SIZE) {
+        if (at == 0) {
+            return;
+        }
+        free(pool[0].key);  // make room by dropping the worst
+        memmove(pool, pool + 1, (at - 1) * sizeof(EvictCand));
+        at--;
+    } else {
+        memmove(pool + at + 1, pool + at, (n - at) * sizeof(EvictCand));
+        sh->evict_pool_len++;
+    }
+    uint8_t *key = malloc(e->klen ? e->klen : 1);
+    if (!key) {
+        die("malloc()");
+    }
+    memcpy(key, e->key, e->klen);
+    pool[at] = (EvictCand){score, e->hcode, e->klen, key};
+}
+
+// the key sh's policy would evict next, or NULL if it may not evict any
+static Entry *evict_pick(Shard *sh) {
+    if (hm_size(&sh->db) == 0) {
+        return NULL;
+    }
+    Entry *sample[EVICT_SAMPLES] = {0};
+    switch (config.maxmemory_policy) {
+    case EVICT_VOLATILE_TTL: {
+        HeapNode *top = heap_top(&sh->ttl_heap);
+        return top ? container_of(top, Entry, ttl_node) : NULL;
+    }
+    case EVICT_ALLKEYS_RANDOM:
+        while (hm_sample(&sh->db, shard_rand(sh), sample, 1) == 0) {
+        }
+        return sample[0];
+    case EVICT_ALLKEYS_LRU:
+    case EVICT_ALLKEYS_LFU:
+        while (1) {
+            size_t got = hm_sample(&sh->db, shard_rand(sh), sample, EVICT_SAMPLES);
+            for (size_t i = 0; i < got; i++) {
+                evict_pool_offer(sh, sample[i]);
+            }
+            // the best candidate may have been deleted since it was sampled
+            while (sh->evict_pool_len > 0) {
+                EvictCand *c = &sh->evict_pool[--sh->evict_pool_len];
+                Entry *e = hm_lookup(&sh->db, c->key, c->klen, c->hcode);
+                free(c->key);
+                if (e) {
+                    return e;
+                }
+            }
+        }
+    default:
+        return NULL;
+    }
+}
+
+// get the shard a write to a key with this hash goes to back under its
+// share of --maxmemory; false if it is over and can't be
+static bool evict_for_write(uint64_t hcode) {
+    if (config.maxmemory == 0) {
+        return true;
+    }
+    Shard *sh = shard_of(hcode);
+    while (sh->mem_used > config.maxmemory / nshards) {
+        Entry *e = evict_pick(sh);
+        if (!e) {
+            return false;
+        }
+        Arg del[2] = {{3, (const uint8_t *)"del"}, {e->klen, (const uint8_t *)e->key}};
+        aof_feed(del, 2);
+        entry_free(hm_remove(&sh->db, (const uint8_t *)e->key, e->klen, e->hcode));
+        sh->evicted_keys++;
+    }
+    return true;
+}
+
+// ---- blocked clients ----
+// BLPOP and BRPOP park a client whose lists are all empty on the shard that
+// owns its keys, until a push gives it an element or its timeout passes.
+// Each shard indexes its waiters by key: a key somebody waits on has a BKey
+// queueing them oldest first, and a waiter is linked into the BKey of every
+// key it named. A push to such a key only marks its BKey ready. Right after
+// the command that pushed, the shard's thread hands elements to the oldest
+// waiters of each ready key (loop_serve_blocked), so waking is O(waiters on
+// that key), and a push to a key nobody waits on costs one check. Timeouts
+// sit in a deadline heap of their own beside the TTL heap, and the nearer of
+// the two bounds epoll_wait().
+//
+// The reply always travels as a MSG_RES to the thread that owns the
+// connection, even when that is the shard's own thread, the same way a
+// forwarded request's does.
+
+typedef struct WaitLink {
+    struct Waiter *w;
+    struct BKey *bk;
+    struct WaitLink *prev, *next;   // in bk's queue
+} WaitLink;
+
+typedef struct Waiter {
+    HeapNode deadline;      // in the shard's deadline heap, unless it waits forever
+    struct Loop *from;      // the thread that owns the connection and gets the reply
+    struct Conn *conn;
+    bool front;             // BLPOP rather than BRPOP
+    uint32_t nkeys;
+    WaitLink links[];       // one per key, in the order given
+} Waiter;
+
+typedef struct BKey {
+    struct BKey *next;          // hash chain
+    struct BKey *next_ready;
+    uint64_t hcode;
+    WaitLink *head, *tail;      // oldest waiter first
+    bool ready;                 // pushed to since its waiters were last served
+    uint32_t klen;
+    uint8_t key[];
+} BKey;
+
+typedef struct {
+    BKey **tab;
+    size_t mask;        // buckets - 1
+    size_t nkeys;
+    size_t nwaiters;
+    Heap deadlines;
+    BKey *ready;        // keys pushed to since the last serve
+} BlockIndex;
+
+#define BLOCK_TABLE_MIN 16
+
+static BlockIndex blocks[MAX_THREADS];  // by shard
+
+// where the BKey for key is linked, or the NULL at the end of its chain
+static BKey **bkey_link(BlockIndex *bi, const uint8_t *key, uint32_t klen, uint64_t hcode) {
+    BKey **link = &bi->tab[hcode & bi->mask];
+    while (*link && !((*link)->hcode == hcode && (*link)->klen == klen && memcmp((*link)->key, key, klen) == 0)) {
+        link = &(*link)->next;
+    }
+    return link;
+}
+
+static BKey *bkey_get(BlockIndex *bi, const uint8_t *key, uint32_t klen, uint64_t hcode) {
+    if (!bi->tab || bi->nkeys > bi->mask) {     // keep chains short: grow at one key per bucket
+        size_t buckets = bi->tab ? (bi->mask + 1) * 2 : BLOCK_TABLE_MIN;
+        BKey **tab = calloc(buckets, sizeof(BKey *));
+        if (!tab) {
+            die("calloc()");
+        }
+        for (size_t i = 0; bi->tab && i <= bi->mask; i++) {
+            BKey *bk = bi->tab[i];
+            while (bk) {
+                BKey *next = bk->next;
+                bk->next = tab[bk->hcode & (buckets - 1)];
+                tab[bk->hcode & (buckets - 1)] = bk;
+                bk = next;
+            }
+        }
+        free(bi->tab);
+        bi->tab = tab;
+        bi->mask = buckets - 1;
+    }
+    BKey **link = bkey_link(bi, key, klen, hcode);
+    if (!*link) {
+        BKey *bk = calloc(1, sizeof(BKey) + klen);
+        if (!bk) {
+            die("calloc()");
+        }
+        bk->hcode = hcode;
+        bk->klen = klen;
+        memcpy(bk->key, key, klen);
+        *link = bk;
+        bi->nkeys++;
+    }
+    return *link;
+}
+
+static void bkey_free(BlockIndex *bi, BKey *bk) {
+    *bkey_link(bi, bk->key, bk->klen, bk->hcode) = bk->next;
+    bi->nkeys--;
+    free(bk);
+}
+
+// park a client on the shard owning keys, which must all be on that shard;
+// deadline_ms 0 waits forever
+static void block_park(uint32_t shard, struct Loop *from, struct Conn *conn, const Arg *keys, uint32_t nkeys,
+        bool front, uint64_t deadline_ms) {
+    BlockIndex *bi = &blocks[shard];
+    Waiter *w = calloc(1, sizeof(Waiter) + nkeys * sizeof(WaitLink));
+    if (!w) {
+        die("calloc()");
+    }
+    w->deadline.idx = HEAP_NONE;
+    w->from = from;
+    w->conn = conn;
+    w->front = front;
+    w->nkeys = nkeys;
+    for (uint32_t i = 0; i < nkeys; i++) {
+        WaitLink *l = &w->links[i];
+        l->w = w;
+        l->bk = bkey_get(bi, keys[i].data, keys[i].len, hash_bytes(keys[i].data, keys[i].len));
+        l->prev = l->bk->tail;
+        *(l->prev ? &l->prev->next : &l->bk->head) = l;
+        l->bk->tail = l;
+    }
+    if (deadline_ms != 0) {
+        heap_upsert(&bi->deadlines, &w->deadline, deadline_ms);
+    }
+    bi->nwaiters++;
+}
+
+// take a waiter off every queue it is in and free it. A key left without
+// waiters goes too, unless it is ready: loop_serve_blocked frees those.
+static void block_remove(BlockIndex *bi, Waiter *w) {
+    for (uint32_t i = 0; i < w->nkeys; i++) {
+        WaitLink *l = &w->links[i];
+        *(l->prev ? &l->prev->next : &l->bk->head) = l->next;
+        *(l->next ? &l->next->prev : &l->bk->tail) = l->prev;
+        if (!l->bk->head && !l->bk->ready) {
+            bkey_free(bi, l->bk);
+        }
+    }
+    heap_remove(&bi->deadlines, &w->deadline);
+    bi->nwaiters--;
+    free(w);
+}
+
+// note a push to a list, in case somebody waits on its key
+static void block_signal(const Entry *e) {
+    BlockIndex *bi = &blocks[shard_idx(e->hcode)];
+    if (bi->nwaiters == 0) {
+        return;
+    }
+    BKey *bk = *bkey_link(bi, (const uint8_t *)e->key, e->klen, e->hcode);
+    if (bk && !bk->ready) {
+        bk->ready = true;
+        bk->next_ready = bi->ready;
+        bi->ready = bk;
+    }
+}
+
+// drop conn's waiter, if it is still parked on this shard. hcode is the hash
+// of its first key, which leads to a queue it is in. Returns whether it was.
+static bool block_cancel(uint32_t shard, const struct Conn *conn, uint64_t hcode) {
+    BlockIndex *bi = &blocks[shard];
+    for (BKey *bk = bi->tab ? bi->tab[hcode & bi->mask] : NULL; bk; bk = bk->next) {
+        for (WaitLink *l = bk->hcode == hcode ? bk->head : NULL; l; l = l->next) {
+            if (l->w->conn == conn) {
+                block_remove(bi, l->w);
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+// whether BLPOP/BRPOP keys all belong to one shard, which it can wait on
+static bool block_keys_share_shard(const Arg *keys, uint32_t nkeys) {
+    uint32_t first = shard_idx(hash_bytes(keys[0].data, keys[0].len));
+    for (uint32_t i = 1; i < nkeys; i++) {
+        if (shard_idx(hash_bytes(keys[i].data, keys[i].len)) != first) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// the milliseconds until the next BLPOP/BRPOP timeout on a shard, capped at max_ms
+static int block_timeout_ms(uint32_t shard, int max_ms) {
+    HeapNode *top = heap_top(&blocks[shard].deadlines);
+    if (!top) {
+        return max_ms;
+    }
+    uint64_t now_ms = get_wall_ms();
+    uint64_t wait = top->at_ms > now_ms ? top->at_ms - now_ms : 0;
+    return wait < (uint64_t)max_ms ? (int)wait : max_ms;
+}
+
+// ---- typed response protocol ----
+// every response body now starts with a 1-byte type tag:
+//   NIL -> no payload
+//   ERR -> [4-byte error code][message bytes]
+//   STR -> raw string bytes
+//   INT -> [8-byte int64]
+//   ARR -> [4-byte count] then count elements, each a [4-byte length] and a
+//          typed body of that length (which may itself be an array)
+enum {
+    RES_NIL = 0,
+    RES_ERR = 1,
+    RES_STR = 2,
+    RES_INT = 3,
+    RES_ARR = 4,
+};
+
+enum {
+    ERR_UNKNOWN_CMD = 1,
     ERR_BAD_ARGS = 2,
+    ERR_PERSIST = 3,    // a save could not be done
+    ERR_WRONGTYPE = 4,  // the key holds a different type than the command works on
+    ERR_OOM = 5,        // a write that needs memory, over --maxmemory with nothing left to evict
+    ERR_READONLY = 6,   // a write sent to a replica
+    ERR_SYNC = 7,       // replication could not be set up
+};
+
+#define WRONGTYPE_MSG "WRONGTYPE Operation against a key holding the wrong kind of value"
+#define READONLY_MSG "READONLY You can't write against a read only replica."
+
+static void out_nil(Out *out) {
+    *out_reserve(out, 1) = RES_NIL;
+}
+
+static void out_err(Out *out, uint32_t code, const char *emsg) {
+    *out_reserve(out, 1) = RES_ERR;
+    out_append(out, &code, 4);
+    out_append(out, emsg, strlen(emsg));
+}
+
+static void out_str(Out *out, const uint8_t *data, size_t len) {
+    *out_reserve(out, 1) = RES_STR;
+    out_append(out, data, len);
+}
+
+// like out_str, but hands over text, a malloc()ed block, instead of copying it
+static void out_str_owned(Out *out, uint8_t *text, size_t len) {
+    *out_reserve(out, 1) = RES_STR;
+    out_ref(out, text, len, free, text);
+}
+
+// an entry's value as a string. A shared value is referenced rather than
+// copied, and stays alive until the reply has been sent.
+static void out_value(Out *out, const Entry *e) {
+    if (!val_is_shared(e->vlen)) {
+        out_str(out, (const uint8_t *)e->val, e->vlen);
+        return;
+    }
+    SharedVal *sv = entry_shared_val(e);
+    shared_val_retain(sv);
+    *out_reserve(out, 1) = RES_STR;
+    out_ref(out, sv->data, e->vlen, shared_val_release, sv);
+}
+
+// a sorted set score as a string, in as few digits as read back exactly
+static void out_score(Out *out, double score) {
+    char text[32];
+    int n = 0;
+    for (int digits = 15; digits <= 17; digits++) {
+        n = snprintf(text, sizeof(text), "%.*g", digits, score);
+        if (strtod(text, NULL) == score) {
+            break;
+        }
+    }
+    out_str(out, (const uint8_t *)text, (size_t)n);
+}
+
+static void out_int(Out *out, int64_t val) {
+    *out_reserve(out, 1) = RES_INT;
+    out_append(out, &val, 8);
+}
+
+// start an array of n elements; each one is written as out_len_begin(), an
+// out_* call, out_len_end(). Returns where n is stored, for a caller that
+// only knows the count once it has written the elements.
+static uint8_t *out_arr(Out *out, uint32_t n) {
+    *out_reserve(out, 1) = RES_ARR;
+    uint8_t *at = out_reserve(out, 4);
+    memcpy(at, &n, 4);
+    return at;
+}
+
+// hash_foreach callback writing a field and its value as two array elements
+static void out_field(const uint8_t *f, uint32_t flen, const uint8_t *v, uint32_t vlen, void *arg) {
+    Out *out = arg;
+    uint8_t *at = out_len_begin(out);
+    out_str(out, f, flen);
+    out_len_end(out, at);
+    at = out_len_begin(out);
+    out_str(out, v, vlen);
+    out_len_end(out, at);
+}
+
+// list_foreach callback writing an element as an array element
+static void out_element(const uint8_t *data, uint32_t len, void *arg) {
+    Out *out = arg;
+    uint8_t *at = out_len_begin(out);
+    out_str(out, data, len);
+    out_len_end(out, at);
+}
+
+// pop an element for BLPOP or BRPOP, replying [key, element], and log it as
+// the LPOP or RPOP it amounts to. A list left empty is deleted; returns the
+// entry as it now is, or NULL then.
+static Entry *out_blocking_pop(Out *out, Entry *e, bool front) {
+    const uint8_t *data = NULL;
+    uint32_t len = 0;
+    Arg pop[2] = {{4, (const uint8_t *)(front ? "lpop" : "rpop")}, {e->klen, (const uint8_t *)e->key}};
+    list_peek(e, front, &data, &len);
+    out_arr(out, 2);
+    out_element(pop[1].data, pop[1].len, out);
+    out_element(data, len, out);
+    aof_feed(pop, 2);
+    if (list_len(e) == 1) {
+        h_del_hashed((const uint8_t *)e->key, e->klen, e->hcode);
+        return NULL;
+    }
+    return list_drop(e, front);
+}
+
+// case-insensitive check for whether an Arg matches a literal command name
+static bool arg_is(const Arg *a, const char *s) {
+    size_t slen = strlen(s);
+    return a->len == slen && strncasecmp((const char *)a->data, s, slen) == 0;
+}
+
+// parse an Arg (not null-terminated) as a base-10 signed integer
+static bool arg_to_i64(const Arg *a, int64_t *out) {
+    if (a->len == 0 || a->len > 20) {
+        return false;
+    }
+    char buf[21];
+    memcpy(buf, a->data, a->len);
+    buf[a->len] = '\0';
+
+    char *end = NULL;
+    errno = 0;
+    long long v = strtoll(buf, &end, 10);
+    if (errno != 0 || end != buf + a->len) {
+        return false;
+    }
+    *out = (int64_t)v;
+    return true;
+}
+
+// parse an Arg as a score: a finite or infinite double, never NaN
+static bool arg_to_score(const Arg *a, double *out) {
+    if (a->len == 0 || a->len > 63) {
+        return false;
+    }
+    char buf[64];
+    memcpy(buf, a->data, a->len);
+    buf[a->len] = '\0';
+
+    char *end = NULL;
+    double v = strtod(buf, &end);
+    if (end != buf + a->len || isnan(v)) {
+        return false;
+    }
+    *out = v;
+    return true;
+}
+
+// parse an Arg as one end of a score interval: a score, or "(score" to
+// leave the score itself out
+static bool arg_to_score_bound(const Arg *a, double *out, bool *exclusive) {
+    *exclusive = a->len > 0 && a->data[0] == '(';
+    Arg rest = {a->len - *exclusive, a->data + *exclusive};
+    return arg_to_score(&rest, out);
+}
+
+// the timeout of BLPOP and BRPOP: seconds, fractions allowed, 0 for none.
+// Rounded up to whole milliseconds, so a tiny timeout doesn't become none.
+static bool arg_to_timeout_ms(const Arg *a, uint64_t *ms) {
+    double secs = 0;
+    if (!arg_to_score(a, &secs) || secs < 0 || secs > 1e9) {
+        return false;
+    }
+    *ms = (uint64_t)(secs * 1000);
+    *ms += (double)*ms < secs * 1000;
+    return true;
+}
+
+// SLABSTATS text: allocator totals over every shard, then one line per size
+// class in use. used_bytes is what entries asked for; allocated_bytes is what
+// the allocator holds for them, so their ratio is the fragmentation overhead.
+static void slab_report(Buf *text) {
+    Slab sum = {0};
+    for (uint32_t i = 0; i < nshards; i++) {
+        const Slab *sl = &shards[i].slab;
+        for (uint32_t c = 0; c < slab_nclasses; c++) {
+            sum.classes[c].pages += sl->classes[c].pages;
+            sum.classes[c].used += sl->classes[c].used;
+            sum.classes[c].free += sl->classes[c].free;
+            sum.classes[c].requested += sl->classes[c].requested;
+        }
+        sum.large_used += sl->large_used;
+        sum.large_bytes += sl->large_bytes;
+        sum.allocs += sl->allocs;
+        sum.frees += sl->frees;
+        sum.inplace_overwrites += sl->inplace_overwrites;
+        sum.shared_values += sl->shared_values;
+        sum.shared_bytes += sl->shared_bytes;
+    }
+    size_t used_bytes = sum.large_bytes + sum.shared_bytes;
+    size_t allocated_bytes = used_bytes, pages = 0;
+    for (uint32_t c = 0; c < slab_nclasses; c++) {
+        used_bytes += sum.classes[c].requested;
+        allocated_bytes += sum.classes[c].pages * SLAB_PAGE_SIZE;
+        pages += sum.classes[c].pages;
+    }
+    buf_printf(text,
+        "# Slabs\r\n"
+        "used_bytes:%zu\r\n"
+        "allocated_bytes:%zu\r\n"
+        "fragmentation_ratio:%.2f\r\n"
+        "slab_pages:%zu\r\n"
+        "large_blocks:%zu\r\n"
+        "large_bytes:%zu\r\n"
+        "allocs:%llu\r\n"
+        "frees:%llu\r\n"
+        "inplace_overwrites:%llu\r\n"
+        "shared_values:%zu\r\n"
+        "shared_bytes:%zu\r\n"
+        "# Classes\r\n",
+        used_bytes, allocated_bytes,
+        used_bytes ? (double)allocated_bytes / (double)used_bytes : 0.0,
+        pages, sum.large_used, sum.large_bytes,
+        (unsigned long long)sum.allocs,
+        (unsigned long long)sum.frees,
+        (unsigned long long)sum.inplace_overwrites,
+        sum.shared_values, sum.shared_bytes);
+    for (uint32_t c = 0; c < slab_nclasses; c++) {
+        const SlabClass *sc = &sum.classes[c];
+        if (sc->pages == 0) {
+            continue;
+        }
+        buf_printf(text, "class_%u:chunk_size=%zu,pages=%zu,used=%zu,free=%zu,requested=%zu\r\n",
+            c, slab_chunk_size[c], sc->pages, sc->used, sc->free, sc->requested);
+    }
+}
+
+// Multi-key commands (MGET, MSET, DEL k1 k2 ...) go through their keys
+// KEY_BATCH at a time. h_prefetch hashes a whole batch first and prefetches
+// in two rounds, the table slots and then the entries they point at, so by
+// the time each key is resolved its cache misses have overlapped with the
+// others' instead of being paid one after another.
+#define KEY_BATCH 16
+
+// hash n <= KEY_BATCH keys, every stride-th Arg from keys, into hcodes and
+// start loading where each one lives
+static void h_prefetch(const Arg *keys, uint32_t n, uint32_t stride, uint64_t *hcodes) {
+    for (uint32_t i = 0; i < n; i++) {
+        hcodes[i] = hash_bytes(keys[i * stride].data, keys[i * stride].len);
+        hm_prefetch(&shard_of(hcodes[i])->db, hcodes[i]);
+    }
+    for (uint32_t i = 0; i < n; i++) {
+        hm_prefetch_entry(&shard_of(hcodes[i])->db, hcodes[i]);
+    }
+}
+
+// --maxmemory is enforced before the commands that may need more memory,
+// the CMD_DENYOOM ones: each makes room on the shard of every key it
+// writes; false if one of them is out of memory
+static bool evict_for_request(const Command *c, const Arg *args, uint32_t nstr) {
+    uint32_t first = 0, last = 0;
+    if (config.maxmemory == 0 || !cmd_key_range(c, nstr, &first, &last)) {
+        return true;
+    }
+    for (uint32_t i = first; i <= last; i += c->key_step) {
+        if (!evict_for_write(hash_bytes(args[i].data, args[i].len))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// whether INFO [section] includes the named one: without a section every
+// one but hashtable, whose distribution walks every bucket, and all of them
+// for "all"
+static bool info_wants(const Arg *section, const char *name) {
+    if (!section) {
+        return strcmp(name, "hashtable") != 0;
+    }
+    return arg_is(section, "all") || arg_is(section, name);
+}
+
+// INFO text, summed over every shard and thread; with several threads this
+// runs while the others are parked. False for an unknown section.
+static bool info_report(Buf *text, const Arg *section) {
+    static const char *const sections[] = {
+        "all", "keyspace", "memory", "hashtable", "clients", "stats",
+        "commandstats", "latencystats", "expiry", "logging", "persistence", "replication",
+    };
+    bool known = !section;
+    for (size_t i = 0; i < sizeof(sections) / sizeof(sections[0]) && !known; i++) {
+        known = arg_is(section, sections[i]);
+    }
+    if (!known) {
+        return false;
+    }
+
+    size_t keys = 0, keys_with_ttl = 0, mem_used = 0, slots = 0;
+    uint32_t rehashing = 0;
+    uint64_t evicted = 0;
+    ExpireStats st = {0};
+    for (uint32_t i = 0; i < nshards; i++) {
+        const Shard *sh = &shards[i];
+        keys += hm_size(&sh->db);
+        keys_with_ttl += sh->ttl_heap.size;
+        mem_used += sh->mem_used;
+        evicted += sh->evicted_keys;
+        expire_stats_add(&st, &sh->expire_stats);
+        for (int t = 0; t < 2; t++) {
+            slots += sh->db.ht[t].tab ? sh->db.ht[t].mask + 1 : 0;
+        }
+        rehashing += hm_is_rehashing(&sh->db);
+    }
+    if (info_wants(section, "keyspace")) {
+        buf_printf(text,
+            "# Keyspace\r\n"
+            "keys:%zu\r\n"
+            "keys_with_ttl:%zu\r\n"
+            "hash_engine:%s\r\n"
+            "hashtable_load_factor:%.3f\r\n"
+            "hashtable_rehashing_shards:%u\r\n",
+            keys, keys_with_ttl, HT_ENGINE, slots ? (double)keys / (double)slots : 0.0, rehashing);
+    }
+    if (info_wants(section, "memory")) {
+        buf_printf(text,
+            "# Memory\r\n"
+            "used_memory:%zu\r\n"
+            "maxmemory:%zu\r\n"
+            "maxmemory_policy:%s\r\n"
+            "evicted_keys:%llu\r\n",
+            mem_used, config.maxmemory, evict_policy_names[config.maxmemory_policy], (unsigned long long)evicted);
+    }
+    if (info_wants(section, "hashtable")) {
+        // chained: buckets by entries chained in them; swiss: entries by
+        // groups probed past their first before reaching them
+        uint64_t dist[HT_DIST_MAX + 1] = {0};
+        for (uint32_t i = 0; i < nshards; i++) {
+#ifdef HT_SWISS
+            hm_probe_lengths(&shards[i].db, dist);
+#else
+            hm_chain_lengths(&shards[i].db, dist);
+#endif
+        }
+#ifdef HT_SWISS
+        const char *what = "probe";
+#else
+        const char *what = "chain";
+#endif
+        buf_printf(text, "# Hashtable\r\nhashtable_slots:%zu\r\nhashtable_%s_lengths:", slots, what);
+        for (uint32_t len = 0; len <= HT_DIST_MAX; len++) {
+            buf_printf(text, "%s%u%s=%llu", len ? "," : "", len, len == HT_DIST_MAX ? "+" : "",
+                (unsigned long long)dist[len]);
+        }
+        buf_printf(text, "\r\n");
+    }
+    if (info_wants(section, "clients")) {
+        size_t by_state[STATE_COUNT] = {0}, connected = 0, waiting = 0, held = 0;
+        for (uint32_t i = 0; i < nloops; i++) {
+            for (size_t fd = 0; fd < loops[i].fd2conn_cap; fd++) {
+                const struct Conn *conn = loops[i].fd2conn[fd];
+                if (conn) {
+                    by_state[conn->state]++;
+                    waiting += conn->waiting && !conn->blocked;
+                    held += conn->held;
+                }
+            }
+        }
+        for (uint32_t st = 0; st < sizeof(by_state) / sizeof(by_state[0]); st++) {
+            connected += st != STATE_END ? by_state[st] : 0;    // END is one being torn down
+        }
+        buf_printf(text,
+            "# Clients\r\n"
+            "connected_clients:%zu\r\n"
+            "clients_reading:%zu\r\n"
+            "clients_writing:%zu\r\n"
+            "clients_blocked:%zu\r\n"
+            "clients_waiting_on_shard:%zu\r\n"
+            "clients_held_for_fsync:%zu\r\n",
+            connected,
+            by_state[STATE_REQ], by_state[STATE_RES], by_state[STATE_BLOCKED], waiting, held);
+    }
+    bool commandstats = info_wants(section, "commandstats"), latencystats = info_wants(section, "latencystats");
+    if (info_wants(section, "stats") || commandstats || latencystats) {
+        uint64_t calls = 0, ops = 0;
+        Buf cmds = {0}, lat = {0};
+        CmdStats cs;
+        for (uint32_t c = 0; c < CMD_COUNT; c++) {
+            uint64_t cmd_ops = 0;
+            stats_sum(c, &cs, &cmd_ops);
+            calls += cs.calls;
+            ops += cmd_ops;
+            if (cs.calls == 0) {
+                continue;
+            }
+            buf_printf(&cmds, "cmdstat_%s:calls=%llu,usec=%.0f,usec_per_call=%.3f,ops_per_sec=%llu\r\n",
+                commands[c].name, (unsigned long long)cs.calls, ticks_to_us(cs.ticks),
+                ticks_to_us(cs.ticks) / (double)cs.calls, (unsigned long long)cmd_ops);
+            buf_printf(&lat, "latency_percentiles_usec_%s:p50=%.3f,p99=%.3f,p99.9=%.3f,max=%.3f\r\n",
+                commands[c].name, ticks_to_us(hist_percentile(&cs.hist, 50)), ticks_to_us(hist_percentile(&cs.hist, 99)),
+                ticks_to_us(hist_percentile(&cs.hist, 99.9)), ticks_to_us(cs.hist.max));
+        }
+        stats_read_reply_sum(&cs.hist);
+        if (cs.hist.total > 0) {
+            buf_printf(&lat, "latency_percentiles_usec_read_reply:p50=%.3f,p99=%.3f,p99.9=%.3f,max=%.3f\r\n",
+                ticks_to_us(hist_percentile(&cs.hist, 50)), ticks_to_us(hist_percentile(&cs.hist, 99)),
+                ticks_to_us(hist_percentile(&cs.hist, 99.9)), ticks_to_us(cs.hist.max));
+        }
+        if (info_wants(section, "stats")) {
+            buf_printf(text, "# Stats\r\ntotal_commands_processed:%llu\r\ninstantaneous_ops_per_sec:%llu\r\n",
+                (unsigned long long)calls, (unsigned long long)ops);
+        }
+        if (commandstats) {
+            buf_printf(text, "# Commandstats\r\n");
+            buf_append(text, cmds.data, buf_len(&cmds));
+        }
+        if (latencystats) {
+            buf_printf(text, "# Latencystats\r\n");
+            buf_append(text, lat.data, buf_len(&lat));
+        }
+        buf_free(&cmds);
+        buf_free(&lat);
+    }
+    if (info_wants(section, "expiry")) {
+        buf_printf(text,
+            "# Expiry\r\n"
+            "expired_keys:%llu\r\n"
+            "expire_sweeps:%llu\r\n"
+            "expire_last_sweep_us:%llu\r\n"
+            "expire_max_sweep_us:%llu\r\n"
+            "expire_total_sweep_us:%llu\r\n",
+            (unsigned long long)st.expired_keys,
+            (unsigned long long)st.sweeps,
+            (unsigned long long)st.last_sweep_us,
+            (unsigned long long)st.max_sweep_us,
+            (unsigned long long)st.total_sweep_us);
+    }
+    if (info_wants(section, "logging")) {
+        buf_printf(text,
+            "# Logging\r\n"
+            "log_level:%s\r\n"
+            "log_dropped_lines:%llu\r\n",
+            log_level_names[atomic_load(&log_level)],
+            (unsigned long long)atomic_load(&log_ring.dropped));
+    }
+    if (info_wants(section, "persistence")) {
+        buf_printf(text,
+            "# Persistence\r\n"
+            "bgsave_in_progress:%d\r\n"
+            "last_save_time:%lld\r\n"
+            "last_save_status:%s\r\n"
+            "last_save_bytes:%llu\r\n"
+            "last_save_ms:%llu\r\n"
+            "loaded_keys:%llu\r\n"
+            "load_bytes:%llu\r\n"
+            "load_ms:%llu\r\n"
+            "aof_enabled:%d\r\n"
+            "aof_fsync:%s\r\n"
+            "aof_rewrite_in_progress:%d\r\n"
+            "aof_last_rewrite_status:%s\r\n"
+            "aof_fsyncs:%llu\r\n"
+            "aof_loaded_commands:%llu\r\n",
+            persist.child != 0 && !persist.child_is_rewrite,
+            (long long)persist.last_save,
+            persist.last_save_ok ? "ok" : "err",
+            (unsigned long long)persist.last_save_bytes,
+            (unsigned long long)persist.last_save_ms,
+            (unsigned long long)persist.loaded_keys,
+            (unsigned long long)persist.load_bytes,
+            (unsigned long long)persist.load_ms,
+            aof.fd >= 0,
+            aof_fsync_names[aof.fsync],
+            persist.child != 0 && persist.child_is_rewrite,
+            persist.last_rewrite_ok ? "ok" : "err",
+            (unsigned long long)atomic_load(&aof.fsyncs),
+            (unsigned long long)persist.aof_loaded_commands);
+    }
+    if (info_wants(section, "replication")) {
+        buf_printf(text, "# Replication\r\nrole:%s\r\n", repl.primary_port ? "slave" : "master");
+        if (repl.primary_port) {
+            buf_printf(text,
+                "master_host:%s\r\n"
+                "master_port:%d\r\n"
+                "master_link_status:%s\r\n"
+                "master_sync_in_progress:%d\r\n"
+                "master_link_replid:%s\r\n"
+                "slave_repl_offset:%llu\r\n"
+                "slave_read_only:1\r\n",
+                repl.primary_host, repl.primary_port, repl.link_state == REPL_LINK_UP ? "up" : "down",
+                repl.link_state == REPL_LINK_SYNCING, repl.link_replid, (unsigned long long)repl.link_offset);
+        }
+        buf_printf(text, "connected_slaves:%zu\r\n", repl.nreplicas);
+        uint64_t now_ms = get_wall_ms();
+        for (size_t i = 0; i < repl.nreplicas; i++) {
+            const struct Conn *conn = repl.replicas[i];
+            struct sockaddr_in addr = {0};
+            socklen_t alen = sizeof(addr);
+            char ip[INET_ADDRSTRLEN] = "?";
+            if (getpeername(conn->fd, (struct sockaddr *)&addr, &alen) == 0) {
+                inet_ntop(AF_INET, &addr.sin_addr, ip, sizeof(ip));
+            }
+            buf_printf(text, "slave%zu:ip=%s,port=%d,state=%s,offset=%llu,lag=%llu\r\n", i, ip, ntohs(addr.sin_port),
+                conn->sync_child ? "wait_bgsave" : "online", (unsigned long long)conn->repl_ack,
+                (unsigned long long)(conn->repl_ack_ms ? (now_ms - conn->repl_ack_ms) / 1000 : 0));
+        }
+        buf_printf(text,
+            "master_replid:%s\r\n"
+            "master_repl_offset:%llu\r\n"
+            "repl_backlog_active:%d\r\n"
+            "repl_backlog_size:%zu\r\n"
+            "repl_backlog_first_byte_offset:%llu\r\n"
+            "repl_backlog_histlen:%llu\r\n"
+            "sync_full:%llu\r\n"
+            "sync_partial_ok:%llu\r\n"
+            "sync_partial_err:%llu\r\n",
+            repl.replid, (unsigned long long)repl.offset, repl.backlog != NULL, config.repl_backlog_size,
+            (unsigned long long)repl.backlog_off, (unsigned long long)(repl.offset - repl.backlog_off),
+            (unsigned long long)repl.sync_full, (unsigned long long)repl.sync_partial_ok,
+            (unsigned long long)repl.sync_partial_err);
+    }
+    return true;
+}
+
+// one LATENCY HISTOGRAM element: [name, calls, [[usec, count], ...]], where
+// count is how many calls took at most usec, for usec = 1, 2, 4, ... up to
+// the first bound that takes them all
+static void out_latency_histogram(Out *out, const char *name, const Hist *h) {
+    double ticks_per_us = ticks_per_ns() * 1000;
+    uint64_t bounds[64], counts[64], seen = 0;
+    uint32_t n = 0, b = 0;
+    for (uint64_t us = 1; n < 64 && seen < h->total; us *= 2) {
+        while (b < HIST_BUCKETS && (double)hist_bucket_max(b) <= (double)us * ticks_per_us) {
+            seen += h->counts[b++];
+        }
+        if (b == HIST_BUCKETS) {
+            seen = h->total;    // the top bucket holds everything above it too
+        }
+        bounds[n] = us;
+        counts[n++] = seen;
+    }
+    uint8_t *at = out_len_begin(out);
+    out_arr(out, 3);
+    out_element((const uint8_t *)name, (uint32_t)strlen(name), out);
+    uint8_t *elem = out_len_begin(out);
+    out_int(out, (int64_t)h->total);
+    out_len_end(out, elem);
+    elem = out_len_begin(out);
+    out_arr(out, n);
+    for (uint32_t i = 0; i < n; i++) {
+        uint8_t *pair = out_len_begin(out);
+        out_arr(out, 2);
+        uint8_t *v = out_len_begin(out);
+        out_int(out, (int64_t)bounds[i]);
+        out_len_end(out, v);
+        v = out_len_begin(out);
+        out_int(out, (int64_t)counts[i]);
+        out_len_end(out, v);
+        out_len_end(out, pair);
+    }
+    out_len_end(out, elem);
+    out_len_end(out, at);
+}
+
+// LATENCY HISTOGRAM: the named commands, or every one called so far plus
+// the read_reply path, skipping any with no calls
+static void latency_histograms(Out *out, const Arg *names, uint32_t n) {
+    uint8_t *count_at = out_arr(out, 0);
+    uint32_t count = 0;
+    CmdStats cs;
+    uint64_t ops = 0;
+    for (uint32_t c = 0; c < CMD_COUNT; c++) {
+        bool wanted = n == 0;
+        for (uint32_t i = 0; i < n && !wanted; i++) {
+            wanted = arg_is(&names[i], commands[c].name);
+        }
+        if (!wanted) {
+            continue;
+        }
+        stats_sum(c, &cs, &ops);
+        if (cs.calls > 0) {
+            out_latency_histogram(out, commands[c].name, &cs.hist);
+            count++;
+        }
+    }
+    bool read_reply = n == 0;
+    for (uint32_t i = 0; i < n && !read_reply; i++) {
+        read_reply = arg_is(&names[i], "read_reply");
+    }
+    if (read_reply) {
+        stats_read_reply_sum(&cs.hist);
+        if (cs.hist.total > 0) {
+            out_latency_histogram(out, "read_reply", &cs.hist);
+            count++;
+        }
+    }
+    memcpy(count_at, &count, 4);
+}
+
+static void cmd_get(const Arg *args, uint32_t nstr, Out *out_buf) {
+    (void)nstr;
+    Entry *e = h_lookup(args[1].data, args[1].len);
+    if (!e) {
+        out_nil(out_buf);
+        return;
+    }
+    if (e->type != TYPE_STRING) {
+        out_err(out_buf, ERR_WRONGTYPE, WRONGTYPE_MSG);
+        return;
+    }
+    out_value(out_buf, e);
+}
+
+static void cmd_mget(const Arg *args, uint32_t nstr, Out *out_buf) {
+    uint32_t nkeys = nstr - 1;
+    out_arr(out_buf, nkeys);
+    for (uint32_t i = 0; i < nkeys; i += KEY_BATCH) {
+        const Arg *keys = &args[1 + i];
+        uint32_t n = nkeys - i < KEY_BATCH ? nkeys - i : KEY_BATCH;
+        uint64_t hcodes[KEY_BATCH];
+        Entry *found[KEY_BATCH];
+        h_prefetch(keys, n, 1, hcodes);
+        // resolve the whole batch before writing any of it: interleaving
+        // the reply appends with the lookups loses most of the overlap
+        for (uint32_t j = 0; j < n; j++) {
+            found[j] = h_lookup_hashed(keys[j].data, keys[j].len, hcodes[j]);
+        }
+        for (uint32_t j = 0; j < n; j++) {
+            uint8_t *at = out_len_begin(out_buf);
+            if (found[j] && found[j]->type == TYPE_STRING) {
+                out_value(out_buf, found[j]);
+            } else {
+                out_nil(out_buf);
+            }
+            out_len_end(out_buf, at);
+        }
+    }
+}
+
+static void cmd_mset(const Arg *args, uint32_t nstr, Out *out_buf) {
+    if (nstr % 2 == 0) {
+        out_err(out_buf, ERR_BAD_ARGS, "wrong number of arguments for 'mset'");
+        return;
+    }
+    // every key is checked before any is written, so a WRONGTYPE
+    // leaves all of them alone; the second pass finds them in cache
+    // and its h_set_hashed calls can't fail
+    uint32_t npairs = (nstr - 1) / 2;
+    uint64_t hcodes[MAX_ARGS / 2];
+    for (uint32_t i = 0; i < npairs; i += KEY_BATCH) {
+        const Arg *pairs = &args[1 + 2 * i];
+        uint32_t n = npairs - i < KEY_BATCH ? npairs - i : KEY_BATCH;
+        h_prefetch(pairs, n, 2, &hcodes[i]);
+        for (uint32_t j = 0; j < n; j++) {
+            Entry *e = h_lookup_hashed(pairs[2 * j].data, pairs[2 * j].len, hcodes[i + j]);
+            if (e && e->type != TYPE_STRING) {
+                out_err(out_buf, ERR_WRONGTYPE, WRONGTYPE_MSG);
+                return;
+            }
+        }
+    }
+    for (uint32_t i = 0; i < npairs; i++) {
+        const Arg *kv = &args[1 + 2 * i];
+        h_set_hashed(kv[0].data, kv[0].len, kv[1].data, kv[1].len, hcodes[i]);
+        // logged as one SET per key, so each lands in its own shard's batch
+        Arg set[3] = {{3, (const uint8_t *)"set"}, kv[0], kv[1]};
+        aof_feed(set, 3);
+    }
+    out_str(out_buf, (const uint8_t *)"OK", 2);
+}
+
+static void cmd_set(const Arg *args, uint32_t nstr, Out *out_buf) {
+    if (!h_set(args[1].data, args[1].len, args[2].data, args[2].len)) {
+        out_err(out_buf, ERR_WRONGTYPE, WRONGTYPE_MSG);
+        return;
+    }
+    aof_feed(args, nstr);
+    out_str(out_buf, (const uint8_t *)"OK", 2);
+}
+
+// DEL k1 k2 ... replies with how many of the keys existed
+static void cmd_del(const Arg *args, uint32_t nstr, Out *out_buf) {
+    if (nstr == 2) {    // the usual single key, with no batch to overlap misses across
+        bool deleted = h_del(args[1].data, args[1].len);
+        if (deleted) {
+            aof_feed(args, nstr);
+        }
+        out_int(out_buf, deleted ? 1 : 0);
+        return;
+    }
+    uint32_t nkeys = nstr - 1;
+    int64_t deleted = 0;
+    for (uint32_t i = 0; i < nkeys; i += KEY_BATCH) {
+        const Arg *keys = &args[1 + i];
+        uint32_t n = nkeys - i < KEY_BATCH ? nkeys - i : KEY_BATCH;
+        uint64_t hcodes[KEY_BATCH];
+        h_prefetch(keys, n, 1, hcodes);
+        for (uint32_t j = 0; j < n; j++) {
+            if (h_del_hashed(keys[j].data, keys[j].len, hcodes[j])) {
+                Arg del[2] = {args[0], keys[j]};
+                aof_feed(del, 2);
+                deleted++;
+            }
+        }
+    }
+    out_int(out_buf, deleted);
+}
+
+// EXPIRE takes seconds from now, EXPIREAT an absolute unix time
+static void expire_generic(const Arg *args, Out *out_buf, bool at) {
+    int64_t secs = 0;
+    if (!arg_to_i64(&args[2], &secs)) {
+        out_err(out_buf, ERR_BAD_ARGS, "expire time is not an integer");
+        return;
+    }
+    Entry *e = h_lookup(args[1].data, args[1].len);
+    if (!e) {
+        out_int(out_buf, 0);   // key doesn't exist, nothing to expire
+        return;
+    }
+    time_t deadline = at ? (time_t)secs : time(NULL) + (time_t)secs;
+    entry_set_expire(e, deadline);
+    aof_feed_expireat(&args[1], deadline);
+    out_int(out_buf, 1);
+}
+
+static void cmd_expire(const Arg *args, uint32_t nstr, Out *out_buf) {
+    (void)nstr;
+    expire_generic(args, out_buf, false);
+}
+
+static void cmd_expireat(const Arg *args, uint32_t nstr, Out *out_buf) {
+    (void)nstr;
+    expire_generic(args, out_buf, true);
+}
+
+static void cmd_ttl(const Arg *args, uint32_t nstr, Out *out_buf) {
+    (void)nstr;
+    Entry *e = h_lookup(args[1].data, args[1].len);
+    if (!e) {
+        out_int(out_buf, -2);   // key does not exist
+        return;
+    }
+    if (e->expire_at == 0) {
+        out_int(out_buf, -1);   // key exists but has no TTL
+        return;
+    }
+    int64_t remaining = (int64_t)(e->expire_at - time(NULL));
+    if (remaining < 0) {
+        remaining = 0;
+    }
+    out_int(out_buf, remaining);
+}
+
+// ZADD key score member [score member ...] replies with how many
+// members are new; the others just get their score changed
+static void cmd_zadd(const Arg *args, uint32_t nstr, Out *out_buf) {
+    if (nstr % 2 != 0) {
+        out_err(out_buf, ERR_BAD_ARGS, "wrong number of arguments for 'zadd'");
+        return;
+    }
+    for (uint32_t i = 2; i < nstr; i += 2) {
+        double score = 0;
+        if (!arg_to_score(&args[i], &score)) {
+            out_err(out_buf, ERR_BAD_ARGS, "score is not a valid float");
+            return;
+        }
+    }
+    Entry *e = h_lookup(args[1].data, args[1].len);
+    if (e && e->type != TYPE_ZSET) {
+        out_err(out_buf, ERR_WRONGTYPE, WRONGTYPE_MSG);
+        return;
+    }
+    ZSet *zs = e ? e->zset : h_new_typed(args[1].data, args[1].len, TYPE_ZSET)->zset;
+    int64_t added = 0;
+    for (uint32_t i = 2; i < nstr; i += 2) {
+        double score = 0;
+        arg_to_score(&args[i], &score);
+        added += zset_add(zs, score, args[i + 1].data, args[i + 1].len);
+    }
+    aof_feed(args, nstr);
+    out_int(out_buf, added);
+}
+
+// ZREM key member [member ...] and ZREMRANGEBYSCORE key min max reply
+// with how many members they removed; a set left empty is deleted
+static void zrem_generic(const Arg *args, uint32_t nstr, Out *out_buf, bool by_score) {
+    ZRange range = {0};
+    if (by_score && (!arg_to_score_bound(&args[2], &range.min, &range.minex)
+            || !arg_to_score_bound(&args[3], &range.max, &range.maxex))) {
+        out_err(out_buf, ERR_BAD_ARGS, "min or max is not a float");
+        return;
+    }
+    Entry *e = h_lookup(args[1].data, args[1].len);
+    if (e && e->type != TYPE_ZSET) {
+        out_err(out_buf, ERR_WRONGTYPE, WRONGTYPE_MSG);
+        return;
+    }
+    int64_t removed = 0;
+    if (e && by_score) {
+        removed = (int64_t)zset_remove_range(e->zset, &range);
+    }
+    for (uint32_t i = 2; e && !by_score && i < nstr; i++) {
+        ZNode *x = zset_find(e->zset, args[i].data, args[i].len);
+        if (x) {
+            zset_remove(e->zset, x);
+            removed++;
+        }
+    }
+    if (removed > 0) {
+        if (e->zset->len == 0) {
+            h_del(args[1].data, args[1].len);
+        }
+        aof_feed(args, nstr);
+    }
+    out_int(out_buf, removed);
+}
+
+static void cmd_zrem(const Arg *args, uint32_t nstr, Out *out_buf) {
+    zrem_generic(args, nstr, out_buf, false);
+}
+
+static void cmd_zremrangebyscore(const Arg *args, uint32_t nstr, Out *out_buf) {
+    zrem_generic(args, nstr, out_buf, true);
+}
+
+// ZSCORE key member replies with the score as a string and ZRANK key
+// member with the 0-based rank by score; nil if either is missing
+static void zscore_generic(const Arg *args, Out *out_buf, bool rank) {
+    Entry *e = h_lookup(args[1].data, args[1].len);
+    if (e && e->type != TYPE_ZSET) {
+        out_err(out_buf, ERR_WRONGTYPE, WRONGTYPE_MSG);
+        return;
+    }
+    ZNode *x = e ? zset_find(e->zset, args[2].data, args[2].len) : NULL;
+    if (!x) {
+        out_nil(out_buf);
+    } else if (rank) {
+        out_int(out_buf, (int64_t)zset_rank(e->zset, x));
+    } else {
+        out_score(out_buf, x->score);
+    }
+}
+
+static void cmd_zscore(const Arg *args, uint32_t nstr, Out *out_buf) {
+    (void)nstr;
+    zscore_generic(args, out_buf, false);
+}
+
+static void cmd_zrank(const Arg *args, uint32_t nstr, Out *out_buf) {
+    (void)nstr;
+    zscore_generic(args, out_buf, true);
+}
+
+static void cmd_zcard(const Arg *args, uint32_t nstr, Out *out_buf) {
+    (void)nstr;
+    Entry *e = h_lookup(args[1].data, args[1].len);
+    if (e && e->type != TYPE_ZSET) {
+        out_err(out_buf, ERR_WRONGTYPE, WRONGTYPE_MSG);
+        return;
+    }
+    out_int(out_buf, e ? (int64_t)e->zset->len : 0);
+}
+
+// ZRANGE key start stop [WITHSCORES] takes 0-based ranks, negative
+// ones counting from the end. ZRANGEBYSCORE key min max [WITHSCORES]
+// [LIMIT offset count] takes a score interval. Both reply with an
+// array of members in score order, each followed by its score with
+// WITHSCORES.
+static void zrange_generic(const Arg *args, uint32_t nstr, Out *out_buf, bool by_score) {
+    bool withscores = false;
+    int64_t offset = 0, limit = -1;
+    uint32_t i = 4;
+    for (; i < nstr; i++) {
+        if (arg_is(&args[i], "withscores")) {
+            withscores = true;
+        } else if (by_score && arg_is(&args[i], "limit") && i + 2 < nstr
+                && arg_to_i64(&args[i + 1], &offset) && arg_to_i64(&args[i + 2], &limit)) {
+            i += 2;
+        } else {
+            break;
+        }
+    }
+    if (i != nstr) {
+        out_err(out_buf, ERR_BAD_ARGS, by_score
+            ? "wrong number of arguments for 'zrangebyscore'" : "wrong number of arguments for 'zrange'");
+        return;
+    }
+    ZRange range = {0};
+    int64_t start = 0, stop = 0;
+    if (by_score ? !arg_to_score_bound(&args[2], &range.min, &range.minex)
+            || !arg_to_score_bound(&args[3], &range.max, &range.maxex)
+            : !arg_to_i64(&args[2], &start) || !arg_to_i64(&args[3], &stop)) {
+        out_err(out_buf, ERR_BAD_ARGS, by_score ? "min or max is not a float" : "start or stop is not an integer");
+        return;
+    }
+    Entry *e = h_lookup(args[1].data, args[1].len);
+    if (e && e->type != TYPE_ZSET) {
+        out_err(out_buf, ERR_WRONGTYPE, WRONGTYPE_MSG);
+        return;
+    }
+    ZNode *x = NULL;
+    uint64_t count = 0;
+    if (e && by_score) {
+        x = offset >= 0 ? zset_first_in_range(e->zset, &range, NULL) : NULL;
+        for (int64_t skip = 0; x && skip < offset; skip++) {
+            x = x->lvl[0].forward;
+        }
+        count = limit < 0 ? UINT64_MAX : (uint64_t)limit;
+    } else if (e) {
+        int64_t len = (int64_t)e->zset->len;
+        start = start < 0 ? (start + len < 0 ? 0 : start + len) : start;
+        stop = stop < 0 ? stop + len : (stop >= len ? len - 1 : stop);
+        if (start <= stop) {
+            x = zset_at_rank(e->zset, (size_t)start);
+            count = (uint64_t)(stop - start + 1);
+        }
+    }
+    // the count is only known once the walk stops at the end of the range
+    uint8_t *count_at = out_arr(out_buf, 0);
+    uint32_t n = 0;
+    for (; x && count > 0 && (!by_score || zrange_below_max(&range, x->score)); x = x->lvl[0].forward, count--) {
+        uint8_t *at = out_len_begin(out_buf);
+        out_str(out_buf, znode_member(x), x->mlen);
+        out_len_end(out_buf, at);
+        n++;
+        if (withscores) {
+            at = out_len_begin(out_buf);
+            out_score(out_buf, x->score);
+            out_len_end(out_buf, at);
+            n++;
+        }
+    }
+    memcpy(count_at, &n, 4);
+}
+
+static void cmd_zrange(const Arg *args, uint32_t nstr, Out *out_buf) {
+    zrange_generic(args, nstr, out_buf, false);
+}
+
+static void cmd_zrangebyscore(const Arg *args, uint32_t nstr, Out *out_buf) {
+    zrange_generic(args, nstr, out_buf, true);
+}
+
+// HSET key field value [field value ...] replies with how many fields are new
+static void cmd_hset(const Arg *args, uint32_t nstr, Out *out_buf) {
+    if (nstr % 2 != 0) {
+        out_err(out_buf, ERR_BAD_ARGS, "wrong number of arguments for 'hset'");
+        return;
+    }
+    Entry *e = h_lookup(args[1].data, args[1].len);
+    if (e && e->type != TYPE_HASH) {
+        out_err(out_buf, ERR_WRONGTYPE, WRONGTYPE_MSG);
+        return;
+    }
+    if (!e) {
+        e = h_new_typed(args[1].data, args[1].len, TYPE_HASH);
+    }
+    int64_t added = 0;
+    for (uint32_t i = 2; i < nstr; i += 2) {
+        bool is_new = false;
+        e = hash_set(e, args[i].data, args[i].len, args[i + 1].data, args[i + 1].len, &is_new);
+        added += is_new;
+    }
+    aof_feed(args, nstr);
+    out_int(out_buf, added);
+}
+
+static void cmd_hget(const Arg *args, uint32_t nstr, Out *out_buf) {
+    (void)nstr;
+    Entry *e = h_lookup(args[1].data, args[1].len);
+    const uint8_t *val = NULL;
+    uint32_t vlen = 0;
+    if (e && e->type != TYPE_HASH) {
+        out_err(out_buf, ERR_WRONGTYPE, WRONGTYPE_MSG);
+    } else if (e && hash_get(e, args[2].data, args[2].len, &val, &vlen)) {
+        out_str(out_buf, val, vlen);
+    } else {
+        out_nil(out_buf);
+    }
+}
+
+// HDEL key field [field ...] replies with how many fields it removed;
+// a hash left empty is deleted
+static void cmd_hdel(const Arg *args, uint32_t nstr, Out *out_buf) {
+    Entry *e = h_lookup(args[1].data, args[1].len);
+    if (e && e->type != TYPE_HASH) {
+        out_err(out_buf, ERR_WRONGTYPE, WRONGTYPE_MSG);
+        return;
+    }
+    int64_t removed = 0;
+    for (uint32_t i = 2; e && i < nstr; i++) {
+        bool gone = false;
+        e = hash_del(e, args[i].data, args[i].len, &gone);
+        removed += gone;
+    }
+    if (removed > 0) {
+        if (hash_len(e) == 0) {
+            h_del(args[1].data, args[1].len);
+        }
+        aof_feed(args, nstr);
+    }
+    out_int(out_buf, removed);
+}
+
+// HGETALL key replies with an array of every field followed by its
+// value, HLEN key with the number of fields
+static void hgetall_generic(const Arg *args, Out *out_buf, bool all) {
+    Entry *e = h_lookup(args[1].data, args[1].len);
+    if (e && e->type != TYPE_HASH) {
+        out_err(out_buf, ERR_WRONGTYPE, WRONGTYPE_MSG);
+        return;
+    }
+    size_t len = e ? hash_len(e) : 0;
+    if (!all) {
+        out_int(out_buf, (int64_t)len);
+        return;
+    }
+    out_arr(out_buf, (uint32_t)(len * 2));
+    if (e) {
+        hash_foreach(e, out_field, out_buf);
+    }
+}
+
+static void cmd_hgetall(const Arg *args, uint32_t nstr, Out *out_buf) {
+    (void)nstr;
+    hgetall_generic(args, out_buf, true);
+}
+
+static void cmd_hlen(const Arg *args, uint32_t nstr, Out *out_buf) {
+    (void)nstr;
+    hgetall_generic(args, out_buf, false);
+}
+
+// LPUSH key element [element ...] pushes each element onto the front
+// in turn, RPUSH onto the back; both reply with the new length
+static void lpush_generic(const Arg *args, uint32_t nstr, Out *out_buf, bool front) {
+    Entry *e = h_lookup(args[1].data, args[1].len);
+    if (e && e->type != TYPE_LIST) {
+        out_err(out_buf, ERR_WRONGTYPE, WRONGTYPE_MSG);
+        return;
+    }
+    if (!e) {
+        e = h_new_typed(args[1].data, args[1].len, TYPE_LIST);
+    }
+    for (uint32_t i = 2; i < nstr; i++) {
+        e = list_push(e, front, args[i].data, args[i].len);
+    }
+    aof_feed(args, nstr);
+    block_signal(e);
+    out_int(out_buf, (int64_t)list_len(e));
+}
+
+static void cmd_lpush(const Arg *args, uint32_t nstr, Out *out_buf) {
+    lpush_generic(args, nstr, out_buf, true);
+}
+
+static void cmd_rpush(const Arg *args, uint32_t nstr, Out *out_buf) {
+    lpush_generic(args, nstr, out_buf, false);
+}
+
+// LPOP key and RPOP key reply with the element they removed from the
+// front or the back, or nil; a list left empty is deleted
+static void lpop_generic(const Arg *args, uint32_t nstr, Out *out_buf, bool front) {
+    Entry *e = h_lookup(args[1].data, args[1].len);
+    if (e && e->type != TYPE_LIST) {
+        out_err(out_buf, ERR_WRONGTYPE, WRONGTYPE_MSG);
+        return;
+    }
+    if (!e) {
+        out_nil(out_buf);
+        return;
+    }
+    const uint8_t *data = NULL;
+    uint32_t len = 0;
+    list_peek(e, front, &data, &len);
+    out_str(out_buf, data, len);
+    if (list_len(e) == 1) {
+        h_del(args[1].data, args[1].len);
+    } else {
+        list_drop(e, front);
+    }
+    aof_feed(args, nstr);
+}
+
+static void cmd_lpop(const Arg *args, uint32_t nstr, Out *out_buf) {
+    lpop_generic(args, nstr, out_buf, true);
+}
+
+static void cmd_rpop(const Arg *args, uint32_t nstr, Out *out_buf) {
+    lpop_generic(args, nstr, out_buf, false);
+}
+
+// BLPOP key [key ...] timeout pops the front element of the first of
+// the lists that has one and replies with [key, element]; BRPOP pops
+// from the back. When they are all empty the caller parks the client
+// instead of getting here (see "blocked clients" and
+// block_must_wait()), so the nil a timeout gives only comes back from
+// here to a caller that can't wait.
+static void blpop_generic(const Arg *args, uint32_t nstr, Out *out_buf, bool front) {
+    uint64_t timeout_ms = 0;
+    if (!arg_to_timeout_ms(&args[nstr - 1], &timeout_ms)) {
+        out_err(out_buf, ERR_BAD_ARGS, "timeout is not a float or out of range");
+        return;
+    }
+    if (!block_keys_share_shard(&args[1], nstr - 2)) {
+        out_err(out_buf, ERR_BAD_ARGS, "keys of a blocking pop must all live on one shard");
+        return;
+    }
+    for (uint32_t i = 1; i < nstr - 1; i++) {
+        Entry *e = h_lookup(args[i].data, args[i].len);
+        if (e && e->type != TYPE_LIST) {
+            out_err(out_buf, ERR_WRONGTYPE, WRONGTYPE_MSG);
+            return;
+        }
+        if (e) {
+            out_blocking_pop(out_buf, e, front);
+            return;
+        }
+    }
+    out_nil(out_buf);
+}
+
+static void cmd_blpop(const Arg *args, uint32_t nstr, Out *out_buf) {
+    blpop_generic(args, nstr, out_buf, true);
+}
+
+static void cmd_brpop(const Arg *args, uint32_t nstr, Out *out_buf) {
+    blpop_generic(args, nstr, out_buf, false);
+}
+
+// LRANGE key start stop replies with the elements from index start to
+// stop inclusive, negative ones counting from the end; LLEN key with
+// the number of elements
+static void lrange_generic(const Arg *args, Out *out_buf, bool range) {
+    int64_t start = 0, stop = 0;
+    if (range && (!arg_to_i64(&args[2], &start) || !arg_to_i64(&args[3], &stop))) {
+        out_err(out_buf, ERR_BAD_ARGS, "start or stop is not an integer");
+        return;
+    }
+    Entry *e = h_lookup(args[1].data, args[1].len);
+    if (e && e->type != TYPE_LIST) {
+        out_err(out_buf, ERR_WRONGTYPE, WRONGTYPE_MSG);
+        return;
+    }
+    int64_t len = e ? (int64_t)list_len(e) : 0;
+    if (!range) {
+        out_int(out_buf, len);
+        return;
+    }
+    start = start < 0 ? (start + len < 0 ? 0 : start + len) : start;
+    stop = stop < 0 ? stop + len : (stop >= len ? len - 1 : stop);
+    uint32_t count = start <= stop ? (uint32_t)(stop - start + 1) : 0;
+    out_arr(out_buf, count);
+    if (count > 0) {
+        list_foreach(e, (size_t)start, count, out_element, out_buf);
+    }
+}
+
+static void cmd_lrange(const Arg *args, uint32_t nstr, Out *out_buf) {
+    (void)nstr;
+    lrange_generic(args, out_buf, true);
+}
+
+static void cmd_llen(const Arg *args, uint32_t nstr, Out *out_buf) {
+    (void)nstr;
+    lrange_generic(args, out_buf, false);
+}
+
+static void cmd_info(const Arg *args, uint32_t nstr, Out *out_buf) {
+    if (nstr > 2) {
+        out_err(out_buf, ERR_BAD_ARGS, "wrong number of arguments for 'info'");
+        return;
+    }
+    Buf text = {0};
+    if (!info_report(&text, nstr == 2 ? &args[1] : NULL)) {
+        buf_free(&text);
+        out_err(out_buf, ERR_BAD_ARGS, "unknown INFO section");
+        return;
+    }
+    out_str_owned(out_buf, text.data, buf_len(&text));     // start is still 0
+}
+
+// LATENCY HISTOGRAM [command ...] / LATENCY RESET; runs with the
+// other threads parked, like INFO
+static void cmd_latency(const Arg *args, uint32_t nstr, Out *out_buf) {
+    if (nstr == 2 && arg_is(&args[1], "reset")) {
+        memset(thread_stats, 0, nloops * sizeof(ThreadStats));
+        out_str(out_buf, (const uint8_t *)"OK", 2);
+        return;
+    }
+    if (nstr < 2 || !arg_is(&args[1], "histogram")) {
+        out_err(out_buf, ERR_BAD_ARGS, "usage: LATENCY HISTOGRAM [command ...] | LATENCY RESET");
+        return;
+    }
+    latency_histograms(out_buf, &args[2], nstr - 2);
+}
+
+static void cmd_slabstats(const Arg *args, uint32_t nstr, Out *out_buf) {
+    (void)args;
+    (void)nstr;
+    Buf text = {0};
+    slab_report(&text);
+    out_str_owned(out_buf, text.data, buf_len(&text));     // start is still 0
+}
+
+// both run on thread 0 with the other threads parked; SAVE writes the
+// snapshot right here, BGSAVE forks and leaves it to the child
+static void save_generic(Out *out_buf, bool background) {
+    if (persist.child != 0) {
+        out_err(out_buf, ERR_PERSIST, "a background save or rewrite is already in progress");
+        return;
+    }
+    if (background) {
+        if (snapshot_bgsave(config.snapshot) < 0) {
+            out_err(out_buf, ERR_PERSIST, "fork() failed");
+            return;
+        }
+        const char *text = "Background saving started";
+        out_str(out_buf, (const uint8_t *)text, strlen(text));
+        return;
+    }
+    uint64_t start_ms = get_wall_ms();
+    int64_t bytes = snapshot_save(config.snapshot);
+    persist.last_save_ok = bytes >= 0;
+    if (bytes < 0) {
+        out_err(out_buf, ERR_PERSIST, "could not write the snapshot");
+        return;
+    }
+    persist.last_save = time(NULL);
+    persist.last_save_bytes = (uint64_t)bytes;
+    persist.last_save_ms = get_wall_ms() - start_ms;
+    out_str(out_buf, (const uint8_t *)"OK", 2);
+}
+
+static void cmd_save(const Arg *args, uint32_t nstr, Out *out_buf) {
+    (void)args;
+    (void)nstr;
+    save_generic(out_buf, false);
+}
+
+static void cmd_bgsave(const Arg *args, uint32_t nstr, Out *out_buf) {
+    (void)args;
+    (void)nstr;
+    save_generic(out_buf, true);
+}
+
+// runs on thread 0 with the other threads parked, like BGSAVE
+static void cmd_bgrewriteaof(const Arg *args, uint32_t nstr, Out *out_buf) {
+    (void)args;
+    (void)nstr;
+    if (aof.fd < 0) {
+        out_err(out_buf, ERR_PERSIST, "the AOF is not enabled");
+        return;
+    }
+    if (persist.child != 0) {
+        out_err(out_buf, ERR_PERSIST, "a background save or rewrite is already in progress");
+        return;
+    }
+    if (aof_bgrewrite(config.aof) < 0) {
+        out_err(out_buf, ERR_PERSIST, "fork() failed");
+        return;
+    }
+    const char *text = "Background append only file rewriting started";
+    out_str(out_buf, (const uint8_t *)text, strlen(text));
+}
+
+// REPLICAOF host port makes this server a replica of another, REPLICAOF NO
+// ONE a primary again, keeping its data. Runs on thread 0 with the other
+// threads parked; repl_cron() then drops the old link and makes the new one.
+static void cmd_replicaof(const Arg *args, uint32_t nstr, Out *out_buf) {
+    (void)nstr;
+    if (arg_is(&args[1], "no") && arg_is(&args[2], "one")) {
+        if (repl.primary_port != 0) {
+            log_at(LOG_INFO, "no longer a replica of %s:%d", repl.primary_host, repl.primary_port);
+        }
+        repl.primary_host[0] = '\0';
+        repl.primary_port = 0;
+    } else {
+        int64_t port = 0;
+        if (!arg_to_i64(&args[2], &port) || port < 1 || port > 65535
+                || args[1].len == 0 || args[1].len >= sizeof(repl.primary_host)) {
+            out_err(out_buf, ERR_BAD_ARGS, "usage: REPLICAOF host port | REPLICAOF NO ONE");
+            return;
+        }
+        if (repl.primary_port == port && strlen(repl.primary_host) == args[1].len
+                && memcmp(repl.primary_host, args[1].data, args[1].len) == 0) {
+            out_str(out_buf, (const uint8_t *)"OK", 2);     // already following it
+            return;
+        }
+        memcpy(repl.primary_host, args[1].data, args[1].len);
+        repl.primary_host[args[1].len] = '\0';
+        repl.primary_port = (int)port;
+        log_at(LOG_INFO, "replicating %s:%d", repl.primary_host, repl.primary_port);
+    }
+    // what we hold is no longer a copy of the old primary's history: writes
+    // may have been made here, so the next sync is a full one
+    strcpy(repl.link_replid, "?");
+    repl.link_offset = 0;
+    repl.link_gen++;
+    repl.relink = true;
+    out_str(out_buf, (const uint8_t *)"OK", 2);
+}
+
+// try_one_request() hands a connection that sends PSYNC to thread 0 before
+// it is ever dispatched, so only a request that didn't come from a client
+// gets here
+static void cmd_psync(const Arg *args, uint32_t nstr, Out *out_buf) {
+    (void)args;
+    (void)nstr;
+    out_err(out_buf, ERR_SYNC, "PSYNC is only accepted from a client connection");
+}
+
+// LOGLEVEL reports the level, LOGLEVEL <off|warn|info|debug> changes it;
+// debug turns on a trace line per request
+static void cmd_loglevel(const Arg *args, uint32_t nstr, Out *out_buf) {
+    if (nstr > 2) {
+        out_err(out_buf, ERR_BAD_ARGS, "wrong number of arguments for 'loglevel'");
+        return;
+    }
+    if (nstr == 2) {
+        int level = log_level_parse((const char *)args[1].data, args[1].len);
+        if (level < 0) {
+            out_err(out_buf, ERR_BAD_ARGS, "log level must be off, warn, info or debug");
+            return;
+        }
+        atomic_store(&log_level, level);
+        out_str(out_buf, (const uint8_t *)"OK", 2);
+        return;
+    }
+    const char *name = log_level_names[atomic_load(&log_level)];
+    out_str(out_buf, (const uint8_t *)name, strlen(name));
+}
+
+// one element of an array: a string, or an int
+static void out_elem_str(Out *out, const char *s) {
+    uint8_t *at = out_len_begin(out);
+    out_str(out, (const uint8_t *)s, strlen(s));
+    out_len_end(out, at);
+}
+
+static void out_elem_int(Out *out, int64_t v) {
+    uint8_t *at = out_len_begin(out);
+    out_int(out, v);
+    out_len_end(out, at);
+}
+
+// COMMAND [INFO [name ...]] describes the named commands, or every one, as
+// [name, arity, [flag ...], first key, last key, key step] each, the same
+// shape as Redis's, with nil for a name that is no command. COMMAND COUNT
+// replies with how many commands there are.
+static void cmd_command(const Arg *args, uint32_t nstr, Out *out_buf) {
+    if (nstr == 2 && arg_is(&args[1], "count")) {
+        out_int(out_buf, CMD_COUNT);
+        return;
+    }
+    if (nstr > 1 && !arg_is(&args[1], "info")) {
+        out_err(out_buf, ERR_BAD_ARGS, "usage: COMMAND [INFO [command ...]] | COMMAND COUNT");
+        return;
+    }
+    bool all = nstr <= 2;
+    uint32_t n = all ? CMD_COUNT : nstr - 2;
+    out_arr(out_buf, n);
+    for (uint32_t i = 0; i < n; i++) {
+        uint32_t id = all ? i : cmd_lookup(&args[2 + i]);
+        uint8_t *at = out_len_begin(out_buf);
+        if (id == CMD_NONE) {
+            out_nil(out_buf);
+            out_len_end(out_buf, at);
+            continue;
+        }
+        const Command *c = &commands[id];
+        out_arr(out_buf, 6);
+        out_elem_str(out_buf, c->name);
+        out_elem_int(out_buf, c->arity);
+        uint8_t *flags_at = out_len_begin(out_buf);
+        uint8_t *nflags_at = out_arr(out_buf, 0);
+        uint32_t nflags = 0;
+        for (uint32_t f = 0; f < sizeof(cmd_flag_names) / sizeof(cmd_flag_names[0]); f++) {
+            if (c->flags & (1u << f)) {
+                out_elem_str(out_buf, cmd_flag_names[f]);
+                nflags++;
+            }
+        }
+        memcpy(nflags_at, &nflags, 4);
+        out_len_end(out_buf, flags_at);
+        out_elem_int(out_buf, c->first_key);
+        out_elem_int(out_buf, c->last_key);
+        out_elem_int(out_buf, c->key_step);
+        out_len_end(out_buf, at);
+    }
+}
+
+// each command's handler, by id; cmd_call() has checked its arity, so a
+// handler only checks what the arity can't say
+typedef void (*CmdProc)(const Arg *args, uint32_t nstr, Out *out_buf);
+
+static const CmdProc cmd_procs[CMD_COUNT] = {
+    [CMD_GET] = cmd_get,
+    [CMD_MGET] = cmd_mget,
+    [CMD_MSET] = cmd_mset,
+    [CMD_SET] = cmd_set,
+    [CMD_DEL] = cmd_del,
+    [CMD_EXPIRE] = cmd_expire,
+    [CMD_EXPIREAT] = cmd_expireat,
+    [CMD_TTL] = cmd_ttl,
+    [CMD_ZADD] = cmd_zadd,
+    [CMD_ZREM] = cmd_zrem,
+    [CMD_ZREMRANGEBYSCORE] = cmd_zremrangebyscore,
+    [CMD_ZSCORE] = cmd_zscore,
+    [CMD_ZRANK] = cmd_zrank,
+    [CMD_ZCARD] = cmd_zcard,
+    [CMD_ZRANGE] = cmd_zrange,
+    [CMD_ZRANGEBYSCORE] = cmd_zrangebyscore,
+    [CMD_HSET] = cmd_hset,
+    [CMD_HGET] = cmd_hget,
+    [CMD_HDEL] = cmd_hdel,
+    [CMD_HGETALL] = cmd_hgetall,
+    [CMD_HLEN] = cmd_hlen,
+    [CMD_LPUSH] = cmd_lpush,
+    [CMD_RPUSH] = cmd_rpush,
+    [CMD_LPOP] = cmd_lpop,
+    [CMD_RPOP] = cmd_rpop,
+    [CMD_BLPOP] = cmd_blpop,
+    [CMD_BRPOP] = cmd_brpop,
+    [CMD_LRANGE] = cmd_lrange,
+    [CMD_LLEN] = cmd_llen,
+    [CMD_INFO] = cmd_info,
+    [CMD_LATENCY] = cmd_latency,
+    [CMD_SLABSTATS] = cmd_slabstats,
+    [CMD_SAVE] = cmd_save,
+    [CMD_BGSAVE] = cmd_bgsave,
+    [CMD_BGREWRITEAOF] = cmd_bgrewriteaof,
+    [CMD_LOGLEVEL] = cmd_loglevel,
+    [CMD_REPLICAOF] = cmd_replicaof,
+    [CMD_PSYNC] = cmd_psync,
+    [CMD_COMMAND] = cmd_command,
+};
+
+// run a request as the command cmd, CMD_NONE for an unknown name, appending
+// the typed response body to out. A replicated request, from our primary's
+// stream, skips --maxmemory: the primary has already made the write, and a
+// replica that evicted or refused on its own would no longer be a copy.
+static void cmd_call(uint32_t cmd, const Arg *args, uint32_t nstr, Out *out_buf, bool replicated) {
+    if (nstr == 0) {
+        out_err(out_buf, ERR_BAD_ARGS, "empty command");
+        return;
+    }
+    if (cmd == CMD_NONE) {
+        out_err(out_buf, ERR_UNKNOWN_CMD, "unknown command");
+        return;
+    }
+    const Command *c = &commands[cmd];
+    if (c->arity >= 0 ? nstr != (uint32_t)c->arity : nstr < (uint32_t)-c->arity) {
+        char emsg[64];
+        snprintf(emsg, sizeof(emsg), "wrong number of arguments for '%s'", c->name);
+        out_err(out_buf, ERR_BAD_ARGS, emsg);
+        return;
+    }
+    if ((c->flags & CMD_DENYOOM) && !replicated && !evict_for_request(c, args, nstr)) {
+        out_err(out_buf, ERR_OOM, "OOM command not allowed when used memory > 'maxmemory'");
+        return;
+    }
+    cmd_procs[cmd](args, nstr, out_buf);
+}
+
+// run a request, untimed; AOF replay's way in
+static void do_command(const Arg *args, uint32_t nstr, Out *out_buf) {
+    cmd_call(nstr > 0 ? cmd_lookup(&args[0]) : CMD_NONE, args, nstr, out_buf, false);
+}
+
+// run a request, timing it into the running thread's stats for its command
+static void do_request(const Arg *args, uint32_t nstr, Out *out_buf, bool replicated) {
+    uint32_t cmd = nstr > 0 ? cmd_lookup(&args[0]) : CMD_NONE;
+    uint64_t start = ticks_now();
+    cmd_call(cmd, args, nstr, out_buf, replicated);
+    if (cmd != CMD_NONE) {
+        stats_record(cmd, ticks_now() - start);
+    }
+}
+
+// ---- request routing ----
+// With several I/O threads a request must run on the thread that owns the
+// shard its key lives in; the command table says which arguments are keys.
+// CMD_GLOBAL commands, which read the whole keyspace, run on thread 0 while
+// every other thread is parked. A multi-key command runs on its keys' shard
+// if they all share one, and like a whole-keyspace command otherwise.
+
+enum {
+    ROUTE_LOCAL = -1,   // touches no shard, or there is only one: run it right here
+    ROUTE_ALL = -2,     // reads every shard: run it on thread 0 inside stop_world()
 };
 
-static uint32_t out_nil(uint8_t *out) {
-    out[0] = RES_NIL;
-    return 1;
+static int32_t req_route(const Arg *args, uint32_t nstr) {
+    if (nshards == 1 || nstr == 0) {
+        return ROUTE_LOCAL;
+    }
+    uint32_t cmd = cmd_lookup(&args[0]);
+    if (cmd == CMD_NONE) {
+        return ROUTE_LOCAL;     // an error wherever it runs
+    }
+    const Command *c = &commands[cmd];
+    if (c->flags & CMD_GLOBAL) {
+        return ROUTE_ALL;
+    }
+    uint32_t first = 0, last = 0;
+    if (!cmd_key_range(c, nstr, &first, &last)) {
+        return ROUTE_LOCAL;     // process-wide, like LOGLEVEL, or too short to name its key
+    }
+    if (c->flags & CMD_BLOCKING) {
+        last = first;   // it refuses keys on several shards itself, and can only wait on one
+    }
+    uint32_t shard = shard_idx(hash_bytes(args[first].data, args[first].len));
+    for (uint32_t i = first + c->key_step; i <= last; i += c->key_step) {
+        if (shard_idx(hash_bytes(args[i].data, args[i].len)) != shard) {
+            return ROUTE_ALL;
+        }
+    }
+    return (int32_t)shard;
+}
+
+// whether a request is a BLPOP or BRPOP that has to wait: well formed, with
+// every key missing from this thread's shard. Anything else, errors
+// included, is for do_request() to answer right away.
+static bool block_must_wait(const Arg *args, uint32_t nstr, uint64_t *timeout_ms) {
+    if (nstr < 3 || !(arg_is(&args[0], "blpop") || arg_is(&args[0], "brpop"))
+            || !arg_to_timeout_ms(&args[nstr - 1], timeout_ms) || !block_keys_share_shard(&args[1], nstr - 2)) {
+        return false;
+    }
+    for (uint32_t i = 1; i < nstr - 1; i++) {
+        if (h_lookup(args[i].data, args[i].len)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void loop_wake(Loop *loop) {
+    if (!atomic_exchange(&loop->wake_pending, true)) {
+        uint64_t one = 1;
+        ssize_t rv = write(loop->wake_fd, &one, sizeof(one));
+        (void)rv;   // the only failure is a saturated counter, which still wakes the loop
+    }
+}
+
+static Msg *msg_new(uint32_t type, Loop *from, struct Conn *conn, const uint8_t *data, uint32_t len) {
+    Msg *m = malloc(sizeof(Msg) + len);
+    if (!m) {
+        die("malloc()");
+    }
+    m->type = type;
+    m->from = from;
+    m->conn = conn;
+    memset(&m->res, 0, sizeof(m->res));
+    m->len = len;
+    if (len) {
+        memcpy(m->data, data, len);
+    }
+    return m;
+}
+
+static void msg_send(Loop *to, Msg *m) {
+    mq_push(&to->inbox, m);
+    loop_wake(to);
+}
+
+// ---- stop-the-world sections ----
+// Thread 0 is the only thread that ever stops the world, so two threads can
+// never wait on each other. It asks every other thread to park, waits until
+// they all have, and then has the whole keyspace to itself.
+
+static pthread_mutex_t world_mu = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t world_cv = PTHREAD_COND_INITIALIZER;
+static uint32_t world_parked = 0;   // threads currently parked
+static uint64_t world_gen = 0;      // bumped by resume_world() to release them
+
+// called by a thread that received MSG_PAUSE
+static void world_park(void) {
+    pthread_mutex_lock(&world_mu);
+    uint64_t gen = world_gen;
+    world_parked++;
+    pthread_cond_broadcast(&world_cv);
+    while (world_gen == gen) {
+        pthread_cond_wait(&world_cv, &world_mu);
+    }
+    world_parked--;
+    pthread_cond_broadcast(&world_cv);
+    pthread_mutex_unlock(&world_mu);
+}
+
+static void stop_world(void) {
+    for (uint32_t i = 1; i < nloops; i++) {
+        msg_send(&loops[i], msg_new(MSG_PAUSE, &loops[0], NULL, NULL, 0));
+    }
+    pthread_mutex_lock(&world_mu);
+    while (world_parked < nloops - 1) {
+        pthread_cond_wait(&world_cv, &world_mu);
+    }
+    pthread_mutex_unlock(&world_mu);
+}
+
+static void resume_world(void) {
+    pthread_mutex_lock(&world_mu);
+    world_gen++;
+    pthread_cond_broadcast(&world_cv);
+    while (world_parked > 0) {  // don't let a later stop_world() mistake a leaver for a parker
+        pthread_cond_wait(&world_cv, &world_mu);
+    }
+    pthread_mutex_unlock(&world_mu);
+}
+
+// run a request that reads every shard; only ever called on thread 0
+static void do_request_all(const Arg *args, uint32_t nstr, Out *out_buf, bool replicated) {
+    stop_world();
+    do_request(args, nstr, out_buf, replicated);
+    if (aof.fd >= 0) {
+        // a multi-key write may have logged into other shards' batches. Append
+        // them now, while their threads are parked, and hold this reply until
+        // the last of them is synced, not just thread 0's own.
+        uint64_t seq = 0;
+        for (uint32_t i = 0; i < nloops; i++) {
+            aof_write_batch(&loops[i]);
+            seq = loops[i].aof_wait_seq > seq ? loops[i].aof_wait_seq : seq;
+        }
+        loops[0].aof_wait_seq = seq;
+    }
+    resume_world();
+}
+
+// ---- connection I/O ----
+
+// request tracing, at LOG_DEBUG: one line per request with its arguments
+static void log_request(const struct Conn *conn, const Arg *args, uint32_t nstr) {
+    char line[LOG_LINE_MAX] = "";
+    size_t used = 0;
+    for (uint32_t i = 0; i < nstr && used < sizeof(line); i++) {
+        // cap each argument, so tracing a huge value doesn't scan all of it
+        int alen = args[i].len > 64 ? 64 : (int)args[i].len;
+        int n = snprintf(&line[used], sizeof(line) - used, " '%.*s'%s",
+            alen, args[i].data, (uint32_t)alen < args[i].len ? "..." : "");
+        used += n < 0 ? 0 : (size_t)n;
+    }
+    log_write(LOG_DEBUG, "thread %u fd %d:%s", conn->loop->id, conn->fd, line);
+}
+
+// Pipelining: every complete request already in rbuf is executed and its
+// reply appended to wbuf, and the whole batch then goes out in one writev().
+// A burst of 100 pipelined commands costs one read and one write rather than
+// a write and an epoll round trip each. Batching pauses once wbuf holds
+// PIPELINE_FLUSH_AT bytes, so a client that never reads can't make the
+// server buffer unbounded output.
+#define PIPELINE_FLUSH_AT (256 * 1024)
+
+// A reply held back until the AOF batch with its write is synced
+// (--aof-fsync always): either a connection's wbuf, or a MSG_RES for the
+// thread that forwarded the request.
+typedef struct Held {
+    struct Conn *conn;
+    Loop *to;
+    Msg *m;
+} Held;
+
+static void loop_hold(Loop *loop, Held h) {
+    if (loop->nheld == loop->held_cap) {
+        loop->held_cap = loop->held_cap ? loop->held_cap * 2 : 64;
+        loop->held = realloc(loop->held, loop->held_cap * sizeof(Held));
+        if (!loop->held) {
+            die("realloc()");
+        }
+    }
+    loop->held[loop->nheld++] = h;
+}
+
+// hand the elements just pushed onto lists with waiters to the oldest of
+// them, after the command that pushed; each pop is logged, so its reply is
+// held like any write's
+static void loop_serve_blocked(Loop *loop) {
+    BlockIndex *bi = &blocks[loop->id];
+    while (bi->ready) {
+        BKey *bk = bi->ready;
+        bi->ready = bk->next_ready;
+        Entry *e = h_lookup_hashed(bk->key, bk->klen, bk->hcode);
+        while (bk->head && e && e->type == TYPE_LIST) {
+            Waiter *w = bk->head->w;
+            Msg *res = msg_new(MSG_RES, loop, w->conn, NULL, 0);
+            e = out_blocking_pop(&res->res, e, w->front);
+            if (aof_must_hold(loop)) {
+                loop_hold(loop, (Held){.to = w->from, .m = res});
+            } else {
+                msg_send(w->from, res);
+            }
+            block_remove(bi, w);
+        }
+        bk->ready = false;
+        if (!bk->head) {
+            bkey_free(bi, bk);
+        }
+    }
+}
+
+// answer the waiters whose timeout has passed with nil
+static void loop_expire_blocked(Loop *loop) {
+    BlockIndex *bi = &blocks[loop->id];
+    uint64_t now_ms = get_wall_ms();
+    HeapNode *top;
+    while ((top = heap_top(&bi->deadlines)) && top->at_ms <= now_ms) {
+        Waiter *w = container_of(top, Waiter, deadline);
+        Msg *res = msg_new(MSG_RES, loop, w->conn, NULL, 0);
+        out_nil(&res->res);
+        msg_send(w->from, res);
+        block_remove(bi, w);
+    }
+}
+
+// execute the request at the front of rbuf, appending its reply to wbuf;
+// returns whether another one may follow
+static bool try_one_request(struct Conn *conn) {
+    // replies go out in request order, so nothing new starts while one is
+    // pending from another thread
+    if (conn->state == STATE_END || conn->waiting || out_len(&conn->wbuf) >= PIPELINE_FLUSH_AT) {
+        return false;
+    }
+    if (buf_len(&conn->rbuf) < 4) {    // ensure enough data is available for a message header
+        return false;
+    }
+    const uint8_t *req = conn->rbuf.data + conn->rbuf.start;
+    uint32_t len = 0;
+    memcpy(&len, req, 4);           // extract message length
+    // the primary's stream is taken whatever its size: it was accepted there
+    // already, and refusing it would only resync the same write again
+    if(len > config.max_msg_size && !conn->primary) { // validate message length
+        msg("request too long");
+        conn->state = STATE_END;
+        return false;
+    }
+    if (4 + (size_t)len > buf_len(&conn->rbuf)) {   // check if the complete message has been received
+        return false;
+    }
+
+    // parse the body into a list of strings
+    Arg args[MAX_ARGS];
+    uint32_t nstr = 0;
+    if (parse_req(&req[4], len, &nstr, args, MAX_ARGS) < 0) {
+        msg("bad request");
+        conn->state = STATE_END;
+        return false;
+    }
+
+    if (log_enabled(LOG_DEBUG)) {
+        log_request(conn, args, nstr);
+    }
+    if (nstr > 0 && arg_is(&args[0], "psync")) {
+        // a replica: once the replies before it have gone, thread 0 takes
+        // the connection over and streams the keyspace and its writes
+        if (out_len(&conn->wbuf) == 0) {
+            conn->state = STATE_SYNC;
+        }
+        return false;
+    }
+    if (conn->primary) {
+        repl.link_offset += 4 + (uint64_t)len;
+    }
+
+    Loop *loop = conn->loop;
+    int32_t route = req_route(args, nstr);
+    bool forwarded = false;
+    uint64_t timeout_ms = 0;
+    uint32_t cmd = repl.primary_port != 0 && !conn->primary && nstr > 0 ? cmd_lookup(&args[0]) : CMD_NONE;
+    if (cmd != CMD_NONE && (commands[cmd].flags & CMD_WRITE)) {
+        // a replica only takes writes from its primary
+        uint8_t *hdr = out_len_begin(&conn->wbuf);
+        out_err(&conn->wbuf, ERR_READONLY, READONLY_MSG);
+        out_len_end(&conn->wbuf, hdr);
+        conn->replies_due++;
+    } else if (conn->primary && route >= 0 && (uint32_t)route != loop->id) {
+        // the primary's replies are dropped, so its stream never waits on
+        // another shard; each inbox is FIFO, which keeps every shard's
+        // writes in stream order
+        msg_send(&loops[route], msg_new(MSG_APPLY, loop, NULL, &req[4], len));
+    } else if (route == ROUTE_ALL && loop->id != 0) {
+        msg_send(&loops[0], msg_new(MSG_REQ_ALL, loop, conn, &req[4], len));
+        forwarded = true;
+    } else if (route >= 0 && (uint32_t)route != loop->id) {
+        msg_send(&loops[route], msg_new(MSG_REQ, loop, conn, &req[4], len));
+        forwarded = true;
+    } else if (route != ROUTE_ALL && !conn->primary && block_must_wait(args, nstr, &timeout_ms)) {
+        // wait here, answered by a MSG_RES just like a forwarded request
+        block_park(loop->id, loop, conn, &args[1], nstr - 2, arg_is(&args[0], "blpop"),
+            timeout_ms ? get_wall_ms() + timeout_ms : 0);
+        forwarded = true;
+    } else {
+        // build the response after a 4-byte header that is filled in once its size is known
+        uint8_t *hdr = out_len_begin(&conn->wbuf);
+        if (route == ROUTE_ALL) {
+            do_request_all(args, nstr, &conn->wbuf, conn->primary);
+        } else {
+            do_request(args, nstr, &conn->wbuf, conn->primary);
+        }
+        out_len_end(&conn->wbuf, hdr);
+        conn->replies_due++;
+        if (blocks[loop->id].ready) {
+            loop_serve_blocked(loop);
+        }
+    }
+    if (conn->primary) {
+        out_consume(&conn->wbuf, out_len(&conn->wbuf));     // the primary isn't listening
+    }
+    bool blocking = forwarded && (arg_is(&args[0], "blpop") || arg_is(&args[0], "brpop"));
+    uint64_t hcode = blocking ? hash_bytes(args[1].data, args[1].len) : 0;
+
+    buf_consume(&conn->rbuf, 4 + (size_t)len);  // remove processed data from the read buffer
+    if (forwarded) {
+        conn->waiting = true;   // the owning thread's MSG_RES is spliced onto wbuf
+        if (blocking) {
+            conn->state = STATE_BLOCKED;
+            conn->blocked = true;
+            conn->block_hcode = hcode;
+        }
+        return false;
+    }
+    return true;
+}
+
+// once the batch is built, switch to sending it
+static void conn_start_flush(struct Conn *conn) {
+    if (conn->primary) {
+        out_consume(&conn->wbuf, out_len(&conn->wbuf));     // forwarded replies to the stream
+        conn->replies_due = 0;
+        return;
+    }
+    if (conn->state == STATE_REQ && out_len(&conn->wbuf) > 0) {
+        if (aof_must_hold(conn->loop)) {
+            if (!conn->held) {
+                conn->held = true;
+                loop_hold(conn->loop, (Held){.conn = conn});
+            }
+            return;
+        }
+        conn->state = STATE_RES;
+    }
+}
+
+// fill read buffer with data
+static bool try_fill_buffer(struct Conn *conn) {
+    // continuously read data from the client and fill the connection's read buffer
+    while (1) {
+        if (conn->state != STATE_REQ) {
+            return false;
+        }
+        // a full batch of replies, or one pending from another thread: send
+        // what is ready before reading more, so the buffers can't grow
+        // without bound
+        if (conn->waiting || out_len(&conn->wbuf) >= PIPELINE_FLUSH_AT) {
+            conn_start_flush(conn);
+            return false;
+        }
+        // make room for the rest of a partially received message in one go,
+        // and for at least a decent chunk otherwise
+        size_t want = BUF_READ_CHUNK;
+        if (buf_len(&conn->rbuf) >= 4) {
+            uint32_t len = 0;
+            memcpy(&len, conn->rbuf.data + conn->rbuf.start, 4);
+            size_t missing = 4 + (size_t)len - buf_len(&conn->rbuf);
+            if ((len <= config.max_msg_size || conn->primary) && missing > want) {
+                want = missing;
+            }
+        }
+        buf_reserve(&conn->rbuf, want);
+        size_t cap = conn->rbuf.cap - conn->rbuf.end;                       // calculate the available space in the buffer
+        ssize_t rv = read(conn->fd, conn->rbuf.data + conn->rbuf.end, cap); // number of bytes read
+        
+        // nonblocking check
+        if (rv < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {  // if no more data is available
+            conn_start_flush(conn);     // send every reply from this read burst at once
+            return false;
+        }
+
+        // error handling
+        if (rv <= 0) {
+            if (rv == 0) {
+                log_at(LOG_INFO, "fd %d: client closed the connection", conn->fd);
+            } else {
+                log_at(LOG_WARN, "fd %d: read() error: %s", conn->fd, strerror(errno));
+            }
+            conn->state = STATE_END;
+            return false;
+        }
+
+        // buffer update
+        conn->rbuf.end += rv;               // grow the buffered data by rv
+        conn->last_active_ms = get_wall_ms();
+        if (conn->read_ticks == 0) {
+            conn->read_ticks = ticks_now();
+        }
+        while (try_one_request(conn)) {}    // process requests from the buffer until no more complete requests remain
+        buf_shrink(&conn->rbuf, false);
+    }
+    return true;
+}
+
+// every reply in wbuf has been written: time the requests they answer from
+// when they were read. Requests still buffered, or forwarded and not yet
+// answered, keep that read time.
+static void conn_replied(struct Conn *conn) {
+    if (conn->replies_due > 0 && conn->read_ticks != 0) {
+        hist_add(&thread_stats[conn->loop->id].read_reply, ticks_now() - conn->read_ticks, conn->replies_due);
+    }
+    conn->replies_due = 0;
+    if (buf_len(&conn->rbuf) == 0 && !conn->waiting) {
+        conn->read_ticks = 0;
+    }
+}
+
+// flush write buffer
+static bool try_flush_buffer(struct Conn *conn) {
+    // continuously write the connection's reply chain to the client, up to
+    // OUT_IOV_MAX segments per writev()
+    while (1) {
+        struct iovec iov[OUT_IOV_MAX];
+        int niov = out_iov(&conn->wbuf, iov, OUT_IOV_MAX);
+        ssize_t rv = writev(conn->fd, iov, niov);
+
+        // nonblocking check
+        if (rv < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) { // if the socket's write buffer is full
+            return false;
+        }
+
+        // error handling
+        if (rv <= 0) {
+            log_at(LOG_WARN, "fd %d: writev() error: %s", conn->fd, strerror(errno));
+            conn->state = STATE_END;
+            return false;
+        }
+
+        // buffer update
+        out_consume(&conn->wbuf, (size_t)rv);
+        if (out_len(&conn->wbuf) == 0) {
+            conn_replied(conn);
+        }
+        if (out_len(&conn->wbuf) == 0 && conn->state == STATE_BLOCKED) {
+            return false;   // nothing else goes out until the blocking pop is answered
+        }
+        if (out_len(&conn->wbuf) == 0) {
+            conn->state = STATE_REQ;    // when fully sent, the state transitions back to STATE_REQ
+
+            // run requests that were already buffered behind a full batch; if
+            // they were answered on the spot keep writing, as epoll won't
+            // report writable again
+            while (try_one_request(conn)) {}
+            conn_start_flush(conn);
+            if (conn->state != STATE_RES) {
+                return false;
+            }
+        }
+    }
+}
+
+// A blocked connection still sends the replies to requests before its
+// blocking pop, held as usual under --aof-fsync always. Its input stays
+// unread until the pop is answered; loop_run() notices a hangup from the
+// EPOLLRDHUP it asks for meanwhile.
+static void conn_blocked_io(struct Conn *conn) {
+    if (out_len(&conn->wbuf) == 0 || conn->held) {
+        return;
+    }
+    if (aof_must_hold(conn->loop)) {
+        conn->held = true;
+        loop_hold(conn->loop, (Held){.conn = conn});
+        return;
+    }
+    try_flush_buffer(conn);
+}
+
+// A replica's connection: after the reply to its PSYNC (and the snapshot,
+// which a child writes) it carries the stream, moved from its pending buffer
+// a chunk at a time. All a replica sends is REPLCONF ACK <offset>, once a
+// second.
+static void replica_io(struct Conn *conn) {
+    pthread_mutex_lock(&repl.mu);
+    bool overflow = conn->repl_overflow;
+    pthread_mutex_unlock(&repl.mu);
+    if (overflow) {
+        log_at(LOG_WARN, "fd %d: replica is more than --repl-buffer-limit behind, dropping it", conn->fd);
+        conn->state = STATE_END;
+        return;
+    }
+    if (conn->sync_child) {
+        return;     // the child has the socket, in blocking mode, until it exits
+    }
+    while (1) {
+        buf_reserve(&conn->rbuf, BUF_READ_CHUNK);
+        ssize_t rv = read(conn->fd, conn->rbuf.data + conn->rbuf.end, conn->rbuf.cap - conn->rbuf.end);
+        if (rv < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }
+        if (rv <= 0) {
+            log_at(LOG_INFO, "fd %d: replica closed the connection", conn->fd);
+            conn->state = STATE_END;
+            return;
+        }
+        conn->rbuf.end += (size_t)rv;
+    }
+    while (buf_len(&conn->rbuf) >= 4) {
+        const uint8_t *req = conn->rbuf.data + conn->rbuf.start;
+        uint32_t len = 0;
+        memcpy(&len, req, 4);
+        if (len > REPL_ACK_MAX) {
+            log_at(LOG_WARN, "fd %d: replica sent something other than an ack", conn->fd);
+            conn->state = STATE_END;
+            return;
+        }
+        if (4 + (size_t)len > buf_len(&conn->rbuf)) {
+            break;
+        }
+        Arg args[3];
+        uint32_t nstr = 0;
+        int64_t off = 0;
+        if (parse_req(&req[4], len, &nstr, args, 3) == 0 && nstr == 3 && arg_is(&args[0], "replconf")
+                && arg_is(&args[1], "ack") && arg_to_i64(&args[2], &off) && off >= 0) {
+            conn->repl_ack = (uint64_t)off;
+            conn->repl_ack_ms = get_wall_ms();
+        }
+        buf_consume(&conn->rbuf, 4 + (size_t)len);
+    }
+    while (1) {
+        if (out_len(&conn->wbuf) == 0) {
+            pthread_mutex_lock(&repl.mu);
+            size_t n = buf_len(&conn->repl_pending);
+            n = n < REPL_SEND_CHUNK ? n : REPL_SEND_CHUNK;
+            out_append(&conn->wbuf, conn->repl_pending.data + conn->repl_pending.start, n);
+            buf_consume(&conn->repl_pending, n);
+            buf_shrink(&conn->repl_pending, false);
+            pthread_mutex_unlock(&repl.mu);
+            if (n == 0) {
+                return;
+            }
+        }
+        struct iovec iov[OUT_IOV_MAX];
+        int niov = out_iov(&conn->wbuf, iov, OUT_IOV_MAX);
+        ssize_t rv = writev(conn->fd, iov, niov);
+        if (rv < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return;     // EPOLLOUT brings us back
+        }
+        if (rv <= 0) {
+            log_at(LOG_WARN, "fd %d: writev() to replica error: %s", conn->fd, strerror(errno));
+            conn->state = STATE_END;
+            return;
+        }
+        out_consume(&conn->wbuf, (size_t)rv);
+    }
+}
+
+// manages state transitions
+static void connection_io(struct Conn *conn) {
+    // edge-triggered: keep servicing the connection until its current state's
+    // I/O would block, since epoll will not report the same readiness again
+    while (1) {
+        uint32_t state = conn->state;
+        if (state == STATE_REQ) {
+            try_fill_buffer(conn);  // fill the read buffer
+        } else if (state == STATE_RES) {
+            try_flush_buffer(conn); // flush the write buffer
+        } else if (state == STATE_BLOCKED) {
+            conn_blocked_io(conn);
+        } else if (state == STATE_REPLICA) {
+            replica_io(conn);
+        }
+        if (conn->state == state || conn->state == STATE_END) {
+            break;
+        }
+    }
+    // only touch epoll when the state actually moved between REQ and RES
+    if (conn->state != STATE_END && conn->state != STATE_SYNC && state_events(conn->state) != conn->events) {
+        conn->events = state_events(conn->state);
+        struct epoll_event ev = {.events = conn->events, .data.fd = conn->fd};
+        if (epoll_ctl(conn->loop->epfd, EPOLL_CTL_MOD, conn->fd, &ev) < 0) {
+            msg("epoll_ctl() error");
+            conn->state = STATE_END;
+        }
+    }
+}
+
+// cleanup a closed connection. If a forwarded request is still in flight the
+// Conn itself is kept until its MSG_RES comes back, since that carries a
+// pointer to it, and likewise while it is on its loop's held list; the fd is
+// released now either way.
+static void conn_close(struct Conn *conn) {
+    Loop *loop = conn->loop;
+    if (conn->blocked) {
+        // take its waiter off the shard, which then sends the MSG_RES that
+        // frees the Conn, unless an answer is already on its way
+        uint32_t shard = shard_idx(conn->block_hcode);
+        if (shard != loop->id) {
+            msg_send(&loops[shard], msg_new(MSG_UNBLOCK, loop, conn, (const uint8_t *)&conn->block_hcode, 8));
+        } else if (block_cancel(shard, conn, conn->block_hcode)) {
+            conn->waiting = false;
+            conn->blocked = false;
+        }
+    }
+    if (conn == repl.link) {
+        if (!repl.relink) {     // rather than dropped by REPLICAOF
+            log_at(LOG_WARN, "lost the link to primary %s:%d", repl.primary_host, repl.primary_port);
+        }
+        repl.link = NULL;
+        repl.link_state = REPL_LINK_CONNECT;
+        repl.retry_ms = get_wall_ms() + REPL_RETRY_MS;
+        buf_consume(&repl.ack_buf, buf_len(&repl.ack_buf));
+    }
+    pthread_mutex_lock(&repl.mu);
+    for (size_t i = 0; i < repl.nreplicas; i++) {
+        if (repl.replicas[i] == conn) {
+            repl.replicas[i] = repl.replicas[--repl.nreplicas];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&repl.mu);
+    buf_free(&conn->repl_pending);
+    if (conn->sync_child) {     // a full sync nobody will read
+        kill(conn->sync_child, SIGKILL);
+        waitpid(conn->sync_child, NULL, 0);
+    }
+    loop->fd2conn[conn->fd] = NULL;
+    close(conn->fd);    // closing also removes it from the epoll set
+    buf_free(&conn->rbuf);
+    out_free(&conn->wbuf);
+    if (!conn->waiting && !conn->held) {
+        free(conn);
+    }
+}
+
+// ---- idle connection housekeeping ----
+// Every CONN_CRON_INTERVAL_MS a loop looks at a slice of its connection table,
+// sized so the whole table is covered about once a second, and frees the
+// drained buffers of connections that have been quiet for a while. A burst
+// that grew a buffer to megabytes doesn't pin that memory forever.
+
+#define CONN_CRON_INTERVAL_MS 100
+#define CONN_IDLE_MS 2000   // quiet this long and a connection's empty buffers are freed
+
+static void conn_cron(Loop *loop, uint64_t now_ms) {
+    if (now_ms - loop->cron_last_ms < CONN_CRON_INTERVAL_MS || loop->fd2conn_cap == 0) {
+        return;
+    }
+    loop->cron_last_ms = now_ms;
+    size_t n = loop->fd2conn_cap / (1000 / CONN_CRON_INTERVAL_MS) + 1;
+    for (size_t i = 0; i < n; i++) {
+        loop->cron_cursor = (loop->cron_cursor + 1) % loop->fd2conn_cap;
+        struct Conn *conn = loop->fd2conn[loop->cron_cursor];
+        if (conn && now_ms - conn->last_active_ms >= CONN_IDLE_MS) {
+            buf_shrink(&conn->rbuf, true);
+            out_shrink(&conn->wbuf, true);
+        }
+    }
+}
+
+// ---- replication ----
+// REPLICAOF host port (or --replicaof) makes this server a replica. Thread 0
+// starts a replication thread, which connects to the primary and sends
+// PSYNC <replid> <offset>: the history it holds a copy of, "?" for none, and
+// how much of it has been applied. The primary answers CONTINUE <replid>
+// when those bytes are still in its backlog, or FULLRESYNC <replid> <offset>
+// followed by a snapshot of its keyspace as of that offset. The thread
+// receives the snapshot into a file; thread 0 then loads it with the other
+// threads parked and turns the socket into an ordinary connection whose
+// requests are the primary's stream. They are applied like any client's
+// and their replies dropped, except that a write for another thread's shard
+// is passed to it without waiting, so the stream never stalls on a round
+// trip between threads. Once a second the replica sends REPLCONF ACK with
+// how far it has got. Clients may read from a replica; writes get READONLY.
+//
+// On the primary a PSYNC connection moves to thread 0, which serves every
+// replica. A partial sync is sent the backlog from the replica's offset on;
+// from then on, like after a full sync, every loop appends the stream to the
+// replica's own pending buffer, which thread 0 drains into the socket. A
+// full sync forks, like BGSAVE, and the child writes the FULLRESYNC reply and
+// the snapshot straight down the socket; the stream after it waits in the
+// buffer until the child exits. A replica whose buffer would pass
+// --repl-buffer-limit is dropped, and resyncs when it reconnects.
+
+// a sync attempt, filled in by the replication thread for thread 0
+typedef struct {
+    uint64_t gen;                       // repl.link_gen when it started
+    char host[256];
+    int port;
+    char replid[REPL_ID_LEN + 1];       // the history we ask to continue
+    uint64_t offset;
+    char path[4096];                    // where a full sync's snapshot is received
+    int fd;                             // the connected link, or -1 if it failed
+    bool full;
+    char primary_replid[REPL_ID_LEN + 1];
+    uint64_t primary_offset;            // the stream offset the link carries on from
+    const char *err;
+} ReplSync;
+
+static int read_full(int fd, uint8_t *data, size_t len) {
+    while (len > 0) {
+        ssize_t rv = read(fd, data, len);
+        if (rv < 0 && errno == EINTR) {
+            continue;
+        }
+        if (rv <= 0) {
+            return -1;
+        }
+        data += rv;
+        len -= (size_t)rv;
+    }
+    return 0;
+}
+
+// whether a replica that has the history replid up to offset can be sent
+// just the rest of it, starting at *from. Called with repl.mu held.
+static bool repl_can_continue(const Arg *replid, const Arg *offset, uint64_t *from) {
+    int64_t off = 0;
+    if (replid->len != REPL_ID_LEN || memcmp(replid->data, repl.replid, REPL_ID_LEN) != 0
+            || !arg_to_i64(offset, &off) || off < 0) {
+        return false;
+    }
+    bool ok = repl.backlog && (uint64_t)off >= repl.backlog_off && (uint64_t)off <= repl.offset;
+    *from = (uint64_t)off;
+    return ok;
+}
+
+// a full sync, in a child forked with every thread parked: the FULLRESYNC
+// reply, then the snapshot, written in blocking mode
+static int repl_send_snapshot(int fd, uint64_t offset) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    struct timeval tv = {.tv_sec = REPL_SYNC_TIMEOUT_S};
+    if (flags < 0 || fcntl(fd, F_SETFL, flags & ~O_NONBLOCK) < 0
+            || setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) < 0) {
+        return -1;
+    }
+    uint8_t frame[128];
+    int n = snprintf((char *)&frame[5], sizeof(frame) - 5, "FULLRESYNC %s %llu", repl.replid, (unsigned long long)offset);
+    uint32_t len = 1 + (uint32_t)n;
+    memcpy(frame, &len, 4);
+    frame[4] = RES_STR;
+    if (write_full(fd, frame, 4 + len) < 0) {
+        return -1;
+    }
+    return snapshot_write(fd) < 0 ? -1 : 0;
 }
 
-static uint32_t out_err(uint8_t *out, uint32_t code, const char *emsg) {
-    out[0] = RES_ERR;
-    memcpy(&out[1], &code, 4);
-    size_t mlen = strlen(emsg);
-    memcpy(&out[5], emsg, mlen);
-    return 5 + (uint32_t)mlen;
+// serve a connection that sent PSYNC as a replica; on thread 0, with the
+// request still in its rbuf. A malformed PSYNC asks for a full sync, like
+// PSYNC ? -1.
+static void repl_psync(struct Conn *conn) {
+    Loop *loop = &loops[0];
+    bool moved = conn->loop != loop;
+    conn->loop = loop;
+    conn_put(loop, conn);
+    conn->state = STATE_REPLICA;
+    conn->events = state_events(STATE_REPLICA);
+    struct epoll_event ev = {.events = conn->events, .data.fd = conn->fd};
+    if (epoll_ctl(loop->epfd, moved ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, conn->fd, &ev) < 0) {
+        msg("epoll_ctl() error");
+        conn->state = STATE_END;
+        conn_close(conn);
+        return;
+    }
+
+    const uint8_t *req = conn->rbuf.data + conn->rbuf.start;
+    uint32_t len = 0;
+    memcpy(&len, req, 4);
+    Arg args[3];
+    uint32_t nstr = 0;
+    uint64_t from = 0;
+    bool parsed = parse_req(&req[4], len, &nstr, args, 3) == 0 && nstr == 3;
+    bool asked = nstr == 3 && !arg_is(&args[1], "?");
+    // the check, the catch-up copy and joining the replicas are one step,
+    // so that no loop's append falls between them
+    pthread_mutex_lock(&repl.mu);
+    bool partial = parsed && repl_can_continue(&args[1], &args[2], &from);
+    if (partial) {
+        char text[16 + REPL_ID_LEN];
+        int n = snprintf(text, sizeof(text), "CONTINUE %s", repl.replid);
+        uint8_t *hdr = out_len_begin(&conn->wbuf);
+        out_str(&conn->wbuf, (const uint8_t *)text, (size_t)n);
+        out_len_end(&conn->wbuf, hdr);
+        repl_backlog_copy(from, &conn->wbuf, SIZE_MAX);
+        repl_add_replica(conn);
+    }
+    pthread_mutex_unlock(&repl.mu);
+    buf_consume(&conn->rbuf, 4 + (size_t)len);
+    if (partial) {
+        repl.sync_partial_ok++;
+        log_at(LOG_INFO, "fd %d: replica continues from offset %llu", conn->fd, (unsigned long long)from);
+    } else {
+        repl.sync_partial_err += asked;
+        repl.sync_full++;
+        stop_world();
+        // what the other loops logged so far is in the snapshot, and must
+        // not be streamed on top of it
+        for (uint32_t i = 0; i < nloops; i++) {
+            aof_write_batch(&loops[i]);
+        }
+        if (!repl.backlog) {
+            repl_backlog_create();
+        }
+        uint64_t offset = repl.offset;
+        pid_t pid = fork();
+        if (pid == 0) {
+            _exit(repl_send_snapshot(conn->fd, offset) < 0 ? 1 : 0);
+        }
+        if (pid > 0) {
+            // the stream after the snapshot waits in its buffer
+            pthread_mutex_lock(&repl.mu);
+            repl_add_replica(conn);
+            pthread_mutex_unlock(&repl.mu);
+        }
+        resume_world();
+        if (pid < 0) {
+            log_at(LOG_WARN, "fd %d: fork() for a full sync failed: %s", conn->fd, strerror(errno));
+            conn->state = STATE_END;
+        } else {
+            conn->sync_child = pid;
+            log_at(LOG_INFO, "fd %d: full sync to a replica at offset %llu", conn->fd, (unsigned long long)offset);
+        }
+    }
+    connection_io(conn);
+    if (conn->state == STATE_END) {
+        conn_close(conn);
+    }
 }
 
-static uint32_t out_str(uint8_t *out, const uint8_t *data, size_t len) {
-    out[0] = RES_STR;
-    memcpy(&out[1], data, len);
-    return 1 + (uint32_t)len;
+// hand a connection that sent PSYNC over to thread 0
+static void repl_handoff(struct Conn *conn) {
+    Loop *loop = conn->loop;
+    if (loop->id == 0) {
+        repl_psync(conn);
+        return;
+    }
+    epoll_ctl(loop->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+    loop->fd2conn[conn->fd] = NULL;
+    msg_send(&loops[0], msg_new(MSG_PSYNC, loop, conn, NULL, 0));
 }
 
-static uint32_t out_int(uint8_t *out, int64_t val) {
-    out[0] = RES_INT;
-    memcpy(&out[1], &val, 8);
-    return 9;
+// after a connection's I/O: close it if it ended, or pass it on if it has
+// become a replica's
+static void conn_finish_io(struct Conn *conn) {
+    if (conn->state == STATE_END) {
+        conn_close(conn);
+    } else if (conn->state == STATE_SYNC) {
+        repl_handoff(conn);
+    }
 }
 
-// case-insensitive check for whether an Arg matches a literal command name
-static bool arg_is(const Arg *a, const char *s) {
-    size_t slen = strlen(s);
-    return a->len == slen && strncasecmp((const char *)a->data, s, slen) == 0;
+// connect to host:port with blocking socket timeouts, or -1
+static int repl_connect(const char *host, int port) {
+    struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM}, *res = NULL;
+    char service[8];
+    snprintf(service, sizeof(service), "%d", port);
+    if (getaddrinfo(host, service, &hints, &res) != 0) {
+        return -1;
+    }
+    int fd = -1;
+    for (struct addrinfo *ai = res; ai && fd < 0; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd < 0) {
+            continue;
+        }
+        struct timeval tv = {.tv_sec = REPL_SYNC_TIMEOUT_S};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) < 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(res);
+    return fd;
 }
 
-// parse an Arg (not null-terminated) as a base-10 signed integer
-static bool arg_to_i64(const Arg *a, int64_t *out) {
-    if (a->len == 0 || a->len > 20) {
-        return false;
+// receive a snapshot from fd into a new file at path: the header, then
+// blocks until the empty one that ends it
+static const char *repl_recv_snapshot(int fd, const char *path) {
+    int out = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out < 0) {
+        return "can't create the snapshot file";
     }
-    char buf[21];
-    memcpy(buf, a->data, a->len);
-    buf[a->len] = '\0';
+    const char *err = NULL;
+    uint8_t *chunk = malloc(SNAP_BLOCK_SIZE);
+    if (!chunk) {
+        die("malloc()");
+    }
+    uint8_t header[SNAP_HEADER_SIZE];
+    if (read_full(fd, header, sizeof(header)) < 0 || write_full(out, header, sizeof(header)) < 0) {
+        err = "snapshot cut short";
+    }
+    while (!err) {
+        uint8_t bh[SNAP_BLOCK_HEADER_SIZE];
+        uint32_t len = 0;
+        if (read_full(fd, bh, sizeof(bh)) < 0 || write_full(out, bh, sizeof(bh)) < 0) {
+            err = "snapshot cut short";
+            break;
+        }
+        memcpy(&len, bh, 4);
+        if (len == 0) {
+            break;  // the end marker
+        }
+        while (len > 0 && !err) {
+            uint32_t n = len < SNAP_BLOCK_SIZE ? len : SNAP_BLOCK_SIZE;
+            if (read_full(fd, chunk, n) < 0 || write_full(out, chunk, n) < 0) {
+                err = "snapshot cut short";
+            }
+            len -= n;
+        }
+    }
+    free(chunk);
+    if ((fsync(out) < 0 || close(out) < 0) && !err) {
+        err = "can't write the snapshot file";
+    }
+    if (err) {
+        unlink(path);
+    }
+    return err;
+}
 
+// the replication thread's exchange with the primary over s->fd
+static const char *repl_sync(ReplSync *s) {
+    char off[24];
+    int n = snprintf(off, sizeof(off), "%llu", (unsigned long long)s->offset);
+    Arg args[3] = {{5, (const uint8_t *)"psync"}, {(uint32_t)strlen(s->replid), (const uint8_t *)s->replid},
+        {(uint32_t)n, (const uint8_t *)off}};
+    Buf req = {0};
+    aof_append_cmd(&req, args, 3);
+    int rv = write_full(s->fd, req.data + req.start, buf_len(&req));
+    buf_free(&req);
+    if (rv < 0) {
+        return "can't send PSYNC";
+    }
+    uint8_t reply[128];
+    uint32_t len = 0;
+    if (read_full(s->fd, (uint8_t *)&len, 4) < 0 || len < 1 || len >= sizeof(reply) || read_full(s->fd, reply, len) < 0) {
+        return "bad reply to PSYNC";
+    }
+    reply[len] = '\0';
+    const char *text = (const char *)&reply[1];
+    if (reply[0] != RES_STR) {
+        return "PSYNC refused";
+    }
+    if (strncmp(text, "CONTINUE ", 9) == 0 && strlen(text + 9) == REPL_ID_LEN) {
+        memcpy(s->primary_replid, text + 9, REPL_ID_LEN + 1);
+        s->primary_offset = s->offset;
+        return NULL;
+    }
     char *end = NULL;
+    if (strncmp(text, "FULLRESYNC ", 11) != 0 || strlen(text + 11) < REPL_ID_LEN + 2 || text[11 + REPL_ID_LEN] != ' ') {
+        return "bad reply to PSYNC";
+    }
+    memcpy(s->primary_replid, text + 11, REPL_ID_LEN);
+    s->primary_replid[REPL_ID_LEN] = '\0';
     errno = 0;
-    long long v = strtoll(buf, &end, 10);
-    if (errno != 0 || end != buf + a->len) {
-        return false;
+    s->primary_offset = strtoull(text + 12 + REPL_ID_LEN, &end, 10);
+    if (errno != 0 || *end != '\0') {
+        return "bad reply to PSYNC";
     }
-    *out = (int64_t)v;
-    return true;
+    s->full = true;
+    return repl_recv_snapshot(s->fd, s->path);
 }
 
-// real command dispatch: GET key / SET key value / DEL key
-static uint32_t do_request(const Arg *args, uint32_t nstr, uint8_t *out_buf) {
-    if (nstr == 0) {
-        return out_err(out_buf, ERR_BAD_ARGS, "empty command");
+// the replication thread: connects and syncs, blocking, while thread 0
+// carries on serving, then hands the outcome to thread 0
+static void *repl_sync_thread_run(void *arg) {
+    ReplSync *s = (ReplSync *)arg;
+    s->fd = repl_connect(s->host, s->port);
+    s->err = s->fd < 0 ? "can't connect" : repl_sync(s);
+    if (s->err && s->fd >= 0) {
+        close(s->fd);
+        s->fd = -1;
     }
-    if (arg_is(&args[0], "get")) {
-        if (nstr != 2) {
-            return out_err(out_buf, ERR_BAD_ARGS, "wrong number of arguments for 'get'");
-        }
-        Entry *e = h_lookup(args[1].data, args[1].len);
-        if (!e) {
-            return out_nil(out_buf);
+    msg_send(&loops[0], msg_new(MSG_SYNCED, NULL, NULL, (const uint8_t *)&s, sizeof(s)));
+    return NULL;
+}
+
+// on thread 0: load a full sync, then start applying the primary's stream
+static void repl_sync_done(ReplSync *s) {
+    if (s->gen != repl.link_gen) {     // REPLICAOF has moved on since
+        if (s->fd >= 0) {
+            close(s->fd);
         }
-        size_t vlen = e->vlen > MAX_MSG_SIZE - 1 ? MAX_MSG_SIZE - 1 : e->vlen;
-        return out_str(out_buf, (const uint8_t *)e->val, vlen);
-    }
-    if (arg_is(&args[0], "set")) {
-        if (nstr != 3) {
-            return out_err(out_buf, ERR_BAD_ARGS, "wrong number of arguments for 'set'");
+        if (s->full) {
+            unlink(s->path);
         }
-        h_set(args[1].data, args[1].len, args[2].data, args[2].len);
-        return out_str(out_buf, (const uint8_t *)"OK", 2);
+        free(s);
+        return;
     }
-    if (arg_is(&args[0], "del")) {
-        if (nstr != 2) {
-            return out_err(out_buf, ERR_BAD_ARGS, "wrong number of arguments for 'del'");
-        }
-        bool deleted = h_del(args[1].data, args[1].len);
-        return out_int(out_buf, deleted ? 1 : 0);
+    if (s->err) {
+        log_at(LOG_WARN, "sync with primary %s:%d failed: %s", s->host, s->port, s->err);
+        repl.link_state = REPL_LINK_CONNECT;
+        repl.retry_ms = get_wall_ms() + REPL_RETRY_MS;
+        free(s);
+        return;
     }
-    if (arg_is(&args[0], "expire")) {
-        if (nstr != 3) {
-            return out_err(out_buf, ERR_BAD_ARGS, "wrong number of arguments for 'expire'");
+    if (s->full) {
+        uint64_t start_ms = get_wall_ms();
+        long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+        const char *err = NULL;
+        stop_world();
+        for (uint32_t i = 0; i < nloops; i++) {
+            aof_write_batch(&loops[i]);
+            shard_flush(&shards[i]);
         }
-        int64_t secs = 0;
-        if (!arg_to_i64(&args[2], &secs)) {
-            return out_err(out_buf, ERR_BAD_ARGS, "expire time is not an integer");
+        strcpy(repl.link_replid, "?");     // until the load is through
+        int64_t loaded = snapshot_load(s->path, ncpus > 0 ? (uint32_t)ncpus : 1, &err);
+        if (loaded >= 0) {
+            if (rename(s->path, config.snapshot) < 0) {
+                unlink(s->path);
+            }
+            // our own history ends here: replicas of ours must sync again
+            repl_new_id(repl.replid);
+            repl.backlog_off = repl.offset;
+            while (repl.nreplicas > 0) {
+                repl.replicas[0]->state = STATE_END;
+                conn_close(repl.replicas[0]);
+            }
+            if (aof.fd >= 0 && (persist.child != 0 || aof_bgrewrite(config.aof) < 0)) {
+                log_at(LOG_WARN, "the AOF still holds the data from before the sync until BGREWRITEAOF");
+            }
+        } else {
+            unlink(s->path);
         }
-        Entry *e = h_lookup(args[1].data, args[1].len);
-        if (!e) {
-            return out_int(out_buf, 0);   // key doesn't exist, nothing to expire
+        resume_world();
+        if (loaded < 0) {
+            log_at(LOG_WARN, "can't load the snapshot from primary %s:%d: %s", s->host, s->port, err);
+            close(s->fd);
+            repl.link_state = REPL_LINK_CONNECT;
+            repl.retry_ms = get_wall_ms() + REPL_RETRY_MS;
+            free(s);
+            return;
         }
-        e->expire_at = time(NULL) + (time_t)secs;
-        return out_int(out_buf, 1);
+        log_at(LOG_INFO, "full sync from primary %s:%d: %lld keys in %llu ms", s->host, s->port,
+            (long long)loaded, (unsigned long long)(get_wall_ms() - start_ms));
+    } else {
+        log_at(LOG_INFO, "continuing from primary %s:%d at offset %llu", s->host, s->port,
+            (unsigned long long)s->offset);
     }
-    if (arg_is(&args[0], "ttl")) {
-        if (nstr != 2) {
-            return out_err(out_buf, ERR_BAD_ARGS, "wrong number of arguments for 'ttl'");
-        }
-        Entry *e = h_lookup(args[1].data, args[1].len);
-        if (!e) {
-            return out_int(out_buf, -2);   // key does not exist
-        }
-        if (e->expire_at == 0) {
-            return out_int(out_buf, -1);   // key exists but has no TTL
-        }
-        int64_t remaining = (int64_t)(e->expire_at - time(NULL));
-        if (remaining < 0) {
-            remaining = 0;
-        }
-        return out_int(out_buf, remaining);
+    memcpy(repl.link_replid, s->primary_replid, sizeof(repl.link_replid));
+    repl.link_offset = s->primary_offset;
+    fd_set_nb(s->fd);
+    int one = 1;
+    setsockopt(s->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    struct Conn *conn = conn_new(&loops[0], s->fd);
+    free(s);
+    if (!conn) {
+        repl.link_state = REPL_LINK_CONNECT;
+        repl.retry_ms = get_wall_ms() + REPL_RETRY_MS;
+        return;
+    }
+    conn->primary = true;
+    conn->last_active_ms = get_wall_ms();
+    repl.link = conn;
+    repl.link_state = REPL_LINK_UP;
+    repl.ack_ms = 0;
+    connection_io(conn);    // the stream may have started already
+    if (conn->state == STATE_END) {
+        conn_close(conn);
     }
-    return out_err(out_buf, ERR_UNKNOWN_CMD, "unknown command");
 }
 
-// try to process one request
-static bool try_one_request(struct Conn *conn) {
-    if (conn->rbuf_size < 4) {  // ensure enough data is available for a message header
-        return false;
+// start a sync with the primary in the replication thread
+static void repl_start_sync(uint64_t now_ms) {
+    ReplSync *s = calloc(1, sizeof(ReplSync));
+    if (!s) {
+        die("calloc()");
     }
-    uint32_t len = 0;
-    memcpy(&len, conn->rbuf, 4);    // extract message length
-    if(len > MAX_MSG_SIZE) {        // validate message length
-        msg("request too long");
-        conn->state = STATE_END;
-        return false;
-    }
-    if (4 + len > conn->rbuf_size) {    // check if the complete message has been received
-        return false;
+    s->gen = repl.link_gen;
+    memcpy(s->host, repl.primary_host, sizeof(s->host));
+    s->port = repl.primary_port;
+    memcpy(s->replid, repl.link_replid, sizeof(s->replid));
+    s->offset = repl.link_offset;
+    s->fd = -1;
+    snprintf(s->path, sizeof(s->path), "%s.sync-%d-%llu", config.snapshot, (int)getpid(), (unsigned long long)s->gen);
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, repl_sync_thread_run, s) != 0) {
+        free(s);
+        repl.retry_ms = now_ms + REPL_RETRY_MS;
+        return;
     }
+    pthread_detach(thread);
+    repl.link_state = REPL_LINK_SYNCING;
+    log_at(LOG_INFO, "syncing with primary %s:%d", repl.primary_host, repl.primary_port);
+}
 
-    // parse the body into a list of strings
-    Arg args[MAX_ARGS];
-    uint32_t nstr = 0;
-    if (parse_req(&conn->rbuf[4], len, &nstr, args, MAX_ARGS) < 0) {
-        msg("bad request");
-        conn->state = STATE_END;
-        return false;
+// queue and send a REPLCONF ACK <offset> to the primary once a second. It
+// is a few bytes, so whatever the socket won't take now goes next time.
+static void repl_send_ack(uint64_t now_ms) {
+    struct Conn *link = repl.link;
+    if (now_ms - repl.ack_ms >= REPL_ACK_INTERVAL_MS && buf_len(&repl.ack_buf) == 0) {
+        char off[24];
+        int n = snprintf(off, sizeof(off), "%llu", (unsigned long long)repl.link_offset);
+        Arg args[3] = {{8, (const uint8_t *)"replconf"}, {3, (const uint8_t *)"ack"}, {(uint32_t)n, (const uint8_t *)off}};
+        aof_append_cmd(&repl.ack_buf, args, 3);
+        repl.ack_ms = now_ms;
     }
-
-    printf("client says:");
-    for (uint32_t i = 0; i < nstr; i++) {
-        printf(" '%.*s'", args[i].len, args[i].data);
+    if (buf_len(&repl.ack_buf) == 0) {
+        return;
     }
-    printf("\n");
-
-    uint32_t rlen = do_request(args, nstr, &conn->wbuf[4]);   // build response after the 4-byte header
-    memcpy(conn->wbuf, &rlen, 4);
-    conn->wbuf_size = 4 + rlen;
-
-    size_t remain = conn->rbuf_size - 4 - len;  // remove processed data from the read buffer
-    if (remain > 0) {
-        memmove(conn->rbuf, &conn->rbuf[4 + len], remain);
+    ssize_t rv = write(link->fd, repl.ack_buf.data + repl.ack_buf.start, buf_len(&repl.ack_buf));
+    if (rv < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return;
     }
-    conn->rbuf_size = remain;
-    conn->state = STATE_RES;    // switch to write state
-    return true;
+    if (rv <= 0) {
+        log_at(LOG_WARN, "fd %d: write() to primary error: %s", link->fd, strerror(errno));
+        link->state = STATE_END;
+        conn_close(link);
+        return;
+    }
+    buf_consume(&repl.ack_buf, (size_t)rv);
 }
 
-// fill read buffer with data
-static bool try_fill_buffer(struct Conn *conn) {
-    // continuously read data from the client and fill the connection's read buffer
-    while (1) {
-        size_t cap = sizeof(conn->rbuf) - conn->rbuf_size;              // calculate the available space in the buffer
-        ssize_t rv = read(conn->fd, &conn->rbuf[conn->rbuf_size], cap); // number of bytes read
-        
-        // nonblocking check
-        if (rv < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {  // if no more data is available
-            return false;
+// thread 0's replication housekeeping, once per loop iteration: follow
+// REPLICAOF, keep the link to the primary going, and feed the replicas
+static void repl_cron(uint64_t now_ms) {
+    if (repl.relink) {
+        if (repl.link) {
+            repl.link->state = STATE_END;
+            conn_close(repl.link);
         }
-
-        // error handling
-        if (rv <= 0) {
-            msg("read error or EOF");
-            conn->state = STATE_END;
-            return false;
+        repl.relink = false;
+        repl.link_state = repl.primary_port != 0 ? REPL_LINK_CONNECT : REPL_LINK_NONE;
+        repl.retry_ms = 0;
+    }
+    if (repl.link_state == REPL_LINK_CONNECT && now_ms >= repl.retry_ms) {
+        repl_start_sync(now_ms);
+    }
+    if (repl.link) {
+        repl_send_ack(now_ms);
+    }
+    for (size_t i = 0; i < repl.nreplicas; i++) {
+        struct Conn *conn = repl.replicas[i];
+        int status = 0;
+        if (conn->sync_child && waitpid(conn->sync_child, &status, WNOHANG) == conn->sync_child) {
+            conn->sync_child = 0;
+            if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+                fd_set_nb(conn->fd);    // the child shared the file's flags
+                log_at(LOG_INFO, "fd %d: full sync sent, streaming what came after it", conn->fd);
+            } else {
+                log_at(LOG_WARN, "fd %d: full sync to a replica failed", conn->fd);
+                conn->state = STATE_END;
+            }
+        }
+        if (conn->state != STATE_END) {
+            connection_io(conn);
+        }
+    }
+    for (size_t i = repl.nreplicas; i-- > 0;) {     // closing moves the last one into i
+        if (repl.replicas[i]->state == STATE_END) {
+            conn_close(repl.replicas[i]);
         }
-
-        // buffer update
-        conn->rbuf_size += rv;              // increase rbuf_size by rv
-        while (try_one_request(conn)) {}    // process requests from the buffer until no more complete requests remain
     }
-    return true;
 }
 
-// flush write buffer
-static bool try_flush_buffer(struct Conn *conn) {
-    // continuously write data from the connection's write buffer to the client
-    while (1) {
-        size_t remain = conn->wbuf_size - conn->wbuf_sent;  // calculate how much data remains to be written
-        ssize_t rv = write(conn->fd, &conn->wbuf[conn->wbuf_sent], remain);
-        
-        // nonblocking check
-        if (rv < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) { // if the socket's write buffer is full
-            return false;
-        }
+// ---- I/O threads ----
 
-        // error handling
-        if (rv <= 0) {
-            msg("Write error");
-            conn->state = STATE_END;
-            return false;
+// handle one message from another thread
+static void loop_handle_msg(Loop *loop, Msg *m) {
+    switch (m->type) {
+    case MSG_REQ:
+    case MSG_REQ_ALL: {
+        Arg args[MAX_ARGS];
+        uint32_t nstr = 0;
+        uint64_t timeout_ms = 0;
+        Msg *res = msg_new(MSG_RES, loop, m->conn, NULL, 0);
+        if (parse_req(m->data, m->len, &nstr, args, MAX_ARGS) == 0) {   // already validated by the sender
+            if (m->type == MSG_REQ_ALL) {
+                do_request_all(args, nstr, &res->res, false);
+            } else if (block_must_wait(args, nstr, &timeout_ms)) {
+                block_park(loop->id, m->from, m->conn, &args[1], nstr - 2, arg_is(&args[0], "blpop"),
+                    timeout_ms ? get_wall_ms() + timeout_ms : 0);
+                free(res);
+                break;  // its MSG_RES comes once it is served or times out
+            } else {
+                do_request(args, nstr, &res->res, false);
+                if (blocks[loop->id].ready) {
+                    loop_serve_blocked(loop);
+                }
+            }
         }
-
-        // buffer update
-        conn->wbuf_sent += rv;
-        if (conn->wbuf_sent == conn->wbuf_size) {
-            while (try_one_request(conn)) {}
-            conn->state = STATE_REQ;    // when fully sent, the state transitions back to STATE_REQ
-            
-            // buffer counters are reset, preparing for the next request
-            conn->wbuf_sent = 0;
-            conn->wbuf_size = 0;
-            return false;
+        if (aof_must_hold(loop)) {
+            loop_hold(loop, (Held){.to = m->from, .m = res});
+        } else {
+            msg_send(m->from, res);
+        }
+        break;
+    }
+    case MSG_RES: {
+        struct Conn *conn = m->conn;
+        if (conn->blocked) {
+            // a blocking pop's wait isn't latency: unless earlier replies
+            // are still going out, what was read behind it is timed from now
+            if (conn->replies_due == 0) {
+                conn->read_ticks = buf_len(&conn->rbuf) ? ticks_now() : 0;
+            }
+        } else {
+            conn->replies_due++;
+        }
+        conn->waiting = false;
+        conn->blocked = false;
+        if (conn->state == STATE_BLOCKED) {
+            conn->state = STATE_REQ;
+        }
+        if (conn->state == STATE_END) {     // the client went away while we waited
+            out_free(&m->res);
+            if (!conn->held) {
+                free(conn);
+            }
+            break;
+        }
+        uint32_t len = (uint32_t)out_len(&m->res);
+        out_append(&conn->wbuf, &len, 4);
+        out_splice(&conn->wbuf, &m->res);
+        while (try_one_request(conn)) {}    // carry on with the rest of the batch
+        conn_start_flush(conn);
+        connection_io(conn);    // send it, then read anything else the client sent
+        conn_finish_io(conn);
+        break;
+    }
+    case MSG_UNBLOCK: {
+        uint64_t hcode = 0;
+        memcpy(&hcode, m->data, 8);
+        if (block_cancel(loop->id, m->conn, hcode)) {
+            msg_send(m->from, msg_new(MSG_RES, loop, m->conn, NULL, 0));
+        }
+        break;
+    }
+    case MSG_PAUSE:
+        world_park();
+        break;
+    case MSG_APPLY: {
+        Arg args[MAX_ARGS];
+        uint32_t nstr = 0;
+        Out res = {0};
+        if (parse_req(m->data, m->len, &nstr, args, MAX_ARGS) == 0) {   // already validated by the sender
+            do_request(args, nstr, &res, true);
+            if (blocks[loop->id].ready) {
+                loop_serve_blocked(loop);
+            }
         }
+        out_free(&res);
+        break;
+    }
+    case MSG_PSYNC:
+        repl_psync(m->conn);
+        break;
+    case MSG_SYNCED: {
+        ReplSync *s = NULL;
+        memcpy(&s, m->data, sizeof(s));
+        repl_sync_done(s);
+        break;
+    }
     }
+    free(m);
 }
 
-// manages state transitions
-static void connection_io(struct Conn *conn) {
-    if (conn->state == STATE_REQ) {
-        try_fill_buffer(conn);  // fill the read buffer
-    } else if (conn->state == STATE_RES) {
-        try_flush_buffer(conn); // flush the write buffer
+static void loop_drain_inbox(Loop *loop) {
+    // clear the flag first, so a push that lands after this point pokes us again
+    atomic_store(&loop->wake_pending, false);
+    Msg *m;
+    while ((m = mq_pop(&loop->inbox))) {
+        loop_handle_msg(loop, m);
     }
 }
 
-// initates server and manages incoming connections
-int main() {
+// create a nonblocking listening socket on 0.0.0.0:port. With several I/O
+// threads each gets its own socket on the same port via SO_REUSEPORT and the
+// kernel spreads incoming connections between them.
+static int open_listener(int port, bool reuseport) {
     // creates server socket
     int fd = socket(AF_INET, SOCK_STREAM, 0);           // TCP socket for IPv4
     if (fd < 0) {                                       // if fd for the socket is negative, prints out error and exit
@@ -490,11 +7623,14 @@ int main() {
         // 2nd and 3rd arguments are options to set
         // 4th argument is the option value
         // last argument is val's length as option value is arbitrary bytes
+    if (reuseport && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &val, sizeof(val)) < 0) {
+        die("setsockopt(SO_REUSEPORT)");
+    }
 
     // bind address
     struct sockaddr_in addr = {};   // sets up address structure for the server
     addr.sin_family = AF_INET;      // specifies IPv4
-    addr.sin_port = htons(1234);    // sets port to 1234
+    addr.sin_port = htons(port);    // sets port (1234 by default)
     addr.sin_addr.s_addr = htonl(0);// sets IP to 0.0.0.0
 
     // bind socket
@@ -511,59 +7647,427 @@ int main() {
     }
 
     fd_set_nb(fd);
-    struct pollfd poll_fds[MAX_FD + 1];   // +1 for the listening socket
-
-    // acccept and handle client connections
-    while (1) {
-        // build the poll_fds array fresh each iteration from active connections only
-        nfds_t nfds = 0;
+    return fd;
+}
 
-        poll_fds[nfds].fd = fd;
-        poll_fds[nfds].events = POLLIN;    // monitor server socket for incoming connections
-        poll_fds[nfds].revents = 0;
-        nfds++;
+// send the held replies once the AOF batch they wait for is synced
+static void loop_release_held(Loop *loop) {
+    if (loop->nheld == 0 || atomic_load(&aof.synced) < loop->aof_wait_seq) {
+        return;
+    }
+    // releasing may hold replies again, for new writes: a released
+    // connection can run more requests and serve blocked clients, so the
+    // list is swapped out rather than refilled while it is being walked
+    Held *held = loop->held;
+    size_t n = loop->nheld;
+    loop->held = NULL;
+    loop->nheld = loop->held_cap = 0;
+    for (size_t i = 0; i < n; i++) {
+        Held h = held[i];
+        if (h.m) {
+            if (aof_must_hold(loop)) {  // released connections have logged writes it must follow
+                loop_hold(loop, h);
+            } else {
+                msg_send(h.to, h.m);
+            }
+            continue;
+        }
+        struct Conn *conn = h.conn;
+        conn->held = false;
+        if (conn->state == STATE_END) {     // closed while held
+            if (!conn->waiting) {
+                free(conn);
+            }
+            continue;
+        }
+        conn_start_flush(conn);
+        connection_io(conn);
+        conn_finish_io(conn);
+    }
+    free(held);
+}
 
-        for (int i = 0; i < MAX_FD; i++) {
-            struct Conn *conn = fd2conn[i];
-            if (!conn) {
-                continue;
+// the AOF fsync thread. Under everysec it syncs once a second if anything was
+// written; under always it syncs as soon as a loop appends a batch, covering
+// every batch appended so far, and then wakes the loops to release replies.
+static void *aof_fsync_thread_run(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&aof.mu);
+    while (1) {
+        uint64_t target = aof.written;
+        if (target == atomic_load(&aof.synced)) {
+            if (aof.fsync == AOF_FSYNC_ALWAYS) {
+                pthread_cond_wait(&aof.cv, &aof.mu);
+            } else {
+                struct timespec ts;
+                clock_gettime(CLOCK_REALTIME, &ts);
+                ts.tv_sec += 1;
+                pthread_cond_timedwait(&aof.cv, &aof.mu, &ts);
             }
-            struct pollfd pfd = {0};
-            pfd.fd = conn->fd;
-            pfd.events = (conn->state == STATE_REQ) ? POLLIN : POLLOUT;
-            pfd.events |= POLLERR;   // always watch for errors
-            poll_fds[nfds] = pfd;
-            nfds++;
+            continue;
         }
+        pthread_mutex_unlock(&aof.mu);
+        if (fdatasync(aof.fd) < 0) {
+            die("fdatasync() on the AOF");
+        }
+        atomic_fetch_add(&aof.fsyncs, 1);
+        atomic_store(&aof.synced, target);
+        if (aof.fsync == AOF_FSYNC_ALWAYS) {
+            for (uint32_t i = 0; i < nloops; i++) {
+                loop_wake(&loops[i]);
+            }
+        } else {
+            sleep(1);
+        }
+        pthread_mutex_lock(&aof.mu);
+    }
+    return NULL;
+}
+
+static void loop_init(Loop *loop, uint32_t id, int port) {
+    loop->id = id;
+    loop->listen_fd = open_listener(port, nloops > 1);
+    loop->wake_fd = eventfd(0, EFD_NONBLOCK);
+    if (loop->wake_fd < 0) {
+        die("eventfd()");
+    }
+    atomic_store(&loop->wake_pending, false);
+    mq_init(&loop->inbox);
+
+    // every socket is registered once; connections only change interest when
+    // their state flips, so a wakeup costs O(ready fds), not O(connections)
+    loop->epfd = epoll_create1(0);
+    if (loop->epfd < 0) {
+        die("epoll_create1()");
+    }
+    struct epoll_event lev = {.events = EPOLLIN | EPOLLET, .data.fd = loop->listen_fd};
+    struct epoll_event wev = {.events = EPOLLIN | EPOLLET, .data.fd = loop->wake_fd};
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->listen_fd, &lev) < 0
+            || epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->wake_fd, &wev) < 0) {
+        die("epoll_ctl()");
+    }
+}
 
-        int rv = poll(poll_fds, nfds, 1000);   // poll only fds that are actually connected
+// one I/O thread: its connections, its inbox, and housekeeping for its shard
+static void *loop_run(void *arg) {
+    Loop *loop = (Loop *)arg;
+    Shard *sh = &shards[loop->id];
+    struct epoll_event events[MAX_EVENTS];
+    stats_slot = loop->id;
 
-        if (rv < 0) {
-            die("poll()");
+    // acccept and handle client connections
+    while (1) {
+        // sleep until the next key is due to expire, and wake up often while
+        // a resize is pending so idle ticks can finish it, or while thread 0
+        // has a BGSAVE or BGREWRITEAOF child to reap, or replication to tend
+        bool tend = loop->id == 0 && (persist.child != 0 || repl.primary_port != 0 || repl.nreplicas > 0);
+        int max_ms = hm_is_rehashing(&sh->db) ? 10 : tend ? 100 : 1000;
+        int timeout_ms = block_timeout_ms(loop->id, next_expiry_timeout_ms(sh, max_ms));
+        int nready = epoll_wait(loop->epfd, events, MAX_EVENTS, timeout_ms);
+
+        if (nready < 0 && errno != EINTR) {
+            die("epoll_wait()");
         }
-        if (poll_fds[0].revents & POLLIN) {  // accept new connections if server socket is ready
-            accept_new_conn(fd);
+        sh->clock_ms = get_wall_ms();   // what this iteration's key accesses are stamped with
+        stats_tick(&thread_stats[loop->id], sh->clock_ms);
+        if (nready == 0) {  // idle tick: spend a little time moving buckets of a pending resize
+            hm_rehash_ms(&sh->db, HT_REHASH_IDLE_MS);
         }
 
-        // walk poll_fds (skip index 0, the listening socket) and only service fds that fired
-        for (size_t i = 1; i < nfds; i++) {
-            uint32_t ready = poll_fds[i].revents;
-            if (ready == 0) {
-                continue;   // nothing happened on this fd, skip the syscalls entirely
+        // only the fds that actually fired are reported, nothing to skip over
+        for (int i = 0; i < nready; i++) {
+            int rfd = events[i].data.fd;
+            if (rfd == loop->listen_fd) {   // edge-triggered: accept until the backlog is empty
+                while (accept_new_conn(loop) == 0) {}
+                continue;
+            }
+            if (rfd == loop->wake_fd) {     // messages are drained below on every iteration
+                uint64_t count;
+                ssize_t rv = read(loop->wake_fd, &count, sizeof(count));
+                (void)rv;
+                continue;
             }
 
-            struct Conn *conn = fd2conn[poll_fds[i].fd];
+            struct Conn *conn = loop->fd2conn[rfd];
             if (!conn) {
                 continue;
             }
+            if (conn->state == STATE_BLOCKED && (events[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR))) {
+                log_at(LOG_INFO, "fd %d: client closed the connection while blocked", conn->fd);
+                conn->state = STATE_END;    // conn_close() cancels its wait
+            }
 
             connection_io(conn);
-            if (conn->state == STATE_END) {   // cleanup closed connections
-                close(conn->fd);
-                free(conn);
-                fd2conn[poll_fds[i].fd] = NULL;
+            conn_finish_io(conn);   // cleanup closed connections, hand over replicas
+        }
+
+        loop_drain_inbox(loop);
+        loop_expire_blocked(loop);  // answer BLPOP/BRPOPs whose timeout has passed
+        expire_sweep(sh, EXPIRE_SWEEP_BUDGET_US);   // actively drop keys whose TTL has passed
+        conn_cron(loop, get_wall_ms());
+        if (loop->id == 0) {
+            persist_reap_child();   // note when a BGSAVE or BGREWRITEAOF finishes
+        }
+        // send replies whose writes are now on disk, then append this
+        // iteration's writes (including any those replies led to), and
+        // have thread 0 stream them to the replicas
+        loop_release_held(loop);
+        bool logged = repl.backlog && buf_len(&sh->aof_buf) > 0;
+        aof_write_batch(loop);
+        if (loop->id == 0) {
+            repl_cron(get_wall_ms());
+        } else if (logged) {
+            loop_wake(&loops[0]);
+        }
+    }
+    return NULL;
+}
+
+// ---- startup ----
+
+// Replay the AOF at path through do_command(), untimed. A command cut short at the end
+// (the server died mid-append) is dropped and the file truncated to the last
+// whole one, so new writes don't land after garbage. Returns the number of
+// commands replayed, 0 if there is no file, or -1 with *err set.
+static int64_t aof_load(const char *path, const char **err) {
+    int fd = open(path, O_RDWR);
+    if (fd < 0) {
+        if (errno == ENOENT) {
+            return 0;
+        }
+        *err = strerror(errno);
+        return -1;
+    }
+    Buf in = {0};
+    Out out = {0};
+    int64_t replayed = 0;
+    off_t good = 0;     // end of the last whole command
+    *err = NULL;
+    while (!*err) {
+        buf_reserve(&in, SNAP_BLOCK_SIZE);
+        ssize_t rv = read(fd, in.data + in.end, in.cap - in.end);
+        if (rv < 0 && errno == EINTR) {
+            continue;
+        }
+        if (rv <= 0) {
+            break;
+        }
+        in.end += (size_t)rv;
+        while (buf_len(&in) >= 4 && !*err) {
+            uint32_t len = 0;
+            memcpy(&len, in.data + in.start, 4);
+            if (buf_len(&in) < 4 + (size_t)len) {
+                buf_reserve(&in, 4 + (size_t)len - buf_len(&in));     // a command bigger than a chunk
+                break;
+            }
+            Arg args[MAX_ARGS];
+            uint32_t nstr = 0;
+            if (parse_req(in.data + in.start + 4, len, &nstr, args, MAX_ARGS) < 0 || nstr == 0) {
+                *err = "malformed command in the AOF";
+                break;
+            }
+            do_command(args, nstr, &out);
+            out_consume(&out, out_len(&out));
+            replayed++;
+            good += 4 + (off_t)len;
+            buf_consume(&in, 4 + (size_t)len);
+        }
+    }
+    if (!*err && buf_len(&in) > 0) {
+        log_at(LOG_WARN, "%s ends with %zu bytes of an unfinished command, dropping them", path, buf_len(&in));
+        if (ftruncate(fd, good) < 0) {
+            *err = strerror(errno);
+        }
+    }
+    buf_free(&in);
+    out_free(&out);
+    close(fd);
+    return *err ? -1 : replayed;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "usage: %s [--port N] [--threads N] [--max-msg-size BYTES] [--log-level LEVEL] [--snapshot FILE]\n"
+        "       [--aof FILE] [--aof-fsync always|everysec|no] [--hash-max-pack-entries N] [--hash-max-pack-value BYTES]\n"
+        "       [--list-max-pack-entries N] [--list-max-pack-value BYTES] [--maxmemory BYTES] [--maxmemory-policy POLICY]\n"
+        "       [--replicaof HOST:PORT] [--repl-backlog-size BYTES] [--repl-buffer-limit BYTES]\n", prog);
+    fprintf(stderr, "  --port N              TCP port to listen on (default 1234)\n");
+    fprintf(stderr, "  --threads N           I/O threads, each owning one keyspace shard (1-%d, default 1)\n", MAX_THREADS);
+    fprintf(stderr, "  --max-msg-size BYTES  largest request accepted (default %u)\n", MSG_SIZE_LIMIT);
+    fprintf(stderr, "  --log-level LEVEL     off, warn, info or debug, which traces every request (default warn)\n");
+    fprintf(stderr, "  --snapshot FILE       written by SAVE/BGSAVE and loaded at startup (default dump.rdb)\n");
+    fprintf(stderr, "  --aof FILE            log every write to FILE and replay it at startup instead of the snapshot\n");
+    fprintf(stderr, "  --aof-fsync POLICY    when the AOF is synced: always, everysec or no (default everysec)\n");
+    fprintf(stderr, "  --hash-max-pack-entries N      a hash is packed up to N fields (default %u)\n", config.hash_pack_entries);
+    fprintf(stderr, "  --hash-max-pack-value BYTES    ... and while no field or value is longer (default %u)\n", config.hash_pack_value);
+    fprintf(stderr, "  --list-max-pack-entries N      a list is packed up to N elements (default %u)\n", config.list_pack_entries);
+    fprintf(stderr, "  --list-max-pack-value BYTES    ... and while no element is longer (default %u)\n", config.list_pack_value);
+    fprintf(stderr, "  --maxmemory BYTES     memory the keys may use before writes evict some, 0 for no limit (default 0)\n");
+    fprintf(stderr, "  --maxmemory-policy POLICY  noeviction, allkeys-lru, allkeys-lfu, volatile-ttl or allkeys-random\n"
+        "                        (default noeviction: writes fail once over the limit)\n");
+    fprintf(stderr, "  --replicaof HOST:PORT a read-only replica of the server at HOST:PORT, like REPLICAOF\n");
+    fprintf(stderr, "  --repl-backlog-size BYTES  stream kept for replicas to resync from (default %u)\n", REPL_BACKLOG_SIZE);
+    fprintf(stderr, "  --repl-buffer-limit BYTES  unsent stream a replica may have before it is dropped (default %u)\n",
+        REPL_BUFFER_LIMIT);
+    exit(EXIT_FAILURE);
+}
+
+// parse a decimal command line value in [min, max], or print usage and exit
+static long parse_flag_value(const char *prog, const char *s, long min, long max) {
+    char *end = NULL;
+    errno = 0;
+    long v = strtol(s, &end, 10);
+    if (errno != 0 || end == s || *end != '\0' || v < min || v > max) {
+        usage(prog);
+    }
+    return v;
+}
+
+static void parse_args(int argc, char **argv) {
+    for (int i = 1; i < argc; i++) {
+        if (i + 1 < argc && strcmp(argv[i], "--port") == 0) {
+            config.port = (int)parse_flag_value(argv[0], argv[++i], 1, 65535);
+        } else if (i + 1 < argc && strcmp(argv[i], "--threads") == 0) {
+            config.threads = (uint32_t)parse_flag_value(argv[0], argv[++i], 1, MAX_THREADS);
+        } else if (i + 1 < argc && strcmp(argv[i], "--max-msg-size") == 0) {
+            // a reply carries a value plus a few bytes of framing, so leave headroom below 4 GiB
+            config.max_msg_size = (uint32_t)parse_flag_value(argv[0], argv[++i], 1024, UINT32_MAX - 4096);
+        } else if (i + 1 < argc && strcmp(argv[i], "--log-level") == 0) {
+            config.log_level = argv[++i];
+            if (log_level_parse(config.log_level, strlen(config.log_level)) < 0) {
+                usage(argv[0]);
+            }
+        } else if (i + 1 < argc && strcmp(argv[i], "--snapshot") == 0) {
+            config.snapshot = argv[++i];
+        } else if (i + 1 < argc && strcmp(argv[i], "--aof") == 0) {
+            config.aof = argv[++i];
+        } else if (i + 1 < argc && strcmp(argv[i], "--aof-fsync") == 0) {
+            aof.fsync = aof_fsync_parse(argv[++i]);
+            if (aof.fsync < 0) {
+                usage(argv[0]);
             }
+        } else if (i + 1 < argc && strcmp(argv[i], "--maxmemory") == 0) {
+            config.maxmemory = (size_t)parse_flag_value(argv[0], argv[++i], 0, LONG_MAX);
+        } else if (i + 1 < argc && strcmp(argv[i], "--maxmemory-policy") == 0) {
+            config.maxmemory_policy = evict_policy_parse(argv[++i]);
+            if (config.maxmemory_policy < 0) {
+                usage(argv[0]);
+            }
+        } else if (i + 1 < argc && strcmp(argv[i], "--hash-max-pack-entries") == 0) {
+            config.hash_pack_entries = (uint32_t)parse_flag_value(argv[0], argv[++i], 0, UINT16_MAX);
+        } else if (i + 1 < argc && strcmp(argv[i], "--hash-max-pack-value") == 0) {
+            config.hash_pack_value = (uint32_t)parse_flag_value(argv[0], argv[++i], 0, UINT16_MAX);
+        } else if (i + 1 < argc && strcmp(argv[i], "--list-max-pack-entries") == 0) {
+            config.list_pack_entries = (uint32_t)parse_flag_value(argv[0], argv[++i], 0, UINT16_MAX);
+        } else if (i + 1 < argc && strcmp(argv[i], "--list-max-pack-value") == 0) {
+            config.list_pack_value = (uint32_t)parse_flag_value(argv[0], argv[++i], 0, UINT16_MAX);
+        } else if (i + 1 < argc && strcmp(argv[i], "--replicaof") == 0) {
+            const char *arg = argv[++i];
+            const char *colon = strrchr(arg, ':');
+            size_t hlen = colon ? (size_t)(colon - arg) : 0;
+            if (hlen == 0 || hlen >= sizeof(repl.primary_host)) {
+                usage(argv[0]);
+            }
+            memcpy(repl.primary_host, arg, hlen);
+            repl.primary_host[hlen] = '\0';
+            repl.primary_port = (int)parse_flag_value(argv[0], colon + 1, 1, 65535);
+            repl.link_state = REPL_LINK_CONNECT;
+        } else if (i + 1 < argc && strcmp(argv[i], "--repl-backlog-size") == 0) {
+            config.repl_backlog_size = (size_t)parse_flag_value(argv[0], argv[++i], REPL_BACKLOG_MIN, LONG_MAX);
+        } else if (i + 1 < argc && strcmp(argv[i], "--repl-buffer-limit") == 0) {
+            config.repl_buffer_limit = (size_t)parse_flag_value(argv[0], argv[++i], REPL_BACKLOG_MIN, LONG_MAX);
+        } else {
+            usage(argv[0]);
+        }
+    }
+}
+
+// lift the soft open-file limit to the hard limit so we can hold as many
+// connections as the system allows
+static void raise_fd_limit(void) {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
+// initates server and manages incoming connections
+int main(int argc, char **argv) {
+    parse_args(argc, argv);
+    raise_fd_limit();
+    signal(SIGPIPE, SIG_IGN);   // a client hanging up mid-write is an EPIPE error, not a crash
+
+    log_init();
+    slab_classes_init();
+    atomic_store(&log_level, log_level_parse(config.log_level, strlen(config.log_level)));
+    pthread_t log_thread;
+    if (pthread_create(&log_thread, NULL, log_thread_run, NULL) != 0) {
+        die("pthread_create()");
+    }
+
+    nloops = nshards = config.threads;
+    for (uint32_t i = 0; i < nshards; i++) {
+        shards[i].clock_ms = get_wall_ms();     // loaded keys count as used at startup
+    }
+    ticks_per_ns();     // calibrate the request timer now, not on the first INFO
+    hash_seed_init();
+    repl_new_id(repl.replid);
+    // load the data before opening the port, so a client that can connect
+    // can be served: the AOF if there is one, as it's the more recent,
+    // otherwise the snapshot, decoded on every core
+    uint64_t load_start_us = get_monotonic_us();
+    const char *load_err = NULL;
+    const char *load_path = config.aof && access(config.aof, F_OK) == 0 ? config.aof : config.snapshot;
+    if (load_path == config.aof) {
+        int64_t replayed = aof_load(config.aof, &load_err);
+        if (replayed < 0) {
+            fprintf(stderr, "can't load %s: %s\n", config.aof, load_err);
+            exit(EXIT_FAILURE);
+        }
+        persist.aof_loaded_commands = (uint64_t)replayed;
+        for (uint32_t i = 0; i < nshards; i++) {
+            persist.loaded_keys += hm_size(&shards[i].db);
+        }
+    } else {
+        long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+        int64_t loaded = snapshot_load(config.snapshot, ncpus > 0 ? (uint32_t)ncpus : 1, &load_err);
+        if (loaded < 0) {
+            fprintf(stderr, "can't load %s: %s\n", config.snapshot, load_err);
+            exit(EXIT_FAILURE);
         }
+        persist.loaded_keys = (uint64_t)loaded;
     }
+    uint64_t load_us = get_monotonic_us() - load_start_us;
+    persist.load_ms = load_us / 1000;
+    struct stat load_st;
+    persist.load_bytes = persist.loaded_keys > 0 && stat(load_path, &load_st) == 0 ? (uint64_t)load_st.st_size : 0;
+    if (persist.loaded_keys > 0) {
+        double secs = load_us > 0 ? (double)load_us / 1e6 : 1e-6;
+        log_at(LOG_INFO, "loaded %llu keys (%.1f MB) from %s in %llu ms: %.1f MB/s, %.0f keys/s",
+            (unsigned long long)persist.loaded_keys, (double)persist.load_bytes / 1e6, load_path,
+            (unsigned long long)persist.load_ms, (double)persist.load_bytes / 1e6 / secs,
+            (double)persist.loaded_keys / secs);
+    }
+    for (uint32_t i = 0; i < nloops; i++) {
+        loop_init(&loops[i], i, config.port);
+    }
+    if (config.aof) {
+        if (aof_open(config.aof) < 0) {
+            fprintf(stderr, "can't open %s: %s\n", config.aof, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        pthread_t fsync_thread;
+        if (aof.fsync != AOF_FSYNC_NO && pthread_create(&fsync_thread, NULL, aof_fsync_thread_run, NULL) != 0) {
+            die("pthread_create()");
+        }
+    }
+    log_at(LOG_INFO, "listening on port %d with %u I/O thread(s)", config.port, nloops);
+    // thread 0 is the main thread; the rest get their own
+    for (uint32_t i = 1; i < nloops; i++) {
+        if (pthread_create(&loops[i].thread, NULL, loop_run, &loops[i]) != 0) {
+            die("pthread_create()");
+        }
+    }
+    loop_run(&loops[0]);
     return 0;
-}
\ No newline at end of file
+}
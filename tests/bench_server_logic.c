@@ -0,0 +1,350 @@
+// Microbenchmarks for server.c's hot paths, built the same way as the unit
+// tests: hash_bytes over several key lengths, next to plain FNV-1a;
+// h_set/h_lookup/h_del from 1K keys up to a chosen maximum (10x apart);
+// cmd_lookup and parse_req on the requests clients actually send; and
+// do_request end to end, parsing included. Each line reports ns/op,
+// last-level cache misses per op, and heap allocations per op made by
+// server.c, so a change to the store or the protocol can be checked for
+// regressions in numbers:
+//
+//   gcc -O2 -Wall -Wextra -pthread -o bench_server_logic bench_server_logic.c
+//   ./bench_server_logic [max_keys]
+//
+// max_keys defaults to 1M; 100M needs about 13 GB of memory. Cache misses
+// come from perf_event_open() and show as "-" where the kernel doesn't allow
+// it (perf_event_paranoid, containers). Allocations are counted by routing
+// server.c's malloc/calloc/realloc/aligned_alloc through counting wrappers,
+// which is why those are defined before server.c is included. Add -DHT_SWISS
+// for the Swiss table engine, as with bench_hashtable.
+#include <stdlib.h>
+#include <stdint.h>
+
+static uint64_t bench_allocs;   // allocations server.c has made so far
+
+static void *bench_malloc(size_t n) {
+    bench_allocs++;
+    return malloc(n);
+}
+
+static void *bench_calloc(size_t n, size_t size) {
+    bench_allocs++;
+    return calloc(n, size);
+}
+
+static void *bench_realloc(void *p, size_t n) {
+    bench_allocs++;
+    return realloc(p, n);
+}
+
+#ifdef HT_SWISS   // only the Swiss table engine uses it
+static void *bench_aligned_alloc(size_t align, size_t n) {
+    bench_allocs++;
+    return aligned_alloc(align, n);
+}
+#define aligned_alloc bench_aligned_alloc
+#endif
+
+#define malloc bench_malloc
+#define calloc bench_calloc
+#define realloc bench_realloc
+#define main server_main_unused
+#include "../server.c"
+#undef main
+#undef malloc
+#undef calloc
+#undef realloc
+#undef aligned_alloc
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+
+#define DEFAULT_MAX_KEYS 1000000
+#define KEY_STRIDE 2654435761u  // steps through 0..n-1 in a scattered order for any n it doesn't divide
+
+static int perf_fd = -1;
+
+// count last-level cache misses of this thread in user space, if allowed
+static void perf_open(void) {
+    struct perf_event_attr attr = {0};
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    perf_fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static uint64_t perf_read(void) {
+    uint64_t v = 0;
+    if (perf_fd < 0 || read(perf_fd, &v, sizeof(v)) != sizeof(v)) {
+        return 0;
+    }
+    return v;
+}
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+// what a measured section started from
+typedef struct {
+    double ns;
+    uint64_t misses;
+    uint64_t allocs;
+} Mark;
+
+static Mark mark(void) {
+    return (Mark){now_ns(), perf_read(), bench_allocs};
+}
+
+static void report(const char *what, Mark start, size_t ops) {
+    double ns = (now_ns() - start.ns) / (double)ops;
+    double allocs = (double)(bench_allocs - start.allocs) / (double)ops;
+    if (perf_fd < 0) {
+        printf("%-30s %10.1f %12s %12.3f\n", what, ns, "-", allocs);
+    } else {
+        printf("%-30s %10.1f %12.2f %12.3f\n", what, ns, (double)(perf_read() - start.misses) / (double)ops, allocs);
+    }
+}
+
+// key i as "key:" and 12 hex digits, or "kez:..." for keys never inserted;
+// cheap enough next to a lookup that keys needn't be stored up front, which
+// 100M of them wouldn't be
+static void make_key(char *key, uint64_t i, bool missing) {
+    static const char hex[] = "0123456789abcdef";
+    memcpy(key, missing ? "kez:" : "key:", 4);
+    for (int d = 15; d >= 4; d--) {
+        key[d] = hex[i & 15];
+        i >>= 4;
+    }
+}
+
+#define KEY_LEN 16
+
+// the i-th step of a walk over 0..n-1 that visits each once, out of order
+static uint64_t scattered(uint64_t *pos, uint64_t n) {
+    uint64_t cur = *pos;
+    *pos += KEY_STRIDE % n;
+    if (*pos >= n) {
+        *pos -= n;
+    }
+    return cur;
+}
+
+// the byte-at-a-time FNV-1a that hash_bytes replaced, as a baseline for it
+static uint64_t fnv1a(const uint8_t *data, size_t len) {
+    uint64_t h = 14695981039346656037UL;
+    for (size_t i = 0; i < len; i++) {
+        h ^= data[i];
+        h *= 1099511628211UL;
+    }
+    return h;
+}
+
+static void bench_hash_bytes(void) {
+    static uint8_t data[256];
+    memset(data, 'k', sizeof(data));
+    size_t lens[] = {8, 16, 32, 40, 64, 120, 256};
+    uint64_t sink = 0;
+    for (size_t l = 0; l < sizeof(lens) / sizeof(lens[0]); l++) {
+        size_t ops = 20000000 / lens[l] * 8;
+        char what[40];
+        for (int fnv = 0; fnv < 2; fnv++) {
+            Mark m = mark();
+            for (size_t i = 0; i < ops; i++) {
+                data[0] = (uint8_t)i;
+                sink += fnv ? fnv1a(data, lens[l]) : hash_bytes(data, lens[l]);
+            }
+            snprintf(what, sizeof(what), "%s %zuB", fnv ? "  fnv1a (baseline)" : "hash_bytes", lens[l]);
+            report(what, m, ops);
+        }
+    }
+    if (sink == 42) {   // keep the loop from being optimised away
+        printf(" ");
+    }
+}
+
+static void bench_keyspace(uint64_t n) {
+    char key[KEY_LEN];
+    const uint8_t *val = (const uint8_t *)"some-bench-value";
+    uint64_t found = 0, pos = 0;
+    printf("-- %llu keys\n", (unsigned long long)n);
+
+    Mark m = mark();
+    for (uint64_t i = 0; i < n; i++) {
+        make_key(key, i, false);
+        found += key[4] == 'x';
+    }
+    report("make_key (included below)", m, n);
+
+    m = mark();
+    for (uint64_t i = 0; i < n; i++) {
+        make_key(key, i, false);
+        h_set((const uint8_t *)key, KEY_LEN, val, 16);
+    }
+    report("h_set insert", m, n);
+    hm_rehash_ms(&shards[0].db, 100000);    // don't bill a pending resize to the lookups
+
+    m = mark();
+    for (uint64_t i = 0; i < n; i++) {
+        make_key(key, scattered(&pos, n), false);
+        found += h_lookup((const uint8_t *)key, KEY_LEN) != NULL;
+    }
+    report("h_lookup hit", m, n);
+
+    m = mark();
+    for (uint64_t i = 0; i < n; i++) {
+        make_key(key, scattered(&pos, n), true);
+        found += h_lookup((const uint8_t *)key, KEY_LEN) != NULL;
+    }
+    report("h_lookup miss", m, n);
+
+    m = mark();
+    for (uint64_t i = 0; i < n; i++) {
+        make_key(key, scattered(&pos, n), false);
+        h_set((const uint8_t *)key, KEY_LEN, val, 16);
+    }
+    report("h_set overwrite", m, n);
+
+    m = mark();
+    for (uint64_t i = 0; i < n; i++) {
+        make_key(key, scattered(&pos, n), false);
+        found += h_del((const uint8_t *)key, KEY_LEN);
+    }
+    report("h_del", m, n);
+
+    if (found != 2 * n || hm_size(&shards[0].db) != 0) {
+        fprintf(stderr, "expected %llu keys found, got %llu\n", (unsigned long long)(2 * n), (unsigned long long)found);
+        exit(EXIT_FAILURE);
+    }
+}
+
+// encode a request body ([nstr][len][str]...) for parse_req/do_request
+static size_t encode_body(uint8_t *buf, const char **strs, size_t n) {
+    uint32_t nstr = (uint32_t)n;
+    memcpy(buf, &nstr, 4);
+    size_t pos = 4;
+    for (size_t i = 0; i < n; i++) {
+        uint32_t len = (uint32_t)strlen(strs[i]);
+        memcpy(&buf[pos], &len, 4);
+        memcpy(&buf[pos + 4], strs[i], len);
+        pos += 4 + len;
+    }
+    return pos;
+}
+
+// request shapes: what a cache client sends most
+typedef struct {
+    const char *name;
+    const char *strs[MAX_ARGS];
+    size_t n;
+} Shape;
+
+static void fill_shape(Shape *s, const char *name, const char *cmd, size_t keys, bool with_values, const char *value) {
+    static char keybuf[256][KEY_LEN + 1];
+    s->name = name;
+    s->strs[0] = cmd;
+    s->n = 1;
+    for (size_t i = 0; i < keys; i++) {
+        make_key(keybuf[i], i, false);
+        keybuf[i][KEY_LEN] = '\0';
+        s->strs[s->n++] = keybuf[i];
+        if (with_values) {
+            s->strs[s->n++] = value;
+        }
+    }
+}
+
+static void bench_requests(void) {
+    static char value[101];
+    memset(value, 'v', 100);
+    static uint8_t body[64 * 1024];
+    Shape shapes[6];
+    fill_shape(&shapes[0], "GET", "get", 1, false, NULL);
+    fill_shape(&shapes[1], "SET 100B", "set", 1, true, value);
+    fill_shape(&shapes[2], "GET miss", "get", 1, false, NULL);
+    shapes[2].strs[1] = "no-such-key";
+    fill_shape(&shapes[3], "MGET 16", "mget", 16, false, NULL);
+    fill_shape(&shapes[4], "MSET 16 x 100B", "mset", 16, true, value);
+    fill_shape(&shapes[5], "DEL + SET", "del", 1, false, NULL);
+
+    // the keys the shapes read exist, so GET and MGET hit
+    for (size_t i = 0; i < 16; i++) {
+        h_set((const uint8_t *)shapes[3].strs[1 + i], KEY_LEN, (const uint8_t *)value, 100);
+    }
+
+    Arg args[MAX_ARGS];
+    uint32_t nstr = 0;
+    char what[48];
+    size_t ops = 2000000;
+    const char *names[] = {"get", "zrangebyscore", "GET", "nosuchcommand"};
+    for (size_t c = 0; c < sizeof(names) / sizeof(names[0]); c++) {
+        Arg name = {(uint32_t)strlen(names[c]), (const uint8_t *)names[c]};
+        uint64_t sink = 0;
+        Mark m = mark();
+        for (size_t i = 0; i < ops; i++) {
+            sink += cmd_lookup(&name);
+        }
+        snprintf(what, sizeof(what), "cmd_lookup %s", names[c]);
+        report(what, m, ops);
+        if (sink == 42) {   // keep the loop from being optimised away
+            printf(" ");
+        }
+    }
+    for (size_t s = 0; s < sizeof(shapes) / sizeof(shapes[0]) - 1; s++) {
+        size_t len = encode_body(body, shapes[s].strs, shapes[s].n);
+        Mark m = mark();
+        for (size_t i = 0; i < ops; i++) {
+            body[len - 1] ^= 1;     // so the parse can't be hoisted out of the loop
+            parse_req(body, len, &nstr, args, MAX_ARGS);
+        }
+        snprintf(what, sizeof(what), "parse_req %s", shapes[s].name);
+        report(what, m, ops);
+    }
+
+    Out out = {0};
+    for (size_t s = 0; s < sizeof(shapes) / sizeof(shapes[0]); s++) {
+        size_t len = encode_body(body, shapes[s].strs, shapes[s].n);
+        Shape set_back;
+        fill_shape(&set_back, "", "set", 1, true, value);
+        uint8_t set_body[256];
+        size_t set_len = encode_body(set_body, set_back.strs, set_back.n);
+        Mark m = mark();
+        for (size_t i = 0; i < ops; i++) {
+            parse_req(body, len, &nstr, args, MAX_ARGS);
+            do_request(args, nstr, &out, false);
+            if (s == 5) {   // put the deleted key back, so every DEL deletes
+                parse_req(set_body, set_len, &nstr, args, MAX_ARGS);
+                do_request(args, nstr, &out, false);
+            }
+            out_consume(&out, out_len(&out));
+        }
+        snprintf(what, sizeof(what), "do_request %s", shapes[s].name);
+        report(what, m, ops);
+    }
+    out_free(&out);
+}
+
+int main(int argc, char **argv) {
+    uint64_t max_keys = argc > 1 ? (uint64_t)atoll(argv[1]) : DEFAULT_MAX_KEYS;
+    if (max_keys < 1000) {
+        fprintf(stderr, "usage: %s [max_keys (at least 1000)]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    log_init();
+    slab_classes_init();
+    perf_open();
+    printf("engine: %s, cache misses %s\n", HT_ENGINE, perf_fd < 0 ? "unavailable" : "from perf_event_open()");
+    printf("%-30s %10s %12s %12s\n", "", "ns/op", "misses/op", "allocs/op");
+
+    bench_hash_bytes();
+    for (uint64_t n = 1000; n <= max_keys; n *= 10) {
+        bench_keyspace(n);
+    }
+    printf("-- requests\n");
+    bench_requests();
+    return 0;
+}
@@ -0,0 +1,124 @@
+// Time-to-ready benchmark for restarting from a snapshot. It builds a dataset
+// in memory, saves it with the server's own snapshot writer, then starts
+// ../server on that file with 1, 2, 4, ... up to max_threads I/O threads and
+// measures how long each takes until it answers a GET, which is when a
+// restarted node could take traffic again. Throughput is reported against
+// the file size and key count.
+//
+// With N threads the keyspace has N shards, each filled by its own thread,
+// while checksums and key hashes are computed on every core regardless.
+//
+//   gcc -O2 -Wall -Wextra -pthread -o bench_snapshot_load bench_snapshot_load.c
+//   ./bench_snapshot_load [keys] [value_bytes] [max_threads] [server_path]
+//
+// Like bench_hashtable, it includes server.c to reach its statics.
+#define main server_main_unused
+#include "../server.c"
+#undef main
+
+#include <netinet/tcp.h>
+
+#define BENCH_PORT 12360
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+// send GET key:0 on a fresh connection; whether a reply came back
+static bool server_answers(int port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (fd < 0 || connect(fd, (const struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return false;
+    }
+    uint8_t req[] = {20, 0, 0, 0, 2, 0, 0, 0, 3, 0, 0, 0, 'g', 'e', 't', 5, 0, 0, 0, 'k', 'e', 'y', ':', '0'};
+    uint32_t len = 0;
+    bool ok = write_full(fd, req, sizeof(req)) == 0 && recv(fd, &len, 4, MSG_WAITALL) == 4;
+    close(fd);
+    return ok;
+}
+
+// start the server on the snapshot and return seconds until it answers
+static double time_to_ready(const char *server, const char *snapshot, unsigned threads) {
+    int port = BENCH_PORT + (int)threads;
+    double start = now_sec();
+    pid_t pid = fork();
+    if (pid < 0) {
+        die("fork()");
+    }
+    if (pid == 0) {
+        int devnull = open("/dev/null", O_WRONLY);
+        dup2(devnull, STDOUT_FILENO);
+        dup2(devnull, STDERR_FILENO);
+        char tbuf[16], pbuf[16];
+        snprintf(tbuf, sizeof(tbuf), "%u", threads);
+        snprintf(pbuf, sizeof(pbuf), "%d", port);
+        execl(server, server, "--threads", tbuf, "--port", pbuf, "--snapshot", snapshot, (char *)NULL);
+        _exit(127);
+    }
+    double ready = -1;
+    while (now_sec() - start < 600) {
+        if (server_answers(port)) {
+            ready = now_sec() - start;
+            break;
+        }
+        if (waitpid(pid, NULL, WNOHANG) == pid) {
+            break;  // it exited instead
+        }
+        usleep(1000);
+    }
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    if (ready < 0) {
+        fprintf(stderr, "server at %s did not become ready\n", server);
+        exit(EXIT_FAILURE);
+    }
+    return ready;
+}
+
+int main(int argc, char **argv) {
+    size_t n = argc > 1 ? (size_t)atol(argv[1]) : 1000000;
+    size_t vlen = argc > 2 ? (size_t)atol(argv[2]) : 100;
+    unsigned max_threads = argc > 3 ? (unsigned)atoi(argv[3]) : 4;
+    const char *server = argc > 4 ? argv[4] : "../server";
+    if (n == 0 || max_threads < 1 || max_threads > MAX_THREADS) {
+        fprintf(stderr, "usage: %s [keys] [value_bytes] [max_threads] [server_path]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    slab_classes_init();
+
+    uint8_t *val = malloc(vlen + 1);
+    memset(val, 'v', vlen);
+    char key[32];
+    for (size_t i = 0; i < n; i++) {
+        int klen = snprintf(key, sizeof(key), "key:%zu", i);
+        h_set((const uint8_t *)key, (size_t)klen, val, vlen);
+    }
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/bench_snapshot_load-%d.rdb", (int)getpid());
+    double start = now_sec();
+    int64_t size = snapshot_save(path);
+    if (size < 0) {
+        die("snapshot_save()");
+    }
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    printf("%zu keys, %zu-byte values, %.1f MB snapshot written in %.2fs, %ld cores\n",
+           n, vlen, (double)size / 1e6, now_sec() - start, ncpus);
+
+    printf("%-10s %14s %10s %14s\n", "threads", "ready (ms)", "MB/s", "keys/s");
+    for (unsigned t = 1; t <= max_threads; t = t * 2 > max_threads && t != max_threads ? max_threads : t * 2) {
+        double secs = time_to_ready(server, path, t);
+        printf("%-10u %14.1f %10.1f %14.0f\n", t, secs * 1000, (double)size / 1e6 / secs, (double)n / secs);
+        fflush(stdout);
+    }
+    unlink(path);
+    free(val);
+    return 0;
+}
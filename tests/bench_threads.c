@@ -0,0 +1,238 @@
+// Throughput benchmark for the server's --threads mode. It starts ../server
+// with 1, 2, 4, ... up to max_threads I/O threads in turn, drives each one
+// with the same client load for a few seconds, and prints ops/sec plus the
+// speedup over a single thread, so the scaling is visible in numbers.
+//
+// The load is a 50/50 mix of SET and GET over a fixed key space. Each client
+// worker thread owns a slice of the connections and keeps exactly one request
+// in flight on each of them, so the server always has work queued on every
+// connection without relying on deep pipelining.
+//
+//   gcc -O2 -Wall -Wextra -pthread -o bench_threads bench_threads.c
+//   ./bench_threads [max_threads] [seconds] [connections] [server_path]
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#define BENCH_PORT 12340
+#define KEY_SPACE 100000
+
+static void die(const char *message) {
+    perror(message);
+    exit(EXIT_FAILURE);
+}
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static int read_full(int fd, uint8_t *buf, size_t n) {
+    while (n > 0) {
+        ssize_t rv = read(fd, buf, n);
+        if (rv <= 0) {
+            return -1;
+        }
+        n -= (size_t)rv;
+        buf += rv;
+    }
+    return 0;
+}
+
+static int write_all(int fd, const uint8_t *buf, size_t n) {
+    while (n > 0) {
+        ssize_t rv = write(fd, buf, n);
+        if (rv <= 0) {
+            return -1;
+        }
+        n -= (size_t)rv;
+        buf += rv;
+    }
+    return 0;
+}
+
+// encode [len][nstr][len1][str1]... into buf, returning the total size
+static size_t encode_req(uint8_t *buf, const char **cmd, size_t n) {
+    size_t pos = 8;
+    for (size_t i = 0; i < n; i++) {
+        uint32_t slen = (uint32_t)strlen(cmd[i]);
+        memcpy(&buf[pos], &slen, 4);
+        memcpy(&buf[pos + 4], cmd[i], slen);
+        pos += 4 + slen;
+    }
+    uint32_t len = (uint32_t)(pos - 4), nstr = (uint32_t)n;
+    memcpy(buf, &len, 4);
+    memcpy(&buf[4], &nstr, 4);
+    return pos;
+}
+
+static int connect_server(int port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        die("socket()");
+    }
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(fd, (const struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+typedef struct {
+    int *fds;
+    size_t nfds;
+    double deadline;
+    uint64_t ops;
+    unsigned seed;
+    int failed;
+} Worker;
+
+static void *worker_run(void *arg) {
+    Worker *w = (Worker *)arg;
+    uint8_t req[256], res[4096];
+    char key[32];
+    while (now_sec() < w->deadline) {
+        for (size_t i = 0; i < w->nfds; i++) {   // one request in flight per connection
+            snprintf(key, sizeof(key), "key:%d", rand_r(&w->seed) % KEY_SPACE);
+            const char *set_cmd[3] = {"set", key, "some-bench-value"};
+            const char *get_cmd[2] = {"get", key};
+            size_t n = rand_r(&w->seed) % 2 ? encode_req(req, set_cmd, 3) : encode_req(req, get_cmd, 2);
+            if (write_all(w->fds[i], req, n) < 0) {
+                w->failed = 1;
+                return NULL;
+            }
+        }
+        for (size_t i = 0; i < w->nfds; i++) {
+            uint32_t len = 0;
+            if (read_full(w->fds[i], (uint8_t *)&len, 4) < 0 || len > sizeof(res)
+                    || read_full(w->fds[i], res, len) < 0) {
+                w->failed = 1;
+                return NULL;
+            }
+            w->ops++;
+        }
+    }
+    return NULL;
+}
+
+static pid_t start_server(const char *path, unsigned threads, int port) {
+    pid_t pid = fork();
+    if (pid < 0) {
+        die("fork()");
+    }
+    if (pid == 0) {
+        int devnull = open("/dev/null", O_WRONLY);
+        dup2(devnull, STDOUT_FILENO);
+        dup2(devnull, STDERR_FILENO);
+        char tbuf[16], pbuf[16];
+        snprintf(tbuf, sizeof(tbuf), "%u", threads);
+        snprintf(pbuf, sizeof(pbuf), "%d", port);
+        execl(path, path, "--threads", tbuf, "--port", pbuf, (char *)NULL);
+        _exit(127);
+    }
+    for (int i = 0; i < 100; i++) {     // wait up to 5s for it to start listening
+        int fd = connect_server(port);
+        if (fd >= 0) {
+            close(fd);
+            return pid;
+        }
+        usleep(50000);
+    }
+    fprintf(stderr, "server at %s did not start\n", path);
+    kill(pid, SIGKILL);
+    exit(EXIT_FAILURE);
+}
+
+// drive a server running with `threads` I/O threads; returns ops/sec
+static double run_one(const char *path, unsigned threads, unsigned workers, size_t conns, double seconds) {
+    int port = BENCH_PORT + (int)threads;
+    pid_t pid = start_server(path, threads, port);
+
+    int *fds = calloc(conns, sizeof(int));
+    for (size_t i = 0; i < conns; i++) {
+        fds[i] = connect_server(port);
+        if (fds[i] < 0) {
+            die("connect()");
+        }
+    }
+    Worker *ws = calloc(workers, sizeof(Worker));
+    pthread_t *tids = calloc(workers, sizeof(pthread_t));
+    double start = now_sec();
+    size_t per = conns / workers;
+    for (unsigned i = 0; i < workers; i++) {
+        ws[i].fds = &fds[i * per];
+        ws[i].nfds = i + 1 == workers ? conns - i * per : per;
+        ws[i].deadline = start + seconds;
+        ws[i].seed = 1234 + i;
+        pthread_create(&tids[i], NULL, worker_run, &ws[i]);
+    }
+    uint64_t ops = 0;
+    int failed = 0;
+    for (unsigned i = 0; i < workers; i++) {
+        pthread_join(tids[i], NULL);
+        ops += ws[i].ops;
+        failed |= ws[i].failed;
+    }
+    double elapsed = now_sec() - start;
+
+    for (size_t i = 0; i < conns; i++) {
+        close(fds[i]);
+    }
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    free(fds);
+    free(ws);
+    free(tids);
+    if (failed) {
+        fprintf(stderr, "a connection failed during the %u-thread run\n", threads);
+        exit(EXIT_FAILURE);
+    }
+    return (double)ops / elapsed;
+}
+
+int main(int argc, char **argv) {
+    unsigned max_threads = argc > 1 ? (unsigned)atoi(argv[1]) : 4;
+    double seconds = argc > 2 ? atof(argv[2]) : 3.0;
+    size_t conns = argc > 3 ? (size_t)atoi(argv[3]) : 64;
+    const char *path = argc > 4 ? argv[4] : "../server";
+    if (max_threads < 1 || seconds <= 0 || conns < 1) {
+        fprintf(stderr, "usage: %s [max_threads] [seconds] [connections] [server_path]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    // enough client threads that the client side is not the bottleneck
+    unsigned workers = max_threads < conns ? max_threads : (unsigned)conns;
+    signal(SIGPIPE, SIG_IGN);
+
+    printf("%u client threads, %zu connections, %.1fs per run, %d keys, 50%% SET / 50%% GET\n",
+           workers, conns, seconds, KEY_SPACE);
+    printf("%-10s %14s %10s\n", "threads", "ops/sec", "speedup");
+    double base = 0;
+    for (unsigned t = 1; t <= max_threads; t = t * 2 > max_threads && t != max_threads ? max_threads : t * 2) {
+        double rate = run_one(path, t, workers, conns, seconds);
+        if (t == 1) {
+            base = rate;
+        }
+        printf("%-10u %14.0f %9.2fx\n", t, rate, rate / base);
+        fflush(stdout);
+    }
+    return 0;
+}
@@ -0,0 +1,81 @@
+#!/bin/bash
+# Two-process replication test: a primary and a replica on localhost, both
+# with several I/O threads. The replica syncs in full, keeps up with a
+# pipelined write load without being dropped, refuses client writes, and
+# ends up holding exactly the primary's keys.
+#
+#   cd tests && ./test_replication.sh
+set -eo pipefail
+
+PRIMARY_PORT=${PRIMARY_PORT:-16379}
+REPLICA_PORT=${REPLICA_PORT:-16380}
+dir=$(mktemp -d)
+pids=()
+cleanup() {
+    for pid in "${pids[@]}"; do
+        kill "$pid" 2>/dev/null || true
+    done
+    wait 2>/dev/null || true
+    rm -rf "$dir"
+}
+trap cleanup EXIT
+
+fail() {
+    echo "FAIL: $1"
+    echo "--- primary log"; cat "$dir/primary.log"
+    echo "--- replica log"; cat "$dir/replica.log"
+    exit 1
+}
+
+gcc -Wall -Wextra -pthread -o "$dir/server" ../server.c
+gcc -Wall -Wextra -pthread -o "$dir/client" ../client.c
+
+# the value of one INFO field from the server on port $1
+info_field() {
+    "$dir/client" --port "$1" INFO all 2>/dev/null | tr -d '\r' | sed -n "s/^$2://p"
+}
+
+# wait up to 10 s for command $@ to succeed
+wait_for() {
+    for _ in $(seq 1 100); do
+        if "$@"; then
+            return 0
+        fi
+        sleep 0.1
+    done
+    return 1
+}
+
+primary_up() { "$dir/client" --port "$PRIMARY_PORT" GET probe >/dev/null 2>&1; }
+link_up() { [ "$(info_field "$REPLICA_PORT" master_link_status)" = up ]; }
+caught_up() {
+    [ "$(info_field "$REPLICA_PORT" slave_repl_offset)" = "$(info_field "$PRIMARY_PORT" master_repl_offset)" ]
+}
+
+(cd "$dir" && exec ./server --port "$PRIMARY_PORT" --threads 4 --snapshot primary.rdb --log-level info \
+    2>primary.log) &
+pids+=($!)
+wait_for primary_up || fail "the primary didn't start"
+"$dir/client" --port "$PRIMARY_PORT" --requests 20000 --keyspace 20000 --get-ratio 0 >/dev/null
+
+(cd "$dir" && exec ./server --port "$REPLICA_PORT" --threads 4 --snapshot replica.rdb --log-level info \
+    --replicaof "127.0.0.1:$PRIMARY_PORT" 2>replica.log) &
+pids+=($!)
+wait_for link_up || fail "the replica never linked up"
+
+"$dir/client" --port "$PRIMARY_PORT" --requests 400000 --keyspace 20000 --get-ratio 0 --pipeline 16 \
+    --connections 50 --seed 7 >/dev/null
+wait_for caught_up || fail "the replica didn't catch up with the stream"
+
+[ "$(info_field "$PRIMARY_PORT" sync_full)" = 1 ] || fail "the replica was dropped and resynced"
+[ "$(info_field "$PRIMARY_PORT" keys)" = "$(info_field "$REPLICA_PORT" keys)" ] || fail "key counts differ"
+for i in $(seq 0 397 19999); do
+    [ "$("$dir/client" --port "$PRIMARY_PORT" GET "key:$i")" = "$("$dir/client" --port "$REPLICA_PORT" GET "key:$i")" ] \
+        || fail "key:$i differs"
+done
+"$dir/client" --port "$REPLICA_PORT" SET key:0 x | grep -q READONLY || fail "the replica took a client write"
+
+"$dir/client" --port "$REPLICA_PORT" REPLICAOF NO ONE >/dev/null
+"$dir/client" --port "$REPLICA_PORT" SET key:0 x | grep -q OK || fail "a promoted replica refused a write"
+
+echo "replication tests passed"
@@ -1,8 +1,11 @@
 // Unit tests for the pure logic inside server.c: request parsing, integer
-// parsing, hash table operations, and command dispatch. None of this needs a
-// live socket or root, unlike accept_new_conn/try_fill_buffer/connection_io,
-// which are exercised instead by actually running the server and client
-// together (see the example session in the README).
+// parsing, hash table operations (including incremental resizing), the slab
+// allocator, sorted sets, active expiry, snapshots, the AOF, shard routing,
+// connection buffers, the log ring, pipelined batching (over a socketpair),
+// and command dispatch. None of this needs a live TCP socket or root, unlike
+// accept_new_conn and the epoll loop, which are exercised instead by actually
+// running the server and client together (see the example session in the
+// README).
 //
 // This file includes server.c directly so the tests can reach its static
 // functions without changing server.c's structure or adding a build system.
@@ -26,19 +29,46 @@ static int tests_failed = 0;
         }                                                               \
     } while (0)
 
-// wipe every bucket of the hash table so tests don't leak state into each other
+// shard s's table, for the tests that spread keys over several shards
+static HMap *shard_db(uint32_t s) {
+    return &shards[s].db;
+}
+
+// the tests mostly run single-threaded, so the whole keyspace is shard 0
+#define db (shards[0].db)
+#define ttl_heap (shards[0].ttl_heap)
+#define expire_stats (shards[0].expire_stats)
+
+// wipe every shard so tests don't leak state into each other
 static void clear_htable(void) {
-    for (int i = 0; i < HTABLE_SIZE; i++) {
-        Entry *e = htable[i];
-        while (e) {
-            Entry *next = e->next;
-            free(e->key);
-            free(e->val);
-            free(e);
-            e = next;
+    for (uint32_t s = 0; s < nshards; s++) {
+        shard_flush(&shards[s]);
+    }
+}
+
+// set key<i> = val<i> for i in [from, to)
+static void set_numbered_keys(int from, int to) {
+    char key[32], val[32];
+    for (int i = from; i < to; i++) {
+        int klen = snprintf(key, sizeof(key), "key%d", i);
+        int vlen = snprintf(val, sizeof(val), "val%d", i);
+        h_set((const uint8_t *)key, (size_t)klen, (const uint8_t *)val, (size_t)vlen);
+    }
+}
+
+// count how many of key<i> for i in [from, to) can be found with the right value
+static int count_numbered_keys(int from, int to) {
+    char key[32], val[32];
+    int found = 0;
+    for (int i = from; i < to; i++) {
+        int klen = snprintf(key, sizeof(key), "key%d", i);
+        int vlen = snprintf(val, sizeof(val), "val%d", i);
+        Entry *e = h_lookup((const uint8_t *)key, (size_t)klen);
+        if (e && e->vlen == (size_t)vlen && memcmp(e->val, val, (size_t)vlen) == 0) {
+            found++;
         }
-        htable[i] = NULL;
     }
+    return found;
 }
 
 // build an Arg pointing at a C string literal, for convenience in tests
@@ -54,6 +84,37 @@ static uint8_t resp_type(const uint8_t *buf) {
     return buf[0];
 }
 
+// copy every unsent byte of a reply chain into b
+static void out_flatten(const Out *out, Buf *b) {
+    struct iovec iov[OUT_IOV_MAX];
+    int n = out_iov(out, iov, OUT_IOV_MAX);
+    for (int i = 0; i < n; i++) {
+        buf_append(b, iov[i].iov_base, iov[i].iov_len);
+    }
+}
+
+// run one command through do_request into b, which is reset first, and
+// return where its response starts
+static const uint8_t *run_request(Buf *b, const Arg *args, uint32_t nstr) {
+    Out out = {0};
+    do_request(args, nstr, &out, false);
+    b->start = b->end = 0;
+    out_flatten(&out, b);
+    out_free(&out);
+    return b->data + b->start;
+}
+
+// whether the n bytes at buf contain the C string needle anywhere
+static bool bytes_contain(const uint8_t *buf, size_t n, const char *needle) {
+    size_t nlen = strlen(needle);
+    for (size_t i = 0; i + nlen <= n; i++) {
+        if (memcmp(buf + i, needle, nlen) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
 // ---- parse_req ----
 
 static void test_parse_req_single_string(void) {
@@ -123,7 +184,7 @@ static void test_parse_req_rejects_string_overrunning_body(void) {
 
 static void test_parse_req_rejects_too_many_args(void) {
     uint8_t body[4];
-    uint32_t nstr = 999;   // above MAX_ARGS
+    uint32_t nstr = MAX_ARGS + 1;
     memcpy(body, &nstr, 4);
 
     Arg args[MAX_ARGS];
@@ -198,6 +259,43 @@ static void test_arg_is_rejects_prefix_match(void) {
 
 // ---- hash table ----
 
+static void test_hash_bytes(void) {
+    static uint8_t data[200], moved[201];
+    for (size_t i = 0; i < sizeof(data); i++) {
+        data[i] = (uint8_t)(i * 7);
+    }
+    memcpy(moved + 1, data, sizeof(data));
+    bool stable = true, distinct = true;
+    for (size_t len = 0; len <= sizeof(data); len++) {
+        uint64_t h = hash_bytes(data, len);
+        stable &= hash_bytes(moved + 1, len) == h;     // an unaligned copy hashes the same
+        distinct &= len == 0 || hash_bytes(data, len - 1) != h;
+        for (size_t i = 0; i < len; i += 13) {
+            data[i] ^= 1;
+            distinct &= hash_bytes(data, len) != h;  // so does any changed byte, in every read path
+            data[i] ^= 1;
+        }
+    }
+    CHECK(stable, "hash_bytes depends only on the bytes, not their address");
+    CHECK(distinct, "hash_bytes changes with the length and with every byte");
+
+    // FNV-1a put all of these on one shard of four
+    nshards = 4;
+    bool seen[4] = {false};
+    for (char c = '0'; c <= '7'; c++) {
+        char key[2] = {'x', c};
+        seen[shard_idx(hash_bytes((const uint8_t *)key, 2))] = true;
+    }
+    nshards = 1;
+    CHECK(seen[0] + seen[1] + seen[2] + seen[3] >= 3, "keys differing in one byte spread across shards");
+
+    uint64_t before = hash_bytes((const uint8_t *)"key:1", 5);
+    uint64_t saved = hash_seed;
+    hash_seed_init();
+    CHECK(hash_bytes((const uint8_t *)"key:1", 5) != before, "a new seed moves every key");
+    hash_seed = saved;
+}
+
 static void test_hashtable_set_and_get(void) {
     clear_htable();
     h_set((const uint8_t *)"key1", 4, (const uint8_t *)"hello", 5);
@@ -233,80 +331,1978 @@ static void test_hashtable_lazy_expiry(void) {
     CHECK(h_lookup((const uint8_t *)"key1", 4) == NULL, "h_lookup treats a key past its expire_at as missing");
 }
 
+static void test_hashtable_grows_with_keys(void) {
+    clear_htable();
+    set_numbered_keys(0, 10000);
+    CHECK(db.ht[0].size + db.ht[1].size == 10000, "the store counts every inserted key");
+    CHECK(count_numbered_keys(0, 10000) == 10000, "every key is still found while the table grows");
+    hm_rehash_ms(&db, 1000);
+    CHECK(!hm_is_rehashing(&db), "an idle-tick rehash finishes a pending resize");
+    CHECK(db.ht[0].mask + 1 >= 10000, "the table doubled to at least one bucket per key");
+}
+
+static void test_hashtable_lookup_mid_rehash(void) {
+    clear_htable();
+    set_numbered_keys(0, 100);
+    hm_rehash_ms(&db, 1000);     // settle, then add keys until the table is full enough to grow
+    int n = 100;
+    while (!hm_is_rehashing(&db) && n < 1000) {
+        set_numbered_keys(n, n + 1);
+        n++;
+    }
+    CHECK(hm_is_rehashing(&db), "inserting past the maximum fill starts an incremental resize");
+    CHECK(db.ht[0].size > 0 && db.ht[1].tab != NULL, "the resize has not moved every bucket at once");
+    CHECK(h_del((const uint8_t *)"key3", 4), "h_del finds a key while a resize is in progress");
+    CHECK(count_numbered_keys(0, n) == n - 1, "keys are found whichever table they currently live in");
+}
+
+static void test_hashtable_survives_churn(void) {
+    clear_htable();
+    // deleting and re-adding keys leaves deleted slots behind in an
+    // open-addressing table; every live key must stay reachable past them
+    char key[32];
+    for (int round = 0; round < 20; round++) {
+        set_numbered_keys(round * 500, round * 500 + 1000);
+        for (int i = round * 500; i < round * 500 + 500; i++) {
+            int klen = snprintf(key, sizeof(key), "key%d", i);
+            h_del((const uint8_t *)key, (size_t)klen);
+        }
+    }
+    CHECK(count_numbered_keys(0, 10000) == 0, "every deleted key stays deleted");
+    CHECK(count_numbered_keys(10000, 10500) == 500, "every live key is found after heavy churn");
+    CHECK(db.ht[0].size + db.ht[1].size == 500, "the store counts exactly the live keys");
+}
+
+static void test_hashtable_shrinks_after_deletes(void) {
+    clear_htable();
+    set_numbered_keys(0, 4096);
+    hm_rehash_ms(&db, 1000);
+    size_t big = db.ht[0].mask + 1;
+    char key[32];
+    for (int i = 0; i < 4090; i++) {
+        int klen = snprintf(key, sizeof(key), "key%d", i);
+        h_del((const uint8_t *)key, (size_t)klen);
+    }
+    hm_rehash_ms(&db, 1000);
+    CHECK(db.ht[0].mask + 1 < big, "the table shrinks once it falls below its minimum fill");
+    CHECK(count_numbered_keys(4090, 4096) == 6, "the remaining keys survive the shrink");
+}
+
+// ---- latency histograms and command stats ----
+
+static void test_hist_buckets_bound_values(void) {
+    bool within = true, ordered = true;
+    uint32_t prev = 0;
+    for (uint64_t v = 0; v < 200000; v += 1 + v / 64) {
+        uint32_t b = hist_bucket(v);
+        uint64_t hi = hist_bucket_max(b);
+        within = within && hi >= v && (hi - v) * HIST_SUB <= v;
+        ordered = ordered && b >= prev;
+        prev = b;
+    }
+    CHECK(within, "a value's bucket tops out within 1/8 above it");
+    CHECK(ordered, "larger values never land in lower buckets");
+    CHECK(hist_bucket(UINT64_MAX) == HIST_BUCKETS - 1, "huge values share the top bucket");
+}
+
+static void test_hist_percentiles(void) {
+    Hist h = {0};
+    CHECK(hist_percentile(&h, 99) == 0, "an empty histogram has no percentiles");
+    for (uint64_t v = 1; v <= 1000; v++) {
+        hist_add(&h, v, 1);
+    }
+    uint64_t p50 = hist_percentile(&h, 50), p99 = hist_percentile(&h, 99);
+    CHECK(h.total == 1000 && p50 >= 500 && p50 <= 500 + 500 / HIST_SUB, "p50 of 1..1000 is about 500");
+    CHECK(p99 >= 990 && p99 <= 990 + 990 / HIST_SUB, "p99 of 1..1000 is about 990");
+    CHECK(hist_percentile(&h, 100) == 1000, "p100 is the exact maximum");
+    Hist sum = {0};
+    hist_merge(&sum, &h);
+    hist_add(&sum, (uint64_t)1 << 50, 10);
+    CHECK(sum.total == 1010 && hist_percentile(&sum, 100) == (uint64_t)1 << 50, "merged counts add up, beyond the top bucket too");
+}
+
+static void test_cmd_lookup(void) {
+    bool all = true;
+    for (uint32_t c = 0; c < CMD_COUNT; c++) {
+        Arg a = mkarg(commands[c].name);
+        all = all && cmd_lookup(&a) == c;
+    }
+    CHECK(all, "every command name finds its own id");
+    Arg upper = mkarg("ZRangeByScore"), longer = mkarg("gets"), empty = mkarg("");
+    CHECK(cmd_lookup(&upper) != CMD_NONE && strcmp(commands[cmd_lookup(&upper)].name, "zrangebyscore") == 0,
+        "lookup ignores case");
+    CHECK(cmd_lookup(&longer) == CMD_NONE && cmd_lookup(&empty) == CMD_NONE, "other names are no command");
+    bool handled = true;
+    for (uint32_t c = 0; c < CMD_COUNT; c++) {
+        handled = handled && cmd_procs[c] != NULL && commands[c].arity != 0;
+    }
+    CHECK(handled, "every command has a handler and an arity");
+}
+
+// ---- deadline heap and active expiry ----
+
+static void test_heap_orders_by_deadline(void) {
+    Heap h = {0};
+    HeapNode nodes[5];
+    uint64_t deadlines[5] = {50, 10, 40, 20, 30};
+    for (int i = 0; i < 5; i++) {
+        nodes[i].idx = HEAP_NONE;
+        heap_upsert(&h, &nodes[i], deadlines[i]);
+    }
+    CHECK(heap_top(&h) == &nodes[1], "heap_top returns the soonest deadline");
+    heap_remove(&h, &nodes[1]);
+    heap_upsert(&h, &nodes[0], 5);   // reschedule the latest node to be the soonest
+    CHECK(heap_top(&h) == &nodes[0], "heap_upsert moves an already queued node");
+    uint64_t prev = 0;
+    bool ordered = true;
+    while (heap_top(&h)) {
+        HeapNode *n = heap_top(&h);
+        ordered = ordered && n->at_ms >= prev;
+        prev = n->at_ms;
+        heap_remove(&h, n);
+    }
+    CHECK(ordered && nodes[1].idx == HEAP_NONE, "nodes come off the heap in deadline order");
+    free(h.items);
+}
+
+static void test_expire_sweep_removes_untouched_keys(void) {
+    clear_htable();
+    memset(&expire_stats, 0, sizeof(expire_stats));
+    set_numbered_keys(0, 100);
+    char key[32];
+    for (int i = 0; i < 50; i++) {
+        int klen = snprintf(key, sizeof(key), "key%d", i);
+        entry_set_expire(h_lookup((const uint8_t *)key, (size_t)klen), time(NULL) - 1);
+    }
+    entry_set_expire(h_lookup((const uint8_t *)"key99", 5), time(NULL) + 100);
+    CHECK(ttl_heap.size == 51, "every key given a TTL is tracked in the deadline heap");
+
+    expire_sweep(&shards[0], 1000000);
+    CHECK(db.ht[0].size + db.ht[1].size == 50, "the sweeper removes expired keys nobody looked up again");
+    CHECK(expire_stats.expired_keys == 50 && expire_stats.sweeps == 1, "the sweeper counts what it expired");
+    CHECK(ttl_heap.size == 1, "keys whose TTL has not passed stay queued");
+    int timeout = next_expiry_timeout_ms(&shards[0], 1000);
+    CHECK(timeout == 1000, "epoll_wait() sleeps no longer than the cap when the next expiry is far off");
+}
+
+static void test_set_and_del_leave_the_ttl_heap(void) {
+    clear_htable();
+    set_numbered_keys(0, 2);
+    entry_set_expire(h_lookup((const uint8_t *)"key0", 4), time(NULL) + 100);
+    entry_set_expire(h_lookup((const uint8_t *)"key1", 4), time(NULL) + 100);
+    set_numbered_keys(0, 1);    // overwrite clears key0's TTL
+    CHECK(ttl_heap.size == 1, "SET drops an overwritten key from the deadline heap");
+    h_del((const uint8_t *)"key1", 4);
+    CHECK(ttl_heap.size == 0, "DEL drops a deleted key from the deadline heap");
+    CHECK(next_expiry_timeout_ms(&shards[0], 1000) == 1000, "with no TTLs pending epoll_wait() uses the cap");
+}
+
+// ---- slab allocator ----
+
+static void test_slab_classes_cover_every_size(void) {
+    bool ok = true;
+    for (size_t size = 1; size <= SLAB_MAX_CHUNK; size += 7) {
+        uint32_t c = slab_class_for(size);
+        ok = ok && c != SLAB_LARGE && slab_chunk_size[c] >= size && (c == 0 || slab_chunk_size[c - 1] < size);
+    }
+    CHECK(ok, "every size up to the largest chunk maps to the smallest class that fits");
+    CHECK(slab_class_for(SLAB_MAX_CHUNK + 1) == SLAB_LARGE, "bigger blocks bypass the slabs");
+}
+
+static void test_slab_entry_is_one_block(void) {
+    clear_htable();
+    h_set((const uint8_t *)"key1", 4, (const uint8_t *)"hello", 5);
+    Entry *e = h_lookup((const uint8_t *)"key1", 4);
+    CHECK(e && e->key == (char *)(e + 1) && e->val == e->key + 4, "key and value are stored inline after the entry");
+    CHECK(e && e->slab_class == slab_class_for(entry_size(4, 5)), "the entry came from the class for its size");
+}
+
+static void test_slab_overwrite_reuses_block(void) {
+    clear_htable();
+    Slab *sl = &shards[0].slab;
+    h_set((const uint8_t *)"key1", 4, (const uint8_t *)"hello", 5);
+    Entry *before = h_lookup((const uint8_t *)"key1", 4);
+    uint64_t inplace = sl->inplace_overwrites;
+    h_set((const uint8_t *)"key1", 4, (const uint8_t *)"howdy", 5);
+    Entry *after = h_lookup((const uint8_t *)"key1", 4);
+    CHECK(after == before && sl->inplace_overwrites == inplace + 1, "an overwrite that fits reuses the entry's block");
+    CHECK(after && memcmp(after->val, "howdy", 5) == 0, "the reused block holds the new value");
+
+    char big[1000];
+    memset(big, 'b', sizeof(big));
+    h_set((const uint8_t *)"key1", 4, (const uint8_t *)big, sizeof(big));
+    after = h_lookup((const uint8_t *)"key1", 4);
+    CHECK(after && after->vlen == sizeof(big) && after->slab_class == slab_class_for(entry_size(4, sizeof(big))),
+          "an overwrite that doesn't fit moves to a bigger class");
+    CHECK(after && memcmp(after->val, big, sizeof(big)) == 0, "the moved entry holds the new value");
+}
+
+static void test_slab_free_list_is_reused(void) {
+    clear_htable();
+    h_set((const uint8_t *)"key1", 4, (const uint8_t *)"hello", 5);
+    Entry *old = h_lookup((const uint8_t *)"key1", 4);
+    h_del((const uint8_t *)"key1", 4);
+    h_set((const uint8_t *)"key2", 4, (const uint8_t *)"world", 5);
+    CHECK(h_lookup((const uint8_t *)"key2", 4) == old, "a freed chunk is handed to the next entry of its class");
+}
+
+static void test_slab_large_blocks(void) {
+    clear_htable();
+    Slab *sl = &shards[0].slab;
+    size_t klen = SLAB_MAX_CHUNK * 2;   // a big value would be shared instead, so use a big key
+    uint8_t *key = calloc(1, klen);
+    h_set(key, klen, (const uint8_t *)"v", 1);
+    Entry *e = h_lookup(key, klen);
+    CHECK(e && e->slab_class == SLAB_LARGE && sl->large_used == 1, "an entry bigger than any class is malloc()ed whole");
+    h_del(key, klen);
+    CHECK(sl->large_used == 0 && sl->large_bytes == 0, "freeing a large entry releases it");
+    free(key);
+}
+
+static void test_shared_value_outlives_its_entry(void) {
+    clear_htable();
+    Slab *sl = &shards[0].slab;
+    size_t vlen = VAL_SHARED_MIN;
+    uint8_t *val = malloc(vlen);
+    memset(val, 'a', vlen);
+    h_set((const uint8_t *)"big", 3, val, vlen);
+    Entry *e = h_lookup((const uint8_t *)"big", 3);
+    CHECK(e && e->slab_class != SLAB_LARGE, "a shared value keeps its entry in a slab class");
+    CHECK(sl->shared_values == 1 && sl->shared_bytes == vlen, "a big value is counted as shared");
+
+    // GET it, then overwrite and delete the key before the reply is sent
+    Out out = {0};
+    Arg get[2] = {mkarg("get"), mkarg("big")};
+    do_request(get, 2, &out, false);
+    CHECK(out.head && out.head->next && out.head->next->cap == 0, "GET references a shared value instead of copying it");
+    memset(val, 'b', vlen);
+    h_set((const uint8_t *)"big", 3, val, vlen);
+    e = h_lookup((const uint8_t *)"big", 3);
+    CHECK(e && e->val[0] == 'b', "a SET replaces a shared value");
+    h_del((const uint8_t *)"big", 3);
+    CHECK(sl->shared_values == 0 && sl->shared_bytes == 0, "deleting the key stops counting its value");
+
+    Buf b = {0};
+    out_flatten(&out, &b);
+    const uint8_t *res = b.data + b.start;
+    bool intact = resp_type(res) == RES_STR && buf_len(&b) == 1 + vlen;
+    for (size_t i = 0; intact && i < vlen; i++) {
+        intact = res[1 + i] == 'a';
+    }
+    CHECK(intact, "a pending reply still sends the value it read");
+    out_free(&out);     // drops the last reference; ASan flags a leak or a double free
+    buf_free(&b);
+    free(val);
+}
+
+static void test_do_request_slabstats(void) {
+    clear_htable();
+    set_numbered_keys(0, 100);
+    Buf ob = {0};
+    const uint8_t *out = NULL;
+    Arg args[1] = {mkarg("slabstats")};
+    out = run_request(&ob, args, 1);
+    CHECK(resp_type(out) == RES_STR, "SLABSTATS returns a string");
+    CHECK(bytes_contain(out, buf_len(&ob), "fragmentation_ratio:"), "SLABSTATS reports fragmentation");
+    CHECK(bytes_contain(out, buf_len(&ob), "class_0:chunk_size=96,"), "SLABSTATS lists the classes in use");
+    buf_free(&ob);
+}
+
+// ---- sorted sets ----
+
+// whether every node's rank, position by rank, backward link and index entry
+// agree with a walk of level 0, which must be in (score, member) order
+static bool zset_consistent(const ZSet *zs) {
+    size_t i = 0;
+    const ZNode *prev = NULL;
+    for (const ZNode *x = zs->header->lvl[0].forward; x; prev = x, x = x->lvl[0].forward, i++) {
+        if ((prev && !znode_before(prev, x->score, znode_member(x), x->mlen)) || x->backward != prev
+                || zset_rank(zs, x) != i || zset_at_rank(zs, i) != x
+                || zset_find(zs, znode_member(x), x->mlen) != x) {
+            return false;
+        }
+    }
+    return i == zs->len && zs->tail == prev;
+}
+
+static void test_zset_ranks_follow_scores(void) {
+    size_t mem = 0;
+    ZSet *zs = zset_new(&mem);
+    char member[16];
+    unsigned seed = 7;
+    for (int i = 0; i < 2000; i++) {
+        int n = snprintf(member, sizeof(member), "m%d", i);
+        zset_add(zs, (double)(rand_r(&seed) % 500), (const uint8_t *)member, (size_t)n);    // plenty of ties
+    }
+    CHECK(zs->len == 2000 && zset_consistent(zs), "ranks and order hold after inserts with tied scores");
+    CHECK(zs->height > 1, "the skiplist grows taller than one level");
+
+    CHECK(!zset_add(zs, -1, (const uint8_t *)"m5", 2), "re-adding a member is not counted as new");
+    CHECK(zset_at_rank(zs, 0) == zset_find(zs, (const uint8_t *)"m5", 2), "a lower score moves it to the front");
+    for (int i = 0; i < 2000; i += 2) {
+        int n = snprintf(member, sizeof(member), "m%d", i);
+        zset_remove(zs, zset_find(zs, (const uint8_t *)member, (size_t)n));
+    }
+    CHECK(zs->len == 1000 && zset_consistent(zs), "ranks and order hold after removing half the members");
+    CHECK(zset_find(zs, (const uint8_t *)"m4", 2) == NULL, "a removed member is gone from the index");
+    CHECK(mem > 1000 * sizeof(ZNode), "the set's memory is charged to its owner");
+    zset_free(zs);
+    CHECK(mem == 0, "and given back in full when it is freed");
+}
+
+static void test_zset_remove_range(void) {
+    size_t mem = 0;
+    ZSet *zs = zset_new(&mem);
+    char member[16];
+    for (int i = 0; i < 100; i++) {
+        int n = snprintf(member, sizeof(member), "m%d", i);
+        zset_add(zs, i, (const uint8_t *)member, (size_t)n);
+    }
+    ZRange r = {.min = 10, .max = 20, .minex = true};
+    CHECK(zset_first_in_range(zs, &r, NULL)->score == 11, "an excluded minimum skips the score itself");
+    CHECK(zset_remove_range(zs, &r) == 10, "(10 to 20 covers ten scores");
+    CHECK(zs->len == 90 && zset_consistent(zs), "ranks hold after removing a range");
+    r = (ZRange){.min = -INFINITY, .max = INFINITY};
+    CHECK(zset_remove_range(zs, &r) == 90 && zs->len == 0 && zs->tail == NULL, "-inf to +inf removes everything");
+    r = (ZRange){.min = 5, .max = 5, .maxex = true};
+    zset_add(zs, 5, (const uint8_t *)"a", 1);
+    CHECK(zset_first_in_range(zs, &r, NULL) == NULL, "an interval that excludes its only score is empty");
+    zset_free(zs);
+}
+
+static bool hash_has(const Entry *e, const char *field, const char *val) {
+    const uint8_t *v = NULL;
+    uint32_t vlen = 0;
+    return hash_get(e, (const uint8_t *)field, (uint32_t)strlen(field), &v, &vlen)
+        && vlen == strlen(val) && memcmp(v, val, vlen) == 0;
+}
+
+static void test_hash_converts_past_pack_limits(void) {
+    clear_htable();
+    Entry *e = h_new_typed((const uint8_t *)"h", 1, TYPE_HASH);
+    char field[16], val[16];
+    bool added = false;
+    for (uint32_t i = 0; i < config.hash_pack_entries; i++) {
+        int n = snprintf(field, sizeof(field), "f%u", i), m = snprintf(val, sizeof(val), "v%u", i);
+        e = hash_set(e, (const uint8_t *)field, (uint32_t)n, (const uint8_t *)val, (uint32_t)m, &added);
+    }
+    CHECK(e->enc == ENC_PACK && hash_len(e) == config.hash_pack_entries, "a hash up to the entry limit stays packed");
+    CHECK(e->slab_class != SLAB_LARGE && e->vlen <= 10 * config.hash_pack_entries,
+        "and its fields live in the entry's own block, a few bytes each");
+    e = hash_set(e, (const uint8_t *)"f7", 2, (const uint8_t *)"seven", 5, &added);
+    CHECK(!added && e->enc == ENC_PACK && hash_has(e, "f7", "seven"), "replacing a field at the limit keeps it packed");
+    entry_set_expire(e, time(NULL) + 100);
+    e = hash_set(e, (const uint8_t *)"extra", 5, (const uint8_t *)"x", 1, &added);
+    CHECK(added && e->enc == ENC_TABLE && hash_len(e) == config.hash_pack_entries + 1,
+        "one more field converts it to a table");
+    CHECK(hash_has(e, "f0", "v0") && hash_has(e, "f7", "seven") && hash_has(e, "extra", "x"), "with every field kept");
+    CHECK(h_lookup((const uint8_t *)"h", 1) == e && e->expire_at != 0, "the moved entry is the key's, TTL and all");
+    bool removed = false;
+    e = hash_del(e, (const uint8_t *)"f0", 2, &removed);
+    CHECK(removed && !hash_has(e, "f0", "v0") && hash_len(e) == config.hash_pack_entries, "HDEL works on the table too");
+
+    e = h_new_typed((const uint8_t *)"g", 1, TYPE_HASH);
+    char big[100];
+    memset(big, 'b', sizeof(big));
+    e = hash_set(e, (const uint8_t *)"f", 1, (const uint8_t *)big, sizeof(big), &added);
+    CHECK(e->enc == ENC_TABLE && hash_len(e) == 1, "a value past the length limit converts it as well");
+}
+
+// list_foreach callback joining elements with commas into a Buf
+static void join_element(const uint8_t *data, uint32_t len, void *arg) {
+    Buf *b = (Buf *)arg;
+    if (buf_len(b) > 0) {
+        buf_append(b, ",", 1);
+    }
+    buf_append(b, data, len);
+}
+
+static void test_list_converts_to_quicklist(void) {
+    clear_htable();
+    uint32_t saved = config.list_pack_entries;
+    config.list_pack_entries = 4;
+    Entry *e = h_new_typed((const uint8_t *)"l", 1, TYPE_LIST);
+    e = list_push(e, false, (const uint8_t *)"b", 1);
+    e = list_push(e, true, (const uint8_t *)"a", 1);
+    e = list_push(e, false, (const uint8_t *)"c", 1);
+    e = list_push(e, false, (const uint8_t *)"d", 1);
+    CHECK(e->enc == ENC_PACK && list_len(e) == 4, "a list up to the entry limit stays packed");
+    char el[8];
+    for (int i = 0; i < 10; i++) {
+        int n = snprintf(el, sizeof(el), "%d", i);
+        e = list_push(e, i % 2 == 0, (const uint8_t *)el, (uint32_t)n);
+    }
+    CHECK(e->enc == ENC_QUICKLIST && list_len(e) == 14 && e->list->head != e->list->tail,
+        "pushing past it makes a quicklist of several nodes");
+    Buf b = {0};
+    list_foreach(e, 0, list_len(e), join_element, &b);
+    const char *want = "8,6,4,2,0,a,b,c,d,1,3,5,7,9";
+    CHECK(buf_len(&b) == strlen(want) && memcmp(b.data, want, buf_len(&b)) == 0, "elements keep their order");
+    buf_consume(&b, buf_len(&b));
+    list_foreach(e, 6, 3, join_element, &b);
+    CHECK(buf_len(&b) == 5 && memcmp(b.data, "b,c,d", 5) == 0, "a range can start inside a later node");
+    buf_free(&b);
+
+    const uint8_t *data = NULL;
+    uint32_t len = 0;
+    for (int i = 0; i < 5; i++) {
+        e = list_drop(e, true);
+    }
+    list_peek(e, true, &data, &len);
+    CHECK(len == 1 && data[0] == 'a', "popping from the front empties and frees whole nodes");
+    e = list_drop(e, false);
+    list_peek(e, false, &data, &len);
+    CHECK(len == 1 && data[0] == '7' && list_len(e) == 8, "and from the back");
+    config.list_pack_entries = saved;
+}
+
+// ---- memory limit and eviction ----
+static void test_mem_used_counts_every_type(void) {
+    clear_htable();
+    Shard *sh = &shards[0];
+    CHECK(sh->mem_used == 0, "an empty keyspace uses nothing");
+    uint8_t *big = calloc(1, VAL_SHARED_MIN);
+    h_set((const uint8_t *)"s", 1, (const uint8_t *)"v", 1);
+    h_set((const uint8_t *)"big", 3, big, VAL_SHARED_MIN);
+    CHECK(sh->mem_used > VAL_SHARED_MIN, "a large value counts in full");
+    Arg zadd[4] = {mkarg("zadd"), mkarg("z"), mkarg("1"), mkarg("a")};
+    Arg hset[4] = {mkarg("hset"), mkarg("h"), mkarg("f"), mkarg("v")};
+    Arg rpush[3] = {mkarg("rpush"), mkarg("l"), mkarg("x")};
+    Buf ob = {0};
+    size_t before = sh->mem_used;
+    for (int i = 0; i < 300; i++) {
+        char member[16];
+        int n = snprintf(member, sizeof(member), "m%d", i);
+        zadd[3] = hset[2] = rpush[2] = (Arg){(uint32_t)n, (const uint8_t *)member};
+        run_request(&ob, zadd, 4);
+        run_request(&ob, hset, 4);
+        run_request(&ob, rpush, 3);
+    }
+    Entry *h = h_lookup((const uint8_t *)"h", 1), *l = h_lookup((const uint8_t *)"l", 1);
+    CHECK(h->enc == ENC_TABLE && l->enc == ENC_QUICKLIST, "the hash and list are in containers");
+    CHECK(sh->mem_used > before + 3 * 300 * 16, "so are their elements and the set's members");
+    h_set((const uint8_t *)"s", 1, big, 100);
+    h_set((const uint8_t *)"big", 3, (const uint8_t *)"v", 1);
+    h_del((const uint8_t *)"s", 1);
+    h_del((const uint8_t *)"big", 3);
+    h_del((const uint8_t *)"z", 1);
+    h_del((const uint8_t *)"h", 1);
+    h_del((const uint8_t *)"l", 1);
+    CHECK(sh->mem_used == 0, "and all of it is given back when the keys go");
+    buf_free(&ob);
+    free(big);
+}
+
+// fill shard 0 with n keys "key:<i>", all last used at clock tick 0
+static void fill_for_eviction(int n) {
+    clear_htable();
+    shards[0].clock_ms = 0;
+    char key[32];
+    for (int i = 0; i < n; i++) {
+        int klen = snprintf(key, sizeof(key), "key:%d", i);
+        h_set((const uint8_t *)key, (size_t)klen, (const uint8_t *)"some-value", 10);
+    }
+}
+
+static void test_eviction_approximates_lru(void) {
+    fill_for_eviction(2000);
+    Shard *sh = &shards[0];
+    sh->clock_ms = 60 * 1000;   // a minute later the first 200 keys are read again
+    char key[32];
+    for (int i = 0; i < 200; i++) {
+        int klen = snprintf(key, sizeof(key), "key:%d", i);
+        h_lookup((const uint8_t *)key, (size_t)klen);
+    }
+    config.maxmemory = sh->mem_used / 2;
+    config.maxmemory_policy = EVICT_ALLKEYS_LRU;
+    uint64_t evicted = sh->evicted_keys;
+    CHECK(evict_for_write(0), "a shard over its limit evicts until it is under");
+    CHECK(sh->mem_used <= config.maxmemory && sh->evicted_keys - evicted >= 900, "taking about half the keys");
+    int kept = 0;
+    for (int i = 0; i < 200; i++) {
+        int klen = snprintf(key, sizeof(key), "key:%d", i);
+        kept += hm_lookup(shard_db(0), (const uint8_t *)key, (size_t)klen, hash_bytes((const uint8_t *)key, (size_t)klen)) != NULL;
+    }
+    CHECK(kept >= 190, "recently read keys survive sampled LRU eviction");
+
+    config.maxmemory_policy = EVICT_NOEVICTION;
+    config.maxmemory = sh->mem_used / 2;
+    Buf ob = {0};
+    Arg set[3] = {mkarg("set"), mkarg("k"), mkarg("v")};
+    uint32_t code = 0;
+    const uint8_t *out = run_request(&ob, set, 3);
+    memcpy(&code, out + 1, 4);
+    CHECK(resp_type(out) == RES_ERR && code == ERR_OOM && h_lookup((const uint8_t *)"k", 1) == NULL,
+        "with noeviction a write over the limit fails");
+    Arg get[2] = {mkarg("get"), mkarg("key:1")};
+    out = run_request(&ob, get, 2);
+    CHECK(resp_type(out) == RES_STR, "but reads still work");
+    config.maxmemory = 0;
+    buf_free(&ob);
+}
+
+static void test_eviction_approximates_lfu(void) {
+    config.maxmemory_policy = EVICT_ALLKEYS_LFU;
+    fill_for_eviction(2000);
+    Shard *sh = &shards[0];
+    char key[32];
+    for (int round = 0; round < 50; round++) {  // the first 200 keys are read often
+        for (int i = 0; i < 200; i++) {
+            int klen = snprintf(key, sizeof(key), "key:%d", i);
+            h_lookup((const uint8_t *)key, (size_t)klen);
+        }
+    }
+    Entry *hot = hm_lookup(shard_db(0), (const uint8_t *)"key:0", 5, hash_bytes((const uint8_t *)"key:0", 5));
+    Entry *cold = hm_lookup(shard_db(0), (const uint8_t *)"key:1999", 8, hash_bytes((const uint8_t *)"key:1999", 8));
+    CHECK((hot->lru & 0xFF) > LFU_INIT_VAL && (cold->lru & 0xFF) == LFU_INIT_VAL, "reads raise a key's LFU counter");
+    sh->clock_ms = 3 * 60 * 1000;
+    CHECK(lfu_decayed(sh, hot) == (uint32_t)(hot->lru & 0xFF) - 3, "which loses one per idle minute");
+    config.maxmemory = sh->mem_used / 2;
+    CHECK(evict_for_write(0) && sh->mem_used <= config.maxmemory, "LFU eviction gets under the limit too");
+    int kept = 0;
+    for (int i = 0; i < 200; i++) {
+        int klen = snprintf(key, sizeof(key), "key:%d", i);
+        kept += hm_lookup(shard_db(0), (const uint8_t *)key, (size_t)klen, hash_bytes((const uint8_t *)key, (size_t)klen)) != NULL;
+    }
+    CHECK(kept >= 190, "frequently read keys survive");
+    config.maxmemory = 0;
+    config.maxmemory_policy = EVICT_NOEVICTION;
+}
+
+static void test_eviction_volatile_ttl_and_random(void) {
+    fill_for_eviction(100);
+    Shard *sh = &shards[0];
+    Entry *soon = h_lookup((const uint8_t *)"key:7", 5), *later = h_lookup((const uint8_t *)"key:8", 5);
+    entry_set_expire(soon, time(NULL) + 10);
+    entry_set_expire(later, time(NULL) + 1000);
+    config.maxmemory_policy = EVICT_VOLATILE_TTL;
+    config.maxmemory = sh->mem_used - 1;
+    CHECK(evict_for_write(0) && h_lookup((const uint8_t *)"key:7", 5) == NULL && h_lookup((const uint8_t *)"key:8", 5),
+        "volatile-ttl evicts the key that expires soonest");
+    config.maxmemory = sh->mem_used / 2;
+    CHECK(!evict_for_write(0) && hm_size(shard_db(0)) == 98, "and nothing without a TTL");
+    config.maxmemory_policy = EVICT_ALLKEYS_RANDOM;
+    CHECK(evict_for_write(0) && sh->mem_used <= config.maxmemory, "allkeys-random evicts anything");
+    config.maxmemory = 0;
+    config.maxmemory_policy = EVICT_NOEVICTION;
+}
+
+// ---- snapshots ----
+// a snapshot file of this process's own, so parallel test runs don't collide
+static const char *snapshot_path(void) {
+    static char path[64];
+    snprintf(path, sizeof(path), "/tmp/test_server_logic-%d.rdb", (int)getpid());
+    return path;
+}
+
+static void test_crc32c_known_answer(void) {
+    CHECK(crc32c_update(0, (const uint8_t *)"123456789", 9) == 0xE3069283u, "CRC-32C of the standard check string");
+    uint32_t crc = crc32c_update(0, (const uint8_t *)"1234", 4);
+    CHECK(crc32c_update(crc, (const uint8_t *)"56789", 5) == 0xE3069283u, "CRC-32C can be computed in pieces");
+}
+
+static void test_snapshot_round_trip(void) {
+    clear_htable();
+    set_numbered_keys(0, 5000);     // several blocks' worth
+    Entry *e = h_lookup((const uint8_t *)"key7", 4);
+    time_t deadline = time(NULL) + 300;
+    entry_set_expire(e, deadline);
+    CHECK(snapshot_save(snapshot_path()) > 0, "snapshot_save writes the file");
+
+    clear_htable();
+    const char *err = NULL;
+    int64_t loaded = snapshot_load(snapshot_path(), 4, &err);
+    CHECK(loaded == 5000 && err == NULL, "snapshot_load reports every key it loaded");
+    CHECK(count_numbered_keys(0, 5000) == 5000, "every key comes back with its value");
+    e = h_lookup((const uint8_t *)"key7", 4);
+    CHECK(e && e->expire_at == deadline, "a TTL comes back as the same absolute deadline");
+    CHECK(ttl_heap.size == 1, "a loaded TTL is in the heap so active expiry sees it");
+    unlink(snapshot_path());
+}
+
+static void test_snapshot_loads_into_every_shard(void) {
+    clear_htable();     // while the old shard count still says where each entry lives
+    nshards = 4;
+    set_numbered_keys(0, 20000);
+    CHECK(snapshot_save(snapshot_path()) > 0, "save a keyspace spread over 4 shards");
+    clear_htable();
+    const char *err = NULL;
+    CHECK(snapshot_load(snapshot_path(), 3, &err) == 20000, "3 decoders and 4 inserters load every key");
+    CHECK(count_numbered_keys(0, 20000) == 20000, "each key lands in the shard it hashes to");
+    size_t total = 0, biggest = 0;
+    for (uint32_t s = 0; s < nshards; s++) {
+        total += hm_size(shard_db(s));
+        biggest = hm_size(shard_db(s)) > biggest ? hm_size(shard_db(s)) : biggest;
+        CHECK(!hm_is_rehashing(shard_db(s)), "a pre-sized shard never resizes while loading");
+    }
+    CHECK(total == 20000 && biggest < 20000, "the keys are split between the shards");
+    clear_htable();
+    nshards = 1;
+    unlink(snapshot_path());
+}
+
+static void test_snapshot_skips_expired_keys(void) {
+    clear_htable();
+    set_numbered_keys(0, 3);
+    entry_set_expire(h_lookup((const uint8_t *)"key1", 4), time(NULL) + 100);
+    h_lookup((const uint8_t *)"key1", 4)->expire_at = time(NULL) - 1;    // expired but not yet removed
+    snapshot_save(snapshot_path());
+    clear_htable();
+    const char *err = NULL;
+    CHECK(snapshot_load(snapshot_path(), 2, &err) == 2, "a key already past its deadline is not saved");
+    CHECK(h_lookup((const uint8_t *)"key1", 4) == NULL, "and does not come back");
+    unlink(snapshot_path());
+}
+
+static void test_snapshot_detects_corruption(void) {
+    clear_htable();
+    set_numbered_keys(0, 100);
+    int64_t size = snapshot_save(snapshot_path());
+    clear_htable();
+
+    // flip one byte in the middle of the records
+    int fd = open(snapshot_path(), O_RDWR);
+    uint8_t byte = 0;
+    off_t at = (off_t)size / 2;
+    CHECK(pread(fd, &byte, 1, at) == 1, "read a byte of the snapshot back");
+    byte ^= 0x01;
+    CHECK(pwrite(fd, &byte, 1, at) == 1, "write the flipped byte");
+    const char *err = NULL;
+    CHECK(snapshot_load(snapshot_path(), 2, &err) < 0 && err != NULL, "a flipped byte fails the checksum");
+    clear_htable();
+
+    // cut the end marker off
+    CHECK(ftruncate(fd, (off_t)size - 4) == 0, "truncate the snapshot");
+    close(fd);
+    err = NULL;
+    CHECK(snapshot_load(snapshot_path(), 2, &err) < 0 && err != NULL, "a truncated snapshot is refused");
+    clear_htable();
+    unlink(snapshot_path());
+
+    err = NULL;
+    CHECK(snapshot_load(snapshot_path(), 2, &err) == 0 && err == NULL, "a missing snapshot just means an empty store");
+}
+
+static void test_bgsave_command(void) {
+    clear_htable();
+    set_numbered_keys(0, 1000);
+    config.snapshot = snapshot_path();
+    Buf ob = {0};
+    Arg args[1] = {mkarg("bgsave")};
+    const uint8_t *out = run_request(&ob, args, 1);
+    CHECK(resp_type(out) == RES_STR && persist.child != 0, "BGSAVE starts a child");
+    out = run_request(&ob, args, 1);
+    CHECK(resp_type(out) == RES_ERR, "a second BGSAVE is refused while the first runs");
+    for (int i = 0; i < 500 && persist.child != 0; i++) {
+        usleep(10000);
+        persist_reap_child();
+    }
+    CHECK(persist.child == 0 && persist.last_save_ok && persist.last_save_bytes > 0, "the child is reaped and its save recorded");
+
+    clear_htable();
+    const char *err = NULL;
+    CHECK(snapshot_load(snapshot_path(), 2, &err) == 1000, "the background snapshot loads back");
+    CHECK(count_numbered_keys(0, 1000) == 1000, "with every key intact");
+
+    Arg save_args[1] = {mkarg("save")};
+    out = run_request(&ob, save_args, 1);
+    CHECK(resp_type(out) == RES_STR && memcmp(out + 1, "OK", 2) == 0, "SAVE writes in the foreground and returns OK");
+    unlink(snapshot_path());
+    buf_free(&ob);
+}
+
+// ---- append-only file ----
+static const char *aof_test_path(void) {
+    static char path[64];
+    snprintf(path, sizeof(path), "/tmp/test_server_logic-%d.aof", (int)getpid());
+    return path;
+}
+
+static void aof_test_close(void) {
+    close(aof.fd);
+    aof.fd = -1;
+    unlink(aof_test_path());
+}
+
+static void test_aof_logs_writes_and_replays_them(void) {
+    clear_htable();
+    set_numbered_keys(0, 10);   // already there when the log starts
+    unlink(aof_test_path());
+    CHECK(aof_open(aof_test_path()) == 0, "aof_open creates a log holding the current keys");
+
+    Buf ob = {0};
+    Arg set1[3] = {mkarg("set"), mkarg("k1"), mkarg("v1")};
+    Arg set2[3] = {mkarg("set"), mkarg("k2"), mkarg("v2")};
+    Arg expire2[3] = {mkarg("expire"), mkarg("k2"), mkarg("100")};
+    Arg del1[2] = {mkarg("del"), mkarg("k1")};
+    Arg del_missing[2] = {mkarg("del"), mkarg("nosuchkey")};
+    run_request(&ob, set1, 3);
+    run_request(&ob, set2, 3);
+    run_request(&ob, expire2, 3);
+    run_request(&ob, del1, 2);
+    run_request(&ob, del_missing, 2);
+    time_t deadline = h_lookup((const uint8_t *)"k2", 2)->expire_at;
+    CHECK(buf_len(&shards[0].aof_buf) > 0, "writes wait in the shard's AOF buffer");
+    aof_write_batch(&loops[0]);
+    CHECK(buf_len(&shards[0].aof_buf) == 0, "one batch write empties it");
+
+    int fd = open(aof_test_path(), O_RDONLY);
+    uint8_t file[4096];
+    ssize_t n = read(fd, file, sizeof(file));
+    close(fd);
+    CHECK(n > 0 && bytes_contain(file, (size_t)n, "expireat"), "EXPIRE is logged as EXPIREAT");
+    CHECK(n > 0 && !bytes_contain(file, (size_t)n, "nosuchkey"), "a DEL that deleted nothing is not logged");
+
+    clear_htable();
+    const char *err = NULL;
+    CHECK(aof_load(aof_test_path(), &err) == 14 && err == NULL, "every logged command is replayed");
+    CHECK(count_numbered_keys(0, 10) == 10, "keys from before the log started come back");
+    CHECK(h_lookup((const uint8_t *)"k1", 2) == NULL, "a deleted key stays deleted");
+    Entry *e = h_lookup((const uint8_t *)"k2", 2);
+    CHECK(e && e->expire_at == deadline, "a replayed TTL keeps its original deadline");
+    aof_test_close();
+    buf_free(&ob);
+}
+
+static void test_aof_load_drops_unfinished_tail(void) {
+    clear_htable();
+    Buf log = {0};
+    Arg set1[3] = {mkarg("set"), mkarg("k1"), mkarg("v1")};
+    Arg set2[3] = {mkarg("set"), mkarg("k2"), mkarg("v2")};
+    aof_append_cmd(&log, set1, 3);
+    size_t whole = buf_len(&log);
+    aof_append_cmd(&log, set2, 3);
+    int fd = open(aof_test_path(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    CHECK(write(fd, log.data, whole + 7) == (ssize_t)(whole + 7), "write a log cut off mid-command");
+    close(fd);
+
+    const char *err = NULL;
+    CHECK(aof_load(aof_test_path(), &err) == 1 && err == NULL, "the whole command is replayed");
+    CHECK(h_lookup((const uint8_t *)"k2", 2) == NULL, "the unfinished one is not");
+    struct stat st;
+    CHECK(stat(aof_test_path(), &st) == 0 && (size_t)st.st_size == whole, "the file is cut back to the last whole command");
+    unlink(aof_test_path());
+    buf_free(&log);
+}
+
+static void test_bgrewriteaof_command(void) {
+    clear_htable();
+    unlink(aof_test_path());
+    config.aof = aof_test_path();
+    CHECK(aof_open(config.aof) == 0, "open an empty log");
+    Buf ob = {0};
+    for (int i = 0; i < 100; i++) {     // 100 overwrites of one key, which a rewrite folds into one
+        Arg set[3] = {mkarg("set"), mkarg("key"), mkarg(i % 2 ? "odd" : "even")};
+        run_request(&ob, set, 3);
+    }
+    aof_write_batch(&loops[0]);
+    struct stat before;
+    stat(config.aof, &before);
+
+    Arg args[1] = {mkarg("bgrewriteaof")};
+    const uint8_t *out = run_request(&ob, args, 1);
+    CHECK(resp_type(out) == RES_STR && persist.child != 0, "BGREWRITEAOF starts a child");
+    Arg during[3] = {mkarg("set"), mkarg("during"), mkarg("rewrite")};
+    run_request(&ob, during, 3);
+    aof_write_batch(&loops[0]);
+    for (int i = 0; i < 500 && persist.child != 0; i++) {
+        usleep(10000);
+        persist_reap_child();
+    }
+    CHECK(persist.child == 0 && persist.last_rewrite_ok, "the child is reaped and the new log swapped in");
+
+    struct stat after;
+    stat(config.aof, &after);
+    CHECK(after.st_size < before.st_size, "the rewritten log is smaller");
+    Arg later[3] = {mkarg("set"), mkarg("later"), mkarg("x")};
+    run_request(&ob, later, 3);
+    aof_write_batch(&loops[0]);     // through the same fd, now the new file
+
+    clear_htable();
+    const char *err = NULL;
+    CHECK(aof_load(config.aof, &err) == 3, "the new log holds one SET per key");
+    Entry *e = h_lookup((const uint8_t *)"key", 3);
+    CHECK(e && e->vlen == 3 && memcmp(e->val, "odd", 3) == 0, "with the latest value");
+    CHECK(h_lookup((const uint8_t *)"during", 6) != NULL, "a write made during the rewrite is kept");
+    CHECK(h_lookup((const uint8_t *)"later", 5) != NULL, "and so is one made after it");
+    aof_test_close();
+    config.aof = NULL;
+    buf_free(&ob);
+}
+
+static void test_snapshot_and_aof_keep_sorted_sets(void) {
+    clear_htable();
+    ZSet *zs = h_new_typed((const uint8_t *)"board", 5, TYPE_ZSET)->zset;
+    char member[16];
+    for (int i = 0; i < 200; i++) {     // several ZADDs' worth for the AOF rewrite
+        int n = snprintf(member, sizeof(member), "m%d", i);
+        zset_add(zs, i * 0.1, (const uint8_t *)member, (size_t)n);
+    }
+    h_set((const uint8_t *)"plain", 5, (const uint8_t *)"v", 1);
+    CHECK(snapshot_save(snapshot_path()) > 0, "a snapshot with a sorted set is written");
+    unlink(aof_test_path());
+    CHECK(aof_write_keyspace(aof_test_path()) == 0, "and so is a rewritten AOF");
+
+    for (int pass = 0; pass < 2; pass++) {
+        clear_htable();
+        const char *err = NULL;
+        if (pass == 0) {
+            CHECK(snapshot_load(snapshot_path(), 2, &err) == 2 && err == NULL, "the snapshot loads both keys");
+        } else {
+            CHECK(aof_load(aof_test_path(), &err) > 0 && err == NULL, "the AOF replays");
+        }
+        Entry *e = h_lookup((const uint8_t *)"board", 5);
+        ZNode *x = e && e->type == TYPE_ZSET ? zset_find(e->zset, (const uint8_t *)"m123", 4) : NULL;
+        CHECK(x && x->score == 123 * 0.1 && e->zset->len == 200, "the sorted set comes back with exact scores");
+        CHECK(x && zset_rank(e->zset, x) == 123 && zset_consistent(e->zset), "and in the same order");
+        e = h_lookup((const uint8_t *)"plain", 5);
+        CHECK(e && e->type == TYPE_STRING, "a string key next to it is still a string");
+    }
+    unlink(snapshot_path());
+    unlink(aof_test_path());
+}
+
+static void test_snapshot_and_aof_keep_hashes_and_lists(void) {
+    clear_htable();
+    bool added = false;
+    Entry *small = h_new_typed((const uint8_t *)"small", 5, TYPE_HASH);
+    small = hash_set(small, (const uint8_t *)"f", 1, (const uint8_t *)"v", 1, &added);
+    Entry *big = h_new_typed((const uint8_t *)"big", 3, TYPE_HASH);
+    Entry *list = h_new_typed((const uint8_t *)"list", 4, TYPE_LIST);
+    char text[16];
+    for (int i = 0; i < 300; i++) {     // past the pack limits, and several HSETs' worth
+        int n = snprintf(text, sizeof(text), "%d", i);
+        big = hash_set(big, (const uint8_t *)text, (uint32_t)n, (const uint8_t *)text, (uint32_t)n, &added);
+        list = list_push(list, false, (const uint8_t *)text, (uint32_t)n);
+    }
+    Entry *pair = h_new_typed((const uint8_t *)"pair", 4, TYPE_LIST);
+    pair = list_push(pair, false, (const uint8_t *)"x", 1);
+    pair = list_push(pair, false, (const uint8_t *)"y", 1);
+    CHECK(small->enc == ENC_PACK && big->enc == ENC_TABLE && list->enc == ENC_QUICKLIST && pair->enc == ENC_PACK,
+        "both encodings of each type are saved");
+    CHECK(snapshot_save(snapshot_path()) > 0, "a snapshot with hashes and lists is written");
+    unlink(aof_test_path());
+    CHECK(aof_write_keyspace(aof_test_path()) == 0, "and so is a rewritten AOF");
+
+    for (int pass = 0; pass < 2; pass++) {
+        clear_htable();
+        const char *err = NULL;
+        if (pass == 0) {
+            CHECK(snapshot_load(snapshot_path(), 2, &err) == 4 && err == NULL, "the snapshot loads every key");
+        } else {
+            CHECK(aof_load(aof_test_path(), &err) > 0 && err == NULL, "the AOF replays");
+        }
+        Entry *e = h_lookup((const uint8_t *)"small", 5);
+        CHECK(e && e->type == TYPE_HASH && e->enc == ENC_PACK && hash_has(e, "f", "v"), "a small hash comes back packed");
+        e = h_lookup((const uint8_t *)"big", 3);
+        CHECK(e && e->enc == ENC_TABLE && hash_len(e) == 300 && hash_has(e, "123", "123"),
+            "a big one comes back as a table");
+        e = h_lookup((const uint8_t *)"list", 4);
+        Buf b = {0};
+        if (e && e->enc == ENC_QUICKLIST && list_len(e) == 300) {
+            list_foreach(e, 297, 3, join_element, &b);
+        }
+        CHECK(buf_len(&b) == 11 && memcmp(b.data, "297,298,299", 11) == 0, "a long list comes back in order");
+        buf_free(&b);
+        e = h_lookup((const uint8_t *)"pair", 4);
+        CHECK(e && e->type == TYPE_LIST && e->enc == ENC_PACK && list_len(e) == 2, "and a short one packed");
+    }
+    unlink(snapshot_path());
+    unlink(aof_test_path());
+}
+
+// ---- sharding and inter-thread messages ----
+
+static void test_msg_queue_is_fifo(void) {
+    MsgQueue q;
+    mq_init(&q);
+    CHECK(mq_pop(&q) == NULL, "a fresh inbox is empty");
+    Msg *sent[3];
+    for (uint32_t i = 0; i < 3; i++) {
+        sent[i] = msg_new(MSG_RES, NULL, NULL, (const uint8_t *)"abc", i);
+        mq_push(&q, sent[i]);
+    }
+    bool in_order = true;
+    for (int i = 0; i < 3; i++) {
+        Msg *m = mq_pop(&q);
+        in_order = in_order && m == sent[i];
+        free(m);
+    }
+    CHECK(in_order, "messages come out of an inbox in the order they were pushed");
+    CHECK(mq_pop(&q) == NULL, "the inbox is empty again once drained");
+}
+
+static void test_req_route_by_key_shard(void) {
+    Arg get_a[2] = {mkarg("get"), mkarg("somekey")};
+    Arg info[1] = {mkarg("info")};
+    CHECK(req_route(get_a, 2) == ROUTE_LOCAL, "with one shard every request runs locally");
+
+    nshards = 4;
+    int32_t route = req_route(get_a, 2);
+    Arg set_a[3] = {mkarg("set"), mkarg("somekey"), mkarg("v")};
+    CHECK(route >= 0 && route < 4, "a keyed command routes to one of the shards");
+    CHECK(req_route(set_a, 3) == route, "every command on the same key routes to the same shard");
+    CHECK(req_route(info, 1) == ROUTE_ALL, "INFO needs every shard");
+    Arg latency[2] = {mkarg("latency"), mkarg("reset")};
+    CHECK(req_route(latency, 2) == ROUTE_ALL, "LATENCY reads and resets every thread's stats");
+
+    // two keys on different shards, and a second key on the first one's shard
+    char other[32] = "", same[32] = "";
+    for (int i = 0; other[0] == '\0' || same[0] == '\0'; i++) {
+        char key[32];
+        int klen = snprintf(key, sizeof(key), "key%d", i);
+        bool on_route = shard_idx(hash_bytes((const uint8_t *)key, (size_t)klen)) == (uint32_t)route;
+        memcpy(on_route ? same : other, key, (size_t)klen + 1);
+    }
+    Arg mget_same[3] = {mkarg("mget"), mkarg("somekey"), mkarg(same)};
+    Arg mget_split[3] = {mkarg("mget"), mkarg("somekey"), mkarg(other)};
+    Arg mset_same[5] = {mkarg("mset"), mkarg("somekey"), mkarg(other), mkarg(same), mkarg(other)};
+    Arg del_split[3] = {mkarg("del"), mkarg("somekey"), mkarg(other)};
+    CHECK(req_route(mget_same, 3) == route, "MGET of keys on one shard routes to that shard");
+    CHECK(req_route(mget_split, 3) == ROUTE_ALL, "MGET of keys on several shards runs with the world stopped");
+    CHECK(req_route(mset_same, 5) == route, "MSET routes by its keys, not its values");
+    CHECK(req_route(del_split, 3) == ROUTE_ALL, "DEL of keys on several shards runs with the world stopped");
+
+    int hits[4] = {0};
+    char key[32];
+    for (int i = 0; i < 4000; i++) {
+        int klen = snprintf(key, sizeof(key), "key%d", i);
+        hits[shard_idx(hash_bytes((const uint8_t *)key, (size_t)klen))]++;
+    }
+    CHECK(hits[0] > 500 && hits[1] > 500 && hits[2] > 500 && hits[3] > 500, "keys spread across every shard");
+    nshards = 1;
+}
+
+// ---- connection buffers ----
+
+static void test_buf_grows_on_demand(void) {
+    Buf b = {0};
+    CHECK(b.cap == 0, "a fresh buffer owns no memory");
+    uint8_t chunk[1000];
+    memset(chunk, 'x', sizeof(chunk));
+    for (int i = 0; i < 100; i++) {
+        buf_append(&b, chunk, sizeof(chunk));
+    }
+    CHECK(buf_len(&b) == 100000 && b.cap >= 100000, "appending past the initial size grows the buffer");
+    CHECK(b.data[0] == 'x' && b.data[99999] == 'x', "grown buffer keeps every byte");
+    buf_free(&b);
+}
+
+static void test_buf_consume_reclaims_front(void) {
+    Buf b = {0};
+    buf_append(&b, "0123456789", 10);
+    buf_consume(&b, 4);
+    CHECK(buf_len(&b) == 6 && memcmp(b.data + b.start, "456789", 6) == 0, "consume drops bytes from the front");
+    size_t cap = b.cap;
+    uint8_t fill[BUF_INIT_SIZE];
+    memset(fill, 'y', sizeof(fill));
+    buf_append(&b, fill, cap - b.end);      // exactly fills the tail
+    buf_consume(&b, 500);
+    buf_append(&b, fill, 400);              // fits once the consumed prefix is reclaimed
+    CHECK(b.cap == cap, "space freed at the front is reused before growing");
+    CHECK(b.data[b.start] == 'y', "reclaiming keeps the unconsumed bytes in order");
+    buf_consume(&b, buf_len(&b));
+    CHECK(b.start == 0 && b.end == 0, "a drained buffer resets to the front");
+    buf_free(&b);
+}
+
+static void test_buf_shrink_frees_drained_buffers(void) {
+    Buf b = {0};
+    uint8_t big[BUF_KEEP_SIZE + 1];
+    memset(big, 'z', sizeof(big));
+    buf_append(&b, big, sizeof(big));
+    buf_shrink(&b, false);
+    CHECK(b.data != NULL, "a buffer still holding data is never freed");
+    buf_consume(&b, sizeof(big));
+    buf_shrink(&b, false);
+    CHECK(b.data == NULL && b.cap == 0, "an oversized buffer is freed once it drains");
+
+    buf_append(&b, "abc", 3);
+    buf_consume(&b, 3);
+    buf_shrink(&b, false);
+    CHECK(b.data != NULL, "a small drained buffer is kept while the connection is active");
+    buf_shrink(&b, true);
+    CHECK(b.data == NULL, "an idle connection's drained buffer is freed");
+}
+
+// ---- reply chains ----
+
+static int released = 0;
+
+static void count_release(void *owner) {
+    (void)owner;
+    released++;
+}
+
+static void test_out_chain_never_moves_bytes(void) {
+    Out out = {0};
+    uint8_t *hdr = out_len_begin(&out);
+    uint8_t chunk[100];
+    memset(chunk, 'x', sizeof(chunk));
+    for (int i = 0; i < 1000; i++) {
+        out_append(&out, chunk, sizeof(chunk));
+    }
+    out_len_end(&out, hdr);
+    uint32_t len = 0;
+    memcpy(&len, hdr, 4);
+    CHECK(out.head != out.tail, "a long reply spreads over several segments");
+    CHECK(len == 100000 && out_len(&out) == 4 + 100000, "a length placeholder stays valid as the chain grows");
+    out_free(&out);
+}
+
+static void test_out_references_are_sent_and_released(void) {
+    int sv[2];
+    CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0, "socketpair for a fake client");
+    static const uint8_t big[] = "a value that is referenced rather than copied";
+    Out out = {0}, fwd = {0};
+    released = 0;
+    uint8_t *hdr = out_len_begin(&out);
+    out_str(&out, (const uint8_t *)"head", 4);
+    out_ref(&out, big, sizeof(big) - 1, count_release, NULL);
+    out_append(&fwd, "tail", 4);
+    out_splice(&out, &fwd);
+    out_len_end(&out, hdr);
+    CHECK(out_len(&fwd) == 0 && fwd.head == NULL, "splicing empties the source chain");
+    CHECK(out_len(&out) == 4 + 5 + (sizeof(big) - 1) + 4, "a chain counts referenced and spliced bytes");
+
+    struct iovec iov[OUT_IOV_MAX];
+    int n = out_iov(&out, iov, OUT_IOV_MAX);
+    ssize_t rv = writev(sv[0], iov, n);
+    CHECK(rv == (ssize_t)out_len(&out), "the whole chain goes out in one writev()");
+    out_consume(&out, (size_t)rv);
+    CHECK(released == 1 && out_len(&out) == 0, "a reference is released once it has been sent");
+    CHECK(out.head == out.tail && out.head->len == 0, "a drained chain keeps only its last inline segment");
+
+    uint8_t res[256];
+    ssize_t got = read(sv[1], res, sizeof(res));
+    uint32_t len = 0;
+    memcpy(&len, res, 4);
+    CHECK(got == rv && len == (uint32_t)rv - 4, "the length covers every part of the reply");
+    CHECK(memcmp(res + 4, "\x02head", 5) == 0 && memcmp(res + 9, big, sizeof(big) - 1) == 0
+        && memcmp(res + 9 + sizeof(big) - 1, "tail", 4) == 0, "the parts arrive in order");
+
+    out_ref(&out, big, 4, count_release, NULL);
+    out_free(&out);
+    CHECK(released == 2, "an unsent reference is released when the chain is dropped");
+    close(sv[0]);
+    close(sv[1]);
+}
+
+static void test_out_consume_partial_writes(void) {
+    Out out = {0};
+    out_append(&out, "abc", 3);
+    out_ref(&out, (const uint8_t *)"defgh", 5, NULL, NULL);
+    out_append(&out, "ij", 2);
+    out_consume(&out, 4);   // all of "abc" and one byte of the reference
+    struct iovec iov[OUT_IOV_MAX];
+    int n = out_iov(&out, iov, OUT_IOV_MAX);
+    CHECK(n == 2 && iov[0].iov_len == 4 && memcmp(iov[0].iov_base, "efgh", 4) == 0,
+        "a partly sent segment resumes where the last write stopped");
+    CHECK(out_len(&out) == 6, "consuming keeps the unsent byte count right");
+    out_consume(&out, 6);
+    CHECK(out.head != NULL && out.head->len == 0, "a drained chain keeps a small segment for the next replies");
+    out_shrink(&out, true);
+    CHECK(out.head == NULL, "an idle connection's chain gives its last segment back");
+}
+
+// ---- logging ----
+
+static void test_log_ring_round_trip(void) {
+    log_init();
+    atomic_store(&log_level, LOG_INFO);
+    log_at(LOG_WARN, "first %d", 1);
+    log_at(LOG_INFO, "second");
+    log_at(LOG_DEBUG, "never formatted");
+    FILE *f = tmpfile();
+    CHECK(log_drain(f) == 2, "only lines at or above the current level reach the ring");
+    CHECK(log_drain(f) == 0, "a drained ring is empty");
+
+    char text[512] = "";
+    rewind(f);
+    size_t n = fread(text, 1, sizeof(text) - 1, f);
+    fclose(f);
+    CHECK(bytes_contain((const uint8_t *)text, n, "[warn] first 1\n"), "a drained line carries its level and text");
+    CHECK(bytes_contain((const uint8_t *)text, n, "[info] second\n"), "lines drain in the order they were logged");
+    CHECK(!bytes_contain((const uint8_t *)text, n, "never"), "a disabled level is skipped");
+    atomic_store(&log_level, LOG_WARN);
+}
+
+static void test_log_ring_drops_when_full(void) {
+    log_init();
+    unsigned long long before = atomic_load(&log_ring.dropped);
+    for (int i = 0; i < LOG_RING_SIZE + 10; i++) {
+        log_write(LOG_WARN, "line %d", i);
+    }
+    CHECK(atomic_load(&log_ring.dropped) - before == 10, "lines past a full ring are dropped and counted");
+    FILE *f = tmpfile();
+    CHECK(log_drain(f) == LOG_RING_SIZE, "everything that fit is still drained");
+    fclose(f);
+    log_write(LOG_WARN, "after");
+    f = tmpfile();
+    CHECK(log_drain(f) == 1, "the ring accepts lines again once drained");
+    fclose(f);
+}
+
+static void test_loglevel_command(void) {
+    Buf ob = {0};
+    const uint8_t *out = NULL;
+    Arg get_level[1] = {mkarg("loglevel")};
+    out = run_request(&ob, get_level, 1);
+    CHECK(resp_type(out) == RES_STR && buf_len(&ob) == 5 && memcmp(out + 1, "warn", 4) == 0, "LOGLEVEL reports the current level");
+
+    Arg set_debug[2] = {mkarg("loglevel"), mkarg("DEBUG")};
+    out = run_request(&ob, set_debug, 2);
+    CHECK(resp_type(out) == RES_STR && log_enabled(LOG_DEBUG), "LOGLEVEL debug turns on request tracing");
+
+    Arg bogus[2] = {mkarg("loglevel"), mkarg("loud")};
+    out = run_request(&ob, bogus, 2);
+    CHECK(resp_type(out) == RES_ERR && log_enabled(LOG_DEBUG), "an unknown level is rejected and changes nothing");
+
+    Arg set_warn[2] = {mkarg("loglevel"), mkarg("warn")};
+    out = run_request(&ob, set_warn, 2);
+    CHECK(!log_enabled(LOG_DEBUG) && log_enabled(LOG_WARN), "LOGLEVEL warn turns tracing back off");
+    buf_free(&ob);
+}
+
+// ---- pipelining ----
+
+// append one encoded request ([len][nstr][len1][str1]...) to b
+static void encode_request(Buf *b, const char **cmd, uint32_t n) {
+    uint32_t len = 4;
+    for (uint32_t i = 0; i < n; i++) {
+        len += 4 + (uint32_t)strlen(cmd[i]);
+    }
+    buf_append(b, &len, 4);
+    buf_append(b, &n, 4);
+    for (uint32_t i = 0; i < n; i++) {
+        uint32_t slen = (uint32_t)strlen(cmd[i]);
+        buf_append(b, &slen, 4);
+        buf_append(b, cmd[i], slen);
+    }
+}
+
+static void test_pipelined_replies_are_batched(void) {
+    clear_htable();
+    int sv[2];
+    CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0, "socketpair for a fake client");
+    fd_set_nb(sv[0]);
+    struct Conn *conn = calloc(1, sizeof(struct Conn));
+    conn->fd = sv[0];
+    conn->state = STATE_REQ;
+    conn->loop = &loops[0];
+
+    Buf req = {0};
+    const char *set_cmd[3] = {"set", "k", "v"};
+    const char *get_cmd[2] = {"get", "k"};
+    encode_request(&req, set_cmd, 3);
+    for (int i = 0; i < 99; i++) {
+        encode_request(&req, get_cmd, 2);
+    }
+    CHECK(write(sv[1], req.data, buf_len(&req)) == (ssize_t)buf_len(&req), "client sends 100 pipelined requests");
+
+    try_fill_buffer(conn);
+    CHECK(conn->state == STATE_RES, "the connection switches to sending once the read burst is done");
+    CHECK(buf_len(&conn->rbuf) == 0, "every pipelined request was executed");
+    CHECK(out_len(&conn->wbuf) == 4 + 3 + 99 * (4 + 2), "all 100 replies sit in one output chain");
+
+    try_flush_buffer(conn);
+    CHECK(conn->state == STATE_REQ && out_len(&conn->wbuf) == 0, "the batch goes out and the connection reads again");
+    uint8_t res[1024];
+    ssize_t n = read(sv[1], res, sizeof(res));
+    CHECK(n == 4 + 3 + 99 * (4 + 2), "the client receives every reply");
+    CHECK(n > 13 && memcmp(&res[5], "OK", 2) == 0 && memcmp(&res[12], "v", 1) == 0, "replies arrive in request order");
+
+    buf_free(&req);
+    buf_free(&conn->rbuf);
+    out_free(&conn->wbuf);
+    free(conn);
+    close(sv[0]);
+    close(sv[1]);
+}
+
+// ---- replication ----
+
+static void test_repl_backlog_wraps_and_copies(void) {
+    size_t saved = config.repl_backlog_size;
+    config.repl_backlog_size = 8;
+    repl.offset = 100;
+    repl_backlog_create();
+    Out out = {0};
+    Buf b = {0};
+    CHECK(repl_backlog_copy(100, &out, 64) == 0, "nothing to copy from a fresh backlog");
+    CHECK(repl_backlog_copy(99, &out, 64) == -1, "bytes from before the backlog existed can't be copied");
+    repl_backlog_append((const uint8_t *)"abcdef", 6);
+    repl_backlog_append((const uint8_t *)"ghij", 4);    // wraps, pushing out "ab"
+    CHECK(repl.offset == 110 && repl.backlog_off == 102, "the backlog keeps only its size's worth of the stream");
+    CHECK(repl_backlog_copy(101, &out, 64) == -1, "a byte that has been overwritten is out of the window");
+    CHECK(repl_backlog_copy(102, &out, 64) == 8, "the whole window can be copied");
+    out_flatten(&out, &b);
+    CHECK(buf_len(&b) == 8 && memcmp(b.data, "cdefghij", 8) == 0, "a copy across the wrap comes out in stream order");
+    out_consume(&out, out_len(&out));
+    CHECK(repl_backlog_copy(105, &out, 3) == 3, "a copy is capped at max bytes");
+    b.start = b.end = 0;
+    out_flatten(&out, &b);
+    CHECK(memcmp(b.data, "fgh", 3) == 0, "and starts at the offset asked for");
+    repl_backlog_append((const uint8_t *)"0123456789", 10);    // longer than the backlog
+    CHECK(repl.backlog_off == 112, "an append bigger than the backlog leaves just its tail");
+    out_consume(&out, out_len(&out));
+    b.start = b.end = 0;
+    repl_backlog_copy(112, &out, 64);
+    out_flatten(&out, &b);
+    CHECK(buf_len(&b) == 8 && memcmp(b.data, "23456789", 8) == 0, "which is what gets copied");
+    out_free(&out);
+    buf_free(&b);
+    free(repl.backlog);
+    repl.backlog = NULL;
+    repl.offset = repl.backlog_off = 0;
+    config.repl_backlog_size = saved;
+}
+
+static void test_repl_can_continue(void) {
+    strcpy(repl.replid, "0123456789012345678901234567890123456789");
+    repl.offset = 50;
+    repl_backlog_create();
+    repl_backlog_append((const uint8_t *)"xyz", 3);
+    uint64_t from = 0;
+    Arg id = mkarg(repl.replid);
+    Arg other = mkarg("9123456789012345678901234567890123456789");
+    Arg unknown = mkarg("?");
+    Arg at50 = mkarg("50"), at53 = mkarg("53"), at49 = mkarg("49"), at54 = mkarg("54"), neg = mkarg("-1");
+    CHECK(repl_can_continue(&id, &at50, &from) && from == 50, "a replica inside the backlog continues from its offset");
+    CHECK(repl_can_continue(&id, &at53, &from) && from == 53, "so does one that is fully caught up");
+    CHECK(!repl_can_continue(&id, &at49, &from), "one that is behind the backlog needs a full sync");
+    CHECK(!repl_can_continue(&id, &at54, &from), "so does one claiming more than was ever sent");
+    CHECK(!repl_can_continue(&other, &at50, &from), "so does one with another history");
+    CHECK(!repl_can_continue(&unknown, &neg, &from), "and PSYNC ? -1 always does");
+    free(repl.backlog);
+    repl.backlog = NULL;
+    repl.offset = repl.backlog_off = 0;
+}
+
+static void test_repl_replica_buffer_limit(void) {
+    size_t saved = config.repl_buffer_limit;
+    config.repl_buffer_limit = 8;
+    repl_backlog_create();
+    struct Conn fast = {0}, slow = {0};
+    repl_add_replica(&fast);
+    repl_add_replica(&slow);
+    repl_backlog_append((const uint8_t *)"abcde", 5);
+    CHECK(buf_len(&fast.repl_pending) == 5 && memcmp(fast.repl_pending.data, "abcde", 5) == 0
+        && buf_len(&slow.repl_pending) == 5, "every replica gets its own copy of the stream");
+    buf_consume(&fast.repl_pending, 5);
+    repl_backlog_append((const uint8_t *)"fgh", 3);
+    CHECK(!slow.repl_overflow && buf_len(&slow.repl_pending) == 8, "a replica may fall as far behind as the limit");
+    repl_backlog_append((const uint8_t *)"i", 1);
+    CHECK(slow.repl_overflow && buf_len(&slow.repl_pending) == 8, "one byte more marks it to be dropped");
+    CHECK(!fast.repl_overflow && buf_len(&fast.repl_pending) == 4, "while one that keeps up goes on");
+    buf_free(&fast.repl_pending);
+    buf_free(&slow.repl_pending);
+    repl.nreplicas = 0;
+    free(repl.backlog);
+    repl.backlog = NULL;
+    repl.offset = repl.backlog_off = 0;
+    config.repl_buffer_limit = saved;
+}
+
+static void test_replicaof_command(void) {
+    Buf ob = {0};
+    Arg bad_port[3] = {mkarg("replicaof"), mkarg("localhost"), mkarg("0")};
+    const uint8_t *out = run_request(&ob, bad_port, 3);
+    CHECK(resp_type(out) == RES_ERR && repl.primary_port == 0, "REPLICAOF rejects a bad port");
+    uint64_t gen = repl.link_gen;
+    Arg follow[3] = {mkarg("replicaof"), mkarg("127.0.0.1"), mkarg("6380")};
+    out = run_request(&ob, follow, 3);
+    CHECK(resp_type(out) == RES_STR && strcmp(repl.primary_host, "127.0.0.1") == 0 && repl.primary_port == 6380,
+        "REPLICAOF host port records the primary");
+    CHECK(repl.relink && repl.link_gen == gen + 1 && strcmp(repl.link_replid, "?") == 0,
+        "and asks for a fresh full sync with it");
+    Arg info[2] = {mkarg("info"), mkarg("replication")};
+    out = run_request(&ob, info, 2);
+    CHECK(bytes_contain(out, buf_len(&ob), "role:slave") && bytes_contain(out, buf_len(&ob), "master_port:6380"),
+        "INFO replication reports the primary");
+    Arg no_one[3] = {mkarg("replicaof"), mkarg("no"), mkarg("one")};
+    out = run_request(&ob, no_one, 3);
+    CHECK(resp_type(out) == RES_STR && repl.primary_port == 0, "REPLICAOF NO ONE makes it a primary again");
+    out = run_request(&ob, info, 2);
+    CHECK(bytes_contain(out, buf_len(&ob), "role:master"), "which INFO reports");
+    Arg psync[3] = {mkarg("psync"), mkarg("?"), mkarg("-1")};
+    out = run_request(&ob, psync, 3);
+    CHECK(resp_type(out) == RES_ERR, "PSYNC is refused outside a client connection");
+    repl.relink = false;
+    buf_free(&ob);
+}
+
+static void test_replica_refuses_client_writes(void) {
+    clear_htable();
+    int sv[2];
+    CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0, "socketpair for a fake client");
+    fd_set_nb(sv[0]);
+    struct Conn *conn = calloc(1, sizeof(struct Conn));
+    conn->fd = sv[0];
+    conn->state = STATE_REQ;
+    conn->loop = &loops[0];
+    repl.primary_port = 6380;
+
+    Buf req = {0};
+    const char *set_cmd[3] = {"set", "k", "v"};
+    const char *get_cmd[2] = {"get", "k"};
+    encode_request(&req, set_cmd, 3);
+    encode_request(&req, get_cmd, 2);
+    CHECK(write(sv[1], req.data, buf_len(&req)) == (ssize_t)buf_len(&req), "client sends a SET and a GET");
+    try_fill_buffer(conn);
+    try_flush_buffer(conn);
+    uint8_t res[256];
+    ssize_t n = read(sv[1], res, sizeof(res));
+    CHECK(n > 9 && res[4] == RES_ERR && bytes_contain(res, (size_t)n, "READONLY"), "a replica answers a write with READONLY");
+    CHECK(n > 0 && res[n - 1] == RES_NIL && h_lookup((const uint8_t *)"k", 1) == NULL, "and serves reads, without the write");
+
+    conn->primary = true;
+    req.start = req.end = 0;
+    encode_request(&req, set_cmd, 3);
+    CHECK(write(sv[1], req.data, buf_len(&req)) == (ssize_t)buf_len(&req), "the primary streams a SET");
+    uint64_t off = repl.link_offset;
+    try_fill_buffer(conn);
+    CHECK(h_lookup((const uint8_t *)"k", 1) != NULL, "the primary's writes are applied");
+    CHECK(repl.link_offset == off + buf_len(&req), "and counted towards the replication offset");
+    CHECK(out_len(&conn->wbuf) == 0 && recv(sv[1], res, sizeof(res), MSG_DONTWAIT) < 0, "and never answered");
+
+    repl.primary_port = 0;
+    repl.link_offset = 0;
+    buf_free(&req);
+    buf_free(&conn->rbuf);
+    out_free(&conn->wbuf);
+    free(conn);
+    close(sv[0]);
+    close(sv[1]);
+}
+
+static void test_replica_applies_stream_over_limits(void) {
+    clear_htable();
+    int sv[2];
+    CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0, "socketpair for a fake primary");
+    fd_set_nb(sv[0]);
+    struct Conn *conn = calloc(1, sizeof(struct Conn));
+    conn->fd = sv[0];
+    conn->state = STATE_REQ;
+    conn->loop = &loops[0];
+    conn->primary = true;
+    repl.primary_port = 6380;
+
+    Buf req = {0};
+    const char *set_a[3] = {"set", "a", "1"};
+    encode_request(&req, set_a, 3);
+    CHECK(write(sv[1], req.data, buf_len(&req)) == (ssize_t)buf_len(&req), "the primary streams a SET");
+    try_fill_buffer(conn);
+    Shard *sh = shard_of(hash_bytes((const uint8_t *)"a", 1));
+    uint64_t evicted = sh->evicted_keys;
+    config.maxmemory = 1;
+    config.maxmemory_policy = EVICT_ALLKEYS_LRU;
+    const char *set_b[3] = {"set", "b", "2"};
+    req.start = req.end = 0;
+    encode_request(&req, set_b, 3);
+    CHECK(write(sv[1], req.data, buf_len(&req)) == (ssize_t)buf_len(&req), "and another over --maxmemory");
+    try_fill_buffer(conn);
+    CHECK(h_lookup((const uint8_t *)"b", 1) != NULL && h_lookup((const uint8_t *)"a", 1) != NULL
+        && sh->evicted_keys == evicted, "a streamed write is applied without evicting anything");
+    config.maxmemory_policy = EVICT_NOEVICTION;
+    const char *set_c[3] = {"set", "c", "3"};
+    req.start = req.end = 0;
+    encode_request(&req, set_c, 3);
+    CHECK(write(sv[1], req.data, buf_len(&req)) == (ssize_t)buf_len(&req), "and one under noeviction");
+    try_fill_buffer(conn);
+    CHECK(h_lookup((const uint8_t *)"c", 1) != NULL, "which is applied rather than refused with OOM");
+    config.maxmemory = 0;
+
+    uint32_t saved = config.max_msg_size;
+    config.max_msg_size = 16;
+    char big[64];
+    memset(big, 'x', sizeof(big) - 1);
+    big[sizeof(big) - 1] = '\0';
+    const char *set_d[3] = {"set", "d", big};
+    req.start = req.end = 0;
+    encode_request(&req, set_d, 3);
+    CHECK(write(sv[1], req.data, buf_len(&req)) == (ssize_t)buf_len(&req), "and one over --max-msg-size");
+    try_fill_buffer(conn);
+    CHECK(conn->state != STATE_END && h_lookup((const uint8_t *)"d", 1) != NULL,
+        "which the link takes too, as the primary did");
+    config.max_msg_size = saved;
+
+    repl.primary_port = 0;
+    repl.link_offset = 0;
+    buf_free(&req);
+    buf_free(&conn->rbuf);
+    out_free(&conn->wbuf);
+    free(conn);
+    close(sv[0]);
+    close(sv[1]);
+}
+
 // ---- do_request (command dispatch) ----
 
 static void test_do_request_set_get_del(void) {
     clear_htable();
-    uint8_t out[MAX_MSG_SIZE];
+    Buf ob = {0};
+    const uint8_t *out = NULL;
 
     Arg set_args[3] = {mkarg("set"), mkarg("key1"), mkarg("hello")};
-    do_request(set_args, 3, out);
+    out = run_request(&ob, set_args, 3);
     CHECK(resp_type(out) == RES_STR && memcmp(out + 1, "OK", 2) == 0, "SET returns string OK");
 
     Arg get_args[2] = {mkarg("get"), mkarg("key1")};
-    do_request(get_args, 2, out);
+    out = run_request(&ob, get_args, 2);
     CHECK(resp_type(out) == RES_STR && memcmp(out + 1, "hello", 5) == 0, "GET returns the stored value");
 
     Arg del_args[2] = {mkarg("del"), mkarg("key1")};
-    do_request(del_args, 2, out);
+    out = run_request(&ob, del_args, 2);
     int64_t delval = 0;
     memcpy(&delval, out + 1, 8);
     CHECK(resp_type(out) == RES_INT && delval == 1, "DEL returns integer 1 when a key was actually deleted");
 
-    do_request(get_args, 2, out);
+    out = run_request(&ob, get_args, 2);
     CHECK(resp_type(out) == RES_NIL, "GET returns nil after the key has been deleted");
+    buf_free(&ob);
+}
+
+// the typed body of element i of the array response at out
+static const uint8_t *arr_elem(const uint8_t *out, uint32_t i, uint32_t *len) {
+    const uint8_t *p = out + 5;     // tag + count
+    for (;;) {
+        memcpy(len, p, 4);
+        if (i-- == 0) {
+            return p + 4;
+        }
+        p += 4 + *len;
+    }
+}
+
+static void test_do_request_mset_mget_del(void) {
+    clear_htable();
+    Buf ob = {0};
+    const uint8_t *out = NULL;
+
+    Arg mset_args[5] = {mkarg("mset"), mkarg("a"), mkarg("1"), mkarg("b"), mkarg("22")};
+    out = run_request(&ob, mset_args, 5);
+    CHECK(resp_type(out) == RES_STR && memcmp(out + 1, "OK", 2) == 0, "MSET returns string OK");
+
+    Arg mget_args[4] = {mkarg("mget"), mkarg("a"), mkarg("missing"), mkarg("b")};
+    out = run_request(&ob, mget_args, 4);
+    uint32_t count = 0, len = 0;
+    memcpy(&count, out + 1, 4);
+    CHECK(resp_type(out) == RES_ARR && count == 3, "MGET returns an array with one element per key");
+    const uint8_t *el = arr_elem(out, 0, &len);
+    CHECK(len == 2 && el[0] == RES_STR && el[1] == '1', "MGET's first element is the first key's value");
+    el = arr_elem(out, 1, &len);
+    CHECK(len == 1 && el[0] == RES_NIL, "MGET returns nil in place of a missing key");
+    el = arr_elem(out, 2, &len);
+    CHECK(len == 3 && el[0] == RES_STR && memcmp(el + 1, "22", 2) == 0, "MGET keeps the keys' order");
+
+    Arg del_args[4] = {mkarg("del"), mkarg("a"), mkarg("missing"), mkarg("b")};
+    out = run_request(&ob, del_args, 4);
+    int64_t deleted = 0;
+    memcpy(&deleted, out + 1, 8);
+    CHECK(resp_type(out) == RES_INT && deleted == 2, "DEL of several keys counts the ones that existed");
+    CHECK(hm_size(&db) == 0, "DEL of several keys removes every one of them");
+
+    Arg mset_odd[4] = {mkarg("mset"), mkarg("a"), mkarg("1"), mkarg("b")};
+    out = run_request(&ob, mset_odd, 4);
+    CHECK(resp_type(out) == RES_ERR, "MSET with a key and no value is an error");
+    buf_free(&ob);
+}
+
+static void test_do_request_mget_many_keys(void) {
+    // more keys than one prefetch batch, spread over several shards
+    nshards = 4;
+    clear_htable();
+    set_numbered_keys(0, 100);
+    static char names[150][16];
+    Arg args[151] = {mkarg("mget")};
+    for (int i = 0; i < 150; i++) {
+        snprintf(names[i], sizeof(names[i]), "key%d", i);
+        args[1 + i] = mkarg(names[i]);
+    }
+    Buf ob = {0};
+    const uint8_t *out = run_request(&ob, args, 151);
+    bool ok = resp_type(out) == RES_ARR;
+    for (uint32_t i = 0; ok && i < 150; i++) {
+        uint32_t len = 0;
+        const uint8_t *el = arr_elem(out, i, &len);
+        ok = i < 100 ? el[0] == RES_STR : el[0] == RES_NIL;
+    }
+    CHECK(ok, "MGET of 150 keys across shards finds exactly the ones that exist");
+    args[0] = mkarg("del");
+    out = run_request(&ob, args, 151);
+    int64_t deleted = 0;
+    memcpy(&deleted, out + 1, 8);
+    CHECK(deleted == 100 && count_numbered_keys(0, 100) == 0, "DEL of 150 keys across shards deletes the 100 that exist");
+    buf_free(&ob);
+    clear_htable();
+    nshards = 1;
+}
+
+static void test_do_request_get_large_value(void) {
+    clear_htable();
+    Buf ob = {0};
+    const uint8_t *out = NULL;
+    size_t vlen = 1 << 20;      // far beyond the old 4096-byte message limit
+    char *val = malloc(vlen + 1);
+    memset(val, 'v', vlen);
+    val[vlen] = '\0';
+    Arg set_args[3] = {mkarg("set"), mkarg("big"), mkarg(val)};
+    out = run_request(&ob, set_args, 3);
+    Arg get_args[2] = {mkarg("get"), mkarg("big")};
+    out = run_request(&ob, get_args, 2);
+    CHECK(resp_type(out) == RES_STR && buf_len(&ob) == 1 + vlen, "GET returns a large value without truncating it");
+    CHECK(out[1] == 'v' && out[vlen] == 'v', "the large value comes back intact");
+    free(val);
+    buf_free(&ob);
+}
+
+// the 8-byte integer in an RES_INT response
+static int64_t res_int(const uint8_t *out) {
+    int64_t v = 0;
+    memcpy(&v, out + 1, 8);
+    return v;
+}
+
+static void test_do_request_sorted_sets(void) {
+    clear_htable();
+    Buf ob = {0};
+    const uint8_t *out = NULL;
+    uint32_t len = 0;
+
+    Arg zadd[8] = {mkarg("zadd"), mkarg("z"), mkarg("3"), mkarg("c"), mkarg("1"), mkarg("a"), mkarg("2"), mkarg("b")};
+    out = run_request(&ob, zadd, 8);
+    CHECK(resp_type(out) == RES_INT && res_int(out) == 3, "ZADD counts the members it added");
+    Arg zadd_again[4] = {mkarg("zadd"), mkarg("z"), mkarg("0.5"), mkarg("c")};
+    out = run_request(&ob, zadd_again, 4);
+    CHECK(resp_type(out) == RES_INT && res_int(out) == 0, "changing a score adds nothing");
+    Arg zadd_nan[4] = {mkarg("zadd"), mkarg("z"), mkarg("nan"), mkarg("d")};
+    out = run_request(&ob, zadd_nan, 4);
+    CHECK(resp_type(out) == RES_ERR, "ZADD refuses a NaN score");
+
+    Arg zscore[3] = {mkarg("zscore"), mkarg("z"), mkarg("c")};
+    out = run_request(&ob, zscore, 3);
+    CHECK(resp_type(out) == RES_STR && buf_len(&ob) == 4 && memcmp(out + 1, "0.5", 3) == 0, "ZSCORE returns the score as text");
+    Arg zrank[3] = {mkarg("zrank"), mkarg("z"), mkarg("b")};
+    out = run_request(&ob, zrank, 3);
+    CHECK(resp_type(out) == RES_INT && res_int(out) == 2, "ZRANK counts from the lowest score");
+    Arg zrank_missing[3] = {mkarg("zrank"), mkarg("z"), mkarg("nobody")};
+    out = run_request(&ob, zrank_missing, 3);
+    CHECK(resp_type(out) == RES_NIL, "ZRANK of a missing member is nil");
+
+    Arg zrange[5] = {mkarg("zrange"), mkarg("z"), mkarg("1"), mkarg("-1"), mkarg("withscores")};
+    out = run_request(&ob, zrange, 5);
+    uint32_t count = 0;
+    memcpy(&count, out + 1, 4);
+    const uint8_t *el = arr_elem(out, 2, &len);
+    CHECK(resp_type(out) == RES_ARR && count == 4 && len == 2 && memcmp(el, "\x02" "b", 2) == 0,
+        "ZRANGE 1 -1 WITHSCORES returns members and scores from rank 1");
+    Arg zrangebyscore[7] = {mkarg("zrangebyscore"), mkarg("z"), mkarg("(0.5"), mkarg("+inf"),
+        mkarg("limit"), mkarg("1"), mkarg("5")};
+    out = run_request(&ob, zrangebyscore, 7);
+    memcpy(&count, out + 1, 4);
+    el = arr_elem(out, 0, &len);
+    CHECK(resp_type(out) == RES_ARR && count == 1 && memcmp(el, "\x02" "b", 2) == 0,
+        "ZRANGEBYSCORE honours an excluded minimum and LIMIT");
+
+    Arg zrem_range[4] = {mkarg("zremrangebyscore"), mkarg("z"), mkarg("-inf"), mkarg("1")};
+    out = run_request(&ob, zrem_range, 4);
+    CHECK(resp_type(out) == RES_INT && res_int(out) == 2, "ZREMRANGEBYSCORE removes the members in range");
+    Arg zrem[4] = {mkarg("zrem"), mkarg("z"), mkarg("b"), mkarg("nobody")};
+    out = run_request(&ob, zrem, 4);
+    CHECK(resp_type(out) == RES_INT && res_int(out) == 1, "ZREM counts only members that were there");
+    Arg zcard[2] = {mkarg("zcard"), mkarg("z")};
+    out = run_request(&ob, zcard, 2);
+    CHECK(resp_type(out) == RES_INT && res_int(out) == 0, "the set is empty");
+    CHECK(h_lookup((const uint8_t *)"z", 1) == NULL, "and an emptied set's key is deleted");
+    buf_free(&ob);
+}
+
+static void test_do_request_hashes(void) {
+    clear_htable();
+    Buf ob = {0};
+    const uint8_t *out = NULL;
+    uint32_t len = 0, count = 0;
+
+    Arg hset[6] = {mkarg("hset"), mkarg("h"), mkarg("a"), mkarg("1"), mkarg("b"), mkarg("2")};
+    out = run_request(&ob, hset, 6);
+    CHECK(resp_type(out) == RES_INT && res_int(out) == 2, "HSET counts the fields it added");
+    Arg hset_again[4] = {mkarg("hset"), mkarg("h"), mkarg("a"), mkarg("one")};
+    out = run_request(&ob, hset_again, 4);
+    CHECK(resp_type(out) == RES_INT && res_int(out) == 0, "replacing a value adds nothing");
+    Arg hget[3] = {mkarg("hget"), mkarg("h"), mkarg("a")};
+    out = run_request(&ob, hget, 3);
+    CHECK(resp_type(out) == RES_STR && buf_len(&ob) == 4 && memcmp(out + 1, "one", 3) == 0, "HGET returns the value");
+    Arg hget_missing[3] = {mkarg("hget"), mkarg("h"), mkarg("zzz")};
+    out = run_request(&ob, hget_missing, 3);
+    CHECK(resp_type(out) == RES_NIL, "HGET of a missing field is nil");
+
+    Arg hgetall[2] = {mkarg("hgetall"), mkarg("h")};
+    out = run_request(&ob, hgetall, 2);
+    memcpy(&count, out + 1, 4);
+    const uint8_t *el = arr_elem(out, 3, &len);
+    CHECK(resp_type(out) == RES_ARR && count == 4 && len == 2 && memcmp(el, "\x02" "2", 2) == 0,
+        "HGETALL returns every field followed by its value");
+    Arg hlen[2] = {mkarg("hlen"), mkarg("h")};
+    out = run_request(&ob, hlen, 2);
+    CHECK(resp_type(out) == RES_INT && res_int(out) == 2, "HLEN counts the fields");
+
+    Arg hdel[5] = {mkarg("hdel"), mkarg("h"), mkarg("a"), mkarg("b"), mkarg("nope")};
+    out = run_request(&ob, hdel, 5);
+    CHECK(resp_type(out) == RES_INT && res_int(out) == 2, "HDEL counts only fields that were there");
+    CHECK(h_lookup((const uint8_t *)"h", 1) == NULL, "and an emptied hash's key is deleted");
+    buf_free(&ob);
+}
+
+static void test_do_request_lists(void) {
+    clear_htable();
+    Buf ob = {0};
+    const uint8_t *out = NULL;
+    uint32_t len = 0, count = 0;
+
+    Arg rpush[4] = {mkarg("rpush"), mkarg("l"), mkarg("b"), mkarg("c")};
+    out = run_request(&ob, rpush, 4);
+    CHECK(resp_type(out) == RES_INT && res_int(out) == 2, "RPUSH replies with the new length");
+    Arg lpush[4] = {mkarg("lpush"), mkarg("l"), mkarg("a"), mkarg("z")};
+    out = run_request(&ob, lpush, 4);
+    CHECK(resp_type(out) == RES_INT && res_int(out) == 4, "so does LPUSH");
+
+    Arg lrange[4] = {mkarg("lrange"), mkarg("l"), mkarg("0"), mkarg("-1")};
+    out = run_request(&ob, lrange, 4);
+    memcpy(&count, out + 1, 4);
+    const uint8_t *el = arr_elem(out, 0, &len);
+    CHECK(resp_type(out) == RES_ARR && count == 4 && len == 2 && memcmp(el, "\x02" "z", 2) == 0,
+        "LPUSH pushes each element onto the front in turn");
+    Arg lrange_tail[4] = {mkarg("lrange"), mkarg("l"), mkarg("-2"), mkarg("99")};
+    out = run_request(&ob, lrange_tail, 4);
+    memcpy(&count, out + 1, 4);
+    el = arr_elem(out, 0, &len);
+    CHECK(count == 2 && memcmp(el, "\x02" "b", 2) == 0, "LRANGE counts negative indices from the end and clamps");
+    Arg lrange_empty[4] = {mkarg("lrange"), mkarg("l"), mkarg("3"), mkarg("1")};
+    out = run_request(&ob, lrange_empty, 4);
+    memcpy(&count, out + 1, 4);
+    CHECK(resp_type(out) == RES_ARR && count == 0, "an empty range is an empty array");
+
+    Arg lpop[2] = {mkarg("lpop"), mkarg("l")};
+    out = run_request(&ob, lpop, 2);
+    CHECK(resp_type(out) == RES_STR && buf_len(&ob) == 2 && out[1] == 'z', "LPOP removes from the front");
+    Arg rpop[2] = {mkarg("rpop"), mkarg("l")};
+    out = run_request(&ob, rpop, 2);
+    CHECK(resp_type(out) == RES_STR && buf_len(&ob) == 2 && out[1] == 'c', "RPOP from the back");
+    run_request(&ob, rpop, 2);
+    run_request(&ob, rpop, 2);
+    CHECK(h_lookup((const uint8_t *)"l", 1) == NULL, "an emptied list's key is deleted");
+    out = run_request(&ob, rpop, 2);
+    CHECK(resp_type(out) == RES_NIL, "and popping a missing list is nil");
+    Arg llen[2] = {mkarg("llen"), mkarg("l")};
+    out = run_request(&ob, llen, 2);
+    CHECK(resp_type(out) == RES_INT && res_int(out) == 0, "LLEN of a missing list is 0");
+    buf_free(&ob);
+}
+
+static void test_do_request_blocking_pops(void) {
+    clear_htable();
+    Buf ob = {0};
+    const uint8_t *out = NULL;
+    uint32_t code = 0, count = 0, len = 0;
+    uint64_t timeout_ms = 0;
+
+    Arg blpop[4] = {mkarg("blpop"), mkarg("missing"), mkarg("l"), mkarg("0.5")};
+    CHECK(block_must_wait(blpop, 4, &timeout_ms) && timeout_ms == 500, "BLPOP on missing keys has to wait");
+    out = run_request(&ob, blpop, 4);
+    CHECK(resp_type(out) == RES_NIL, "answered right away instead, it is nil");
+
+    Arg rpush[4] = {mkarg("rpush"), mkarg("l"), mkarg("a"), mkarg("b")};
+    run_request(&ob, rpush, 4);
+    CHECK(!block_must_wait(blpop, 4, &timeout_ms), "but not once one of its keys holds a list");
+    out = run_request(&ob, blpop, 4);
+    memcpy(&count, out + 1, 4);
+    const uint8_t *el = arr_elem(out, 1, &len);
+    CHECK(resp_type(out) == RES_ARR && count == 2 && len == 2 && memcmp(el, "\x02" "a", 2) == 0,
+        "BLPOP replies with the key and the element it popped from the front");
+    Arg brpop[3] = {mkarg("brpop"), mkarg("l"), mkarg("0")};
+    out = run_request(&ob, brpop, 3);
+    el = arr_elem(out, 1, &len);
+    CHECK(len == 2 && memcmp(el, "\x02" "b", 2) == 0, "BRPOP pops from the back");
+    CHECK(h_lookup((const uint8_t *)"l", 1) == NULL, "and the emptied list's key is deleted");
+
+    Arg bad_timeout[3] = {mkarg("blpop"), mkarg("l"), mkarg("-1")};
+    CHECK(!block_must_wait(bad_timeout, 3, &timeout_ms), "a bad timeout never waits");
+    out = run_request(&ob, bad_timeout, 3);
+    memcpy(&code, out + 1, 4);
+    CHECK(resp_type(out) == RES_ERR && code == ERR_BAD_ARGS, "a negative timeout is an error");
+    Arg set[3] = {mkarg("set"), mkarg("s"), mkarg("v")};
+    run_request(&ob, set, 3);
+    Arg blpop_str[3] = {mkarg("blpop"), mkarg("s"), mkarg("0")};
+    out = run_request(&ob, blpop_str, 3);
+    memcpy(&code, out + 1, 4);
+    CHECK(resp_type(out) == RES_ERR && code == ERR_WRONGTYPE, "BLPOP of a string is WRONGTYPE");
+    buf_free(&ob);
+}
+
+// the per-key index of parked clients, without any threads to reply through
+static void test_block_index_parks_and_cancels(void) {
+    clear_htable();
+    BlockIndex *bi = &blocks[0];
+    int c1 = 0, c2 = 0;     // stand-ins for two connections
+    Arg keys[2] = {mkarg("q1"), mkarg("q2")};
+    block_park(0, NULL, (struct Conn *)&c1, keys, 2, true, 0);
+    block_park(0, NULL, (struct Conn *)&c2, &keys[1], 1, false, get_wall_ms() + 60000);
+    uint64_t h2 = hash_bytes(keys[1].data, keys[1].len);
+    BKey *q2 = *bkey_link(bi, keys[1].data, keys[1].len, h2);
+    CHECK(bi->nkeys == 2 && bi->nwaiters == 2, "each key is indexed once however many wait on it");
+    CHECK(q2 && q2->head->w->conn == (struct Conn *)&c1 && q2->tail->w->conn == (struct Conn *)&c2,
+        "waiters queue on a key in the order they came");
+    int wait = block_timeout_ms(0, 100000);
+    CHECK(wait > 50000 && wait <= 60000, "the epoll timeout covers the nearest deadline");
+
+    Arg rpush[3] = {mkarg("rpush"), mkarg("q2"), mkarg("x")};
+    Buf ob = {0};
+    run_request(&ob, rpush, 3);
+    CHECK(bi->ready == q2 && q2->ready, "a push marks the key ready");
+    bi->ready = NULL;
+    q2->ready = false;
+
+    CHECK(block_cancel(0, (struct Conn *)&c1, hash_bytes(keys[0].data, keys[0].len)), "a hangup cancels a waiter");
+    CHECK(bi->nkeys == 1 && q2->head->w->conn == (struct Conn *)&c2, "which leaves every queue it was in");
+    CHECK(!block_cancel(0, (struct Conn *)&c1, h2), "and only once");
+    CHECK(block_cancel(0, (struct Conn *)&c2, h2), "cancel the other one");
+    CHECK(bi->nkeys == 0 && bi->nwaiters == 0 && bi->deadlines.size == 0, "and the index is empty again");
+    CHECK(block_timeout_ms(0, 100) == 100, "with no deadline left");
+    buf_free(&ob);
+}
+
+static void test_do_request_wrongtype(void) {
+    clear_htable();
+    Buf ob = {0};
+    const uint8_t *out = NULL;
+    uint32_t code = 0, len = 0;
+
+    Arg zadd[4] = {mkarg("zadd"), mkarg("z"), mkarg("1"), mkarg("a")};
+    run_request(&ob, zadd, 4);
+    Arg get[2] = {mkarg("get"), mkarg("z")};
+    out = run_request(&ob, get, 2);
+    memcpy(&code, out + 1, 4);
+    CHECK(resp_type(out) == RES_ERR && code == ERR_WRONGTYPE, "GET of a sorted set is WRONGTYPE");
+    Arg set[3] = {mkarg("set"), mkarg("z"), mkarg("v")};
+    out = run_request(&ob, set, 3);
+    memcpy(&code, out + 1, 4);
+    CHECK(resp_type(out) == RES_ERR && code == ERR_WRONGTYPE, "so is SET");
+    Arg mset[5] = {mkarg("mset"), mkarg("s"), mkarg("v"), mkarg("z"), mkarg("v")};
+    out = run_request(&ob, mset, 5);
+    CHECK(resp_type(out) == RES_ERR && h_lookup((const uint8_t *)"s", 1) == NULL,
+        "MSET with a sorted set key writes none of its keys");
+    Entry *e = h_lookup((const uint8_t *)"z", 1);
+    CHECK(e && e->type == TYPE_ZSET && e->zset->len == 1, "the sorted set is untouched");
+
+    h_set((const uint8_t *)"s", 1, (const uint8_t *)"v", 1);
+    Arg mget[3] = {mkarg("mget"), mkarg("s"), mkarg("z")};
+    out = run_request(&ob, mget, 3);
+    CHECK(resp_type(arr_elem(out, 1, &len)) == RES_NIL, "MGET reads a sorted set as nil");
+    Arg zadd_string[4] = {mkarg("zadd"), mkarg("s"), mkarg("1"), mkarg("a")};
+    out = run_request(&ob, zadd_string, 4);
+    memcpy(&code, out + 1, 4);
+    CHECK(resp_type(out) == RES_ERR && code == ERR_WRONGTYPE, "ZADD on a string is WRONGTYPE");
+    Arg hset_zset[4] = {mkarg("hset"), mkarg("z"), mkarg("f"), mkarg("v")};
+    out = run_request(&ob, hset_zset, 4);
+    memcpy(&code, out + 1, 4);
+    CHECK(resp_type(out) == RES_ERR && code == ERR_WRONGTYPE, "HSET on a sorted set is WRONGTYPE");
+    Arg lpush_string[3] = {mkarg("lpush"), mkarg("s"), mkarg("x")};
+    out = run_request(&ob, lpush_string, 3);
+    memcpy(&code, out + 1, 4);
+    CHECK(resp_type(out) == RES_ERR && code == ERR_WRONGTYPE, "LPUSH on a string is WRONGTYPE");
+    Arg del[2] = {mkarg("del"), mkarg("z")};
+    out = run_request(&ob, del, 2);
+    CHECK(resp_type(out) == RES_INT && res_int(out) == 1 && h_lookup((const uint8_t *)"z", 1) == NULL,
+        "DEL removes a sorted set");
+    buf_free(&ob);
 }
 
 static void test_do_request_unknown_command(void) {
     clear_htable();
-    uint8_t out[MAX_MSG_SIZE];
+    Buf ob = {0};
+    const uint8_t *out = NULL;
     Arg args[1] = {mkarg("bogus")};
-    do_request(args, 1, out);
+    out = run_request(&ob, args, 1);
     uint32_t code = 0;
     memcpy(&code, out + 1, 4);
     CHECK(resp_type(out) == RES_ERR && code == ERR_UNKNOWN_CMD, "an unrecognised command returns ERR_UNKNOWN_CMD");
+    buf_free(&ob);
 }
 
 static void test_do_request_wrong_arg_count(void) {
     clear_htable();
-    uint8_t out[MAX_MSG_SIZE];
+    Buf ob = {0};
+    const uint8_t *out = NULL;
     Arg args[1] = {mkarg("get")};   // GET needs a key argument, this has none
-    do_request(args, 1, out);
+    out = run_request(&ob, args, 1);
     uint32_t code = 0;
     memcpy(&code, out + 1, 4);
     CHECK(resp_type(out) == RES_ERR && code == ERR_BAD_ARGS, "GET with the wrong number of arguments returns ERR_BAD_ARGS");
+    buf_free(&ob);
+}
+
+static void test_do_request_info(void) {
+    clear_htable();
+    Buf ob = {0};
+    const uint8_t *out = NULL;
+    Arg args[1] = {mkarg("info")};
+    out = run_request(&ob, args, 1);
+    CHECK(resp_type(out) == RES_STR, "INFO returns a string");
+    CHECK(bytes_contain(out, buf_len(&ob), "expired_keys:"), "INFO reports the expired key counter");
+    buf_free(&ob);
+}
+
+static void test_do_request_info_sections(void) {
+    clear_htable();
+    Buf ob = {0};
+    const uint8_t *out = NULL;
+    Arg reset[2] = {mkarg("latency"), mkarg("reset")};
+    Arg set_args[3] = {mkarg("set"), mkarg("key1"), mkarg("v")};
+    run_request(&ob, reset, 2);
+    run_request(&ob, set_args, 3);
+    run_request(&ob, set_args, 3);
+
+    Arg info[2] = {mkarg("info"), mkarg("commandstats")};
+    out = run_request(&ob, info, 2);
+    CHECK(resp_type(out) == RES_STR && bytes_contain(out, buf_len(&ob), "cmdstat_set:calls=2,"),
+        "INFO commandstats counts each command's calls");
+    CHECK(!bytes_contain(out, buf_len(&ob), "cmdstat_get:") && !bytes_contain(out, buf_len(&ob), "# Keyspace"),
+        "and only lists commands that ran, in that section alone");
+    info[1] = mkarg("latencystats");
+    out = run_request(&ob, info, 2);
+    CHECK(bytes_contain(out, buf_len(&ob), "latency_percentiles_usec_set:p50="), "INFO latencystats has percentiles");
+
+    out = run_request(&ob, info, 1);
+    CHECK(bytes_contain(out, buf_len(&ob), "hashtable_load_factor:") && bytes_contain(out, buf_len(&ob), "connected_clients:")
+        && bytes_contain(out, buf_len(&ob), "total_commands_processed:"), "plain INFO has the load factor, clients and stats");
+    CHECK(!bytes_contain(out, buf_len(&ob), "# Hashtable"), "but not the bucket walk");
+    info[1] = mkarg("ALL");
+    out = run_request(&ob, info, 2);
+#ifdef HT_SWISS
+    const char *dist = "hashtable_probe_lengths:0=1,";
+#else
+    const char *dist = "hashtable_chain_lengths:0=";
+#endif
+    CHECK(bytes_contain(out, buf_len(&ob), dist) && bytes_contain(out, buf_len(&ob), "# Persistence"),
+        "INFO all adds the length distribution");
+    info[1] = mkarg("nosuchsection");
+    out = run_request(&ob, info, 2);
+    uint32_t code = 0;
+    memcpy(&code, out + 1, 4);
+    CHECK(resp_type(out) == RES_ERR && code == ERR_BAD_ARGS, "an unknown INFO section is an error");
+    buf_free(&ob);
+}
+
+static void test_do_request_latency(void) {
+    clear_htable();
+    Buf ob = {0};
+    const uint8_t *out = NULL;
+    Arg reset[2] = {mkarg("latency"), mkarg("reset")};
+    out = run_request(&ob, reset, 2);
+    CHECK(resp_type(out) == RES_STR, "LATENCY RESET returns OK");
+    Arg get_args[2] = {mkarg("get"), mkarg("nosuchkey")};
+    for (int i = 0; i < 3; i++) {
+        run_request(&ob, get_args, 2);
+    }
+
+    // [[ "get", 3, [[usec, count], ...] ]]
+    Arg hist[3] = {mkarg("latency"), mkarg("histogram"), mkarg("GET")};
+    out = run_request(&ob, hist, 3);
+    uint32_t n = 0, inner = 0, nbounds = 0;
+    int64_t calls = 0, last = 0;
+    memcpy(&n, out + 1, 4);
+    memcpy(&inner, out + 10, 4);
+    memcpy(&calls, out + 27, 8);
+    CHECK(resp_type(out) == RES_ARR && n == 1 && out[9] == RES_ARR && inner == 3, "LATENCY HISTOGRAM returns one entry per command");
+    CHECK(out[18] == RES_STR && memcmp(out + 19, "get", 3) == 0 && out[26] == RES_INT && calls == 3,
+        "naming the command and its calls");
+    memcpy(&nbounds, out + 40, 4);
+    memcpy(&last, out + 44 + (size_t)(nbounds - 1) * 35 + 27, 8);
+    CHECK(out[39] == RES_ARR && nbounds > 0 && last == 3, "its cumulative buckets end with every call");
+
+    Arg none[3] = {mkarg("latency"), mkarg("histogram"), mkarg("zadd")};
+    out = run_request(&ob, none, 3);
+    memcpy(&n, out + 1, 4);
+    CHECK(resp_type(out) == RES_ARR && n == 0, "commands that never ran are left out");
+    Arg bad[2] = {mkarg("latency"), mkarg("doctor")};
+    out = run_request(&ob, bad, 2);
+    CHECK(resp_type(out) == RES_ERR, "other LATENCY subcommands are an error");
+    buf_free(&ob);
+}
+
+static void test_do_request_command_info(void) {
+    Buf ob = {0};
+    const uint8_t *out = NULL;
+    Arg info[5] = {mkarg("command"), mkarg("info"), mkarg("GET"), mkarg("nosuch"), mkarg("mset")};
+    out = run_request(&ob, info, 5);
+    uint32_t n = 0, fields = 0, nflags = 0, skip = 0;
+    int64_t arity = 0, step = 0;
+    memcpy(&n, out + 1, 4);
+    memcpy(&fields, out + 10, 4);
+    memcpy(&arity, out + 27, 8);
+    memcpy(&nflags, out + 40, 4);
+    CHECK(resp_type(out) == RES_ARR && n == 3 && out[9] == RES_ARR && fields == 6, "COMMAND INFO describes each name");
+    CHECK(out[18] == RES_STR && memcmp(out + 19, "get", 3) == 0 && arity == 2, "with its name and arity");
+    CHECK(out[39] == RES_ARR && nflags == 2 && bytes_contain(out + 44, 34, "readonly") && bytes_contain(out + 44, 34, "fast"),
+        "and its flags");
+    memcpy(&skip, out + 5, 4);
+    const uint8_t *second = out + 9 + skip;
+    memcpy(&skip, second, 4);
+    CHECK(skip == 1 && second[4] == RES_NIL, "a name that is no command is nil");
+    const uint8_t *third = second + 5;
+    memcpy(&skip, third, 4);
+    memcpy(&step, third + 4 + skip - 8, 8);
+    CHECK(bytes_contain(third, skip, "denyoom") && step == 2, "MSET's keys are every other argument");
+
+    Arg count[2] = {mkarg("command"), mkarg("count")};
+    out = run_request(&ob, count, 2);
+    int64_t total = 0;
+    memcpy(&total, out + 1, 8);
+    CHECK(resp_type(out) == RES_INT && total == CMD_COUNT, "COMMAND COUNT counts the commands");
+
+    Arg get_extra[3] = {mkarg("get"), mkarg("a"), mkarg("b")}, hlen_none[1] = {mkarg("hlen")};
+    out = run_request(&ob, get_extra, 3);
+    CHECK(resp_type(out) == RES_ERR && bytes_contain(out, buf_len(&ob), "arguments for 'get'"), "arity is checked from the table");
+    out = run_request(&ob, hlen_none, 1);
+    CHECK(resp_type(out) == RES_ERR && bytes_contain(out, buf_len(&ob), "arguments for 'hlen'"), "for every command");
+    buf_free(&ob);
 }
 
 static void test_do_request_expire_and_ttl(void) {
     clear_htable();
-    uint8_t out[MAX_MSG_SIZE];
+    Buf ob = {0};
+    const uint8_t *out = NULL;
 
     Arg set_args[3] = {mkarg("set"), mkarg("key1"), mkarg("hello")};
-    do_request(set_args, 3, out);
+    out = run_request(&ob, set_args, 3);
 
     Arg ttl_args[2] = {mkarg("ttl"), mkarg("key1")};
-    do_request(ttl_args, 2, out);
+    out = run_request(&ob, ttl_args, 2);
     int64_t ttl_val = 0;
     memcpy(&ttl_val, out + 1, 8);
     CHECK(resp_type(out) == RES_INT && ttl_val == -1, "TTL on a key with no expiry returns -1");
 
     Arg expire_args[3] = {mkarg("expire"), mkarg("key1"), mkarg("60")};
-    do_request(expire_args, 3, out);
+    out = run_request(&ob, expire_args, 3);
     int64_t expire_val = 0;
     memcpy(&expire_val, out + 1, 8);
     CHECK(resp_type(out) == RES_INT && expire_val == 1, "EXPIRE on an existing key returns 1");
 
-    do_request(ttl_args, 2, out);
+    out = run_request(&ob, ttl_args, 2);
     memcpy(&ttl_val, out + 1, 8);
     CHECK(resp_type(out) == RES_INT && ttl_val > 0 && ttl_val <= 60, "TTL reports a sensible remaining time after EXPIRE");
 
     Arg ttl_missing[2] = {mkarg("ttl"), mkarg("nosuchkey")};
-    do_request(ttl_missing, 2, out);
+    out = run_request(&ob, ttl_missing, 2);
     memcpy(&ttl_val, out + 1, 8);
     CHECK(resp_type(out) == RES_INT && ttl_val == -2, "TTL on a nonexistent key returns -2");
+    buf_free(&ob);
 }
 
 int main(void) {
+    log_init();     // server.c's main normally does this
+
     test_parse_req_single_string();
     test_parse_req_multi_string();
     test_parse_req_rejects_short_header();
@@ -324,15 +2320,95 @@ int main(void) {
     test_arg_is_rejects_wrong_command();
     test_arg_is_rejects_prefix_match();
 
+    test_hash_bytes();
     test_hashtable_set_and_get();
     test_hashtable_overwrite_resets_ttl();
     test_hashtable_delete();
     test_hashtable_lazy_expiry();
+    test_hashtable_grows_with_keys();
+    test_hashtable_lookup_mid_rehash();
+    test_hashtable_shrinks_after_deletes();
+    test_hashtable_survives_churn();
+
+    test_hist_buckets_bound_values();
+    test_hist_percentiles();
+    test_cmd_lookup();
+    test_heap_orders_by_deadline();
+    test_expire_sweep_removes_untouched_keys();
+    test_set_and_del_leave_the_ttl_heap();
+
+    test_slab_classes_cover_every_size();
+    test_slab_entry_is_one_block();
+    test_slab_overwrite_reuses_block();
+    test_slab_free_list_is_reused();
+    test_slab_large_blocks();
+    test_shared_value_outlives_its_entry();
+    test_do_request_slabstats();
+
+    test_zset_ranks_follow_scores();
+    test_zset_remove_range();
+    test_hash_converts_past_pack_limits();
+    test_list_converts_to_quicklist();
+
+    test_mem_used_counts_every_type();
+    test_eviction_approximates_lru();
+    test_eviction_approximates_lfu();
+    test_eviction_volatile_ttl_and_random();
+
+    test_crc32c_known_answer();
+    test_snapshot_round_trip();
+    test_snapshot_loads_into_every_shard();
+    test_snapshot_skips_expired_keys();
+    test_snapshot_detects_corruption();
+    test_bgsave_command();
+
+    test_aof_logs_writes_and_replays_them();
+    test_aof_load_drops_unfinished_tail();
+    test_bgrewriteaof_command();
+    test_snapshot_and_aof_keep_sorted_sets();
+    test_snapshot_and_aof_keep_hashes_and_lists();
+
+    test_msg_queue_is_fifo();
+    test_req_route_by_key_shard();
+
+    test_buf_grows_on_demand();
+    test_buf_consume_reclaims_front();
+    test_buf_shrink_frees_drained_buffers();
+
+    test_out_chain_never_moves_bytes();
+    test_out_references_are_sent_and_released();
+    test_out_consume_partial_writes();
+
+    test_log_ring_round_trip();
+    test_log_ring_drops_when_full();
+    test_loglevel_command();
+
+    test_pipelined_replies_are_batched();
+
+    test_repl_backlog_wraps_and_copies();
+    test_repl_can_continue();
+    test_repl_replica_buffer_limit();
+    test_replicaof_command();
+    test_replica_refuses_client_writes();
+    test_replica_applies_stream_over_limits();
 
     test_do_request_set_get_del();
+    test_do_request_mset_mget_del();
+    test_do_request_mget_many_keys();
+    test_do_request_get_large_value();
     test_do_request_unknown_command();
     test_do_request_wrong_arg_count();
     test_do_request_expire_and_ttl();
+    test_do_request_sorted_sets();
+    test_do_request_hashes();
+    test_do_request_lists();
+    test_do_request_blocking_pops();
+    test_block_index_parks_and_cancels();
+    test_do_request_wrongtype();
+    test_do_request_info();
+    test_do_request_info_sections();
+    test_do_request_latency();
+    test_do_request_command_info();
 
     printf("\n%d/%d tests passed\n", tests_run - tests_failed, tests_run);
     return tests_failed == 0 ? 0 : 1;